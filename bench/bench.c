@@ -0,0 +1,673 @@
+/*! \file bench.c
+ * Throughput benchmark of the removal engines
+ *
+ * Generates reproducible synthetic trees, removes each of them with every engine of better-rm and with GNU `rm -rf`,
+ * and prints one JSON document with the files per second, the syscalls per file and the peak RSS of every run. Trees
+ * are generated again before every run and are not part of the timing. Syscalls are counted in a separate run under
+ * `strace -c` when strace is installed, so the tracing overhead does not skew the timings.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../include/version.h"
+
+#ifndef BENCH_BETTER_RM
+#define BENCH_BETTER_RM "better-rm"
+#endif
+
+#define BENCH_WRITE_CHUNK (64 * 1024)
+
+/*! What a generated tree holds */
+struct TreeStats {
+    unsigned long long entries; /*!< files, links and directories, the operand included */
+    unsigned long long bytes; /*!< apparent size of the files */
+};
+
+/*! Synthetic tree shape */
+struct Tree {
+    const char *name; /*!< name used by `--trees` and in the report */
+    int (*generate)(const char *root, double scale, uint64_t *rng, struct TreeStats *stats); /*!< builds the tree */
+};
+
+/*! Way of removing a tree */
+enum EngineKind {
+    ENGINE_FD_RELATIVE, /*!< default sequential fd-relative walk */
+    ENGINE_PARALLEL, /*!< work-stealing engine with `--jobs` */
+    ENGINE_IO_URING, /*!< io_uring backend */
+    ENGINE_TRASH_RENAME, /*!< `--trash` to a trash directory on the same filesystem */
+    ENGINE_TRASH_COPY, /*!< `--trash` to a trash directory on another filesystem */
+    ENGINE_GNU_RM, /*!< `rm -rf` as the baseline */
+    ENGINE_COUNT
+};
+
+static const char *const engine_names[ENGINE_COUNT] = {"fd-relative", "parallel",   "io-uring",
+                                                       "trash-rename", "trash-copy", "gnu-rm"};
+
+/*! Benchmark settings */
+struct Config {
+    double scale; /*!< multiplies the entry counts of every tree */
+    uint64_t seed; /*!< seed of the generators */
+    int repeat; /*!< timed runs per tree and engine, the fastest is reported */
+    int jobs; /*!< workers of the parallel engine */
+    const char *better_rm; /*!< better-rm binary */
+    const char *rm; /*!< GNU rm binary */
+    const char *cross_device_dir; /*!< directory on another filesystem for the trash-copy engine, or NULL */
+    const char *trees; /*!< comma separated tree names, NULL for all */
+    const char *engines; /*!< comma separated engine names, NULL for all */
+    bool syscalls; /*!< count syscalls under strace */
+    char work[4096]; /*!< scratch directory the trees are generated in */
+};
+
+/*! Outcome of one tree and engine pair */
+struct Result {
+    double seconds; /*!< wall time of the fastest run */
+    long peak_rss_kib; /*!< largest peak RSS of the runs */
+    long long syscalls; /*!< syscalls of the traced run, -1 if not counted */
+    int status; /*!< exit status of the last run, -1 if it did not exit */
+    bool removed; /*!< the operand was gone after every run */
+};
+
+
+/** Draw the next number of a xorshift64* generator
+ *
+ * @param state generator state, never 0
+ * @return pseudo random number
+ */
+static uint64_t rng_next(uint64_t *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1Dull;
+}
+
+/** Scale an entry count
+ *
+ * @param base count at scale 1
+ * @param scale scale factor
+ * @return scaled count, at least 1
+ */
+static unsigned long scaled(unsigned long base, double scale) {
+    double count = (double) base * scale;
+    return count < 1.0 ? 1 : (unsigned long) count;
+}
+
+/** Create a file of a given size
+ *
+ * @param dirfd directory the file is created in
+ * @param name file name
+ * @param size size in bytes
+ * @return 0 for success -1 for error
+ */
+static int make_file_at(int dirfd, const char *name, size_t size) {
+    static char chunk[BENCH_WRITE_CHUNK];
+    int fd = openat(dirfd, name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return -1;
+    while (size > 0) {
+        size_t len = size < sizeof(chunk) ? size : sizeof(chunk);
+        ssize_t n = write(fd, chunk, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            close(fd);
+            return -1;
+        }
+        size -= (size_t) n;
+    }
+    return close(fd);
+}
+
+/** Create the operand directory of a tree
+ *
+ * @param root operand path
+ * @param stats counts the operand
+ * @return directory fd, -1 for error
+ */
+static int make_root(const char *root, struct TreeStats *stats) {
+    if (mkdir(root, 0755) != 0)
+        return -1;
+    stats->entries = 1;
+    stats->bytes = 0;
+    return open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+/** One directory with 1M empty files
+ *
+ * @param root operand path
+ * @param scale scale factor
+ * @param rng generator state
+ * @param stats receives the counts
+ * @return 0 for success -1 for error
+ */
+static int generate_wide(const char *root, double scale, uint64_t *rng, struct TreeStats *stats) {
+    int fd = make_root(root, stats);
+    if (fd < 0)
+        return -1;
+    unsigned long count = scaled(1000000, scale);
+    int ret = 0;
+    for (unsigned long i = 0; i < count && ret == 0; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "f%07lu", i);
+        ret = make_file_at(fd, name, 0);
+        stats->entries++;
+    }
+    close(fd);
+    return ret;
+}
+
+/** A chain of 10k nested directories with one small file at every level
+ *
+ * @param root operand path
+ * @param scale scale factor
+ * @param rng generator state
+ * @param stats receives the counts
+ * @return 0 for success -1 for error
+ */
+static int generate_deep(const char *root, double scale, uint64_t *rng, struct TreeStats *stats) {
+    int fd = make_root(root, stats);
+    if (fd < 0)
+        return -1;
+    unsigned long levels = scaled(10000, scale);
+    int ret = 0;
+    for (unsigned long i = 0; i < levels && ret == 0; i++) {
+        // Paths get far longer than PATH_MAX, every level is created relative to the previous one
+        if (make_file_at(fd, "f", 64) != 0 || mkdirat(fd, "d", 0755) != 0) {
+            ret = -1;
+            break;
+        }
+        stats->entries += 2;
+        stats->bytes += 64;
+        int child = openat(fd, "d", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        close(fd);
+        fd = child;
+        if (fd < 0)
+            return -1;
+    }
+    close(fd);
+    return ret;
+}
+
+/** 100 directories of files with a skewed size distribution, mostly small with a few large ones
+ *
+ * @param root operand path
+ * @param scale scale factor
+ * @param rng generator state
+ * @param stats receives the counts
+ * @return 0 for success -1 for error
+ */
+static int generate_mixed(const char *root, double scale, uint64_t *rng, struct TreeStats *stats) {
+    int fd = make_root(root, stats);
+    if (fd < 0)
+        return -1;
+    unsigned long files = scaled(200, scale);
+    int ret = 0;
+    for (int d = 0; d < 100 && ret == 0; d++) {
+        char name[32];
+        snprintf(name, sizeof(name), "d%02d", d);
+        int dir = mkdirat(fd, name, 0755) == 0 ? openat(fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC) : -1;
+        if (dir < 0) {
+            ret = -1;
+            break;
+        }
+        stats->entries++;
+        for (unsigned long i = 0; i < files && ret == 0; i++) {
+            // 80% below 4 KiB, 19% below 64 KiB, 1% between 256 KiB and 1 MiB
+            uint64_t r = rng_next(rng);
+            unsigned pick = (unsigned) (r % 100);
+            size_t size = pick < 80   ? (r >> 8) % 4096
+                          : pick < 99 ? 4096 + (r >> 8) % 61440
+                                      : 262144 + (r >> 8) % 786432;
+            snprintf(name, sizeof(name), "f%05lu", i);
+            ret = make_file_at(dir, name, size);
+            stats->entries++;
+            stats->bytes += size;
+        }
+        close(dir);
+    }
+    close(fd);
+    return ret;
+}
+
+/** 1000 files, each hard linked from 100 directories
+ *
+ * @param root operand path
+ * @param scale scale factor
+ * @param rng generator state
+ * @param stats receives the counts
+ * @return 0 for success -1 for error
+ */
+static int generate_hardlinks(const char *root, double scale, uint64_t *rng, struct TreeStats *stats) {
+    int fd = make_root(root, stats);
+    if (fd < 0)
+        return -1;
+    unsigned long inodes = scaled(1000, scale);
+    int origin = mkdirat(fd, "o", 0755) == 0 ? openat(fd, "o", O_RDONLY | O_DIRECTORY | O_CLOEXEC) : -1;
+    int ret = origin < 0 ? -1 : 0;
+    stats->entries++;
+    for (unsigned long i = 0; i < inodes && ret == 0; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "f%05lu", i);
+        ret = make_file_at(origin, name, 1024);
+        stats->entries++;
+        stats->bytes += 1024;
+    }
+    for (int d = 0; d < 100 && ret == 0; d++) {
+        char name[32];
+        snprintf(name, sizeof(name), "l%02d", d);
+        int dir = mkdirat(fd, name, 0755) == 0 ? openat(fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC) : -1;
+        if (dir < 0) {
+            ret = -1;
+            break;
+        }
+        stats->entries++;
+        for (unsigned long i = 0; i < inodes && ret == 0; i++) {
+            snprintf(name, sizeof(name), "f%05lu", i);
+            ret = linkat(origin, name, dir, name, 0);
+            stats->entries++;
+        }
+        close(dir);
+    }
+    if (origin >= 0)
+        close(origin);
+    close(fd);
+    return ret;
+}
+
+static const struct Tree trees[] = {
+        {"wide", generate_wide},
+        {"deep", generate_deep},
+        {"mixed", generate_mixed},
+        {"hardlinks", generate_hardlinks},
+};
+
+/** Tell whether a name is in a comma separated list
+ *
+ * @param list list, NULL selects everything
+ * @param name name
+ * @return true if selected
+ */
+static bool selected(const char *list, const char *name) {
+    if (!list)
+        return true;
+    size_t len = strlen(name);
+    for (const char *p = list; *p;) {
+        const char *end = strchr(p, ',');
+        size_t item = end ? (size_t) (end - p) : strlen(p);
+        if (item == len && strncmp(p, name, len) == 0)
+            return true;
+        if (!end)
+            break;
+        p = end + 1;
+    }
+    return false;
+}
+
+/** Tell whether a program can be found in `PATH`
+ *
+ * @param name program name
+ * @return true if found
+ */
+static bool have_program(const char *name) {
+    const char *path = getenv("PATH");
+    char candidate[4096];
+    for (const char *p = path ? path : ""; *p;) {
+        const char *end = strchr(p, ':');
+        size_t len = end ? (size_t) (end - p) : strlen(p);
+        if (snprintf(candidate, sizeof(candidate), "%.*s/%s", (int) len, p, name) < (int) sizeof(candidate) &&
+            access(candidate, X_OK) == 0)
+            return true;
+        if (!end)
+            break;
+        p = end + 1;
+    }
+    return false;
+}
+
+/** Run a command with its output discarded
+ *
+ * @param argv command
+ * @param rusage receives the resource usage of the command, or NULL
+ * @return exit status, -1 if it could not be run or did not exit
+ */
+static int run_command(char *const argv[], struct rusage *rusage) {
+    pid_t pid = fork();
+    if (pid < 0)
+        return -1;
+    if (pid == 0) {
+        int null = open("/dev/null", O_RDWR);
+        if (null >= 0) {
+            dup2(null, STDOUT_FILENO);
+            dup2(null, STDERR_FILENO);
+        }
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+
+    int status;
+    struct rusage usage;
+    while (wait4(pid, &status, 0, &usage) < 0) {
+        if (errno != EINTR)
+            return -1;
+    }
+    if (rusage)
+        *rusage = usage;
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+/** Remove a path and everything below it, outside of the timing
+ *
+ * @param config benchmark settings
+ * @param path path
+ */
+static void cleanup_path(const struct Config *config, const char *path) {
+    char *argv[] = {(char *) config->rm, (char *) "-rf", (char *) path, NULL};
+    run_command(argv, NULL);
+}
+
+/** Build the command line of an engine
+ *
+ * @param config benchmark settings
+ * @param engine engine
+ * @param operand tree to be removed
+ * @param trash trash directory of the trash engines
+ * @param argv receives the command, room for 8 pointers
+ * @param jobs buffer for the `--jobs` argument
+ * @param trash_arg buffer for the `--trash-dir` argument
+ */
+static void engine_argv(const struct Config *config, enum EngineKind engine, const char *operand, const char *trash,
+                        char **argv, char jobs[32], char trash_arg[4300]) {
+    int argc = 0;
+    if (engine == ENGINE_GNU_RM) {
+        argv[argc++] = (char *) config->rm;
+    } else {
+        argv[argc++] = (char *) config->better_rm;
+    }
+    argv[argc++] = (char *) "-rf";
+    if (engine == ENGINE_PARALLEL) {
+        snprintf(jobs, 32, "--jobs=%d", config->jobs);
+        argv[argc++] = jobs;
+    } else if (engine == ENGINE_IO_URING) {
+        argv[argc++] = (char *) "--io-uring";
+    } else if (engine == ENGINE_TRASH_RENAME || engine == ENGINE_TRASH_COPY) {
+        snprintf(trash_arg, 4300, "--trash-dir=%s", trash);
+        argv[argc++] = (char *) "--trash";
+        argv[argc++] = trash_arg;
+    }
+    argv[argc++] = (char *) operand;
+    argv[argc] = NULL;
+}
+
+/** Read the total call count from the summary written by `strace -c`
+ *
+ * @param path summary file
+ * @return syscalls, -1 if unknown
+ */
+static long long read_strace_total(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return -1;
+    long long total = -1;
+    char line[512];
+    while (fgets(line, sizeof(line), f)) {
+        // % time, seconds, usecs/call, calls, optional errors, then "total"
+        double percent, seconds;
+        long long usecs, calls;
+        if (strstr(line, " total") && sscanf(line, "%lf %lf %lld %lld", &percent, &seconds, &usecs, &calls) == 4)
+            total = calls;
+    }
+    fclose(f);
+    return total;
+}
+
+/** Measure one engine on one tree
+ *
+ * @param config benchmark settings
+ * @param tree tree shape
+ * @param engine engine
+ * @param stats receives the counts of the generated tree
+ * @param result receives the measurements
+ * @return 0 for success -1 if the tree could not be generated
+ */
+static int bench_one(const struct Config *config, const struct Tree *tree, enum EngineKind engine,
+                     struct TreeStats *stats, struct Result *result) {
+    char operand[4200], trash[4200], summary[4200], jobs[32], trash_arg[4300];
+    snprintf(operand, sizeof(operand), "%s/%s", config->work, tree->name);
+    snprintf(trash, sizeof(trash), "%s/trash",
+             engine == ENGINE_TRASH_COPY ? config->cross_device_dir : config->work);
+    snprintf(summary, sizeof(summary), "%s/strace.out", config->work);
+
+    char *argv[16];
+    engine_argv(config, engine, operand, trash, argv, jobs, trash_arg);
+
+    *result = (struct Result) {.seconds = -1, .syscalls = -1, .removed = true};
+    int runs = config->repeat + (config->syscalls ? 1 : 0);
+    for (int run = 0; run < runs; run++) {
+        // Every run sees the same tree
+        uint64_t rng = config->seed;
+        if (tree->generate(operand, config->scale, &rng, stats) != 0 || mkdir(trash, 0700) != 0) {
+            fprintf(stderr, "better-rm-bench: cannot generate '%s': %s\n", operand, strerror(errno));
+            cleanup_path(config, operand);
+            cleanup_path(config, trash);
+            return -1;
+        }
+
+        bool traced = run == config->repeat;
+        if (traced) {
+            char *traced_argv[24] = {(char *) "strace", (char *) "-f", (char *) "-c", (char *) "-o", summary};
+            for (int i = 0; argv[i]; i++)
+                traced_argv[5 + i] = argv[i];
+            run_command(traced_argv, NULL);
+            result->syscalls = read_strace_total(summary);
+            unlink(summary);
+        } else {
+            struct timespec start, end;
+            struct rusage usage;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            result->status = run_command(argv, &usage);
+            clock_gettime(CLOCK_MONOTONIC, &end);
+
+            double seconds = (double) (end.tv_sec - start.tv_sec) + (double) (end.tv_nsec - start.tv_nsec) / 1e9;
+            if (result->seconds < 0 || seconds < result->seconds)
+                result->seconds = seconds;
+            if (usage.ru_maxrss > result->peak_rss_kib)
+                result->peak_rss_kib = usage.ru_maxrss;
+            struct stat st;
+            if (lstat(operand, &st) == 0)
+                result->removed = false;
+        }
+
+        cleanup_path(config, operand);
+        cleanup_path(config, trash);
+    }
+    return 0;
+}
+
+/** Print a string as a JSON string
+ *
+ * @param s string, printable ASCII expected
+ */
+static void print_json_string(const char *s) {
+    putchar('"');
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\')
+            putchar('\\');
+        if ((unsigned char) *s >= 0x20)
+            putchar(*s);
+    }
+    putchar('"');
+}
+
+/** Print the usage
+ *
+ */
+static void print_usage(void) {
+    printf("Usage: better-rm-bench [OPTION]...\n");
+    printf("Time the better-rm engines and GNU rm on synthetic trees, report as JSON on stdout.\n\n");
+    printf("      --scale=F               multiply the entry count of every tree by F (default 1)\n");
+    printf("      --seed=N                seed of the tree generators (default 1)\n");
+    printf("      --repeat=N              timed runs per tree and engine, the fastest is kept (default 1)\n");
+    printf("  -j, --jobs=N                workers of the parallel engine (default: online CPUs)\n");
+    printf("      --trees=LIST            comma separated trees: wide,deep,mixed,hardlinks (default all)\n");
+    printf("      --engines=LIST          comma separated engines: fd-relative,parallel,io-uring,trash-rename,\n");
+    printf("                              trash-copy,gnu-rm (default all)\n");
+    printf("      --workdir=DIR           generate the trees under DIR (default $TMPDIR or /tmp)\n");
+    printf("      --cross-device-dir=DIR  trash directory parent on another filesystem, enables trash-copy\n");
+    printf("      --better-rm=PATH        better-rm binary (default %s)\n", BENCH_BETTER_RM);
+    printf("      --rm=PATH               rm binary used as the baseline (default rm)\n");
+    printf("      --no-syscalls           do not count syscalls under strace\n");
+    printf("  -h, --help                  display this help and exit\n");
+}
+
+/** Program entry point
+ *
+ * @param argc argument count
+ * @param argv argument vector
+ * @return 0 if every run removed its tree, 1 otherwise
+ */
+int main(int argc, char *argv[]) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    struct Config config = {.scale = 1.0,
+                            .seed = 1,
+                            .repeat = 1,
+                            .jobs = cpus > 0 ? (int) cpus : 1,
+                            .better_rm = BENCH_BETTER_RM,
+                            .rm = "rm",
+                            .syscalls = true};
+    const char *workdir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+
+    static const struct option long_options[] = {
+            {"scale", required_argument, 0, 0},       {"seed", required_argument, 0, 0},
+            {"repeat", required_argument, 0, 0},      {"jobs", required_argument, 0, 'j'},
+            {"trees", required_argument, 0, 0},       {"engines", required_argument, 0, 0},
+            {"workdir", required_argument, 0, 0},     {"cross-device-dir", required_argument, 0, 0},
+            {"better-rm", required_argument, 0, 0},   {"rm", required_argument, 0, 0},
+            {"no-syscalls", no_argument, 0, 0},       {"help", no_argument, 0, 'h'},
+            {0, 0, 0, 0}};
+
+    int opt, option_index = 0;
+    while ((opt = getopt_long(argc, argv, "j:h", long_options, &option_index)) != -1) {
+        if (opt == 'j') {
+            config.jobs = atoi(optarg);
+        } else if (opt == 'h') {
+            print_usage();
+            return 0;
+        } else if (opt == 0) {
+            const char *name = long_options[option_index].name;
+            if (strcmp(name, "scale") == 0) {
+                config.scale = strtod(optarg, NULL);
+            } else if (strcmp(name, "seed") == 0) {
+                config.seed = strtoull(optarg, NULL, 10);
+            } else if (strcmp(name, "repeat") == 0) {
+                config.repeat = atoi(optarg);
+            } else if (strcmp(name, "trees") == 0) {
+                config.trees = optarg;
+            } else if (strcmp(name, "engines") == 0) {
+                config.engines = optarg;
+            } else if (strcmp(name, "workdir") == 0) {
+                workdir = optarg;
+            } else if (strcmp(name, "cross-device-dir") == 0) {
+                config.cross_device_dir = optarg;
+            } else if (strcmp(name, "better-rm") == 0) {
+                config.better_rm = optarg;
+            } else if (strcmp(name, "rm") == 0) {
+                config.rm = optarg;
+            } else if (strcmp(name, "no-syscalls") == 0) {
+                config.syscalls = false;
+            }
+        } else {
+            fprintf(stderr, "Try 'better-rm-bench --help' for more information.\n");
+            return 1;
+        }
+    }
+    if (config.scale <= 0 || config.repeat < 1 || config.jobs < 1 || config.seed == 0) {
+        fprintf(stderr, "better-rm-bench: --scale, --seed, --repeat and --jobs must be positive\n");
+        return 1;
+    }
+    if (config.syscalls && !have_program("strace")) {
+        fprintf(stderr, "better-rm-bench: strace not found, syscalls are not counted\n");
+        config.syscalls = false;
+    }
+
+    if (snprintf(config.work, sizeof(config.work), "%s/better-rm-bench.XXXXXX", workdir) >= (int) sizeof(config.work) ||
+        !mkdtemp(config.work)) {
+        fprintf(stderr, "better-rm-bench: cannot create work directory in '%s': %s\n", workdir, strerror(errno));
+        return 1;
+    }
+
+    // Keep the user's configuration, snapshot and trash out of the measurements
+    char home[4200];
+    snprintf(home, sizeof(home), "%s/home", config.work);
+    mkdir(home, 0700);
+    setenv("HOME", home, 1);
+    unsetenv("XDG_CONFIG_HOME");
+    unsetenv("XDG_CACHE_HOME");
+    unsetenv("BETTER_RM_TRASH");
+
+    struct stat work_st, cross_st;
+    bool cross_device = config.cross_device_dir && stat(config.work, &work_st) == 0 &&
+                        stat(config.cross_device_dir, &cross_st) == 0 && work_st.st_dev != cross_st.st_dev;
+    if (config.cross_device_dir && !cross_device)
+        fprintf(stderr, "better-rm-bench: '%s' is not on another filesystem, skipping trash-copy\n",
+                config.cross_device_dir);
+
+    printf("{\"version\":\"%s\",\"scale\":%g,\"seed\":%llu,\"jobs\":%d,\"results\":[", VERSION, config.scale,
+           (unsigned long long) config.seed, config.jobs);
+    bool first = true;
+    int exit_status = 0;
+    for (size_t t = 0; t < sizeof(trees) / sizeof(trees[0]); t++) {
+        if (!selected(config.trees, trees[t].name))
+            continue;
+        for (int e = 0; e < ENGINE_COUNT; e++) {
+            if (!selected(config.engines, engine_names[e]))
+                continue;
+#ifndef BENCH_IO_URING
+            if (e == ENGINE_IO_URING)
+                continue; // better-rm was built without the backend, it would only measure the fallback
+#endif
+            if (e == ENGINE_TRASH_COPY && !cross_device)
+                continue;
+
+            fprintf(stderr, "better-rm-bench: %s with %s\n", trees[t].name, engine_names[e]);
+            struct TreeStats stats;
+            struct Result result;
+            if (bench_one(&config, &trees[t], (enum EngineKind) e, &stats, &result) != 0) {
+                exit_status = 1;
+                continue;
+            }
+            if (result.status != 0 || !result.removed)
+                exit_status = 1;
+
+            printf("%s\n{\"tree\":", first ? "" : ",");
+            print_json_string(trees[t].name);
+            printf(",\"engine\":");
+            print_json_string(engine_names[e]);
+            printf(",\"entries\":%llu,\"bytes\":%llu,\"seconds\":%.6f,\"files_per_second\":%.1f", stats.entries,
+                   stats.bytes, result.seconds, result.seconds > 0 ? (double) stats.entries / result.seconds : 0.0);
+            if (result.syscalls >= 0) {
+                printf(",\"syscalls\":%lld,\"syscalls_per_file\":%.3f", result.syscalls,
+                       (double) result.syscalls / (double) stats.entries);
+            } else {
+                printf(",\"syscalls\":null,\"syscalls_per_file\":null");
+            }
+            printf(",\"peak_rss_kib\":%ld,\"exit_status\":%d,\"removed\":%s}", result.peak_rss_kib, result.status,
+                   result.removed ? "true" : "false");
+            fflush(stdout);
+            first = false;
+        }
+    }
+    printf("\n]}\n");
+
+    cleanup_path(&config, config.work);
+    return exit_status;
+}
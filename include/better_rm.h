@@ -0,0 +1,441 @@
+/*! \file better_rm.h
+ * Declarations shared between the better-rm translation units
+ */
+#ifndef BETTER_RM_H
+#define BETTER_RM_H
+
+#include <dirent.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define CONFIG_FILE "/etc/better-rm.conf"
+#define MAX_PROTECTED_DIRS 100
+#define MAX_KEEP_PATTERNS 100
+#define TRASH_DIR_ENV "BETTER_RM_TRASH"
+#define DEFAULT_TRASH_DIR ".Trash"
+#define DAEMON_NAME "better-rmd"
+#define DAEMON_SOCKET "/run/better-rmd.sock"
+#define DAEMON_SOCKET_ENV "BETTER_RM_DAEMON"
+#define STAGING_PREFIX ".better-rm-staging-"
+
+/*! Format of the per-entry report written to stdout */
+enum OutputFormat {
+    OUTPUT_TEXT, /*!< human readable messages with `--verbose` and `--dry-run` */
+    OUTPUT_NDJSON, /*!< one JSON object per entry and line */
+    OUTPUT_NULL, /*!< NUL terminated path, action, size, result and errno fields per entry */
+};
+
+struct KeepSet;
+
+/*! Options struct used to store user defined options */
+struct Options {
+    bool recursive; /*!< remove directories and their contents recursively */
+    bool force; /*!< ignore nonexistent files, never prompt */
+    bool verbose; /*!< explain what is being done */
+    bool interactive; /*!< prompt before every removal */
+    bool dry_run; /*!< show what would be deleted without actually removing */
+    bool preserve_root; /*!< block removing `/` */
+    bool one_file_system; /*!< stay on the same filesystem */
+    bool use_trash; /*!< move files to trash instead of deleting */
+    bool no_preserve_root; /*!< allow removing `/` */
+    const char *trash_dir; /*!< specify trash directory */
+    int jobs; /*!< number of worker threads for recursive removal, 0 or 1 runs sequentially */
+    bool io_uring; /*!< batch metadata operations through io_uring when available */
+    bool per_mount_trash; /*!< trash operands on other filesystems to their mount's `.Trash-$uid` */
+    enum OutputFormat output; /*!< format of the per-entry report on stdout */
+    bool background; /*!< stage directory operands and remove them in a detached worker */
+    uint64_t rate; /*!< removals per second with `--rate`, 0 for no limit */
+    uint64_t bandwidth; /*!< bytes freed per second with `--bw`, 0 for no limit */
+    uint64_t shrink_above; /*!< regular files larger than this are truncated step by step before the unlink, 0 never */
+    const struct KeepSet *keep; /*!< entries left in place with their parents, NULL if none */
+};
+
+/*! Growable path buffer holding the path of the entry currently being visited */
+struct PathBuf {
+    char *buf; /*!< NUL terminated path */
+    size_t len; /*!< length of the path without the terminator */
+    size_t cap; /*!< allocated size of \ref buf */
+};
+
+/*! Directory on the path of a recursive walk, closed and reopened by walk_dir_enter() and walk_dir_leave() */
+struct WalkDir {
+    struct WalkDir *parent; /*!< containing directory, NULL for the directory the walk starts from */
+    int fd; /*!< directory, -1 while closed */
+    dev_t dev; /*!< device, recorded when the directory is closed */
+    ino_t ino; /*!< inode, checked when the directory is reopened */
+};
+
+int path_push(struct PathBuf *pb, const char *name);
+void path_pop(struct PathBuf *pb, size_t len);
+
+/*! Reader of a directory in getdents64 batches, each handed out in inode order, see dir_batch_next() */
+struct DirBatch {
+    char *buf; /*!< getdents64 records of the current batch */
+    size_t cap; /*!< size of \ref buf */
+    bool grow; /*!< the last batch filled the buffer, grow it before the next one */
+    const struct dirent **entries; /*!< entries of the current batch, sorted by inode number */
+    size_t entries_cap; /*!< allocated size of \ref entries */
+    size_t count; /*!< entries in the current batch */
+    size_t next; /*!< index of the next entry to hand out */
+};
+
+const struct dirent *dir_batch_next(struct DirBatch *batch, int fd);
+void dir_batch_reset(struct DirBatch *batch);
+void dir_batch_free(struct DirBatch *batch);
+
+#define SLAB_CLASSES 8 /*!< power of two size classes of a slab, from 64 bytes to 8 KiB */
+
+struct ArenaBlock;
+
+/*! Bump allocator, released as a whole or rewound to a mark */
+struct Arena {
+    struct ArenaBlock *current; /*!< block allocations are taken from, linked to the older ones */
+    struct ArenaBlock *spare; /*!< blocks emptied by arena_release(), kept for reuse */
+};
+
+/*! Allocation state of an arena */
+struct ArenaMark {
+    struct ArenaBlock *block; /*!< current block when the mark was taken */
+    size_t used; /*!< bytes used in that block */
+};
+
+/*! Recycling allocator of variable sized nodes, owned by one thread */
+struct Slab {
+    struct Arena arena; /*!< memory of the nodes */
+    void *free_lists[SLAB_CLASSES]; /*!< freed nodes of every size class */
+};
+
+/*! Arena of the main thread, holding the path state of the invocation until exit */
+extern struct Arena run_arena;
+
+void *arena_alloc(struct Arena *arena, size_t size);
+char *arena_strdup(struct Arena *arena, const char *s);
+struct ArenaMark arena_mark(const struct Arena *arena);
+void arena_release(struct Arena *arena, struct ArenaMark mark);
+void arena_destroy(struct Arena *arena);
+void *slab_alloc(struct Slab *slab, size_t size);
+void slab_free(struct Slab *slab, void *ptr);
+void slab_destroy(struct Slab *slab);
+
+int generate_trash_name(char *buf, size_t size, const char *original_path, const char *trash_dir);
+
+extern char *protected_dirs[MAX_PROTECTED_DIRS];
+extern int protected_count;
+
+void init_protected_dirs(void);
+void load_config_file(const char *filename);
+int user_config_path(char *buf, size_t size);
+int config_snapshot_load(void);
+int config_snapshot_save(void);
+
+/*! How removals are reported to syslog */
+enum AuditMode {
+    AUDIT_FILE, /*!< one record per removed entry */
+    AUDIT_SUMMARY, /*!< one record per top-level operand with entry, byte and failure counts */
+};
+
+extern enum AuditMode audit_mode;
+
+struct stat;
+void audit_start(void);
+void audit_set_user(const char *user);
+void audit_begin(const char *operand, const char *action);
+void audit_end(void);
+void audit_end_detail(const char *detail);
+void audit_counts(unsigned long long *entries, unsigned long long *bytes, unsigned long long *failures);
+void audit_nested_begin(const char *operand, const char *action);
+void audit_nested_end(void);
+void audit_close(void);
+bool audit_wants_sizes(void);
+void log_deletion(const char *path, const char *action, bool success, off_t size);
+void log_deletion_stat(const char *path, const char *action, bool success, off_t size, const struct stat *st);
+
+extern bool audit_journal;
+
+int journal_dir(char *buf, size_t size);
+void journal_append(const char *path, const char *action, int error, off_t size, const struct stat *st);
+void journal_append_summary(const char *path, const char *action, unsigned long long entries,
+                            unsigned long long bytes, unsigned long long failures);
+void journal_flush(void);
+int journal_query(char *const *operands, size_t count, int64_t after, int64_t before);
+
+/*! Syscalls timed by `--stats` */
+enum StatsOp {
+    STATS_STAT, /*!< lstat() and fstatat() of entries */
+    STATS_OPENDIR, /*!< opening a directory to be scanned */
+    STATS_UNLINK, /*!< unlink of a non-directory entry */
+    STATS_RMDIR, /*!< removal of an emptied directory */
+    STATS_RENAME, /*!< rename into the trash */
+    STATS_COPY, /*!< copy into a trash on another filesystem */
+    STATS_SYSLOG, /*!< one audit record */
+    STATS_URING, /*!< submission of one io_uring batch and wait for its completions */
+    STATS_TRUNCATE, /*!< one step shrinking a large file before its unlink */
+    STATS_JOURNAL, /*!< one group of audit journal records written and synced */
+    STATS_OP_COUNT
+};
+
+int stats_enable(const char *format);
+bool stats_enabled(void);
+uint64_t stats_begin(void);
+void stats_end(enum StatsOp op, uint64_t start, bool failed);
+void stats_removal(bool success, off_t size, int err);
+void stats_report(void);
+
+int output_parse(const char *name, enum OutputFormat *format);
+bool output_human(const struct Options *opts);
+bool output_wants_sizes(const struct Options *opts);
+void output_record(const struct Options *opts, const char *path, const char *action, off_t size, int err);
+void output_flush(void);
+
+/*! What a directory entry is as far as removal is concerned */
+enum EntryKind {
+    ENTRY_GONE, /*!< the entry vanished or could not be stat'ed */
+    ENTRY_FILE, /*!< anything that is removed with a plain unlink */
+    ENTRY_DIR, /*!< a directory to descend into */
+    ENTRY_OTHER_FS, /*!< a directory on another filesystem with `--one-file-system` */
+    ENTRY_PROTECTED, /*!< a protected directory, never entered */
+    ENTRY_KEPT, /*!< matched by a `--keep` pattern, never entered */
+};
+
+/*! Hash tables of the protected set, as stored in a configuration snapshot */
+struct ProtectedTables {
+    size_t id_size; /*!< size of one identity slot */
+    const void *ids; /*!< identity slots */
+    size_t id_slots; /*!< number of identity slots, a power of two */
+    size_t id_count; /*!< used identity slots */
+    const ino_t *probe_inos; /*!< probe slots */
+    size_t probe_slots; /*!< number of probe slots, a power of two */
+    size_t probe_count; /*!< used probe slots */
+    const char *places; /*!< NUL terminated real paths the protected directories are reached at */
+    size_t places_len; /*!< length of \ref places */
+    const char *roots; /*!< NUL terminated paths the set was built from */
+    size_t roots_len; /*!< length of \ref roots */
+    const void *root_ids; /*!< identity of every path of \ref roots, \ref id_size bytes each */
+    size_t root_count; /*!< number of paths in \ref roots */
+};
+
+int protected_set_add(const char *path);
+void protected_set_clear(void);
+void protected_set_export(struct ProtectedTables *tables);
+int protected_set_import(const struct ProtectedTables *tables);
+bool protected_set_current(void);
+bool protected_set_probe(ino_t ino);
+bool protected_set_contains(dev_t dev, ino_t ino);
+bool protected_set_below(const char *path);
+
+bool entry_needs_stat(unsigned char d_type, const struct Options *opts);
+enum EntryKind classify_entry_at(int dirfd, const struct dirent *entry, dev_t dir_dev, const struct Options *opts);
+
+int move_to_trash_at(int dirfd, const char *name, const char *path, const char *trash_dir, bool verbose);
+int copy_to_trash_at(int dirfd, const char *name, const char *trash_path, bool dedup);
+int copy_into_at(int src_dirfd, const char *name, int dst_dirfd, int blobs_fd);
+int copy_dir_attrs(int src, int dst);
+int move_directory_at(int parent_fd, const char *name, int dst_fd, int blobs_fd);
+int remove_file_at(int dirfd, const char *name, const char *path, const struct Options *opts);
+int remove_emptied_dir_at(int parent_fd, const char *name, const char *path, const struct Options *opts);
+
+bool prepare_mount_dir(const char *dir, dev_t dev);
+bool trash_dir_trusted(int fd, const char *path);
+const char *mount_trash_dir(const char *path, const struct stat *st);
+const char *mount_staging_dir(const char *path, const struct stat *st);
+size_t mount_trash_dirs(bool all_users, char ***dirs);
+size_t mount_staging_dirs(bool all_users, char ***dirs);
+size_t mount_binds_of(const char *path, dev_t dev, char ***mount_points);
+uint64_t mounts_hash(void);
+
+int throttle_parse_rate(const char *s, uint64_t *rate);
+int throttle_parse_bandwidth(const char *s, uint64_t *bandwidth);
+bool throttle_enabled(const struct Options *opts);
+bool throttle_wants_sizes(const struct Options *opts);
+void throttle_wait(const struct Options *opts, unsigned ops, uint64_t bytes);
+int throttled_unlink_at(int dirfd, const char *name, const struct stat *st, const struct Options *opts);
+
+struct KeepSlot;
+
+/*! Compiled `--keep` patterns, see keep_match() */
+struct KeepSet {
+    struct KeepSlot *slots; /*!< open addressing table of plain names and `*.ext` suffixes */
+    size_t mask; /*!< number of slots minus one */
+    bool suffixes; /*!< some slot holds a suffix, so the tails of a name are looked up too */
+    const char **globs; /*!< the other patterns, tried with fnmatch() */
+    bool *glob_dirs_only; /*!< the glob of the same index only matches directories */
+    size_t glob_count; /*!< number of \ref globs */
+    size_t count; /*!< number of patterns */
+    char *strings; /*!< copy of the patterns the slots and globs point into */
+};
+
+extern char *keep_patterns[MAX_KEEP_PATTERNS];
+extern int keep_count;
+
+bool keep_pattern_valid(const char *pattern);
+int keep_compile(struct KeepSet *set, char *const *patterns, size_t count);
+bool keep_match(const struct KeepSet *set, const char *name, bool is_dir);
+bool keep_match_operand(const struct KeepSet *set, const char *path, bool is_dir);
+enum EntryKind keep_classify(const struct Options *opts, const char *name, enum EntryKind kind);
+void keep_report(const char *path, const struct Options *opts);
+void keep_free(struct KeepSet *set);
+
+/*! Header of a trash index file */
+struct TrashIndexHeader {
+    char magic[8]; /*!< `BRMTIDX` */
+    uint32_t version; /*!< layout version */
+    uint32_t record_size; /*!< size of a \ref TrashRecord */
+    uint64_t generation; /*!< suffix of the strings file, bumped by every compaction */
+    uint64_t removed; /*!< records flagged \ref TRASH_RECORD_REMOVED */
+    uint32_t flags; /*!< the index was replaced by a compaction */
+    uint32_t reserved; /*!< padding */
+    uint64_t bytes; /*!< apparent size of the live entries */
+    uint64_t inodes; /*!< inodes of the live entries */
+    uint64_t oldest; /*!< no record before this one is live, eviction starts here */
+};
+
+#define TRASH_RECORD_REMOVED 0x1u /*!< the entry was restored or purged */
+#define TRASH_RECORD_BLOBS 0x2u /*!< the entry links to blobs of the store, listed at \ref TrashRecord.blobs_offset */
+
+/*! One trashed entry, offsets point into the strings file */
+struct TrashRecord {
+    uint64_t path_offset; /*!< absolute path the entry was removed from */
+    uint64_t name_offset; /*!< entry name inside the trash directory */
+    uint64_t blobs_offset; /*!< blobs the entry links to, see \ref TRASH_RECORD_BLOBS and dedup_release() */
+    uint64_t dev; /*!< device of the entry before it was trashed */
+    uint64_t ino; /*!< inode of the entry before it was trashed */
+    int64_t size; /*!< apparent size, of the whole tree for a tree measured under a quota, of the directory otherwise */
+    int64_t deleted_at; /*!< time the entry was trashed */
+    uint32_t uid; /*!< user who trashed the entry */
+    uint32_t mode; /*!< type and permissions of the entry */
+    uint32_t flags; /*!< \ref TRASH_RECORD_REMOVED, \ref TRASH_RECORD_BLOBS */
+    uint32_t inodes; /*!< inodes of the entry, counted like \ref size */
+};
+
+/*! Trash index mapped for reading, see trash_index_open() */
+struct TrashIndex {
+    int dirfd; /*!< trash directory */
+    int fd; /*!< index file, holding the shared lock */
+    void *map; /*!< mapping of the index file */
+    size_t map_len; /*!< size of \ref map */
+    struct TrashIndexHeader *header; /*!< header inside \ref map */
+    struct TrashRecord *records; /*!< records inside \ref map, oldest first */
+    size_t count; /*!< number of records, removed ones included */
+    const char *strings; /*!< mapping of the strings file */
+    size_t strings_len; /*!< size of \ref strings */
+    struct TrashRecord **slots; /*!< open addressing table of the records by trash name, NULL when empty */
+    size_t mask; /*!< slot count minus one */
+};
+
+/*! Running totals of a trash directory */
+struct TrashUsage {
+    uint64_t bytes; /*!< apparent size */
+    uint64_t inodes; /*!< inodes */
+    int64_t oldest_at; /*!< time the oldest entry was trashed */
+};
+
+int trash_index_append(const char *trash_dir, const char *original_path, const char *trash_path,
+                       const struct stat *st, const struct TrashUsage *usage, const char *blobs);
+int trash_index_usage(const char *trash_dir, struct TrashUsage *usage);
+int trash_index_open(const char *trash_dir, struct TrashIndex *index);
+int trash_index_open_at(int dirfd, struct TrashIndex *index);
+int trash_index_open_records(const char *trash_dir, struct TrashIndex *index);
+const char *trash_index_string(const struct TrashIndex *index, uint64_t offset);
+struct TrashRecord *trash_index_find(const struct TrashIndex *index, const char *trash_name);
+bool trash_index_remove(struct TrashIndex *index, struct TrashRecord *record);
+void trash_index_skip(struct TrashIndex *index, size_t oldest);
+int trash_index_compact(const char *trash_dir);
+void trash_index_close(struct TrashIndex *index);
+
+/*! How the entries evicted from a full trash are removed */
+enum TrashEvict {
+    TRASH_EVICT_SYNC, /*!< removed before the new entry is trashed */
+    TRASH_EVICT_BACKGROUND, /*!< staged, and removed by the background worker */
+};
+
+extern uint64_t trash_max_bytes;
+extern time_t trash_max_age;
+extern enum TrashEvict trash_evict;
+
+/*! Streaming XXH64 state, see xxh64_update() */
+struct Xxh64 {
+    uint64_t lanes[4]; /*!< accumulators of the four interleaved 8-byte lanes */
+    unsigned char buf[32]; /*!< bytes waiting for a full stripe */
+    size_t buffered; /*!< bytes used in \ref buf */
+    uint64_t total; /*!< bytes hashed */
+};
+
+#define DEDUP_UNLISTED "*" /*!< blob list of an entry whose blobs could not all be listed, never a blob name */
+
+extern bool trash_dedup;
+
+void xxh64_init(struct Xxh64 *state);
+void xxh64_update(struct Xxh64 *state, const void *data, size_t len);
+uint64_t xxh64_digest(const struct Xxh64 *state);
+int dedup_open(int trash_dirfd);
+int dedup_file_at(int blobs_fd, int copy_fd, int dst_dirfd, const char *dst_name, const struct stat *copy,
+                  uint64_t hash);
+void dedup_refs_begin(void);
+const char *dedup_refs_end(void);
+void dedup_release(const struct TrashIndex *index, const struct TrashRecord *record);
+void dedup_collect(int trash_dirfd);
+
+int quota_parse_bytes(const char *s, uint64_t *bytes);
+int quota_parse_age(const char *s, time_t *seconds);
+int trash_quota_measure(int dirfd, const char *name, const struct stat *st, struct TrashUsage *usage);
+int trash_quota_admit(const char *trash_dir, const struct TrashUsage *usage, bool verbose);
+
+const char *get_trash_dir(void);
+bool is_protected(const char *path);
+bool is_root_with_preserve(const char *path, const struct Options *opts);
+const struct Options *operand_options(const char *path, const struct stat *st, const struct Options *opts,
+                                      struct Options *mount_opts);
+int remove_directory(const char *path, const struct Options *opts);
+int remove_directory_in(int parent_fd, const char *name, const char *path, const struct Options *opts);
+int remove_directory_walk(int parent_fd, const char *name, const char *path, const struct Options *opts, bool *kept);
+void walk_dir_enter(struct WalkDir *dir, struct WalkDir *parent, int fd);
+int walk_dir_leave(struct WalkDir *dir);
+void report_remove_failure(const char *path, int err, const struct Options *opts);
+int trash_directory_tree(const char *path, const struct Options *opts);
+int safe_remove(const char *path, const struct Options *opts);
+
+/*! Parent directory shared by consecutive operands, see operand_group_remove() */
+struct OperandGroup {
+    char *parent; /*!< parent as written in the operands, NULL before the first group */
+    size_t parent_len; /*!< length of \ref parent */
+    int fd; /*!< parent fd, -1 if the operands of the group take the regular path */
+    char resolved[PATH_MAX]; /*!< canonical path of the parent */
+};
+
+int operand_group_remove(struct OperandGroup *group, const char *path, const struct Options *opts);
+void operand_group_close(struct OperandGroup *group);
+int files0_run(const char *file, const struct Options *opts);
+int operands_run(char *const *operands, size_t count, const struct Options *opts);
+
+int background_move(const char *path, const struct stat *st, char *staged, size_t size);
+int background_stage(const char *path, const struct stat *st, const struct Options *opts);
+bool background_pending(void);
+void background_start(int jobs);
+int background_reclaim(bool all_users, int jobs);
+
+size_t purge_default_dirs(char ***dirs);
+int purge_trash(char *const *dirs, size_t count, time_t cutoff, const struct Options *opts);
+
+void normalize_path(char *path);
+char *absolute_operand(const char *operand);
+int restore_trash(const char *trash_dir, char *const *operands, size_t count, int64_t deleted_after,
+                  int64_t deleted_before, const struct Options *opts);
+
+int plan_run(char *const *operands, size_t count, const char *plan_file, const struct Options *opts);
+
+int better_rm_main(int argc, char *argv[], bool configured);
+int switch_user(uid_t uid, gid_t gid);
+int daemon_main(int argc, char *argv[]);
+int daemon_client(const char *socket_path, int argc, char *argv[]);
+void daemon_serve(int conn);
+
+int remove_directory_parallel(int parent_fd, const char *name, const char *path, const struct Options *opts);
+
+bool uring_supported(void);
+int uring_scan_dir(int fd, dev_t dir_dev, struct DirBatch *reader, struct PathBuf *path, const struct Options *opts,
+                   bool *kept, int (*add_subdir)(void *ctx, const char *name), void *ctx);
+
+#endif
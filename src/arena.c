@@ -0,0 +1,199 @@
+/*! \file arena.c
+ * Arena and slab allocation of per-invocation path and traversal state
+ *
+ * An arena hands out memory from large blocks by bumping a pointer and never frees anything individually. Scratch
+ * allocations are undone in LIFO order by rewinding to a mark, and the rewound blocks are kept for reuse, so a tree of
+ * millions of entries runs in the memory of its peak instead of doing millions of small `malloc()`/`free()` pairs. The
+ * whole arena is released in one go at exit.
+ *
+ * A slab recycles variable sized nodes that do not die in LIFO order, the directory tasks of the parallel engine,
+ * through free lists of power of two size classes carved from its own arena. Every worker owns a slab, so the hot path
+ * of the engine takes no allocator lock.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/better_rm.h"
+
+#define ARENA_BLOCK_SIZE (64 * 1024)
+#define ARENA_ALIGN 16
+#define SLAB_MIN_SHIFT 6 /*!< the smallest size class holds 64 bytes */
+#define SLAB_HEADER ARENA_ALIGN /*!< room before a slab node for its size class, keeps the node aligned */
+
+/*! Block of arena memory */
+struct ArenaBlock {
+    struct ArenaBlock *prev; /*!< previous block of the arena, or next spare block */
+    size_t size; /*!< usable bytes */
+    size_t used; /*!< bytes handed out */
+};
+
+#define ARENA_BLOCK_HEADER ((sizeof(struct ArenaBlock) + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1))
+
+struct Arena run_arena;
+
+
+/** Get a block with room for a request, reusing a spare block if possible
+ *
+ * @param arena arena
+ * @param size requested size, aligned
+ * @return block, NULL if out of memory
+ */
+static struct ArenaBlock *arena_block(struct Arena *arena, size_t size) {
+    for (struct ArenaBlock **link = &arena->spare; *link; link = &(*link)->prev) {
+        if ((*link)->size >= size) {
+            struct ArenaBlock *block = *link;
+            *link = block->prev;
+            return block;
+        }
+    }
+
+    size_t usable = size > ARENA_BLOCK_SIZE - ARENA_BLOCK_HEADER ? size : ARENA_BLOCK_SIZE - ARENA_BLOCK_HEADER;
+    struct ArenaBlock *block = malloc(ARENA_BLOCK_HEADER + usable);
+    if (block)
+        block->size = usable;
+    return block;
+}
+
+/** Allocate memory from an arena
+ *
+ * @param arena arena
+ * @param size size in bytes
+ * @return memory aligned for any type, valid until the arena is rewound past it, NULL if out of memory
+ */
+void *arena_alloc(struct Arena *arena, size_t size) {
+    if (size > SIZE_MAX - ARENA_BLOCK_SIZE)
+        return NULL;
+    size = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+
+    struct ArenaBlock *block = arena->current;
+    if (!block || block->size - block->used < size) {
+        block = arena_block(arena, size);
+        if (!block)
+            return NULL;
+        block->used = 0;
+        block->prev = arena->current;
+        arena->current = block;
+    }
+
+    void *ptr = (char *) block + ARENA_BLOCK_HEADER + block->used;
+    block->used += size;
+    return ptr;
+}
+
+/** Copy a string into an arena
+ *
+ * @param arena arena
+ * @param s string
+ * @return copy, NULL if out of memory
+ */
+char *arena_strdup(struct Arena *arena, const char *s) {
+    size_t len = strlen(s) + 1;
+    char *copy = arena_alloc(arena, len);
+    if (copy)
+        memcpy(copy, s, len);
+    return copy;
+}
+
+/** Remember the allocation state of an arena
+ *
+ * @param arena arena
+ * @return mark to be given to arena_release()
+ */
+struct ArenaMark arena_mark(const struct Arena *arena) {
+    return (struct ArenaMark) {.block = arena->current, .used = arena->current ? arena->current->used : 0};
+}
+
+/** Free everything allocated since a mark was taken
+ *
+ * The blocks emptied by the rewind are kept for later allocations.
+ *
+ * @param arena arena
+ * @param mark mark returned by arena_mark(), marks taken later are invalidated
+ */
+void arena_release(struct Arena *arena, struct ArenaMark mark) {
+    while (arena->current && arena->current != mark.block) {
+        struct ArenaBlock *block = arena->current;
+        arena->current = block->prev;
+        block->prev = arena->spare;
+        arena->spare = block;
+    }
+    if (arena->current)
+        arena->current->used = mark.used;
+}
+
+/** Give all the memory of an arena back to the system
+ *
+ * @param arena arena, empty and usable afterwards
+ */
+void arena_destroy(struct Arena *arena) {
+    struct ArenaBlock *lists[2] = {arena->current, arena->spare};
+    for (int i = 0; i < 2; i++) {
+        while (lists[i]) {
+            struct ArenaBlock *prev = lists[i]->prev;
+            free(lists[i]);
+            lists[i] = prev;
+        }
+    }
+    arena->current = NULL;
+    arena->spare = NULL;
+}
+
+/** Allocate a node from a slab
+ *
+ * Nodes larger than the biggest size class come from `malloc()`.
+ *
+ * @param slab slab
+ * @param size size in bytes
+ * @return node aligned for any type, NULL if out of memory
+ */
+void *slab_alloc(struct Slab *slab, size_t size) {
+    unsigned cls = 0;
+    while (cls < SLAB_CLASSES && ((size_t) 1 << (SLAB_MIN_SHIFT + cls)) < size + SLAB_HEADER)
+        cls++;
+
+    char *node;
+    if (cls == SLAB_CLASSES) {
+        node = size <= SIZE_MAX - SLAB_HEADER ? malloc(size + SLAB_HEADER) : NULL;
+    } else if (slab->free_lists[cls]) {
+        node = slab->free_lists[cls];
+        slab->free_lists[cls] = *(void **) (node + SLAB_HEADER);
+    } else {
+        node = arena_alloc(&slab->arena, (size_t) 1 << (SLAB_MIN_SHIFT + cls));
+    }
+    if (!node)
+        return NULL;
+    memcpy(node, &cls, sizeof(cls));
+    return node + SLAB_HEADER;
+}
+
+/** Give a node back to a slab
+ *
+ * The node may have been allocated from the slab of another worker of the same engine, it is then recycled by this
+ * one. All those slabs have to be destroyed together.
+ *
+ * @param slab slab
+ * @param ptr node returned by slab_alloc(), or NULL
+ */
+void slab_free(struct Slab *slab, void *ptr) {
+    if (!ptr)
+        return;
+    char *node = (char *) ptr - SLAB_HEADER;
+    unsigned cls;
+    memcpy(&cls, node, sizeof(cls));
+    if (cls == SLAB_CLASSES) {
+        free(node);
+        return;
+    }
+    *(void **) ptr = slab->free_lists[cls];
+    slab->free_lists[cls] = node;
+}
+
+/** Release the memory of a slab once none of its nodes is in use
+ *
+ * @param slab slab, empty and usable afterwards
+ */
+void slab_destroy(struct Slab *slab) {
+    arena_destroy(&slab->arena);
+    memset(slab->free_lists, 0, sizeof(slab->free_lists));
+}
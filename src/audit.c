@@ -0,0 +1,206 @@
+/*! \file audit.c
+ * Audit trail of removals sent to syslog
+ *
+ * A single syslog session is kept open for the whole process. In \ref AUDIT_FILE mode every removed entry is logged,
+ * in \ref AUDIT_SUMMARY mode the entries of an operand are only counted and one record is logged per operand. With
+ * `audit_journal=yes` every record is also appended to the local journal of journal.c.
+ *
+ * Removals a thread does on the side of an operand, evicting old trash entries to make room for it, are counted and
+ * logged under an action of their own between audit_nested_begin() and audit_nested_end().
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "../include/better_rm.h"
+
+enum AuditMode audit_mode = AUDIT_FILE; /*!< selected with `audit=` in the configuration files */
+
+/*! Counters of the operand being removed in \ref AUDIT_SUMMARY mode */
+struct AuditSummary {
+    const char *operand; /*!< top-level operand, NULL outside of audit_begin()/audit_end() */
+    const char *action; /*!< TRASH, DELETE or the action of a nested summary */
+    unsigned long long entries; /*!< entries removed */
+    unsigned long long bytes; /*!< apparent size of the removed non-directory entries */
+    unsigned long long failures; /*!< entries that could not be removed */
+};
+
+static struct AuditSummary summary;
+static __thread struct AuditSummary nested;
+static pthread_once_t audit_once = PTHREAD_ONCE_INIT;
+static const char *audit_user;
+
+
+/** Open the syslog session shared by every record of this process
+ *
+ */
+static void audit_open(void) {
+    openlog("better-rm", LOG_PID | LOG_NDELAY, LOG_USER);
+    audit_user = getenv("USER");
+}
+
+/** Open the syslog session now rather than with the first record
+ *
+ * Used by the daemon, the processes serving its connections share the session.
+ */
+void audit_start(void) {
+    pthread_once(&audit_once, audit_open);
+}
+
+/** Set the user name logged with the records
+ *
+ * @param user name of the user the removals are done for, replaces `$USER`
+ */
+void audit_set_user(const char *user) {
+    pthread_once(&audit_once, audit_open);
+    audit_user = user;
+}
+
+/** Write the buffered journal records and close the syslog session, called once at exit
+ *
+ */
+void audit_close(void) {
+    journal_flush();
+    closelog();
+}
+
+/** Tell whether removals should look up the size of the entries they remove
+ *
+ * @return true in summary mode, which reports the bytes freed per operand, and when journaling, which records the size
+ *         and identity of every entry
+ */
+bool audit_wants_sizes(void) {
+    return audit_mode == AUDIT_SUMMARY || audit_journal;
+}
+
+/** Start counting the entries of a top-level operand
+ *
+ * @param operand operand as given on the command line
+ * @param action TRASH or DELETE
+ */
+void audit_begin(const char *operand, const char *action) {
+    summary.operand = operand;
+    summary.action = action;
+    summary.entries = 0;
+    summary.bytes = 0;
+    summary.failures = 0;
+}
+
+/** Read the counters of the current operand
+ *
+ * @param entries receives the entries removed so far
+ * @param bytes receives the bytes removed so far
+ * @param failures receives the failures so far
+ */
+void audit_counts(unsigned long long *entries, unsigned long long *bytes, unsigned long long *failures) {
+    *entries = __atomic_load_n(&summary.entries, __ATOMIC_RELAXED);
+    *bytes = __atomic_load_n(&summary.bytes, __ATOMIC_RELAXED);
+    *failures = __atomic_load_n(&summary.failures, __ATOMIC_RELAXED);
+}
+
+/** Log a summary record in summary mode and close it
+ *
+ * @param counted summary to be logged
+ * @param detail text appended to the record, NULL for none
+ */
+static void summary_log(struct AuditSummary *counted, const char *detail) {
+    if (audit_mode == AUDIT_SUMMARY && counted->operand && (counted->entries > 0 || counted->failures > 0)) {
+        pthread_once(&audit_once, audit_open);
+        syslog(counted->failures ? LOG_WARNING : LOG_INFO,
+               "%s SUMMARY: %s (user: %s, uid: %d, entries: %llu, bytes: %llu, failures: %llu%s%s)", counted->action,
+               counted->operand, audit_user, getuid(), counted->entries, counted->bytes, counted->failures,
+               detail ? ", " : "", detail ? detail : "");
+        if (audit_journal)
+            journal_append_summary(counted->operand, counted->action, counted->entries, counted->bytes,
+                                   counted->failures);
+    }
+    counted->operand = NULL;
+}
+
+/** Log the summary record of the current operand in summary mode, with extra details appended
+ *
+ * @param detail text appended to the record, NULL for none
+ */
+void audit_end_detail(const char *detail) {
+    summary_log(&summary, detail);
+}
+
+/** Log the summary record of the current operand in summary mode
+ *
+ */
+void audit_end(void) {
+    audit_end_detail(NULL);
+}
+
+/** Count the removals of the calling thread apart from the current operand
+ *
+ * Until audit_nested_end() they are logged with \p action in place of their own, and in summary mode left out of
+ * the counters of the operand.
+ *
+ * @param operand what the removals are done for
+ * @param action action of the records, EVICT
+ */
+void audit_nested_begin(const char *operand, const char *action) {
+    nested = (struct AuditSummary) {.operand = operand, .action = action};
+}
+
+/** Log the summary record of the removals counted since audit_nested_begin() in summary mode
+ *
+ */
+void audit_nested_end(void) {
+    summary_log(&nested, NULL);
+}
+
+/** Log deletion to syslog
+ *
+ * @param path deleted path
+ * @param action TRASH or DELETE
+ * @param success
+ * @param size apparent size of the entry, -1 if unknown
+ */
+void log_deletion(const char *path, const char *action, bool success, off_t size) {
+    log_deletion_stat(path, action, success, size, NULL);
+}
+
+/** Log deletion to syslog, with the identity of the entry for the journal
+ *
+ * @param path deleted path
+ * @param action TRASH or DELETE
+ * @param success
+ * @param size apparent size of the entry, -1 if unknown
+ * @param st lstat() of the entry, NULL if it was not stat'ed
+ */
+void log_deletion_stat(const char *path, const char *action, bool success, off_t size, const struct stat *st) {
+    int saved_errno = errno;
+    stats_removal(success, size, saved_errno);
+
+    struct AuditSummary *counted = nested.operand ? &nested : &summary;
+    if (nested.operand)
+        action = nested.action;
+    if (audit_mode == AUDIT_SUMMARY && counted->operand) {
+        if (success) {
+            __atomic_add_fetch(&counted->entries, 1, __ATOMIC_RELAXED);
+            if (size > 0)
+                __atomic_add_fetch(&counted->bytes, (unsigned long long) size, __ATOMIC_RELAXED);
+        } else {
+            __atomic_add_fetch(&counted->failures, 1, __ATOMIC_RELAXED);
+        }
+        return;
+    }
+
+    pthread_once(&audit_once, audit_open);
+    if (audit_journal)
+        journal_append(path, action, success ? 0 : saved_errno, size, st);
+
+    uint64_t start = stats_begin();
+    if (success) {
+        syslog(LOG_INFO, "%s: %s (user: %s, uid: %d)", action, path, audit_user, getuid());
+    } else {
+        syslog(LOG_WARNING, "%s FAILED: %s (user: %s, uid: %d, error: %s)", action, path, audit_user, getuid(),
+               strerror(saved_errno));
+    }
+    stats_end(STATS_SYSLOG, start, false);
+}
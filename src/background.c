@@ -0,0 +1,295 @@
+/*! \file background.c
+ * Instant-return removal of directory trees with `--background`
+ *
+ * A directory operand goes through the checks of safe_remove() and is then renamed into a private staging directory
+ * on its own filesystem, `$topdir/.better-rm-staging-$uid` or `~/.better-rm-staging`. The rename is a single syscall
+ * whatever the size of the tree, so the name is gone when better-rm returns. A detached worker at idle CPU and I/O
+ * priority then removes everything it finds in the staging directories of the user: the trees of this run and those
+ * left behind by interrupted workers. `--reclaim` runs the same pass in the foreground, from the systemd timer.
+ *
+ * A worker holds an exclusive lock on a staging directory while it empties it. Concurrent workers thus never remove
+ * the same tree twice, and a worker that finds the lock taken waits, then picks up what was staged meanwhile.
+ */
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pwd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../include/better_rm.h"
+
+#define HOME_STAGING_DIR ".better-rm-staging"
+#define WORKER_NICE 19
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_CLASS_SHIFT 13
+
+static unsigned staged_count; /*!< entries staged by this process, part of the staged names */
+static bool staged_pending; /*!< an entry was staged since the process started */
+
+
+/** Resolve the staging directory in the home directory
+ *
+ * @param buf output buffer
+ * @param size size of \p buf
+ * @param home home directory
+ * @return 0 for success -1 if the path does not fit
+ */
+static int home_staging_dir(char *buf, size_t size, const char *home) {
+    int len = snprintf(buf, size, "%s/%s", home, HOME_STAGING_DIR);
+    return len < 0 || (size_t) len >= size ? -1 : 0;
+}
+
+/** Rename an entry into a staging directory of its filesystem
+ *
+ * @param path entry
+ * @param st lstat() of the entry
+ * @param staged receives the staged path, NULL if not needed
+ * @param size size of \p staged
+ * @return 0 if the entry was staged, -1 if no staging directory of its filesystem could take it
+ */
+int background_move(const char *path, const struct stat *st, char *staged, size_t size) {
+    char home_dir[PATH_MAX];
+    const char *home = getenv("HOME");
+    for (int i = 0; i < 2; i++) {
+        // The home directory only when the mount of the entry has no staging directory of its own
+        const char *dir = i == 0 ? mount_staging_dir(path, st) : home_dir;
+        if (i == 1 && (!home || home_staging_dir(home_dir, sizeof(home_dir), home) != 0 ||
+                       !prepare_mount_dir(home_dir, st->st_dev)))
+            break;
+        if (!dir)
+            continue;
+        char staged_path[PATH_MAX];
+        int len = snprintf(staged_path, sizeof(staged_path), "%s/%lld.%d.%u", dir, (long long) time(NULL),
+                           (int) getpid(), __atomic_fetch_add(&staged_count, 1, __ATOMIC_RELAXED));
+        if (len < 0 || (size_t) len >= sizeof(staged_path))
+            continue;
+
+        uint64_t start = stats_begin();
+        int ret = rename(path, staged_path);
+        stats_end(STATS_RENAME, start, ret != 0);
+        // A bind mount of the filesystem is another mount as far as rename() is concerned
+        if (ret != 0)
+            continue;
+
+        __atomic_store_n(&staged_pending, true, __ATOMIC_RELAXED);
+        if (staged)
+            snprintf(staged, size, "%s", staged_path);
+        return 0;
+    }
+    return -1;
+}
+
+/** Move a directory operand into a staging directory of its filesystem
+ *
+ * The operand has passed the checks of safe_remove(), so only the rename is left.
+ *
+ * @param path operand
+ * @param st lstat() of the operand
+ * @param opts provided options
+ * @return 0 if the operand was staged, -1 if it has to be removed in the foreground
+ */
+int background_stage(const char *path, const struct stat *st, const struct Options *opts) {
+    char staged[PATH_MAX];
+    if (background_move(path, st, staged, sizeof(staged)) != 0)
+        return -1;
+
+    if (opts->verbose && opts->output == OUTPUT_TEXT)
+        printf("staged '%s' as '%s' for background removal\n", path, staged);
+    log_deletion(path, "STAGE", true, -1);
+    output_record(opts, path, "STAGE", -1, 0);
+    return 0;
+}
+
+/** Tell whether this process staged anything
+ *
+ * @return true if a background worker has to be started before exiting
+ */
+bool background_pending(void) {
+    return __atomic_load_n(&staged_pending, __ATOMIC_RELAXED);
+}
+
+/** Remove everything staged in one staging directory
+ *
+ * @param dir staging directory, owned by the calling user
+ * @param jobs worker threads per tree
+ * @return 0 for success 1 if entries are left
+ */
+static int reclaim_dir(const char *dir, int jobs) {
+    int fd = open(dir, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_uid != geteuid() || (st.st_mode & 0077) != 0) {
+        if (fd >= 0)
+            close(fd);
+        return 1;
+    }
+    if (flock(fd, LOCK_EX) != 0) {
+        close(fd);
+        return 1;
+    }
+
+    struct Options opts = {
+            .recursive = true, .force = true, .preserve_root = true, .jobs = jobs, .output = OUTPUT_TEXT};
+    int ret = 0;
+    bool progress = true;
+    // Entries staged while the directory is being emptied are picked up by the next pass
+    while (progress) {
+        progress = false;
+        ret = 0;
+        int scan_fd = dup(fd);
+        DIR *staging = scan_fd >= 0 ? fdopendir(scan_fd) : NULL;
+        if (!staging) {
+            if (scan_fd >= 0)
+                close(scan_fd);
+            ret = 1;
+            break;
+        }
+        rewinddir(staging);
+        const struct dirent *entry;
+        while ((entry = readdir(staging)) != NULL) {
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+                continue;
+            char path[PATH_MAX];
+            int len = snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+            struct stat entry_st;
+            if (len < 0 || (size_t) len >= sizeof(path) ||
+                fstatat(fd, entry->d_name, &entry_st, AT_SYMLINK_NOFOLLOW) != 0)
+                continue;
+
+            int removed;
+            if (S_ISDIR(entry_st.st_mode)) {
+                audit_begin(path, "DELETE");
+                removed = remove_directory(path, &opts);
+                audit_end();
+            } else {
+                removed = unlinkat(fd, entry->d_name, 0);
+                log_deletion_stat(path, "DELETE", removed == 0, entry_st.st_size, &entry_st);
+            }
+            if (removed == 0) {
+                progress = true;
+            } else {
+                ret = 1;
+            }
+        }
+        closedir(staging);
+    }
+
+    close(fd);
+    return ret;
+}
+
+/** Reclaim a staging directory with the identity of its owner
+ *
+ * root empties the staging directories of the other users in a child process running as the owner, so nothing the
+ * owner could not have removed is removed.
+ *
+ * @param dir staging directory
+ * @param jobs worker threads per tree
+ * @return 0 for success 1 if entries are left
+ */
+static int reclaim_as_owner(const char *dir, int jobs) {
+    struct stat st;
+    if (lstat(dir, &st) != 0 || !S_ISDIR(st.st_mode))
+        return 1;
+    if (geteuid() != 0 || st.st_uid == 0)
+        return reclaim_dir(dir, jobs);
+
+    const struct passwd *pw = getpwuid(st.st_uid);
+    gid_t gid = pw ? pw->pw_gid : st.st_gid;
+    // The child appends to the journal of the caller, and must not write the records buffered here again
+    journal_flush();
+    pid_t pid = fork();
+    if (pid == 0) {
+        int ret = switch_user(st.st_uid, gid) == 0 ? reclaim_dir(dir, jobs) : 1;
+        audit_close();
+        _exit(ret);
+    }
+    int status;
+    if (pid < 0 || waitpid(pid, &status, 0) != pid)
+        return 1;
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
+
+/** Remove the trees left in the staging directories
+ *
+ * @param all_users reclaim the staging directories of every user, for root
+ * @param jobs worker threads per tree
+ * @return 0 for success 1 if entries are left
+ */
+int background_reclaim(bool all_users, int jobs) {
+    char **dirs;
+    size_t count = mount_staging_dirs(all_users, &dirs);
+
+    // Home directories are collected first, reclaiming looks users up
+    char home_dir[PATH_MAX];
+    const struct passwd *pw;
+    const char *home = getenv("HOME");
+    if (all_users)
+        setpwent();
+    while ((home = all_users ? ((pw = getpwent()) != NULL ? pw->pw_dir : NULL) : home) != NULL) {
+        char **grown;
+        if (home[0] == '/' && strcmp(home, "/") != 0 && home_staging_dir(home_dir, sizeof(home_dir), home) == 0 &&
+            access(home_dir, F_OK) == 0 && (grown = realloc(dirs, (count + 1) * sizeof(*grown))) != NULL) {
+            dirs = grown;
+            if ((dirs[count] = strdup(home_dir)) != NULL)
+                count++;
+        }
+        if (!all_users)
+            break;
+    }
+    if (all_users)
+        endpwent();
+
+    int ret = 0;
+    for (size_t i = 0; i < count; i++) {
+        if ((all_users ? reclaim_as_owner(dirs[i], jobs) : reclaim_dir(dirs[i], jobs)) != 0)
+            ret = 1;
+        free(dirs[i]);
+    }
+    free(dirs);
+    return ret;
+}
+
+/** Start the detached worker reclaiming the staging directories of the user
+ *
+ * The worker runs in a session of its own at idle CPU and I/O priority, with its standard streams on `/dev/null`, so
+ * better-rm returns, and a daemon client gets its streams back, right away.
+ *
+ * @param jobs worker threads per tree
+ */
+void background_start(int jobs) {
+    fflush(NULL);
+    journal_flush();
+    pid_t pid = fork();
+    if (pid < 0) {
+        fprintf(stderr, "better-rm: cannot start the background worker: %s, staged trees are removed by the next run\n",
+                strerror(errno));
+        return;
+    }
+    if (pid > 0)
+        return;
+
+    setsid();
+    int null_fd = open("/dev/null", O_RDWR | O_CLOEXEC);
+    if (null_fd >= 0) {
+        for (int fd = STDIN_FILENO; fd <= STDERR_FILENO; fd++)
+            dup2(null_fd, fd);
+        close(null_fd);
+    }
+    // Best effort, a worker at normal priority still does the job
+    setpriority(PRIO_PROCESS, 0, WORKER_NICE);
+    syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT);
+    int ret = background_reclaim(false, jobs);
+    audit_close();
+    _exit(ret);
+}
@@ -0,0 +1,443 @@
+/*! \file copy.c
+ * Streaming copy engine used when the trash is on another filesystem
+ *
+ * File data is cloned with `FICLONE` when the filesystems allow it, otherwise copied in the kernel with
+ * `copy_file_range()` or `sendfile()`, and only as a last resort through a large aligned user space buffer. Mode,
+ * ownership, timestamps and extended attributes are preserved. A file is written under a temporary name, fsync'ed
+ * and renamed into place, and its new directory entry is fsync'ed before the source is removed, so an interrupted copy
+ * never loses the original. A directory tree is moved entry by entry through the walk of move_directory_at(): the
+ * entries of a directory are copied and fsync'ed into the fresh copy of the directory, which is fsync'ed once before
+ * their sources are removed.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+
+#include "../include/better_rm.h"
+
+#define COPY_BUFFER_SIZE (1 << 20)
+#define COPY_BUFFER_ALIGN 4096
+#define COPY_CHUNK_SIZE (1 << 30)
+#define PARTIAL_SUFFIX ".partial"
+
+
+/** Copy file data from one fd to another through a user space buffer
+ *
+ * @param in source fd opened for reading
+ * @param out destination fd opened for writing
+ * @param hash hash state fed with the data, NULL for none
+ * @return 0 for success -1 for error
+ */
+static int copy_buffered(int in, int out, struct Xxh64 *hash) {
+    void *buf;
+    if (posix_memalign(&buf, COPY_BUFFER_ALIGN, COPY_BUFFER_SIZE) != 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    int ret = 0;
+    for (;;) {
+        ssize_t n = read(in, buf, COPY_BUFFER_SIZE);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            ret = n < 0 ? -1 : 0;
+            break;
+        }
+        if (hash)
+            xxh64_update(hash, buf, (size_t) n);
+        for (ssize_t off = 0; off < n;) {
+            ssize_t w = write(out, (char *) buf + off, (size_t) (n - off));
+            if (w < 0 && errno == EINTR)
+                continue;
+            if (w < 0) {
+                ret = -1;
+                break;
+            }
+            off += w;
+        }
+        if (ret != 0)
+            break;
+    }
+
+    int saved_errno = errno;
+    free(buf);
+    errno = saved_errno;
+    return ret;
+}
+
+/** Copy file data from one fd to another, preferring the cheapest mechanism the filesystems support
+ *
+ * Every step continues from the current file offsets, so a mechanism failing part way is picked up by the next one.
+ *
+ * @param in source fd opened for reading
+ * @param out destination fd opened for writing, empty
+ * @return 0 for success -1 for error
+ */
+static int copy_data(int in, int out) {
+    if (ioctl(out, FICLONE, in) == 0)
+        return 0;
+
+    bool try_copy_file_range = true;
+    bool try_sendfile = true;
+    for (;;) {
+        ssize_t n;
+        if (try_copy_file_range) {
+            n = copy_file_range(in, NULL, out, NULL, COPY_CHUNK_SIZE, 0);
+            if (n < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP)) {
+                try_copy_file_range = false;
+                continue;
+            }
+        } else if (try_sendfile) {
+            n = sendfile(out, in, NULL, COPY_CHUNK_SIZE);
+            if (n < 0 && (errno == ENOSYS || errno == EINVAL)) {
+                try_sendfile = false;
+                continue;
+            }
+        } else {
+            break;
+        }
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (n == 0)
+            return 0;
+    }
+
+    return copy_buffered(in, out, NULL);
+}
+
+/** Copy the extended attributes of an open file
+ *
+ * Attributes the destination filesystem or the caller's privileges do not allow are skipped.
+ *
+ * @param in source fd
+ * @param out destination fd
+ * @return 0 for success -1 for error
+ */
+static int copy_xattrs(int in, int out) {
+    ssize_t list_len = flistxattr(in, NULL, 0);
+    if (list_len <= 0)
+        return (list_len < 0 && errno != ENOTSUP) ? -1 : 0;
+
+    char *list = malloc((size_t) list_len);
+    if (!list)
+        return -1;
+    list_len = flistxattr(in, list, (size_t) list_len);
+
+    int ret = 0;
+    char *value = NULL;
+    size_t value_cap = 0;
+    for (ssize_t off = 0; ret == 0 && off < list_len; off += (ssize_t) strlen(list + off) + 1) {
+        const char *name = list + off;
+        ssize_t value_len = fgetxattr(in, name, NULL, 0);
+        if (value_len < 0)
+            continue;
+        if ((size_t) value_len > value_cap) {
+            char *grown = realloc(value, (size_t) value_len);
+            if (!grown) {
+                ret = -1;
+                break;
+            }
+            value = grown;
+            value_cap = (size_t) value_len;
+        }
+        value_len = fgetxattr(in, name, value, value_cap);
+        if (value_len < 0)
+            continue;
+        if (fsetxattr(out, name, value, (size_t) value_len, 0) != 0 && errno != ENOTSUP && errno != EPERM)
+            ret = -1;
+    }
+
+    free(value);
+    free(list);
+    return ret;
+}
+
+/** Apply ownership, mode and timestamps of the source to an open copy
+ *
+ * A change of owner is only possible for privileged callers, anybody else keeps the copy's owner.
+ *
+ * @param fd destination fd
+ * @param st lstat result of the source
+ * @return 0 for success -1 for error
+ */
+static int copy_metadata(int fd, const struct stat *st) {
+    if (fchown(fd, st->st_uid, st->st_gid) != 0 && errno != EPERM)
+        return -1;
+    if (fchmod(fd, st->st_mode & 07777) != 0)
+        return -1;
+
+    const struct timespec times[2] = {st->st_atim, st->st_mtim};
+    return futimens(fd, times);
+}
+
+/** Copy a file, symlink or special file with its metadata
+ *
+ * @param src_dirfd directory fd \p src_name is relative to
+ * @param src_name source entry
+ * @param dst_dirfd directory fd \p dst_name is relative to
+ * @param dst_name destination entry, must not exist
+ * @param st lstat result of the source
+ * @param blobs_fd blob store regular files are deduplicated against, -1 for none
+ * @return 0 for success -1 for error
+ */
+static int copy_entry_at(int src_dirfd, const char *src_name, int dst_dirfd, const char *dst_name,
+                         const struct stat *st, int blobs_fd) {
+    if (S_ISLNK(st->st_mode)) {
+        char *target = malloc((size_t) st->st_size + 1);
+        if (!target)
+            return -1;
+        ssize_t len = readlinkat(src_dirfd, src_name, target, (size_t) st->st_size + 1);
+        if (len < 0 || len > st->st_size) {
+            free(target);
+            if (len >= 0)
+                errno = EAGAIN; // The link changed while being copied
+            return -1;
+        }
+        target[len] = '\0';
+        int ret = symlinkat(target, dst_dirfd, dst_name);
+        free(target);
+        if (ret != 0)
+            return -1;
+        if (fchownat(dst_dirfd, dst_name, st->st_uid, st->st_gid, AT_SYMLINK_NOFOLLOW) != 0 && errno != EPERM)
+            return -1;
+        const struct timespec times[2] = {st->st_atim, st->st_mtim};
+        return utimensat(dst_dirfd, dst_name, times, AT_SYMLINK_NOFOLLOW);
+    }
+
+    if (!S_ISREG(st->st_mode) && !S_ISDIR(st->st_mode)) {
+        // FIFOs, sockets and device nodes carry no data
+        if (mknodat(dst_dirfd, dst_name, st->st_mode, st->st_rdev) != 0)
+            return -1;
+        if (fchownat(dst_dirfd, dst_name, st->st_uid, st->st_gid, AT_SYMLINK_NOFOLLOW) != 0 && errno != EPERM)
+            return -1;
+        const struct timespec times[2] = {st->st_atim, st->st_mtim};
+        return utimensat(dst_dirfd, dst_name, times, AT_SYMLINK_NOFOLLOW);
+    }
+
+    // Directories are moved entry by entry by move_directory_at()
+    if (S_ISDIR(st->st_mode)) {
+        errno = EISDIR;
+        return -1;
+    }
+
+    int in = openat(src_dirfd, src_name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (in < 0)
+        return -1;
+    // Readable, deduplication compares the copy with its blob
+    int out = openat(dst_dirfd, dst_name, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if (out < 0) {
+        int saved_errno = errno;
+        close(in);
+        errno = saved_errno;
+        return -1;
+    }
+
+    // Hard links to a blob would share the attributes, only plain files are deduplicated
+    struct Xxh64 hash;
+    bool dedup = blobs_fd >= 0 && S_ISREG(st->st_mode) && st->st_size > 0 && flistxattr(in, NULL, 0) == 0;
+    int ret;
+    if (dedup) {
+        xxh64_init(&hash);
+        ret = copy_buffered(in, out, &hash);
+    } else {
+        ret = copy_data(in, out);
+    }
+    if (ret == 0)
+        ret = copy_xattrs(in, out);
+    if (ret == 0)
+        ret = copy_metadata(out, st);
+    struct stat copy_st;
+    if (ret == 0 && dedup && fstat(out, &copy_st) == 0) {
+        // A copy replaced with a link to its blob is as durable as the blob
+        ret = dedup_file_at(blobs_fd, out, dst_dirfd, dst_name, &copy_st, xxh64_digest(&hash));
+        dedup = ret == 1;
+        ret = ret < 0 ? -1 : 0;
+    } else {
+        dedup = false;
+    }
+    if (ret == 0 && !dedup)
+        ret = fsync(out);
+
+    int saved_errno = errno;
+    close(out);
+    close(in);
+    errno = saved_errno;
+    return ret;
+}
+
+/** Copy a non-directory entry into a directory on another filesystem, the first half of moving it
+ *
+ * The source is left in place, the caller removes it once \p dst_dirfd was fsync'ed.
+ *
+ * @param src_dirfd directory fd \p name is relative to
+ * @param name entry to be copied, its copy gets the same name
+ * @param dst_dirfd destination directory fd
+ * @param blobs_fd blob store regular files are deduplicated against, -1 for none
+ * @return 0 for success -1 for error
+ */
+int copy_into_at(int src_dirfd, const char *name, int dst_dirfd, int blobs_fd) {
+    struct stat st;
+    if (fstatat(src_dirfd, name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+        return -1;
+    if (copy_entry_at(src_dirfd, name, dst_dirfd, name, &st, blobs_fd) != 0) {
+        // Only a copy this call created is removed
+        int saved_errno = errno;
+        if (saved_errno != EEXIST && saved_errno != EISDIR)
+            unlinkat(dst_dirfd, name, 0);
+        errno = saved_errno;
+        return -1;
+    }
+    return 0;
+}
+
+/** Give the copy of a directory moved entry by entry the attributes of its source, once its entries are in place
+ *
+ * @param src source directory fd
+ * @param dst copy fd
+ * @return 0 for success -1 for error
+ */
+int copy_dir_attrs(int src, int dst) {
+    struct stat st;
+    if (fstat(src, &st) != 0 || copy_xattrs(src, dst) != 0 || copy_metadata(dst, &st) != 0)
+        return -1;
+    return fsync(dst);
+}
+
+/** Make the entries just created in a directory durable
+ *
+ * @param path entry in the directory
+ */
+static void sync_parent(const char *path) {
+    char *parent = strdup(path);
+    char *slash = parent ? strrchr(parent, '/') : NULL;
+    if (slash) {
+        *slash = '\0';
+        int parent_fd = open(slash == parent ? "/" : parent, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (parent_fd >= 0) {
+            fsync(parent_fd);
+            close(parent_fd);
+        }
+    }
+    free(parent);
+}
+
+/** Rename a file where the filesystem has no `RENAME_NOREPLACE`, failing with `EEXIST` rather than replacing
+ *
+ * A hard link fails on an existing name atomically. Without hard links the check only races with other writers of
+ * \p to.
+ *
+ * @param from file to be renamed
+ * @param to new name, must not exist
+ * @return 0 for success -1 for error
+ */
+static int rename_noreplace_fallback(const char *from, const char *to) {
+    if (link(from, to) == 0) {
+        // Both names hold the copy, a leftover temporary name is only wasted space
+        unlink(from);
+        return 0;
+    }
+    if (errno != EPERM && errno != EOPNOTSUPP && errno != EMLINK)
+        return -1;
+    struct stat st;
+    if (lstat(to, &st) == 0) {
+        errno = EEXIST;
+        return -1;
+    }
+    return rename(from, to);
+}
+
+/** Move an entry to a trash path on another filesystem by copying it and removing the source
+ *
+ * Restoring a trashed entry to another filesystem goes the same way, with its original path as destination. A file
+ * is copied under a temporary name and renamed into place before the source is removed. A directory is created under
+ * \p trash_path and its entries are moved into it one by one, so a move failing part way leaves what was moved under
+ * \p trash_path and the rest at the source.
+ *
+ * @param dirfd directory fd \p name is relative to, or `AT_FDCWD`
+ * @param name entry to be moved
+ * @param trash_path destination path in the trash directory, must not exist
+ * @param dedup deduplicate regular files against the blob store of the trash directory
+ * @return 0 for success, 1 if a directory was only moved in part, -1 for error
+ */
+int copy_to_trash_at(int dirfd, const char *name, const char *trash_path, bool dedup) {
+    struct stat st;
+    if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+        return -1;
+
+    // Without a store the copy is only larger
+    int blobs_fd = -1;
+    const char *dir_end = strrchr(trash_path, '/');
+    if (dedup && dir_end) {
+        char *trash_dir = strndup(trash_path, (size_t) (dir_end - trash_path));
+        int trash_fd = trash_dir ? open(trash_dir[0] ? trash_dir : "/", O_RDONLY | O_DIRECTORY | O_CLOEXEC) : -1;
+        if (trash_fd >= 0) {
+            blobs_fd = dedup_open(trash_fd);
+            close(trash_fd);
+        }
+        free(trash_dir);
+    }
+
+    if (S_ISDIR(st.st_mode)) {
+        // A name taken meanwhile fails before anything was moved
+        int dst_fd = mkdir(trash_path, 0700) == 0 ? open(trash_path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC)
+                                                  : -1;
+        // The copy must outlive a crash before any source entry goes away
+        if (dst_fd >= 0)
+            sync_parent(trash_path);
+        int ret = dst_fd >= 0 ? move_directory_at(dirfd, name, dst_fd, blobs_fd) : -1;
+        int saved_errno = errno;
+        if (dst_fd >= 0)
+            close(dst_fd);
+        if (blobs_fd >= 0)
+            close(blobs_fd);
+        // Nothing was moved when the copy is still empty
+        if (ret != 0 && dst_fd >= 0 && rmdir(trash_path) != 0)
+            ret = 1;
+        errno = saved_errno;
+        return ret;
+    }
+
+    size_t len = strlen(trash_path);
+    char *partial = malloc(len + sizeof(PARTIAL_SUFFIX));
+    if (!partial) {
+        if (blobs_fd >= 0)
+            close(blobs_fd);
+        return -1;
+    }
+    memcpy(partial, trash_path, len);
+    memcpy(partial + len, PARTIAL_SUFFIX, sizeof(PARTIAL_SUFFIX));
+
+    int ret = copy_entry_at(dirfd, name, AT_FDCWD, partial, &st, blobs_fd);
+    if (blobs_fd >= 0)
+        close(blobs_fd);
+    // Never replace an entry trashed under the same name meanwhile
+    if (ret == 0) {
+        ret = renameat2(AT_FDCWD, partial, AT_FDCWD, trash_path, RENAME_NOREPLACE);
+        if (ret != 0 && errno == EINVAL)
+            ret = rename_noreplace_fallback(partial, trash_path);
+    }
+    if (ret != 0) {
+        int saved_errno = errno;
+        unlink(partial);
+        free(partial);
+        errno = saved_errno;
+        return -1;
+    }
+    free(partial);
+
+    // Make the rename durable before the only other copy goes away
+    sync_parent(trash_path);
+    return unlinkat(dirfd, name, 0);
+}
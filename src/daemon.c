@@ -0,0 +1,519 @@
+/*! \file daemon.c
+ * `better-rmd`, a long-running server of removals, and the client side of `better-rm`
+ *
+ * High-frequency callers pay the startup of every invocation: loading the configuration, building the protected set
+ * and opening the syslog session. The daemon does that once and forks a process per connection, which inherits the
+ * warm state copy-on-write, switches to the credentials of the caller read with `SO_PEERCRED` and runs the command
+ * line of the caller as if it had been started in its working directory. The working directory and the standard
+ * streams of the client travel with the request as file descriptors, so prompts, messages and reports reach the caller
+ * directly, and only the exit status is sent back.
+ *
+ * The client forwards its arguments rather than parsed \ref Options, so options are parsed by the same code in both
+ * modes and new options need no change of the protocol. It is enabled by setting \ref DAEMON_SOCKET_ENV and falls
+ * back to a local removal when the daemon cannot be reached.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <grp.h>
+#include <limits.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "../include/better_rm.h"
+
+#define DAEMON_MAGIC "BRMDREQ"
+#define DAEMON_VERSION 1
+#define DAEMON_FDS 4 /*!< working directory, stdin, stdout and stderr of the client */
+#define DAEMON_MAX_REQUEST (64 * 1024 * 1024)
+#define DAEMON_REQUEST_TIMEOUT 10 /*!< seconds a client has to send its request */
+#define DAEMON_LISTEN_FDS_START 3 /*!< first socket passed by systemd socket activation */
+
+/*! Header of a request, followed by the NUL terminated arguments and environment variables */
+struct DaemonRequest {
+    char magic[8]; /*!< \ref DAEMON_MAGIC */
+    uint32_t version; /*!< \ref DAEMON_VERSION */
+    uint32_t argc; /*!< number of arguments, the program name included */
+    uint32_t envc; /*!< number of `NAME=value` environment variables */
+    uint32_t length; /*!< size of the strings following the header */
+};
+
+/*! Environment variables of the client the removal depends on */
+static const char *const daemon_env[] = {"HOME",           "XDG_CONFIG_HOME",      "XDG_STATE_HOME",
+                                         TRASH_DIR_ENV,    "BETTER_RM_TRASH_DAYS", "BETTER_RM_JOURNAL",
+                                         NULL};
+
+
+/** Tell whether an environment variable is forwarded to the daemon
+ *
+ * @param var `NAME=value`
+ * @return true if NAME is listed in \ref daemon_env
+ */
+static bool daemon_env_forwarded(const char *var) {
+    for (int i = 0; daemon_env[i]; i++) {
+        size_t len = strlen(daemon_env[i]);
+        if (strncmp(var, daemon_env[i], len) == 0 && var[len] == '=')
+            return true;
+    }
+    return false;
+}
+
+/** Write a whole buffer to a socket
+ *
+ * @param fd socket
+ * @param buf data
+ * @param len size of \p buf
+ * @return 0 for success -1 for error
+ */
+static int send_all(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        len -= (size_t) n;
+    }
+    return 0;
+}
+
+/** Read a whole buffer from a socket
+ *
+ * @param fd socket
+ * @param buf output
+ * @param len bytes to read
+ * @return 0 for success -1 for error or if the peer closed the connection first
+ */
+static int recv_all(int fd, void *buf, size_t len) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = recv(fd, p, len, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            if (n == 0)
+                errno = ECONNRESET;
+            return -1;
+        }
+        p += n;
+        len -= (size_t) n;
+    }
+    return 0;
+}
+
+/** Fill a Unix socket address
+ *
+ * @param addr output
+ * @param path socket path
+ * @return 0 for success -1 if the path is too long
+ */
+static int daemon_address(struct sockaddr_un *addr, const char *path) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+/** Run a command line through the daemon
+ *
+ * @param socket_path socket of the daemon
+ * @param argc number of arguments
+ * @param argv arguments, the program name included
+ * @return exit status of the command, -1 if the daemon could not be reached and the command has to run locally
+ */
+int daemon_client(const char *socket_path, int argc, char *argv[]) {
+    struct sockaddr_un addr;
+    if (daemon_address(&addr, socket_path) != 0)
+        return -1;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    int cwd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (cwd < 0) {
+        close(fd);
+        return -1;
+    }
+
+    // Arguments then forwarded environment variables, each NUL terminated
+    struct DaemonRequest request = {.magic = DAEMON_MAGIC, .version = DAEMON_VERSION, .argc = (uint32_t) argc};
+    size_t length = 0;
+    for (int i = 0; i < argc; i++)
+        length += strlen(argv[i]) + 1;
+    for (char **env = environ; *env; env++) {
+        if (daemon_env_forwarded(*env)) {
+            length += strlen(*env) + 1;
+            request.envc++;
+        }
+    }
+    char *payload = length <= DAEMON_MAX_REQUEST ? malloc(length) : NULL;
+    if (!payload) {
+        close(cwd);
+        close(fd);
+        return -1;
+    }
+    char *p = payload;
+    for (int i = 0; i < argc; i++)
+        p = stpcpy(p, argv[i]) + 1;
+    for (char **env = environ; *env; env++) {
+        if (daemon_env_forwarded(*env))
+            p = stpcpy(p, *env) + 1;
+    }
+    request.length = (uint32_t) length;
+
+    // The descriptors travel with the header
+    int fds[DAEMON_FDS] = {cwd, STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+    union {
+        char buf[CMSG_SPACE(sizeof(fds))];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct iovec iov = {.iov_base = &request, .iov_len = sizeof(request)};
+    struct msghdr msg = {
+            .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buf, .msg_controllen = sizeof(control.buf)};
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    ssize_t sent;
+    do {
+        sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    } while (sent < 0 && errno == EINTR);
+    close(cwd);
+    if (sent != (ssize_t) sizeof(request)) {
+        // Nothing reached the daemon, a partial header is dropped by it
+        free(payload);
+        close(fd);
+        return -1;
+    }
+
+    int32_t status;
+    int ret = send_all(fd, payload, length);
+    free(payload);
+    if (ret == 0)
+        ret = recv_all(fd, &status, sizeof(status));
+    if (ret != 0) {
+        fprintf(stderr, "better-rm: lost the connection to the daemon at '%s': %s\n", socket_path, strerror(errno));
+        close(fd);
+        return 1;
+    }
+    close(fd);
+    return status;
+}
+
+/** Exit as soon as the client of the connection goes away
+ *
+ * Interrupting the client interrupts the removal, as it would interrupt a local one.
+ *
+ * @param arg connection
+ * @return never returns while the connection is open
+ */
+static void *daemon_watch(void *arg) {
+    int conn = (int) (intptr_t) arg;
+    char byte;
+    while (recv(conn, &byte, 1, 0) < 0 && errno == EINTR) {
+    }
+    _exit(1);
+}
+
+/** Take the identity of a user, with the supplementary groups of their password entry
+ *
+ * @param uid user
+ * @param gid primary group
+ * @return 0 for success -1 for error
+ */
+int switch_user(uid_t uid, gid_t gid) {
+    const struct passwd *pw = getpwuid(uid);
+    gid_t groups[NGROUPS_MAX];
+    int count = NGROUPS_MAX;
+    if (!pw || getgrouplist(pw->pw_name, gid, groups, &count) < 0) {
+        groups[0] = gid;
+        count = 1;
+    }
+    if (setgroups((size_t) count, groups) != 0 || setgid(gid) != 0 || setuid(uid) != 0)
+        return -1;
+    return 0;
+}
+
+/** Take the credentials of the peer of a connection
+ *
+ * A daemon running as root becomes the caller, any other daemon only serves its own user.
+ *
+ * @param cred credentials of the peer
+ * @return 0 for success -1 for error
+ */
+static int daemon_become(const struct ucred *cred) {
+    if (geteuid() != 0) {
+        if (cred->uid != geteuid()) {
+            errno = EACCES;
+            return -1;
+        }
+        return 0;
+    }
+    return switch_user(cred->uid, cred->gid);
+}
+
+/** Run the command line of a request with the credentials, working directory, streams and environment of the caller
+ *
+ * @param conn connection the arguments are read from
+ * @param cred credentials of the caller
+ * @param request header of the request
+ * @param fds working directory, stdin, stdout and stderr of the caller
+ * @return exit status of the command
+ */
+static int daemon_request(int conn, const struct ucred *cred, const struct DaemonRequest *request, const int *fds) {
+    if (memcmp(request->magic, DAEMON_MAGIC, sizeof(request->magic)) != 0 || request->version != DAEMON_VERSION ||
+        request->argc == 0 || request->length > DAEMON_MAX_REQUEST) {
+        dprintf(fds[3], "better-rm: the daemon does not understand this client\n");
+        return 1;
+    }
+    char *payload = malloc((size_t) request->length + 1);
+    char **argv = calloc((size_t) request->argc + 1, sizeof(char *));
+    if (!payload || !argv || recv_all(conn, payload, request->length) != 0) {
+        dprintf(fds[3], "better-rm: cannot read the request of the daemon: %s\n", strerror(errno ? errno : ENOMEM));
+        return 1;
+    }
+    payload[request->length] = '\0';
+
+    // The request is read, from now on the removal stops when the client goes away
+    struct timeval timeout = {.tv_sec = 0, .tv_usec = 0};
+    setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    pthread_t watcher;
+    if (pthread_create(&watcher, NULL, daemon_watch, (void *) (intptr_t) conn) == 0)
+        pthread_detach(watcher);
+
+    if (daemon_become(cred) != 0) {
+        dprintf(fds[3], "better-rm: the daemon cannot run as uid %d: %s\n", (int) cred->uid, strerror(errno));
+        return 1;
+    }
+    if (fchdir(fds[0]) != 0) {
+        dprintf(fds[3], "better-rm: the daemon cannot enter the working directory: %s\n", strerror(errno));
+        return 1;
+    }
+
+    // The identity comes from the credentials, the forwarded variables only locate the caller's files
+    const struct passwd *pw = getpwuid(cred->uid);
+    clearenv();
+    if (pw) {
+        setenv("HOME", pw->pw_dir, 1);
+        setenv("USER", pw->pw_name, 1);
+        audit_set_user(pw->pw_name);
+    }
+    char *p = payload, *end = payload + request->length;
+    for (uint32_t i = 0; i < request->argc + request->envc; i++) {
+        if (p >= end) {
+            dprintf(fds[3], "better-rm: malformed request to the daemon\n");
+            return 1;
+        }
+        if (i < request->argc) {
+            argv[i] = p;
+        } else if (daemon_env_forwarded(p)) {
+            putenv(p);
+        }
+        p += strlen(p) + 1;
+    }
+
+    // The configuration of the caller on top of the system one loaded by the daemon
+    char user_config[PATH_MAX];
+    if (user_config_path(user_config, sizeof(user_config)) == 0)
+        load_config_file(user_config);
+
+    // Only the standard streams keep the caller's descriptors open, a background worker closes them
+    for (int i = 0; i < 3; i++) {
+        if (dup2(fds[i + 1], i) < 0)
+            return 1;
+    }
+    for (int i = 0; i < DAEMON_FDS; i++) {
+        if (fds[i] > STDERR_FILENO)
+            close(fds[i]);
+    }
+    optind = 0;
+    int status = better_rm_main((int) request->argc, argv, true);
+    fflush(NULL);
+    return status;
+}
+
+/** Serve one connection, in a process of its own
+ *
+ * Reads the request and the descriptors of the caller, runs it and sends back the exit status.
+ *
+ * @param conn accepted connection
+ */
+void daemon_serve(int conn) {
+    struct timeval timeout = {.tv_sec = DAEMON_REQUEST_TIMEOUT, .tv_usec = 0};
+    setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    struct ucred cred;
+    socklen_t cred_len = sizeof(cred);
+    if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) != 0)
+        _exit(1);
+
+    struct DaemonRequest request;
+    union {
+        char buf[CMSG_SPACE(DAEMON_FDS * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = {.iov_base = &request, .iov_len = sizeof(request)};
+    struct msghdr msg = {
+            .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buf, .msg_controllen = sizeof(control.buf)};
+    ssize_t n;
+    do {
+        n = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC);
+    } while (n < 0 && errno == EINTR);
+    struct cmsghdr *cmsg = n > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(DAEMON_FDS * sizeof(int)) || (msg.msg_flags & MSG_CTRUNC))
+        _exit(1);
+    int fds[DAEMON_FDS];
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    if ((size_t) n < sizeof(request) && recv_all(conn, (char *) &request + n, sizeof(request) - (size_t) n) != 0)
+        _exit(1);
+
+    int32_t status = daemon_request(conn, &cred, &request, fds);
+    send_all(conn, &status, sizeof(status));
+    _exit(0);
+}
+
+/** Get the listening socket, from systemd socket activation or bound to a path
+ *
+ * @param socket_path path to bind when not activated
+ * @return socket, -1 for error
+ */
+static int daemon_listen(const char *socket_path) {
+    const char *listen_pid = getenv("LISTEN_PID");
+    const char *listen_fds = getenv("LISTEN_FDS");
+    if (listen_pid && listen_fds && strtol(listen_pid, NULL, 10) == (long) getpid() && atoi(listen_fds) >= 1) {
+        unsetenv("LISTEN_PID");
+        unsetenv("LISTEN_FDS");
+        fcntl(DAEMON_LISTEN_FDS_START, F_SETFD, FD_CLOEXEC);
+        return DAEMON_LISTEN_FDS_START;
+    }
+
+    struct sockaddr_un addr;
+    if (daemon_address(&addr, socket_path) != 0) {
+        fprintf(stderr, "better-rmd: invalid socket path '%s': %s\n", socket_path, strerror(errno));
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        fprintf(stderr, "better-rmd: cannot create socket: %s\n", strerror(errno));
+        return -1;
+    }
+    // A socket left behind by a previous daemon
+    unlink(socket_path);
+    // Every user may connect to a root daemon, which authenticates them by their credentials
+    mode_t mask = umask(geteuid() == 0 ? 0111 : 0177);
+    int ret = bind(fd, (struct sockaddr *) &addr, sizeof(addr));
+    umask(mask);
+    if (ret != 0 || listen(fd, SOMAXCONN) != 0) {
+        fprintf(stderr, "better-rmd: cannot listen on '%s': %s\n", socket_path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/** Default socket of the daemon
+ *
+ * @param buf output buffer
+ * @param size size of \p buf
+ * @return \p buf, \ref DAEMON_SOCKET for root, `$XDG_RUNTIME_DIR/better-rmd.sock` for the other users
+ */
+static const char *daemon_default_socket(char *buf, size_t size) {
+    const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+    if (geteuid() == 0 || !runtime_dir) {
+        snprintf(buf, size, "%s", DAEMON_SOCKET);
+    } else {
+        snprintf(buf, size, "%s/%s.sock", runtime_dir, DAEMON_NAME);
+    }
+    return buf;
+}
+
+/** Entry point of `better-rmd`
+ *
+ * Loads the system configuration and opens the syslog session once, then forks a process per connection.
+ *
+ * @param argc number of arguments
+ * @param argv arguments
+ * @return exit status, only returns on error
+ */
+int daemon_main(int argc, char *argv[]) {
+    char default_socket[PATH_MAX];
+    const char *socket_path = daemon_default_socket(default_socket, sizeof(default_socket));
+    static struct option long_options[] = {
+            {"socket", required_argument, 0, 's'}, {"help", no_argument, 0, 'h'}, {0, 0, 0, 0}};
+    int opt;
+    while ((opt = getopt_long(argc, argv, "s:h", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 's':
+                socket_path = optarg;
+                break;
+            case 'h':
+                printf("Usage: %s [--socket=PATH]\n", argv[0]);
+                printf("Serve better-rm removals over a Unix socket (default: %s)\n\n", socket_path);
+                printf("Clients use the daemon when %s is set to its socket.\n", DAEMON_SOCKET_ENV);
+                return 0;
+            default:
+                return 1;
+        }
+    }
+
+    int listen_fd = daemon_listen(socket_path);
+    if (listen_fd < 0)
+        return 1;
+
+    // Per-user configuration files are loaded by every connection on top of this
+    init_protected_dirs();
+    load_config_file(CONFIG_FILE);
+    audit_start();
+
+    // Connections are reaped by the kernel
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = SIG_IGN;
+    sa.sa_flags = SA_NOCLDWAIT;
+    sigaction(SIGCHLD, &sa, NULL);
+
+    for (;;) {
+        int conn = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (conn < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            fprintf(stderr, "better-rmd: cannot accept connections: %s\n", strerror(errno));
+            return 1;
+        }
+        pid_t pid = fork();
+        if (pid == 0) {
+            sa.sa_handler = SIG_DFL;
+            sa.sa_flags = 0;
+            sigaction(SIGCHLD, &sa, NULL);
+            close(listen_fd);
+            daemon_serve(conn);
+        }
+        if (pid < 0)
+            fprintf(stderr, "better-rmd: cannot fork: %s\n", strerror(errno));
+        close(conn);
+    }
+}
@@ -0,0 +1,376 @@
+/*! \file dedup.c
+ * Content-addressed store of the files copied into a trash on another filesystem, enabled with `trash_dedup=yes`
+ *
+ * Copying a tree into the trash of another filesystem stores every byte again, and vendored dependencies or build
+ * outputs trashed over and over are identical file after file. With deduplication the copy engine streams regular
+ * files through a user space buffer and hashes them with XXH64 on the way, then looks the copy up in
+ * `.better-rm-blobs` of the trash directory by hash, size, mode and owner. A copy matching a blob byte for byte is
+ * replaced with a hard link to the blob, one that does not becomes the blob of its content.
+ *
+ * The link count of a blob is its reference count: the store holds one link, every trashed copy another. The blobs a
+ * trashed entry links to are listed in its index record, and removing the entry by purging, evicting or restoring it
+ * frees those of them whose link count dropped to one, so no removal reads the whole store. An entry with blobs is
+ * always restored by copying, a rename would hand the inode of a blob back out of the trash. Files with extended
+ * attributes are not deduplicated, the hard links would share them, and deduplicated copies keep the timestamps of the
+ * first one.
+ */
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../include/better_rm.h"
+
+#define BLOBS_DIR_NAME ".better-rm-blobs"
+#define BLOB_NAME_MAX 96
+#define COMPARE_CHUNK (256 * 1024)
+
+#define XXH_PRIME1 0x9E3779B185EBCA87ull
+#define XXH_PRIME2 0xC2B2AE3D27D4EB4Full
+#define XXH_PRIME3 0x165667B19E3779F9ull
+#define XXH_PRIME4 0x85EBCA77C2B2AE63ull
+#define XXH_PRIME5 0x27D4EB2F165667C5ull
+
+bool trash_dedup; /*!< selected with `trash_dedup=` */
+
+/*! Blobs linked to by the entry being copied into the trash, see dedup_refs_begin() */
+struct DedupRefs {
+    char *buf; /*!< blob names separated by `/` */
+    size_t len; /*!< used bytes of \ref buf, without the NUL */
+    size_t cap; /*!< allocated bytes of \ref buf */
+    bool active; /*!< between dedup_refs_begin() and dedup_refs_end() */
+    bool failed; /*!< a name could not be remembered */
+};
+
+static __thread struct DedupRefs refs;
+
+
+/** Rotate a 64-bit word left
+ *
+ * @param x word
+ * @param r bits, 1 to 63
+ * @return rotated word
+ */
+static uint64_t rotl64(uint64_t x, unsigned r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+/** Read a little endian 64-bit word
+ *
+ * @param p 8 bytes
+ * @return word
+ */
+static uint64_t read64(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+/** Read a little endian 32-bit word
+ *
+ * @param p 4 bytes
+ * @return word
+ */
+static uint32_t read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap32(v);
+#endif
+    return v;
+}
+
+/** Mix one word into a lane
+ *
+ * @param acc lane
+ * @param input word
+ * @return new lane
+ */
+static uint64_t xxh64_round(uint64_t acc, uint64_t input) {
+    acc += input * XXH_PRIME2;
+    return rotl64(acc, 31) * XXH_PRIME1;
+}
+
+/** Fold a lane into the final hash
+ *
+ * @param acc hash so far
+ * @param lane lane
+ * @return new hash
+ */
+static uint64_t xxh64_merge(uint64_t acc, uint64_t lane) {
+    acc ^= xxh64_round(0, lane);
+    return acc * XXH_PRIME1 + XXH_PRIME4;
+}
+
+/** Start hashing a stream
+ *
+ * @param state hash state
+ */
+void xxh64_init(struct Xxh64 *state) {
+    memset(state, 0, sizeof(*state));
+    state->lanes[0] = XXH_PRIME1 + XXH_PRIME2;
+    state->lanes[1] = XXH_PRIME2;
+    state->lanes[2] = 0;
+    state->lanes[3] = 0 - XXH_PRIME1;
+}
+
+/** Hash the next bytes of a stream
+ *
+ * The four lanes are independent, so the compiler keeps them in vector registers.
+ *
+ * @param state hash state
+ * @param data bytes
+ * @param len number of bytes
+ */
+void xxh64_update(struct Xxh64 *state, const void *data, size_t len) {
+    const unsigned char *p = data;
+    state->total += len;
+    if (state->buffered > 0) {
+        size_t fill = sizeof(state->buf) - state->buffered < len ? sizeof(state->buf) - state->buffered : len;
+        memcpy(state->buf + state->buffered, p, fill);
+        state->buffered += fill;
+        p += fill;
+        len -= fill;
+        if (state->buffered < sizeof(state->buf))
+            return;
+        for (int i = 0; i < 4; i++)
+            state->lanes[i] = xxh64_round(state->lanes[i], read64(state->buf + 8 * i));
+        state->buffered = 0;
+    }
+    for (; len >= 32; p += 32, len -= 32) {
+        for (int i = 0; i < 4; i++)
+            state->lanes[i] = xxh64_round(state->lanes[i], read64(p + 8 * i));
+    }
+    memcpy(state->buf, p, len);
+    state->buffered = len;
+}
+
+/** Finish hashing a stream
+ *
+ * @param state hash state
+ * @return XXH64 of the stream with seed 0
+ */
+uint64_t xxh64_digest(const struct Xxh64 *state) {
+    uint64_t h;
+    if (state->total >= 32) {
+        h = rotl64(state->lanes[0], 1) + rotl64(state->lanes[1], 7) + rotl64(state->lanes[2], 12) +
+            rotl64(state->lanes[3], 18);
+        for (int i = 0; i < 4; i++)
+            h = xxh64_merge(h, state->lanes[i]);
+    } else {
+        h = XXH_PRIME5;
+    }
+    h += state->total;
+
+    const unsigned char *p = state->buf;
+    size_t len = state->buffered;
+    for (; len >= 8; p += 8, len -= 8)
+        h = rotl64(h ^ xxh64_round(0, read64(p)), 27) * XXH_PRIME1 + XXH_PRIME4;
+    if (len >= 4) {
+        h = rotl64(h ^ ((uint64_t) read32(p) * XXH_PRIME1), 23) * XXH_PRIME2 + XXH_PRIME3;
+        p += 4;
+        len -= 4;
+    }
+    for (; len > 0; p++, len--)
+        h = rotl64(h ^ (*p * XXH_PRIME5), 11) * XXH_PRIME1;
+
+    h ^= h >> 33;
+    h *= XXH_PRIME2;
+    h ^= h >> 29;
+    h *= XXH_PRIME3;
+    h ^= h >> 32;
+    return h;
+}
+
+/** Open the blob store of a trash directory, creating it on first use
+ *
+ * @param trash_dirfd trash directory
+ * @return store directory fd, -1 for error
+ */
+int dedup_open(int trash_dirfd) {
+    if (mkdirat(trash_dirfd, BLOBS_DIR_NAME, 0700) != 0 && errno != EEXIST)
+        return -1;
+    int fd = openat(trash_dirfd, BLOBS_DIR_NAME, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    struct stat st;
+    // Somebody else's store would hand out files of theirs
+    if (fd >= 0 && (fstat(fd, &st) != 0 || st.st_uid != geteuid())) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/** Compare the contents of two files of the same size
+ *
+ * @param a first file
+ * @param b second file
+ * @param size size of both
+ * @return true if every byte matches
+ */
+static bool same_content(int a, int b, off_t size) {
+    char *buf = malloc(2 * COMPARE_CHUNK);
+    if (!buf)
+        return false;
+    bool same = true;
+    for (off_t off = 0; same && off < size;) {
+        size_t want = size - off < COMPARE_CHUNK ? (size_t) (size - off) : COMPARE_CHUNK;
+        ssize_t na = pread(a, buf, want, off);
+        ssize_t nb = pread(b, buf + COMPARE_CHUNK, want, off);
+        same = na > 0 && na == nb && memcmp(buf, buf + COMPARE_CHUNK, (size_t) na) == 0;
+        off += na > 0 ? na : 0;
+    }
+    free(buf);
+    return same;
+}
+
+/** Start listing the blobs the entry about to be copied into the trash links to
+ *
+ */
+void dedup_refs_begin(void) {
+    refs.len = 0;
+    refs.active = true;
+    refs.failed = false;
+}
+
+/** Stop listing blobs
+ *
+ * @return blob names separated by `/`, valid until the next dedup_refs_begin() of the thread, NULL when the entry
+ *         links to none, \ref DEDUP_UNLISTED if a blob could not be listed
+ */
+const char *dedup_refs_end(void) {
+    refs.active = false;
+    if (refs.failed)
+        return DEDUP_UNLISTED;
+    return refs.len > 0 ? refs.buf : NULL;
+}
+
+/** Remember a blob the entry being copied links to
+ *
+ * @param blob blob name
+ */
+static void refs_add(const char *blob) {
+    if (!refs.active)
+        return;
+    size_t len = strlen(blob);
+    if (refs.len + len + 2 > refs.cap) {
+        size_t cap = refs.cap ? refs.cap * 2 : 1024;
+        while (cap < refs.len + len + 2)
+            cap *= 2;
+        char *grown = realloc(refs.buf, cap);
+        if (!grown) {
+            refs.failed = true;
+            return;
+        }
+        refs.buf = grown;
+        refs.cap = cap;
+    }
+    if (refs.len > 0)
+        refs.buf[refs.len++] = '/';
+    memcpy(refs.buf + refs.len, blob, len + 1);
+    refs.len += len;
+}
+
+/** Share a freshly copied file with the blob store
+ *
+ * Best effort but for the replacement itself: a copy that cannot be stored or looked up stays as it is.
+ *
+ * @param blobs_fd blob store of the trash directory
+ * @param copy_fd the copy, readable
+ * @param dst_dirfd directory of the copy
+ * @param dst_name name of the copy
+ * @param copy fstat() of the copy, with its final metadata
+ * @param hash XXH64 of the content
+ * @return 1 if the copy was replaced with a link to its blob, 0 if it was kept, -1 if it was removed but could not be
+ *         linked to its blob
+ */
+int dedup_file_at(int blobs_fd, int copy_fd, int dst_dirfd, const char *dst_name, const struct stat *copy,
+                  uint64_t hash) {
+    char blob[BLOB_NAME_MAX];
+    snprintf(blob, sizeof(blob), "%016llx-%llx-%o-%u-%u", (unsigned long long) hash, (unsigned long long) copy->st_size,
+             (unsigned) (copy->st_mode & 07777), (unsigned) copy->st_uid, (unsigned) copy->st_gid);
+
+    int blob_fd = openat(blobs_fd, blob, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (blob_fd < 0) {
+        // The copy becomes the blob of its content, a concurrent copy may have won the race
+        if (errno == ENOENT && linkat(dst_dirfd, dst_name, blobs_fd, blob, 0) == 0)
+            refs_add(blob);
+        return 0;
+    }
+
+    // The name is only a hint, an XXH64 collision or a tampered blob must not replace the copy
+    struct stat st;
+    bool same = fstat(blob_fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size == copy->st_size &&
+                st.st_mode == copy->st_mode && st.st_uid == copy->st_uid && st.st_gid == copy->st_gid &&
+                st.st_ino != copy->st_ino && same_content(copy_fd, blob_fd, copy->st_size);
+    close(blob_fd);
+    if (!same)
+        return 0;
+
+    // The source is still in place, a failed link only fails this copy
+    if (unlinkat(dst_dirfd, dst_name, 0) != 0)
+        return 0;
+    if (linkat(blobs_fd, blob, dst_dirfd, dst_name, 0) != 0)
+        return -1;
+    refs_add(blob);
+    return 1;
+}
+
+/** Free the blobs a removed entry linked to that no other trashed entry links to
+ *
+ * @param index open index of the trash directory
+ * @param record record of the entry, already removed from the trash
+ */
+void dedup_release(const struct TrashIndex *index, const struct TrashRecord *record) {
+    const char *blobs = record->flags & TRASH_RECORD_BLOBS ? trash_index_string(index, record->blobs_offset) : NULL;
+    if (!blobs)
+        return;
+    if (strcmp(blobs, DEDUP_UNLISTED) == 0) {
+        dedup_collect(index->dirfd);
+        return;
+    }
+    int fd = openat(index->dirfd, BLOBS_DIR_NAME, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0)
+        return;
+    char blob[BLOB_NAME_MAX];
+    while (*blobs != '\0') {
+        size_t len = strcspn(blobs, "/");
+        if (len > 0 && len < sizeof(blob)) {
+            memcpy(blob, blobs, len);
+            blob[len] = '\0';
+            struct stat st;
+            if (fstatat(fd, blob, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISREG(st.st_mode) && st.st_nlink == 1)
+                unlinkat(fd, blob, 0);
+        }
+        blobs += len + (blobs[len] == '/');
+    }
+    close(fd);
+}
+
+/** Free every blob no trashed entry links to anymore
+ *
+ * Reads the whole store, only for entries whose blobs are not known: ones without a record or with
+ * \ref DEDUP_UNLISTED.
+ *
+ * @param trash_dirfd trash directory
+ */
+void dedup_collect(int trash_dirfd) {
+    int fd = openat(trash_dirfd, BLOBS_DIR_NAME, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0)
+        return;
+    struct DirBatch batch = {0};
+    const struct dirent *entry;
+    while ((entry = dir_batch_next(&batch, fd)) != NULL) {
+        struct stat st;
+        if (fstatat(fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISREG(st.st_mode) && st.st_nlink == 1)
+            unlinkat(fd, entry->d_name, 0);
+    }
+    dir_batch_free(&batch);
+    close(fd);
+}
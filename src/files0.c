@@ -0,0 +1,196 @@
+/*! \file files0.c
+ * Streaming removal of NUL separated operands read with `--files0-from`
+ *
+ * The operands are read in large chunks and removed one by one as they arrive, so `find -print0` can feed millions of
+ * paths to a single process that loads its configuration, prepares the trash directory and builds the protected set
+ * once. Consecutive operands sharing a parent directory, as `find` emits them, form a group: the parent is opened and
+ * resolved once, and the non-directory operands of the group are stat'ed, checked and removed relative to its fd,
+ * without resolving every path again. Directories, symlinks and anything unusual go through safe_remove() like
+ * regular operands. The command line operands are grouped the same way once operands_run() sorted them.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../include/better_rm.h"
+
+#define FILES0_CHUNK (64 * 1024)
+
+
+/** Switch to the group of an operand's parent directory
+ *
+ * @param group current group, replaced if the parent differs
+ * @param path operand
+ * @param parent_len length of the parent part of \p path, 0 for the current directory
+ */
+static void files0_enter(struct OperandGroup *group, const char *path, size_t parent_len) {
+    if (group->parent && group->parent_len == parent_len && memcmp(group->parent, path, parent_len) == 0)
+        return;
+
+    if (group->fd >= 0)
+        close(group->fd);
+    free(group->parent);
+    group->fd = -1;
+    group->parent = malloc(parent_len + 1);
+    group->parent_len = parent_len;
+    if (!group->parent)
+        return;
+    memcpy(group->parent, path, parent_len);
+    group->parent[parent_len] = '\0';
+
+    const char *dir = parent_len == 0 ? "." : parent_len == 1 && path[0] == '/' ? "/" : group->parent;
+    if (realpath(dir, group->resolved) != NULL)
+        group->fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+/** Remove one operand, through the fd of its parent when it shares the parent of the previous one
+ *
+ * @param group group of the previous operand's parent, switched to the one of \p path
+ * @param path operand
+ * @param opts provided options
+ * @return 0 for success 1 for error
+ */
+int operand_group_remove(struct OperandGroup *group, const char *path, const struct Options *opts) {
+    const char *slash = strrchr(path, '/');
+    const char *name = slash ? slash + 1 : path;
+    if (name[0] == '\0' || strcmp(name, ".") == 0 || strcmp(name, "..") == 0 || opts->interactive)
+        return safe_remove(path, opts);
+
+    files0_enter(group, path, slash ? (size_t) (slash == path ? 1 : slash - path) : 0);
+    if (group->fd < 0)
+        return safe_remove(path, opts);
+
+    struct stat st;
+    uint64_t start = stats_begin();
+    int ret = fstatat(group->fd, name, &st, AT_SYMLINK_NOFOLLOW);
+    stats_end(STATS_STAT, start, ret != 0);
+    // Symlinks are checked through their target like regular operands
+    if (ret != 0 || S_ISDIR(st.st_mode) || S_ISLNK(st.st_mode))
+        return safe_remove(path, opts);
+    if (opts->keep && keep_match(opts->keep, name, false)) {
+        keep_report(path, opts);
+        return 0;
+    }
+
+    // The name based check of is_protected(), a non-directory cannot match a protected identity
+    char resolved[PATH_MAX];
+    int len = snprintf(resolved, sizeof(resolved), "%s/%s", strcmp(group->resolved, "/") == 0 ? "" : group->resolved,
+                       name);
+    if (len < 0 || (size_t) len >= sizeof(resolved))
+        return safe_remove(path, opts);
+    for (int i = 0; i < protected_count; i++) {
+        if (strcmp(resolved, protected_dirs[i]) == 0) {
+            fprintf(stderr, "%sbetter-rm: cannot remove '%s': Protected system directory\n",
+                    opts->dry_run ? "[DRY-RUN] " : "", path);
+            output_record(opts, path, "PROTECTED", -1, EPERM);
+            return 1;
+        }
+    }
+
+    struct Options mount_opts;
+    opts = operand_options(path, &st, opts, &mount_opts);
+    audit_begin(path, opts->use_trash ? "TRASH" : "DELETE");
+    ret = remove_file_at(group->fd, name, path, opts);
+    int err = errno;
+    audit_end();
+    // A failed unlink was reported by remove_file_at()
+    if (ret != 0 && !opts->force) {
+        if (opts->use_trash)
+            fprintf(stderr, "better-rm: cannot trash '%s': %s\n", path, strerror(err));
+        return 1;
+    }
+    return 0;
+}
+
+/** Close the parent directory of the last group
+ *
+ * @param group group
+ */
+void operand_group_close(struct OperandGroup *group) {
+    if (group->fd >= 0)
+        close(group->fd);
+    free(group->parent);
+    group->parent = NULL;
+    group->fd = -1;
+}
+
+/** Remove the operands listed in a file, each terminated by a NUL byte
+ *
+ * @param file file to read, `-` for stdin
+ * @param opts provided options
+ * @return 0 for success 1 if an operand could not be removed or the list could not be read
+ */
+int files0_run(const char *file, const struct Options *opts) {
+    bool from_stdin = strcmp(file, "-") == 0;
+    int fd = from_stdin ? STDIN_FILENO : open(file, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "better-rm: cannot open '%s' for reading: %s\n", file, strerror(errno));
+        return 1;
+    }
+
+    size_t cap = FILES0_CHUNK, len = 0;
+    char *buf = malloc(cap + 1);
+    struct OperandGroup group = {.parent = NULL, .parent_len = 0, .fd = -1};
+    int exit_status = 0;
+    bool eof = false;
+    while (buf && !eof) {
+        if (len == cap) {
+            // An operand longer than the buffer, keep reading it
+            char *grown = realloc(buf, cap * 2 + 1);
+            if (!grown) {
+                fprintf(stderr, "better-rm: cannot read '%s': %s\n", file, strerror(ENOMEM));
+                exit_status = 1;
+                break;
+            }
+            buf = grown;
+            cap *= 2;
+        }
+        ssize_t n = read(fd, buf + len, cap - len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "better-rm: cannot read '%s': %s\n", file, strerror(errno));
+            exit_status = 1;
+            break;
+        }
+        if (n == 0) {
+            // A last operand without its terminator still counts
+            eof = true;
+            if (len > 0)
+                buf[len++] = '\0';
+        } else {
+            len += (size_t) n;
+        }
+
+        size_t start = 0;
+        char *end;
+        while ((end = memchr(buf + start, '\0', len - start)) != NULL) {
+            const char *operand = buf + start;
+            start = (size_t) (end - buf) + 1;
+            if (operand[0] == '\0') {
+                fprintf(stderr, "better-rm: %s: invalid zero-length file name\n", from_stdin ? "-" : file);
+                exit_status = 1;
+                continue;
+            }
+            if (operand_group_remove(&group, operand, opts) != 0)
+                exit_status = 1;
+        }
+        memmove(buf, buf + start, len - start);
+        len -= start;
+    }
+    if (!buf) {
+        fprintf(stderr, "better-rm: cannot read '%s': %s\n", file, strerror(ENOMEM));
+        exit_status = 1;
+    }
+
+    operand_group_close(&group);
+    free(buf);
+    if (!from_stdin)
+        close(fd);
+    return exit_status;
+}
@@ -0,0 +1,747 @@
+/*! \file journal.c
+ * Local binary audit journal kept next to syslog, enabled with `audit_journal=yes`
+ *
+ * syslog drops records under its rate limits and has to be grepped to find a path. With the journal every record sent
+ * to syslog is also appended to `audit.journal` in `$XDG_STATE_HOME/better-rm`, or in `BETTER_RM_JOURNAL`: fixed size
+ * records holding the time, user, action, device, inode and size of the entry and the offset of its absolute path in
+ * `audit.paths`. Records are buffered and written in groups, every \ref JOURNAL_GROUP records, once the oldest one
+ * waited \ref JOURNAL_DELAY_NS and at exit. A group costs one write and one fdatasync() per file, under an exclusive
+ * flock() of the journal so concurrent processes append whole groups, and a crash loses the buffered group at most.
+ *
+ * `--audit-query` looks paths up in `audit.index`, the XXH64 of every journaled path sorted with its record number. A
+ * query first indexes the records appended since the index was written, then reads the records of the paths asked
+ * for and of their parent directories only. Patterns have to scan the whole journal.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../include/better_rm.h"
+
+#define JOURNAL_ENV "BETTER_RM_JOURNAL"
+#define JOURNAL_NAME "audit.journal"
+#define JOURNAL_PATHS_NAME "audit.paths"
+#define JOURNAL_INDEX_NAME "audit.index"
+#define JOURNAL_MAGIC "BRMJRN1"
+#define JOURNAL_INDEX_MAGIC "BRMJIX1"
+#define JOURNAL_VERSION 1
+#define JOURNAL_GROUP 512 /*!< buffered records written as one group */
+#define JOURNAL_DELAY_NS 200000000ll /*!< longest time a record stays buffered while records keep coming */
+
+/*! Header of `audit.journal`, followed by the records */
+struct JournalHeader {
+    char magic[8]; /*!< \ref JOURNAL_MAGIC */
+    uint32_t version; /*!< \ref JOURNAL_VERSION */
+    uint32_t record_size; /*!< `sizeof(struct JournalRecord)` */
+};
+
+/*! One journaled removal */
+struct JournalRecord {
+    int64_t time_ns; /*!< time of the removal, nanoseconds since the epoch */
+    uint64_t dev; /*!< device of the entry, 0 if unknown */
+    uint64_t ino; /*!< inode of the entry, 0 if unknown */
+    int64_t size; /*!< apparent size, bytes of the operand for a summary, -1 if unknown */
+    uint64_t path_offset; /*!< NUL terminated absolute path in `audit.paths` */
+    uint64_t path_hash; /*!< XXH64 of the path */
+    uint64_t entries; /*!< entries removed, more than one for a summary */
+    uint32_t uid; /*!< user the removal was done as */
+    int32_t error; /*!< errno of a failed removal, 0 for success */
+    uint32_t failures; /*!< entries that could not be removed, for a summary */
+    uint32_t summary; /*!< 1 for the summary of an operand */
+    char action[16]; /*!< TRASH, DELETE and so on, NUL padded */
+};
+
+/*! Header of `audit.index`, followed by one entry per indexed record */
+struct JournalIndexHeader {
+    char magic[8]; /*!< \ref JOURNAL_INDEX_MAGIC */
+    uint32_t version; /*!< \ref JOURNAL_VERSION */
+    uint32_t reserved; /*!< padding, 0 */
+    uint64_t journal_ino; /*!< inode of the journal the index was built from */
+    uint64_t records; /*!< records indexed, from the first one */
+};
+
+/*! Path hash of one record, entries are sorted by hash and record number */
+struct JournalIndexEntry {
+    uint64_t hash; /*!< \ref JournalRecord::path_hash */
+    uint64_t record; /*!< record number */
+};
+
+/*! Records waiting to be written */
+struct JournalBuffer {
+    struct JournalRecord *records; /*!< records, path offsets relative to \ref paths */
+    size_t count; /*!< number of \ref records */
+    size_t cap; /*!< capacity of \ref records */
+    char *paths; /*!< NUL terminated paths of the records */
+    size_t paths_len; /*!< bytes used in \ref paths */
+    size_t paths_cap; /*!< capacity of \ref paths */
+};
+
+bool audit_journal; /*!< selected with `audit_journal=` */
+
+// Records are added to the current buffer while the other one is written
+static struct JournalBuffer buffers[2];
+static int current;
+static int64_t oldest_ns; /*!< time of the oldest record of the current buffer */
+static pthread_mutex_t buffer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t write_lock = PTHREAD_MUTEX_INITIALIZER;
+static int journal_fd = -1;
+static int paths_fd = -1;
+static bool journal_failed;
+static char working_dir[PATH_MAX];
+
+
+/** Resolve the journal directory
+ *
+ * @param buf output buffer
+ * @param size size of \p buf
+ * @return 0 for success -1 if neither `BETTER_RM_JOURNAL`, `XDG_STATE_HOME` nor `HOME` is set
+ */
+int journal_dir(char *buf, size_t size) {
+    const char *dir = getenv(JOURNAL_ENV);
+    const char *state_home = getenv("XDG_STATE_HOME");
+    const char *home = getenv("HOME");
+    int len;
+
+    if (dir && dir[0] == '/') {
+        len = snprintf(buf, size, "%s", dir);
+    } else if (state_home && state_home[0] == '/') {
+        len = snprintf(buf, size, "%s/better-rm", state_home);
+    } else if (home) {
+        len = snprintf(buf, size, "%s/.local/state/better-rm", home);
+    } else {
+        return -1;
+    }
+    return len > 0 && (size_t) len < size - sizeof(JOURNAL_PATHS_NAME) - 16 ? 0 : -1;
+}
+
+/** Give up on the journal for the rest of the process
+ *
+ * @param what failed step
+ */
+static void journal_fail(const char *what) {
+    if (!journal_failed)
+        fprintf(stderr, "better-rm: cannot %s the audit journal: %s\n", what, strerror(errno));
+    journal_failed = true;
+}
+
+/** Open the journal files for appending, creating them and their directory on first use
+ *
+ * @return 0 for success -1 for error
+ */
+static int journal_open(void) {
+    char dir[PATH_MAX];
+    if (journal_dir(dir, sizeof(dir)) != 0) {
+        errno = ENOENT;
+        return -1;
+    }
+    // ~/.local/state may not exist yet, failures show up when opening the files
+    for (char *slash = strchr(dir + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        mkdir(dir, 0700);
+        *slash = '/';
+    }
+    if (mkdir(dir, 0700) != 0 && errno != EEXIST)
+        return -1;
+
+    int dirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirfd < 0)
+        return -1;
+    journal_fd = openat(dirfd, JOURNAL_NAME, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600);
+    paths_fd = openat(dirfd, JOURNAL_PATHS_NAME, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600);
+    int saved_errno = errno;
+    close(dirfd);
+    if (journal_fd < 0 || paths_fd < 0) {
+        errno = saved_errno;
+        return -1;
+    }
+    return 0;
+}
+
+/** Write a whole buffer at an offset
+ *
+ * @param fd file
+ * @param buf data
+ * @param len length of \p buf
+ * @param offset offset in the file
+ * @return 0 for success -1 for error
+ */
+static int pwrite_all(int fd, const void *buf, size_t len, off_t offset) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = pwrite(fd, p, len, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        p += n;
+        len -= (size_t) n;
+        offset += n;
+    }
+    return 0;
+}
+
+/** Append a group of records to the journal
+ *
+ * @param group records, their path offsets are rebased onto `audit.paths`
+ * @return 0 for success -1 for error
+ */
+static int journal_write(struct JournalBuffer *group) {
+    int ret;
+    while ((ret = flock(journal_fd, LOCK_EX)) != 0 && errno == EINTR) {
+    }
+    if (ret != 0)
+        return -1;
+
+    struct stat st, paths_st;
+    struct JournalHeader header = {.magic = JOURNAL_MAGIC, .version = JOURNAL_VERSION,
+                                   .record_size = sizeof(struct JournalRecord)};
+    struct JournalHeader found;
+    ret = fstat(journal_fd, &st) == 0 && fstat(paths_fd, &paths_st) == 0 ? 0 : -1;
+    if (ret == 0 && st.st_size < (off_t) sizeof(header)) {
+        ret = pwrite_all(journal_fd, &header, sizeof(header), 0);
+        st.st_size = sizeof(header);
+    } else if (ret == 0 && (pread(journal_fd, &found, sizeof(found), 0) != sizeof(found) ||
+                            memcmp(&found, &header, sizeof(header)) != 0)) {
+        errno = EINVAL;
+        ret = -1;
+    }
+
+    // A record torn by a crash would shift every later one
+    off_t end = st.st_size - (st.st_size - (off_t) sizeof(header)) % (off_t) sizeof(struct JournalRecord);
+    if (ret == 0 && end != st.st_size)
+        ret = ftruncate(journal_fd, end);
+    for (size_t i = 0; ret == 0 && i < group->count; i++)
+        group->records[i].path_offset += (uint64_t) paths_st.st_size;
+    // Paths go first, a record is never read before its path
+    if (ret == 0)
+        ret = pwrite_all(paths_fd, group->paths, group->paths_len, paths_st.st_size);
+    if (ret == 0)
+        ret = pwrite_all(journal_fd, group->records, group->count * sizeof(*group->records), end);
+    if (ret == 0)
+        ret = fdatasync(paths_fd);
+    if (ret == 0)
+        ret = fdatasync(journal_fd);
+
+    int saved_errno = errno;
+    flock(journal_fd, LOCK_UN);
+    errno = saved_errno;
+    return ret;
+}
+
+/** Write the buffered records as one group
+ *
+ * @param wait wait for a group being written by another thread, otherwise leave the records to it
+ */
+static void journal_commit(bool wait) {
+    if (wait) {
+        pthread_mutex_lock(&write_lock);
+    } else if (pthread_mutex_trylock(&write_lock) != 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&buffer_lock);
+    struct JournalBuffer *group = &buffers[current];
+    current ^= 1;
+    pthread_mutex_unlock(&buffer_lock);
+
+    if (group->count > 0 && !journal_failed) {
+        uint64_t start = stats_begin();
+        if (journal_fd < 0 && journal_open() != 0) {
+            journal_fail("open");
+        } else if (journal_write(group) != 0) {
+            journal_fail("write");
+        }
+        stats_end(STATS_JOURNAL, start, journal_failed);
+    }
+    group->count = 0;
+    group->paths_len = 0;
+    pthread_mutex_unlock(&write_lock);
+}
+
+/** Make room in a buffer for one more record
+ *
+ * @param buf buffer
+ * @param path_len bytes the path of the record needs, with its NUL
+ * @return 0 for success -1 if out of memory
+ */
+static int journal_reserve(struct JournalBuffer *buf, size_t path_len) {
+    if (buf->count == buf->cap) {
+        size_t cap = buf->cap ? buf->cap * 2 : JOURNAL_GROUP;
+        struct JournalRecord *grown = realloc(buf->records, cap * sizeof(*grown));
+        if (!grown)
+            return -1;
+        buf->records = grown;
+        buf->cap = cap;
+    }
+    if (buf->paths_len + path_len > buf->paths_cap) {
+        size_t cap = buf->paths_cap ? buf->paths_cap : (size_t) JOURNAL_GROUP * 64;
+        while (cap < buf->paths_len + path_len)
+            cap *= 2;
+        char *grown = realloc(buf->paths, cap);
+        if (!grown)
+            return -1;
+        buf->paths = grown;
+        buf->paths_cap = cap;
+    }
+    return 0;
+}
+
+/** Buffer one record, writing the group once it is due
+ *
+ * @param record record, its time, user and path fields are filled in
+ * @param path removed path, made absolute against the working directory
+ */
+static void journal_push(struct JournalRecord *record, const char *path) {
+    if (journal_failed)
+        return;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    record->time_ns = (int64_t) now.tv_sec * 1000000000ll + now.tv_nsec;
+    record->uid = (uint32_t) getuid();
+
+    pthread_mutex_lock(&buffer_lock);
+    // The walkers never change directory, the working directory is looked up once
+    if (path[0] != '/' && working_dir[0] == '\0' && !getcwd(working_dir, sizeof(working_dir)))
+        working_dir[0] = '\0';
+    const char *prefix = path[0] == '/' ? "" : working_dir;
+    size_t need = strlen(prefix) + 1 + strlen(path) + 1;
+
+    // Out of memory the record is dropped, like syslog drops them
+    struct JournalBuffer *buf = &buffers[current];
+    if (journal_reserve(buf, need) == 0) {
+        char *stored = buf->paths + buf->paths_len;
+        snprintf(stored, need, "%s%s%s", prefix, prefix[0] ? "/" : "", path);
+        normalize_path(stored);
+        size_t len = strlen(stored);
+        struct Xxh64 hash;
+        xxh64_init(&hash);
+        xxh64_update(&hash, stored, len);
+        record->path_hash = xxh64_digest(&hash);
+        record->path_offset = buf->paths_len;
+        buf->paths_len += len + 1;
+        if (buf->count == 0)
+            oldest_ns = record->time_ns;
+        buf->records[buf->count++] = *record;
+    }
+    bool due = buf->count >= JOURNAL_GROUP || (buf->count > 0 && record->time_ns - oldest_ns >= JOURNAL_DELAY_NS);
+    pthread_mutex_unlock(&buffer_lock);
+    if (due)
+        journal_commit(false);
+}
+
+/** Journal the removal of one entry
+ *
+ * @param path removed path
+ * @param action TRASH, DELETE and so on
+ * @param error errno of a failed removal, 0 for success
+ * @param size apparent size of the entry, -1 if unknown
+ * @param st lstat() of the entry, NULL if it was not stat'ed
+ */
+void journal_append(const char *path, const char *action, int error, off_t size, const struct stat *st) {
+    struct JournalRecord record = {
+            .dev = st ? (uint64_t) st->st_dev : 0,
+            .ino = st ? (uint64_t) st->st_ino : 0,
+            .size = (int64_t) size,
+            .entries = error == 0 ? 1 : 0,
+            .error = error,
+            .failures = error == 0 ? 0 : 1,
+    };
+    strncpy(record.action, action, sizeof(record.action) - 1);
+    journal_push(&record, path);
+}
+
+/** Journal the summary of one operand
+ *
+ * @param path operand
+ * @param action TRASH or DELETE
+ * @param entries entries removed
+ * @param bytes bytes removed
+ * @param failures entries that could not be removed
+ */
+void journal_append_summary(const char *path, const char *action, unsigned long long entries,
+                            unsigned long long bytes, unsigned long long failures) {
+    struct JournalRecord record = {
+            .size = (int64_t) bytes,
+            .entries = entries,
+            .failures = failures > UINT32_MAX ? UINT32_MAX : (uint32_t) failures,
+            .summary = 1,
+    };
+    strncpy(record.action, action, sizeof(record.action) - 1);
+    journal_push(&record, path);
+}
+
+/** Write the buffered records, before forking and at exit
+ *
+ * The journal is opened even without records, so forked children append to it whatever user they switch to.
+ */
+void journal_flush(void) {
+    if (!audit_journal)
+        return;
+    pthread_mutex_lock(&write_lock);
+    if (journal_fd < 0 && !journal_failed && journal_open() != 0)
+        journal_fail("open");
+    pthread_mutex_unlock(&write_lock);
+    journal_commit(true);
+}
+
+/** Order two index entries by hash and record number
+ *
+ * @param a first entry
+ * @param b second entry
+ * @return negative, zero or positive like strcmp()
+ */
+static int compare_index_entries(const void *a, const void *b) {
+    const struct JournalIndexEntry *x = a, *y = b;
+    if (x->hash != y->hash)
+        return x->hash < y->hash ? -1 : 1;
+    return (x->record > y->record) - (x->record < y->record);
+}
+
+/*! Journal mapped for a query */
+struct JournalView {
+    int dirfd; /*!< journal directory */
+    int fd; /*!< journal, holding a shared lock */
+    ino_t ino; /*!< inode of the journal */
+    const struct JournalRecord *records; /*!< records */
+    size_t count; /*!< number of \ref records */
+    void *map; /*!< mapping of the journal */
+    size_t map_len; /*!< length of \ref map */
+    const char *paths; /*!< mapping of `audit.paths` */
+    size_t paths_len; /*!< length of \ref paths */
+    struct JournalIndexEntry *index; /*!< hash of every record, sorted */
+};
+
+/** Read the path of a record
+ *
+ * @param view mapped journal
+ * @param record record
+ * @return path, NULL if it is not in `audit.paths` or does not match the hash of the record
+ */
+static const char *journal_path(const struct JournalView *view, const struct JournalRecord *record) {
+    if (record->path_offset >= view->paths_len)
+        return NULL;
+    const char *path = view->paths + record->path_offset;
+    const char *end = memchr(path, '\0', view->paths_len - record->path_offset);
+    if (!end)
+        return NULL;
+    struct Xxh64 hash;
+    xxh64_init(&hash);
+    xxh64_update(&hash, path, (size_t) (end - path));
+    return xxh64_digest(&hash) == record->path_hash ? path : NULL;
+}
+
+/** Bring the index up to date with the journal, saving it for the next queries when it grew
+ *
+ * @param view mapped journal, receives the index
+ * @return 0 for success -1 for error
+ */
+static int journal_index(struct JournalView *view) {
+    struct JournalIndexHeader header;
+    struct JournalIndexEntry *index = malloc((view->count ? view->count : 1) * sizeof(*index));
+    if (!index)
+        return -1;
+
+    // A missing, stale or foreign index is rebuilt from the first record
+    size_t indexed = 0;
+    int fd = openat(view->dirfd, JOURNAL_INDEX_NAME, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    struct stat st;
+    if (fd >= 0 && fstat(fd, &st) == 0 && pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+        memcmp(header.magic, JOURNAL_INDEX_MAGIC, sizeof(header.magic)) == 0 && header.version == JOURNAL_VERSION &&
+        header.journal_ino == (uint64_t) view->ino && header.records <= view->count &&
+        (uint64_t) st.st_size == sizeof(header) + header.records * sizeof(*index) &&
+        pread(fd, index, header.records * sizeof(*index), sizeof(header)) ==
+                (ssize_t) (header.records * sizeof(*index)))
+        indexed = (size_t) header.records;
+    if (fd >= 0)
+        close(fd);
+    if (indexed == view->count) {
+        view->index = index;
+        return 0;
+    }
+
+    // Records only ever get appended, the new ones sort after the indexed ones of the same hash
+    size_t added = view->count - indexed;
+    struct JournalIndexEntry *merged = malloc(view->count * sizeof(*merged));
+    if (!merged) {
+        free(index);
+        return -1;
+    }
+    struct JournalIndexEntry *tail = index + indexed;
+    for (size_t i = 0; i < added; i++)
+        tail[i] = (struct JournalIndexEntry) {view->records[indexed + i].path_hash, indexed + i};
+    qsort(tail, added, sizeof(*tail), compare_index_entries);
+    size_t a = 0, b = 0, out = 0;
+    while (a < indexed || b < added)
+        merged[out++] = b == added || (a < indexed && compare_index_entries(&index[a], &tail[b]) < 0) ? index[a++]
+                                                                                                   : tail[b++];
+    free(index);
+    view->index = merged;
+
+    // Best effort, only the owner of the journal can save the index
+    char tmp_name[64];
+    snprintf(tmp_name, sizeof(tmp_name), JOURNAL_INDEX_NAME ".%d", (int) getpid());
+    fd = openat(view->dirfd, tmp_name, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if (fd < 0)
+        return 0;
+    header = (struct JournalIndexHeader) {.magic = JOURNAL_INDEX_MAGIC, .version = JOURNAL_VERSION,
+                                          .journal_ino = (uint64_t) view->ino, .records = view->count};
+    bool saved = pwrite_all(fd, &header, sizeof(header), 0) == 0 &&
+                 pwrite_all(fd, merged, view->count * sizeof(*merged), sizeof(header)) == 0 && fsync(fd) == 0;
+    close(fd);
+    if (!saved || renameat(view->dirfd, tmp_name, view->dirfd, JOURNAL_INDEX_NAME) != 0)
+        unlinkat(view->dirfd, tmp_name, 0);
+    return 0;
+}
+
+/** Map the journal for a query
+ *
+ * @param view receives the mapped journal
+ * @return 0 for success, -1 for error with `errno` set, ENOENT if nothing was journaled yet
+ */
+static int journal_view_open(struct JournalView *view) {
+    memset(view, 0, sizeof(*view));
+    view->dirfd = view->fd = -1;
+    char dir[PATH_MAX];
+    if (journal_dir(dir, sizeof(dir)) != 0) {
+        errno = ENOENT;
+        return -1;
+    }
+    view->dirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (view->dirfd < 0)
+        return -1;
+    view->fd = openat(view->dirfd, JOURNAL_NAME, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    int paths = openat(view->dirfd, JOURNAL_PATHS_NAME, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    struct stat st, paths_st;
+    // Writers hold the exclusive lock while the files grow
+    struct JournalHeader header;
+    if (view->fd < 0 || paths < 0 || flock(view->fd, LOCK_SH) != 0 || fstat(view->fd, &st) != 0 ||
+        fstat(paths, &paths_st) != 0) {
+        if (paths >= 0)
+            close(paths);
+        return -1;
+    }
+    view->ino = st.st_ino;
+    if (st.st_size < (off_t) sizeof(header)) {
+        close(paths);
+        return 0;
+    }
+    if (pread(view->fd, &header, sizeof(header), 0) != sizeof(header) ||
+        memcmp(header.magic, JOURNAL_MAGIC, sizeof(header.magic)) != 0 || header.version != JOURNAL_VERSION ||
+        header.record_size != sizeof(struct JournalRecord)) {
+        close(paths);
+        errno = EINVAL;
+        return -1;
+    }
+
+    view->map_len = (size_t) st.st_size;
+    view->map = mmap(NULL, view->map_len, PROT_READ, MAP_SHARED, view->fd, 0);
+    view->paths_len = (size_t) paths_st.st_size;
+    view->paths = view->paths_len ? mmap(NULL, view->paths_len, PROT_READ, MAP_SHARED, paths, 0) : NULL;
+    close(paths);
+    if (view->map == MAP_FAILED || view->paths == MAP_FAILED) {
+        view->map = view->map == MAP_FAILED ? NULL : view->map;
+        view->paths = view->paths == MAP_FAILED ? NULL : view->paths;
+        return -1;
+    }
+    view->records = (const struct JournalRecord *) ((const char *) view->map + sizeof(header));
+    view->count = (view->map_len - sizeof(header)) / sizeof(struct JournalRecord);
+    return journal_index(view);
+}
+
+/** Unmap a journal
+ *
+ * @param view mapped journal
+ */
+static void journal_view_close(struct JournalView *view) {
+    if (view->map)
+        munmap(view->map, view->map_len);
+    if (view->paths)
+        munmap((void *) view->paths, view->paths_len);
+    if (view->fd >= 0)
+        close(view->fd);
+    if (view->dirfd >= 0)
+        close(view->dirfd);
+    free(view->index);
+}
+
+/** Print one record the way it was sent to syslog
+ *
+ * @param record record
+ * @param path path of the record
+ */
+static void journal_print(const struct JournalRecord *record, const char *path) {
+    time_t when = (time_t) (record->time_ns / 1000000000ll);
+    struct tm tm_info;
+    char stamp[32] = "";
+    if (localtime_r(&when, &tm_info))
+        strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm_info);
+    const struct passwd *pw = getpwuid((uid_t) record->uid);
+    const char *user = pw ? pw->pw_name : "?";
+    char action[sizeof(record->action) + 1] = "";
+    memcpy(action, record->action, sizeof(record->action));
+
+    if (record->summary) {
+        printf("%s %s SUMMARY: %s (user: %s, uid: %u, entries: %llu, bytes: %lld, failures: %u)\n", stamp, action,
+               path, user, record->uid, (unsigned long long) record->entries, (long long) record->size,
+               record->failures);
+    } else if (record->error != 0) {
+        printf("%s %s FAILED: %s (user: %s, uid: %u, error: %s)\n", stamp, action, path, user, record->uid,
+               strerror(record->error));
+    } else if (record->ino != 0) {
+        printf("%s %s: %s (user: %s, uid: %u, size: %lld, inode: %u:%u:%llu)\n", stamp, action, path, user,
+               record->uid, (long long) record->size, major((dev_t) record->dev), minor((dev_t) record->dev),
+               (unsigned long long) record->ino);
+    } else {
+        printf("%s %s: %s (user: %s, uid: %u)\n", stamp, action, path, user, record->uid);
+    }
+}
+
+/** Tell whether a record falls in the time window of a query
+ *
+ * @param record record
+ * @param after records before this time are skipped
+ * @param before records from this time on are skipped
+ * @return true if the record is printed
+ */
+static bool journal_in_window(const struct JournalRecord *record, int64_t after, int64_t before) {
+    int64_t when = record->time_ns / 1000000000ll;
+    return when >= after && when < before;
+}
+
+/** Order two record numbers
+ *
+ * @param a first number
+ * @param b second number
+ * @return negative, zero or positive like strcmp()
+ */
+static int compare_records(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+/** Collect the records journaled under a path
+ *
+ * @param view mapped journal
+ * @param path normalized absolute path
+ * @param matches record numbers, grown as needed
+ * @param count number of \p matches
+ * @param cap capacity of \p matches
+ * @return 0 for success -1 if out of memory
+ */
+static int journal_lookup(const struct JournalView *view, const char *path, uint64_t **matches, size_t *count,
+                          size_t *cap) {
+    struct Xxh64 state;
+    xxh64_init(&state);
+    xxh64_update(&state, path, strlen(path));
+    uint64_t hash = xxh64_digest(&state);
+
+    size_t lo = 0, hi = view->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (view->index[mid].hash < hash) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    for (; lo < view->count && view->index[lo].hash == hash; lo++) {
+        const char *found = journal_path(view, &view->records[view->index[lo].record]);
+        if (!found || strcmp(found, path) != 0)
+            continue;
+        if (*count == *cap) {
+            size_t grown_cap = *cap ? *cap * 2 : 64;
+            uint64_t *grown = realloc(*matches, grown_cap * sizeof(*grown));
+            if (!grown)
+                return -1;
+            *matches = grown;
+            *cap = grown_cap;
+        }
+        (*matches)[(*count)++] = view->index[lo].record;
+    }
+    return 0;
+}
+
+/** Print who removed paths and when, from the journal
+ *
+ * An operand prints the records of the path and of its parent directories, which took it along, an operand with
+ * `*`, `?` or `[` is a pattern on the journaled paths.
+ *
+ * @param operands paths or patterns, none prints every record
+ * @param count number of \p operands
+ * @param after records before this time are skipped
+ * @param before records from this time on are skipped
+ * @return 0 for success 1 for error
+ */
+int journal_query(char *const *operands, size_t count, int64_t after, int64_t before) {
+    struct JournalView view;
+    if (journal_view_open(&view) != 0) {
+        int err = errno;
+        journal_view_close(&view);
+        if (err == ENOENT)
+            return 0;
+        fprintf(stderr, "better-rm: cannot read the audit journal: %s\n", strerror(err));
+        return 1;
+    }
+
+    int ret = 0;
+    for (size_t i = 0; i < (count ? count : 1); i++) {
+        char *path = count ? absolute_operand(operands[i]) : NULL;
+        if (count && !path) {
+            fprintf(stderr, "better-rm: cannot query '%s': %s\n", operands[i], strerror(errno ? errno : ENOMEM));
+            ret = 1;
+            continue;
+        }
+
+        if (!path || strpbrk(path, "*?[")) {
+            for (size_t r = 0; r < view.count; r++) {
+                const char *found = journal_path(&view, &view.records[r]);
+                if (found && journal_in_window(&view.records[r], after, before) &&
+                    (!path || fnmatch(path, found, 0) == 0))
+                    journal_print(&view.records[r], found);
+            }
+            free(path);
+            continue;
+        }
+
+        // The path and every parent directory, a removed tree is journaled under its operand in summary mode
+        uint64_t *matches = NULL;
+        size_t found_count = 0, cap = 0;
+        int lookup = 0;
+        for (char *end = path + strlen(path); lookup == 0 && end > path;) {
+            char saved = *end;
+            *end = '\0';
+            lookup = journal_lookup(&view, path, &matches, &found_count, &cap);
+            *end = saved;
+            while (--end > path && *end != '/') {
+            }
+        }
+        if (lookup != 0) {
+            fprintf(stderr, "better-rm: cannot query '%s': %s\n", operands[i], strerror(ENOMEM));
+            ret = 1;
+        }
+        if (found_count > 1)
+            qsort(matches, found_count, sizeof(*matches), compare_records);
+        for (size_t m = 0; m < found_count; m++) {
+            const struct JournalRecord *record = &view.records[matches[m]];
+            if (journal_in_window(record, after, before))
+                journal_print(record, journal_path(&view, record));
+        }
+        free(matches);
+        free(path);
+    }
+
+    journal_view_close(&view);
+    return ret;
+}
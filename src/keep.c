@@ -0,0 +1,224 @@
+/*! \file keep.c
+ * Entries left in place with `--keep`, `--exclude` and `keep=`
+ *
+ * A pattern matches entry names, never paths, and a trailing `/` restricts it to directories. The patterns of a run are
+ * compiled once into a \ref KeepSet: names without wildcards and `*.ext` suffixes go into one open addressing table,
+ * looked up with the whole name and with every tail of it starting at a `.`, and only the remaining patterns are tried
+ * with fnmatch(). A kept entry is never entered, so a kept directory costs a single lookup however large it is. The
+ * directories holding a kept entry are kept as well, every other entry around them is removed.
+ */
+#include <errno.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/better_rm.h"
+
+#define KEEP_NAME_FILE 0x1u /*!< the whole name of a non-directory matches */
+#define KEEP_NAME_DIR 0x2u /*!< the whole name of a directory matches */
+#define KEEP_SUFFIX_FILE 0x4u /*!< a non-directory whose name ends with the key matches */
+#define KEEP_SUFFIX_DIR 0x8u /*!< a directory whose name ends with the key matches */
+
+/*! Slot of the name and suffix table */
+struct KeepSlot {
+    const char *key; /*!< name or suffix, NULL for a free slot */
+    unsigned kinds; /*!< \ref KEEP_NAME_FILE, \ref KEEP_NAME_DIR, \ref KEEP_SUFFIX_FILE and \ref KEEP_SUFFIX_DIR */
+};
+
+char *keep_patterns[MAX_KEEP_PATTERNS]; /*!< patterns of `keep=` */
+int keep_count; /*!< number of \ref keep_patterns */
+
+
+/** Hash a name with FNV-1a
+ *
+ * @param s name
+ * @return hash
+ */
+static size_t hash_name(const char *s) {
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (; *s; s++)
+        h = (h ^ (unsigned char) *s) * 0x100000001b3ull;
+    return (size_t) (h ^ (h >> 32));
+}
+
+/** Tell whether a pattern is a plain name
+ *
+ * @param s pattern
+ * @return true if \p s holds none of the fnmatch() special characters
+ */
+static bool is_literal(const char *s) {
+    return strpbrk(s, "*?[\\") == NULL;
+}
+
+/** Tell whether a pattern can be used with `--keep` or `keep=`
+ *
+ * @param pattern pattern
+ * @return true if it is not empty and has no `/` but a trailing one
+ */
+bool keep_pattern_valid(const char *pattern) {
+    const char *slash = strchr(pattern, '/');
+    return pattern[0] != '\0' && pattern[0] != '/' && (!slash || slash[1] == '\0');
+}
+
+/** Find the slot of a key
+ *
+ * @param set compiled patterns
+ * @param key name or suffix
+ * @return slot holding \p key, or the free slot it would go to
+ */
+static struct KeepSlot *keep_slot(const struct KeepSet *set, const char *key) {
+    size_t slot = hash_name(key) & set->mask;
+    while (set->slots[slot].key && strcmp(set->slots[slot].key, key) != 0)
+        slot = (slot + 1) & set->mask;
+    return &set->slots[slot];
+}
+
+/** Compile patterns into a set
+ *
+ * @param set receives the compiled patterns, released with keep_free()
+ * @param patterns patterns accepted by keep_pattern_valid()
+ * @param count number of \p patterns
+ * @return 0 for success -1 when out of memory
+ */
+int keep_compile(struct KeepSet *set, char *const *patterns, size_t count) {
+    memset(set, 0, sizeof(*set));
+    size_t strings_len = 0;
+    for (size_t i = 0; i < count; i++)
+        strings_len += strlen(patterns[i]) + 1;
+
+    size_t slots = 16;
+    while (slots < 2 * count)
+        slots *= 2;
+    set->slots = calloc(slots, sizeof(*set->slots));
+    set->globs = malloc((count ? count : 1) * sizeof(*set->globs));
+    set->glob_dirs_only = malloc(count ? count : 1);
+    set->strings = malloc(strings_len ? strings_len : 1);
+    if (!set->slots || !set->globs || !set->glob_dirs_only || !set->strings) {
+        keep_free(set);
+        return -1;
+    }
+    set->mask = slots - 1;
+
+    char *cursor = set->strings;
+    for (size_t i = 0; i < count; i++) {
+        // The trailing slash only says the pattern is for directories, it is not part of the name
+        char *pattern = cursor;
+        cursor = stpcpy(cursor, patterns[i]) + 1;
+        size_t len = strlen(pattern);
+        bool dirs_only = len > 1 && pattern[len - 1] == '/';
+        if (dirs_only)
+            pattern[len - 1] = '\0';
+
+        unsigned kinds;
+        const char *key;
+        if (is_literal(pattern)) {
+            key = pattern;
+            kinds = dirs_only ? KEEP_NAME_DIR : KEEP_NAME_FILE | KEEP_NAME_DIR;
+        } else if (pattern[0] == '*' && pattern[1] == '.' && is_literal(pattern + 1)) {
+            key = pattern + 1;
+            kinds = dirs_only ? KEEP_SUFFIX_DIR : KEEP_SUFFIX_FILE | KEEP_SUFFIX_DIR;
+            set->suffixes = true;
+        } else {
+            set->globs[set->glob_count] = pattern;
+            set->glob_dirs_only[set->glob_count++] = dirs_only;
+            continue;
+        }
+        struct KeepSlot *slot = keep_slot(set, key);
+        slot->key = key;
+        slot->kinds |= kinds;
+    }
+    set->count = count;
+    return 0;
+}
+
+/** Tell whether a name is kept
+ *
+ * @param set compiled patterns
+ * @param name entry name
+ * @param is_dir the entry is a directory
+ * @return true if a pattern matches
+ */
+bool keep_match(const struct KeepSet *set, const char *name, bool is_dir) {
+    unsigned name_kind = is_dir ? KEEP_NAME_DIR : KEEP_NAME_FILE;
+    unsigned suffix_kind = is_dir ? KEEP_SUFFIX_DIR : KEEP_SUFFIX_FILE;
+    const struct KeepSlot *slot = keep_slot(set, name);
+    if (slot->key && (slot->kinds & (name_kind | suffix_kind)))
+        return true;
+
+    // A name has few dots, every tail from one of them is a candidate suffix
+    for (const char *dot = set->suffixes ? strchr(name + 1, '.') : NULL; dot; dot = strchr(dot + 1, '.')) {
+        slot = keep_slot(set, dot);
+        if (slot->key && (slot->kinds & suffix_kind))
+            return true;
+    }
+
+    for (size_t i = 0; i < set->glob_count; i++) {
+        if ((is_dir || !set->glob_dirs_only[i]) && fnmatch(set->globs[i], name, 0) == 0)
+            return true;
+    }
+    return false;
+}
+
+/** Tell whether an operand is kept, by its last component
+ *
+ * @param set compiled patterns, NULL if nothing is kept
+ * @param path operand
+ * @param is_dir the operand is a directory
+ * @return true if a pattern matches
+ */
+bool keep_match_operand(const struct KeepSet *set, const char *path, bool is_dir) {
+    if (!set)
+        return false;
+    size_t end = strlen(path);
+    while (end > 1 && path[end - 1] == '/')
+        end--;
+    size_t start = end;
+    while (start > 0 && path[start - 1] != '/')
+        start--;
+
+    char name[NAME_MAX + 1];
+    if (end == start || end - start > NAME_MAX)
+        return false;
+    memcpy(name, path + start, end - start);
+    name[end - start] = '\0';
+    return keep_match(set, name, is_dir);
+}
+
+/** Turn the kind of a directory entry into \ref ENTRY_KEPT when a pattern matches it
+ *
+ * @param opts provided options
+ * @param name entry name
+ * @param kind kind of the entry
+ * @return \ref ENTRY_KEPT or \p kind
+ */
+enum EntryKind keep_classify(const struct Options *opts, const char *name, enum EntryKind kind) {
+    if (opts->keep && (kind == ENTRY_FILE || kind == ENTRY_DIR) && keep_match(opts->keep, name, kind == ENTRY_DIR))
+        return ENTRY_KEPT;
+    return kind;
+}
+
+/** Report an entry left in place, matched by a pattern or holding one that was
+ *
+ * @param path full path of the entry
+ * @param opts provided options
+ */
+void keep_report(const char *path, const struct Options *opts) {
+    if (opts->verbose && opts->output == OUTPUT_TEXT) {
+        printf("keeping '%s'\n", path);
+    }
+    output_record(opts, path, "KEEP", -1, 0);
+}
+
+/** Release compiled patterns
+ *
+ * @param set compiled patterns
+ */
+void keep_free(struct KeepSet *set) {
+    free(set->slots);
+    free(set->globs);
+    free(set->glob_dirs_only);
+    free(set->strings);
+    memset(set, 0, sizeof(*set));
+}
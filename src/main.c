@@ -3,25 +3,28 @@
 #define GNU_SOURCE
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <pthread.h>
 #include <pwd.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
-#include <syslog.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "../include/better_rm.h"
 #include "../include/version.h"
 
 // Default configuration
-#define CONFIG_FILE "/etc/better-rm.conf"
 #define USER_CONFIG_FILE ".better-rm.conf"
-#define TRASH_DIR_ENV "BETTER_RM_TRASH"
-#define DEFAULT_TRASH_DIR ".Trash"
-#define MAX_PROTECTED_DIRS 100
+#define MAX_JOBS 256
+#define TRASH_DAYS_ENV "BETTER_RM_TRASH_DAYS"
+#define DEFAULT_TRASH_DAYS 30
+#define WALK_MAX_OPEN_DIRS 64
+#define TRASH_NAME_ATTEMPTS 16
 
 const char *DEFAULT_PROTECTED_DIRS[] = {
         "/",      "/bin",  "/boot", "/dev",  "/etc", "/home", "/lib", "/lib32",
@@ -31,28 +34,22 @@ const char *DEFAULT_PROTECTED_DIRS[] = {
 char *protected_dirs[MAX_PROTECTED_DIRS];
 int protected_count = 0;
 
-/*! Options struct used to store user defined options */
-struct Options {
-    bool recursive; /*!< remove directories and their contents recursively */
-    bool force; /*!< ignore nonexistent files, never prompt */
-    bool verbose; /*!< explain what is being done */
-    bool interactive; /*!< prompt before every removal */
-    bool dry_run; /*!< show what would be deleted without actually removing */
-    bool preserve_root; /*!< block removing `/` */
-    bool one_file_system; /*!< stay on the same filesystem */
-    bool use_trash; /*!< move files to trash instead of deleting */
-    bool no_preserve_root; /*!< allow removing `/` */
-    const char *trash_dir; /*!< specify trash directory */
-};
+// Trash naming state of the process
+static pthread_once_t trash_stamp_once = PTHREAD_ONCE_INIT;
+static char trash_stamp[16];
+static unsigned long trash_seq;
+
 
 
 /**
  * Initialize the default protected directories defined in \ref DEFAULT_PROTECTED_DIRS
  */
 void init_protected_dirs(void) {
+    protected_set_clear();
     int i = 0;
     while (DEFAULT_PROTECTED_DIRS[i] != NULL && protected_count < MAX_PROTECTED_DIRS) {
         protected_dirs[protected_count++] = strdup(DEFAULT_PROTECTED_DIRS[i]);
+        protected_set_add(DEFAULT_PROTECTED_DIRS[i]);
         i++;
     }
 }
@@ -80,11 +77,59 @@ void load_config_file(const char *filename) {
 
         // Parse directives
         if (strncmp(line, "protect=", 8) == 0) {
+            // Existing directories are protected by identity even past the name list's capacity
             if (protected_count < MAX_PROTECTED_DIRS) {
                 protected_dirs[protected_count++] = strdup(line + 8);
             }
+            protected_set_add(line + 8);
+        } else if (strncmp(line, "keep=", 5) == 0) {
+            if (!keep_pattern_valid(line + 5)) {
+                fprintf(stderr, "better-rm: %s: invalid keep pattern '%s'\n", filename, line + 5);
+            } else if (keep_count < MAX_KEEP_PATTERNS) {
+                keep_patterns[keep_count++] = strdup(line + 5);
+            } else {
+                fprintf(stderr, "better-rm: %s: too many keep patterns, ignoring '%s'\n", filename, line + 5);
+            }
         } else if (strncmp(line, "trash_dir=", 10) == 0) {
             // This would override the default trash directory
+        } else if (strncmp(line, "audit=", 6) == 0) {
+            if (strcmp(line + 6, "file") == 0) {
+                audit_mode = AUDIT_FILE;
+            } else if (strcmp(line + 6, "summary") == 0) {
+                audit_mode = AUDIT_SUMMARY;
+            } else {
+                fprintf(stderr, "better-rm: %s: unknown audit mode '%s'\n", filename, line + 6);
+            }
+        } else if (strncmp(line, "audit_journal=", 14) == 0) {
+            if (strcmp(line + 14, "yes") == 0) {
+                audit_journal = true;
+            } else if (strcmp(line + 14, "no") == 0) {
+                audit_journal = false;
+            } else {
+                fprintf(stderr, "better-rm: %s: invalid audit_journal '%s'\n", filename, line + 14);
+            }
+        } else if (strncmp(line, "trash_max_bytes=", 16) == 0) {
+            if (quota_parse_bytes(line + 16, &trash_max_bytes) != 0)
+                fprintf(stderr, "better-rm: %s: invalid trash_max_bytes '%s'\n", filename, line + 16);
+        } else if (strncmp(line, "trash_max_age=", 14) == 0) {
+            if (quota_parse_age(line + 14, &trash_max_age) != 0)
+                fprintf(stderr, "better-rm: %s: invalid trash_max_age '%s'\n", filename, line + 14);
+        } else if (strncmp(line, "trash_evict=", 12) == 0) {
+            if (strcmp(line + 12, "sync") == 0) {
+                trash_evict = TRASH_EVICT_SYNC;
+            } else if (strcmp(line + 12, "background") == 0) {
+                trash_evict = TRASH_EVICT_BACKGROUND;
+            } else {
+                fprintf(stderr, "better-rm: %s: unknown eviction mode '%s'\n", filename, line + 12);
+            }
+        } else if (strncmp(line, "trash_dedup=", 12) == 0) {
+            if (strcmp(line + 12, "yes") == 0) {
+                trash_dedup = true;
+            } else if (strcmp(line + 12, "no") == 0) {
+                trash_dedup = false;
+            } else {
+                fprintf(stderr, "better-rm: %s: invalid trash_dedup '%s'\n", filename, line + 12);
+            }
         }
     }
 
@@ -99,22 +144,35 @@ void load_config_file(const char *filename) {
  */
 void load_configs(void) {
     // System config
-    load_config_file("/etc/better-rm.conf");
+    load_config_file(CONFIG_FILE);
 
     // User config - check multiple locations
     char user_config[PATH_MAX];
+    if (user_config_path(user_config, sizeof(user_config)) == 0) {
+        load_config_file(user_config);
+    }
+}
+
+/** Resolves the location of the user configuration file
+ *
+ * @param buf output buffer
+ * @param size size of \p buf
+ * @return 0 for success -1 if neither `XDG_CONFIG_HOME` nor `HOME` is set
+ */
+int user_config_path(char *buf, size_t size) {
     const char *config_home = getenv("XDG_CONFIG_HOME");
     const char *home = getenv("HOME");
 
     if (config_home) {
         // Follow XDG Base Directory spec
-        snprintf(user_config, sizeof(user_config), "%s/better-rm/config", config_home);
+        snprintf(buf, size, "%s/better-rm/config", config_home);
     } else if (home) {
         // Fallback to ~/.config
-        snprintf(user_config, sizeof(user_config), "%s/.config/better-rm/config", home);
+        snprintf(buf, size, "%s/.config/better-rm/config", home);
+    } else {
+        return -1;
     }
-
-    load_config_file(user_config);
+    return 0;
 }
 
 
@@ -165,75 +223,150 @@ int ensure_trash_dir(const char *trash_dir) {
 }
 
 
+/** Format the timestamp shared by the trash names of this process, once
+ *
+ */
+static void trash_stamp_init(void) {
+    time_t now = time(NULL);
+    struct tm tm_info;
+    localtime_r(&now, &tm_info);
+    strftime(trash_stamp, sizeof(trash_stamp), "%Y%m%d_%H%M%S", &tm_info);
+}
+
 /** Generate unique filename while moving the file to the trash
  *
+ * The timestamp is taken once per process and a per-process sequence number keeps the names of same-named entries
+ * apart, so the names are unique without any per-entry formatting of the time and the call is thread safe.
+ *
+ * @param buf output buffer
+ * @param size size of \p buf
  * @param original_path file to be deleted(moved)
  * @param trash_dir trash directory
- * @return filename
+ * @return 0 for success -1 if the name does not fit
  */
-char *generate_trash_name(const char *original_path, const char *trash_dir) {
-    static char trash_path[PATH_MAX];
-    char *basename_copy = strdup(original_path);
-    const char *base = basename(basename_copy);
-
-    time_t now;
-    time(&now);
-    const struct tm *tm_info = localtime(&now);
-
-    // Format: filename.YYYYMMDD_HHMMSS.pid
-    snprintf(trash_path, sizeof(trash_path), "%s/%s.%04d%02d%02d_%02d%02d%02d.%d", trash_dir, base,
-             tm_info->tm_year + 1900, tm_info->tm_mon + 1, tm_info->tm_mday, tm_info->tm_hour, tm_info->tm_min,
-             tm_info->tm_sec, getpid());
-
-    free(basename_copy);
-    return trash_path;
+int generate_trash_name(char *buf, size_t size, const char *original_path, const char *trash_dir) {
+    pthread_once(&trash_stamp_once, trash_stamp_init);
+    unsigned long seq = __atomic_fetch_add(&trash_seq, 1, __ATOMIC_RELAXED);
+
+    // The last component is sliced out of the path in place, trailing slashes excluded
+    size_t end = strlen(original_path);
+    while (end > 1 && original_path[end - 1] == '/')
+        end--;
+    size_t start = end;
+    while (start > 0 && original_path[start - 1] != '/')
+        start--;
+
+    // Format: filename.YYYYMMDD_HHMMSS.pid.seq
+    int len = snprintf(buf, size, "%s/%.*s.%s.%d.%lu", trash_dir, (int) (end - start), original_path + start,
+                       trash_stamp, (int) getpid(), seq);
+    if (len < 0 || (size_t) len >= size) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return 0;
 }
 
-/** Move file to the trash
+/** Move a directory entry to the trash
  *
- * @param path absolute path of the file to be moved
+ * The entry never replaces anything in the trash: a name taken meanwhile makes it retry with the next one. The oldest
+ * entries are evicted first when the entry would not fit in the limits of the trash.
+ *
+ * @param dirfd directory file descriptor \p name is relative to, or `AT_FDCWD`
+ * @param name entry name relative to \p dirfd
+ * @param path full path of the entry, used to name the trashed copy and for messages
  * @param trash_dir trash directory
  * @param verbose verbose output
  * @return 0 for success -1 for error
  */
-int move_to_trash(const char *path, const char *trash_dir, bool verbose) {
-    const char *trash_path = generate_trash_name(path, trash_dir);
+int move_to_trash_at(int dirfd, const char *name, const char *path, const char *trash_dir, bool verbose) {
+    struct stat st;
+    uint64_t start = stats_begin();
+    int ret = fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW);
+    stats_end(STATS_STAT, start, ret != 0);
 
-    if (verbose) {
-        printf("moving '%s' to trash as '%s'\n", path, trash_path);
+    struct TrashUsage usage;
+    if (ret == 0) {
+        if (trash_quota_measure(dirfd, name, &st, &usage) != 0) {
+            fprintf(stderr, "better-rm: cannot move '%s' to trash: cannot measure it: %s\n", path, strerror(errno));
+            return -1;
+        }
+        ret = trash_quota_admit(trash_dir, &usage, verbose);
+        if (ret != 0) {
+            fprintf(stderr, "better-rm: cannot move '%s' to trash: larger than trash_max_bytes\n", path);
+            return -1;
+        }
     }
 
-    if (rename(path, trash_path) != 0) {
+    char trash_path[PATH_MAX];
+    const char *blobs = NULL;
+    for (int attempt = 0; ret == 0 && attempt < TRASH_NAME_ATTEMPTS; attempt++) {
+        ret = generate_trash_name(trash_path, sizeof(trash_path), path, trash_dir);
+        if (ret != 0)
+            break;
+        start = stats_begin();
+        ret = renameat2(dirfd, name, AT_FDCWD, trash_path, RENAME_NOREPLACE);
+        // Filesystems without RENAME_NOREPLACE, the names of this process are unique anyway
+        if (ret != 0 && errno == EINVAL)
+            ret = renameat(dirfd, name, AT_FDCWD, trash_path);
+        stats_end(STATS_RENAME, start, ret != 0);
+
         // If rename fails (different filesystem), try copy and delete
+        if (ret != 0 && errno == EXDEV) {
+            start = stats_begin();
+            dedup_refs_begin();
+            ret = copy_to_trash_at(dirfd, name, trash_path, trash_dedup);
+            blobs = dedup_refs_end();
+            stats_end(STATS_COPY, start, ret != 0);
+        }
+        if (ret >= 0 || errno != EEXIST || attempt + 1 == TRASH_NAME_ATTEMPTS)
+            break;
+        ret = 0;
+    }
+    if (ret < 0) {
         fprintf(stderr, "better-rm: cannot move to trash: %s\n", strerror(errno));
         return -1;
     }
 
-    return 0;
+    // A directory moved in part is indexed too, what was moved can be restored, the walk reported the rest
+    if (verbose && ret == 0) {
+        printf("moving '%s' to trash as '%s'\n", path, trash_path);
+    }
+    trash_index_append(trash_dir, path, trash_path, &st, &usage, blobs);
+    return ret == 0 ? 0 : -1;
+}
+
+/** Move file to the trash
+ *
+ * @param path absolute path of the file to be moved
+ * @param trash_dir trash directory
+ * @param verbose verbose output
+ * @return 0 for success -1 for error
+ */
+int move_to_trash(const char *path, const char *trash_dir, bool verbose) {
+    return move_to_trash_at(AT_FDCWD, path, path, trash_dir, verbose);
 }
 
 /** Resolve path to its absolute form
  *
  * @param path path to be analyzed
- * @return absolute path
+ * @return absolute path allocated in \ref run_arena, NULL on error
  */
 char *resolve_path(const char *path) {
-    char *resolved = realpath(path, NULL);
-    if (resolved == NULL) {
-        // If realpath fails, try to construct absolute path manually
-        if (path[0] != '/') {
-            char cwd[PATH_MAX];
-            if (getcwd(cwd, sizeof(cwd)) != NULL) {
-                resolved = malloc(PATH_MAX);
-                if (resolved) {
-                    snprintf(resolved, PATH_MAX + 1, "%s/%s", cwd, path);
-                }
-            }
-        } else {
-            resolved = strdup(path);
-        }
-    }
-    return resolved;
+    char resolved[PATH_MAX];
+    if (realpath(path, resolved) != NULL)
+        return arena_strdup(&run_arena, resolved);
+    if (path[0] == '/')
+        return arena_strdup(&run_arena, path);
+
+    // If realpath fails, try to construct absolute path manually
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) == NULL)
+        return NULL;
+    size_t size = strlen(cwd) + 1 + strlen(path) + 1;
+    char *joined = arena_alloc(&run_arena, size);
+    if (joined)
+        snprintf(joined, size, "%s/%s", cwd, path);
+    return joined;
 }
 
 /** Function to check if path is protected
@@ -242,6 +375,7 @@ char *resolve_path(const char *path) {
  * @return true if protected else false
  */
 bool is_protected(const char *path) {
+    struct ArenaMark mark = arena_mark(&run_arena);
     char *resolved = resolve_path(path);
     if (resolved == NULL)
         return false;
@@ -254,15 +388,16 @@ bool is_protected(const char *path) {
     }
 
     // Check against protected directories
-    for (int i = 0; i < protected_count; i++) {
-        if (strcmp(resolved, protected_dirs[i]) == 0) {
-            free(resolved);
-            return true;
-        }
-    }
+    bool protected_name = false;
+    for (int i = 0; i < protected_count && !protected_name; i++)
+        protected_name = strcmp(resolved, protected_dirs[i]) == 0;
 
-    free(resolved);
-    return false;
+    // Catches protected directories reached under another name, through a bind mount for instance
+    struct stat st;
+    bool is_protected_id = protected_name || (stat(resolved, &st) == 0 && S_ISDIR(st.st_mode) &&
+                                              protected_set_contains(st.st_dev, st.st_ino));
+    arena_release(&run_arena, mark);
+    return is_protected_id;
 }
 
 /** Check if path is root when preserve-root is enabled
@@ -275,132 +410,859 @@ bool is_root_with_preserve(const char *path, const struct Options *opts) {
     if (!opts->preserve_root || opts->no_preserve_root)
         return false;
 
+    struct ArenaMark mark = arena_mark(&run_arena);
     char *resolved = resolve_path(path);
-    if (resolved == NULL)
-        return false;
-
-    bool is_root = (strcmp(resolved, "/") == 0);
-    free(resolved);
+    bool is_root = resolved && strcmp(resolved, "/") == 0;
+    arena_release(&run_arena, mark);
     return is_root;
 }
 
-/** Log deletion to syslog
+/** Report an entry a removal engine could not remove
+ *
+ * Like a failed operand, nothing is printed with `--force`.
  *
- * @param path deleted path
- * @param action TRASH or DELETE
- * @param success
+ * @param path full path of the entry
+ * @param err errno of the failure
+ * @param opts provided options
  */
-void log_deletion(const char *path, const char *action, bool success) {
-    openlog("better-rm", LOG_PID, LOG_USER);
+void report_remove_failure(const char *path, int err, const struct Options *opts) {
+    if (!opts->force)
+        fprintf(stderr, "better-rm: cannot remove '%s': %s\n", path, strerror(err));
+}
 
-    if (success) {
-        syslog(LOG_INFO, "%s: %s (user: %s, uid: %d)", action, path, getenv("USER"), getuid());
-    } else {
-        syslog(LOG_WARNING, "%s FAILED: %s (user: %s, uid: %d, error: %s)", action, path, getenv("USER"), getuid(),
-               strerror(errno));
+/** Remove a non-directory entry found while walking a directory
+ *
+ * @param dirfd file descriptor of the directory containing the entry
+ * @param name entry name relative to \p dirfd
+ * @param path full path of the entry for messages and logging
+ * @param opts provided options
+ * @return 0 for success -1 for error
+ */
+int remove_file_at(int dirfd, const char *name, const char *path, const struct Options *opts) {
+    int ret = 0;
+    int err = 0;
+
+    if (output_human(opts)) {
+        printf("%s%s '%s'\n", opts->dry_run ? "[DRY-RUN] would be " : "", opts->use_trash ? "trashing" : "removing",
+               path);
     }
+    off_t size = -1;
+    struct stat st;
+    bool have_st = false;
+    if ((!opts->dry_run && (audit_wants_sizes() || stats_enabled())) || output_wants_sizes(opts) ||
+        throttle_wants_sizes(opts)) {
+        uint64_t start = stats_begin();
+        int stat_ret = fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW);
+        stats_end(STATS_STAT, start, stat_ret != 0);
+        have_st = stat_ret == 0;
+        if (have_st)
+            size = st.st_size;
+    }
+    if (!opts->dry_run) {
+        if (opts->use_trash) {
+            throttle_wait(opts, 1, 0);
+            ret = move_to_trash_at(dirfd, name, path, opts->trash_dir, false);
+        } else {
+            ret = throttled_unlink_at(dirfd, name, have_st ? &st : NULL, opts);
+        }
+        err = ret == 0 ? 0 : errno;
+        log_deletion_stat(path, opts->use_trash ? "TRASH" : "DELETE", ret == 0, size, have_st ? &st : NULL);
+    }
+    output_record(opts, path, opts->use_trash ? "TRASH" : "DELETE", size, err);
 
-    closelog();
+    // A failed move to the trash was reported by move_to_trash_at()
+    if (ret != 0) {
+        if (!opts->use_trash)
+            report_remove_failure(path, err, opts);
+        errno = err;
+    }
+    return ret;
 }
 
-/** Recursive directory removal
+/** Tell whether readdir's `d_type` is not enough to decide how to remove an entry
  *
- * @param path directory
+ * Only entries of unknown type need a stat, plus directories when `--one-file-system` needs their device.
+ *
+ * @param d_type type reported by readdir
+ * @param opts provided options
+ * @return true if the entry has to be stat'ed
+ */
+bool entry_needs_stat(unsigned char d_type, const struct Options *opts) {
+    return d_type == DT_UNKNOWN || (opts->one_file_system && d_type == DT_DIR);
+}
+
+/** Classify a directory entry, trusting readdir's `d_type` whenever possible
+ *
+ * @param dirfd file descriptor of the directory containing the entry
+ * @param entry entry returned by readdir
+ * @param dir_dev device of the containing directory, 0 if unknown
+ * @param opts provided options
+ * @return kind of the entry
+ */
+enum EntryKind classify_entry_at(int dirfd, const struct dirent *entry, dev_t dir_dev, const struct Options *opts) {
+    // Directories are only stat'ed when their inode number could be the one of a protected directory
+    if (!entry_needs_stat(entry->d_type, opts) && (entry->d_type != DT_DIR || !protected_set_probe(entry->d_ino)))
+        return keep_classify(opts, entry->d_name, entry->d_type == DT_DIR ? ENTRY_DIR : ENTRY_FILE);
+
+    struct stat st;
+    uint64_t start = stats_begin();
+    int ret = fstatat(dirfd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW);
+    stats_end(STATS_STAT, start, ret != 0);
+    if (ret != 0)
+        return ENTRY_GONE;
+    if (!S_ISDIR(st.st_mode))
+        return keep_classify(opts, entry->d_name, ENTRY_FILE);
+    if (protected_set_contains(st.st_dev, st.st_ino))
+        return ENTRY_PROTECTED;
+    if (opts->one_file_system && dir_dev != 0 && st.st_dev != dir_dev)
+        return ENTRY_OTHER_FS;
+    return keep_classify(opts, entry->d_name, ENTRY_DIR);
+}
+
+/** Append a path component to the buffer
+ *
+ * @param pb path buffer
+ * @param name component to be appended after a `/`
+ * @return 0 for success -1 if the buffer cannot grow
+ */
+int path_push(struct PathBuf *pb, const char *name) {
+    size_t name_len = strlen(name);
+    size_t needed = pb->len + 1 + name_len + 1;
+
+    if (needed > pb->cap) {
+        size_t cap = pb->cap ? pb->cap : 256;
+        while (cap < needed)
+            cap *= 2;
+        char *buf = realloc(pb->buf, cap);
+        if (!buf)
+            return -1;
+        pb->buf = buf;
+        pb->cap = cap;
+    }
+
+    pb->buf[pb->len++] = '/';
+    memcpy(pb->buf + pb->len, name, name_len + 1);
+    pb->len += name_len;
+    return 0;
+}
+
+/** Truncate the buffer back to a previous length
+ *
+ * @param pb path buffer
+ * @param len length returned in \ref PathBuf::len before the matching path_push()
+ */
+void path_pop(struct PathBuf *pb, size_t len) {
+    pb->len = len;
+    pb->buf[len] = '\0';
+}
+
+/** Remove a directory whose entries were all removed
+ *
+ * @param parent_fd file descriptor of the parent directory, or `AT_FDCWD`
+ * @param name directory name relative to \p parent_fd
+ * @param path full path of the directory for messages and logging
  * @param opts provided options
  * @return 0 for success -1 for error
  */
-int remove_directory(const char *path, const struct Options *opts) {
-    DIR *dir = opendir(path);
-    if (!dir) {
+int remove_emptied_dir_at(int parent_fd, const char *name, const char *path, const struct Options *opts) {
+    int ret = 0;
+    int err = 0;
+
+    if (output_human(opts)) {
+        printf("%s%s directory '%s'\n", opts->dry_run ? "[DRY-RUN] would be " : "",
+               opts->use_trash ? "trashing" : "removing", path);
+    }
+    if (!opts->dry_run) {
+        throttle_wait(opts, 1, 0);
+        if (opts->use_trash) {
+            ret = move_to_trash_at(parent_fd, name, path, opts->trash_dir, false);
+        } else {
+            uint64_t start = stats_begin();
+            ret = unlinkat(parent_fd, name, AT_REMOVEDIR);
+            stats_end(STATS_RMDIR, start, ret != 0);
+        }
+        err = ret == 0 ? 0 : errno;
+        log_deletion(path, opts->use_trash ? "TRASH_DIR" : "DELETE_DIR", ret == 0, -1);
+    }
+    output_record(opts, path, opts->use_trash ? "TRASH_DIR" : "DELETE_DIR", -1, err);
+
+    if (ret != 0) {
+        if (!opts->use_trash)
+            report_remove_failure(path, err, opts);
+        errno = err;
+    }
+    return ret;
+}
+
+/*! Directory on the explicit stack of remove_directory_at() */
+struct WalkFrame {
+    int fd; /*!< directory, -1 while closed to stay within \ref WALK_MAX_OPEN_DIRS */
+    dev_t dev; /*!< device, 0 until the directory was stat'ed */
+    ino_t ino; /*!< inode, checked when the directory is reopened */
+    int dst_fd; /*!< copy of the directory when moving the tree, -1 otherwise or while closed */
+    dev_t dst_dev; /*!< device of the copy, recorded when it is closed */
+    ino_t dst_ino; /*!< inode of the copy, checked when it is reopened */
+    size_t name_start; /*!< offset of the directory name in the path buffer */
+    char *subdirs; /*!< NUL terminated names of the subdirectories found by the scan */
+    size_t subdirs_len; /*!< bytes used in \ref subdirs */
+    size_t subdirs_cap; /*!< allocated size of \ref subdirs */
+    size_t next_subdir; /*!< offset of the next subdirectory to descend into */
+    char *moved; /*!< NUL terminated names of the entries copied by the scan, removed once their copies are durable */
+    size_t moved_len; /*!< bytes used in \ref moved */
+    size_t moved_cap; /*!< allocated size of \ref moved */
+    int ret; /*!< 0 while every entry removed so far succeeded */
+    bool scanned; /*!< the entries of the directory were read */
+    bool kept; /*!< an entry below the directory is kept, so the directory stays as well */
+};
+
+/*! Destination of a tree moved entry by entry to another filesystem by remove_directory_at() */
+struct WalkMove {
+    int dst_fd; /*!< directory the entries of the tree are moved into */
+    int blobs_fd; /*!< blob store regular files are deduplicated against, -1 for none */
+};
+
+/** Record the identity of a directory of the walk
+ *
+ * @param frame directory
+ * @return 0 for success -1 for error
+ */
+static int walk_identify(struct WalkFrame *frame) {
+    struct stat st;
+    if (fstat(frame->fd, &st) != 0)
+        return -1;
+    frame->dev = st.st_dev;
+    frame->ino = st.st_ino;
+    if (frame->dst_fd < 0)
+        return 0;
+    if (fstat(frame->dst_fd, &st) != 0)
+        return -1;
+    frame->dst_dev = st.st_dev;
+    frame->dst_ino = st.st_ino;
+    return 0;
+}
+
+/** Reopen a directory closed under fd pressure through the `..` entry of its open child
+ *
+ * The reopened directory has to be the one that was closed. It was scanned before it was closed, so only its fd is
+ * needed again, to remove the subdirectories.
+ *
+ * @param child_fd open subdirectory of the closed directory
+ * @param dev device of the closed directory
+ * @param ino inode of the closed directory
+ * @return file descriptor of the directory, -1 for error
+ */
+static int walk_reopen(int child_fd, dev_t dev, ino_t ino) {
+    int fd = openat(child_fd, "..", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_dev != dev || st.st_ino != ino) {
+        close(fd);
+        errno = ESTALE;
         return -1;
     }
+    return fd;
+}
 
-    const struct dirent *entry;
-    char full_path[PATH_MAX];
+/** Enter a directory of a recursive walk, closing the open ancestor \ref WALK_MAX_OPEN_DIRS levels up
+ *
+ * The recursive engines keep one \ref WalkDir per level on the C stack. An ancestor is closed only while the walk is
+ * below it, and walk_dir_leave() of its child reopens it, so at most \ref WALK_MAX_OPEN_DIRS directories stay open
+ * however deep the tree is. The directory the walk starts from belongs to the caller and is never closed.
+ *
+ * @param dir level to be filled
+ * @param parent level of the containing directory, the one the walk starts from has no parent
+ * @param fd open directory
+ */
+void walk_dir_enter(struct WalkDir *dir, struct WalkDir *parent, int fd) {
+    *dir = (struct WalkDir) {.parent = parent, .fd = fd, .dev = 0, .ino = 0};
+    struct WalkDir *oldest = dir;
+    for (int i = 0; oldest && i < WALK_MAX_OPEN_DIRS; i++)
+        oldest = oldest->parent;
+
+    struct stat st;
+    if (!oldest || !oldest->parent || oldest->fd < 0 || fstat(oldest->fd, &st) != 0)
+        return;
+    oldest->dev = st.st_dev;
+    oldest->ino = st.st_ino;
+    close(oldest->fd);
+    oldest->fd = -1;
+}
+
+/** Leave a directory of a recursive walk, reopening its parent through `..` when it was closed
+ *
+ * @param dir level entered with walk_dir_enter(), its fd is closed
+ * @return 0 for success -1 if the parent cannot be reopened, it stays closed and errno is set
+ */
+int walk_dir_leave(struct WalkDir *dir) {
+    struct WalkDir *parent = dir->parent;
     int ret = 0;
+    if (parent && parent->parent && parent->fd < 0) {
+        parent->fd = dir->fd >= 0 ? walk_reopen(dir->fd, parent->dev, parent->ino) : -1;
+        if (parent->fd < 0) {
+            if (dir->fd < 0)
+                errno = ESTALE;
+            ret = -1;
+        }
+    }
+    if (dir->fd >= 0) {
+        int saved_errno = errno;
+        close(dir->fd);
+        errno = saved_errno;
+    }
+    dir->fd = -1;
+    return ret;
+}
+
+/** Append a name to a list of NUL terminated names
+ *
+ * @param names list, grown as needed
+ * @param len bytes used in \p names
+ * @param cap allocated size of \p names
+ * @param name name to append
+ * @return 0 for success -1 when out of memory
+ */
+static int walk_add_name(char **names, size_t *len, size_t *cap, const char *name) {
+    size_t name_len = strlen(name) + 1;
+    if (*len + name_len > *cap) {
+        size_t grown_cap = *cap ? *cap * 2 : 256;
+        while (grown_cap < *len + name_len)
+            grown_cap *= 2;
+        char *grown = realloc(*names, grown_cap);
+        if (!grown)
+            return -1;
+        *names = grown;
+        *cap = grown_cap;
+    }
+    memcpy(*names + *len, name, name_len);
+    *len += name_len;
+    return 0;
+}
 
+/** Remember a subdirectory found by the scan of a directory
+ *
+ * @param frame directory
+ * @param name subdirectory name
+ * @return 0 for success -1 when out of memory
+ */
+static int walk_add_subdir(struct WalkFrame *frame, const char *name) {
+    return walk_add_name(&frame->subdirs, &frame->subdirs_len, &frame->subdirs_cap, name);
+}
+
+/** Remember a subdirectory found by uring_scan_dir()
+ *
+ * @param ctx directory, a \ref WalkFrame
+ * @param name subdirectory name
+ * @return 0 for success -1 when out of memory
+ */
+static int walk_collect_subdir(void *ctx, const char *name) {
+    return walk_add_subdir(ctx, name);
+}
+
+/** Remove the sources of the entries a scan copied, once their copies are durable
+ *
+ * One fsync of the copy of the directory makes every new entry in it durable, the copied files were each fsync'ed.
+ * When it fails the sources all stay.
+ *
+ * @param frame directory, its scan done
+ * @param path full path of the directory, extended in place for messages
+ */
+static void walk_remove_moved(struct WalkFrame *frame, struct PathBuf *path) {
+    if (frame->moved_len > 0 && fsync(frame->dst_fd) != 0) {
+        fprintf(stderr, "better-rm: cannot move '%s': %s\n", path->buf, strerror(errno));
+        frame->ret = -1;
+        frame->moved_len = 0;
+    }
+    for (size_t off = 0; off < frame->moved_len; off += strlen(frame->moved + off) + 1) {
+        uint64_t start = stats_begin();
+        int ret = unlinkat(frame->fd, frame->moved + off, 0);
+        stats_end(STATS_UNLINK, start, ret != 0);
+        if (ret != 0) {
+            size_t parent_len = path->len;
+            int err = errno;
+            if (path_push(path, frame->moved + off) == 0) {
+                fprintf(stderr, "better-rm: cannot move '%s': %s\n", path->buf, strerror(err));
+                path_pop(path, parent_len);
+            }
+            frame->ret = -1;
+        }
+    }
+    free(frame->moved);
+    frame->moved = NULL;
+    frame->moved_len = frame->moved_cap = 0;
+}
+
+/** Scan a directory of the walk, removing its non-directory entries and collecting its subdirectories
+ *
+ * The entries come in inode order from \p batch, so the unlinks of a large directory walk its inode table in order.
+ * When the tree is moved, the non-directory entries are copied into the copy of the directory before they are removed.
+ * Through the ring the entries are removed by batches instead, see uring_scan_dir().
+ *
+ * @param frame directory
+ * @param batch reader shared by the whole walk
+ * @param path full path of the directory, extended in place for every entry
+ * @param opts provided options
+ * @param move destination of a moved tree, NULL when removing
+ * @param ring remove the entries through io_uring
+ */
+static void walk_scan(struct WalkFrame *frame, struct DirBatch *batch, struct PathBuf *path,
+                      const struct Options *opts, const struct WalkMove *move, bool ring) {
     // Check if we should stay on the same filesystem
-    dev_t dir_dev = 0;
-    if (opts->one_file_system) {
-        struct stat st;
-        if (stat(path, &st) == 0) {
-            dir_dev = st.st_dev;
+    if (opts->one_file_system && frame->dev == 0)
+        walk_identify(frame);
+
+    if (ring) {
+        if (uring_scan_dir(frame->fd, frame->dev, batch, path, opts, &frame->kept, walk_collect_subdir, frame) != 0)
+            frame->ret = -1;
+        frame->scanned = true;
+        return;
+    }
+
+    dir_batch_reset(batch);
+    while (frame->ret == 0 || opts->force) {
+        const struct dirent *entry = dir_batch_next(batch, frame->fd);
+        if (!entry) {
+            if (errno != 0) {
+                report_remove_failure(path->buf, errno, opts);
+                frame->ret = -1;
+            }
+            break;
+        }
+
+        size_t parent_len = path->len;
+        if (path_push(path, entry->d_name) != 0) {
+            fprintf(stderr, "better-rm: cannot remove '%s/%s': %s\n", path->buf, entry->d_name, strerror(ENOMEM));
+            frame->ret = -1;
+            break;
+        }
+
+        switch (classify_entry_at(frame->fd, entry, frame->dev, opts)) {
+            case ENTRY_DIR:
+                // The copy of a subdirectory is created now, the sync of this copy covers it
+                if (move && mkdirat(frame->dst_fd, entry->d_name, 0700) != 0) {
+                    fprintf(stderr, "better-rm: cannot move '%s': %s\n", path->buf, strerror(errno));
+                    frame->ret = -1;
+                } else if (walk_add_subdir(frame, entry->d_name) != 0) {
+                    fprintf(stderr, "better-rm: cannot remove '%s': %s\n", path->buf, strerror(ENOMEM));
+                    frame->ret = -1;
+                }
+                break;
+            case ENTRY_FILE:
+                if (move) {
+                    uint64_t start = stats_begin();
+                    int copied = copy_into_at(frame->fd, entry->d_name, frame->dst_fd, move->blobs_fd);
+                    stats_end(STATS_COPY, start, copied != 0);
+                    if (copied != 0) {
+                        fprintf(stderr, "better-rm: cannot move '%s': %s\n", path->buf, strerror(errno));
+                        frame->ret = -1;
+                    } else if (walk_add_name(&frame->moved, &frame->moved_len, &frame->moved_cap, entry->d_name) !=
+                               0) {
+                        // The source stays, next to a copy that is not durable yet
+                        fprintf(stderr, "better-rm: cannot move '%s': %s\n", path->buf, strerror(ENOMEM));
+                        frame->ret = -1;
+                    }
+                } else if (remove_file_at(frame->fd, entry->d_name, path->buf, opts) != 0) {
+                    frame->ret = -1;
+                }
+                break;
+            case ENTRY_OTHER_FS:
+                // A mount inside a moved tree is neither copied nor emptied, a rename would have left it alone
+                if (move) {
+                    fprintf(stderr, "better-rm: cannot move '%s': %s\n", path->buf, strerror(EXDEV));
+                    frame->ret = -1;
+                    break;
+                }
+                // Check filesystem boundary
+                if (opts->verbose && opts->output == OUTPUT_TEXT) {
+                    printf("skipping '%s': different filesystem\n", path->buf);
+                }
+                output_record(opts, path->buf, "SKIP", -1, 0);
+                break;
+            case ENTRY_PROTECTED:
+                fprintf(stderr, "%sbetter-rm: cannot remove '%s': Protected system directory\n",
+                        opts->dry_run ? "[DRY-RUN] " : "", path->buf);
+                output_record(opts, path->buf, "PROTECTED", -1, EPERM);
+                frame->ret = -1;
+                break;
+            case ENTRY_KEPT:
+                keep_report(path->buf, opts);
+                frame->kept = true;
+                break;
+            case ENTRY_GONE:
+                break;
         }
+        path_pop(path, parent_len);
     }
+    frame->scanned = true;
+    if (move)
+        walk_remove_moved(frame, path);
+}
 
-    while ((entry = readdir(dir)) != NULL) {
-        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+/** Remove a directory of the walk whose entries were all handled
+ *
+ * A moved directory first gets the attributes of its source on its copy, now that nothing is written to the copy
+ * anymore, and is then removed without being reported, the caller reports the tree as a whole.
+ *
+ * @param frame directory, its fds still open
+ * @param parent_fd file descriptor of the parent directory, or `AT_FDCWD`
+ * @param name directory name relative to \p parent_fd
+ * @param path full path of the directory for messages and logging
+ * @param opts provided options
+ * @param move destination of a moved tree, NULL when removing
+ * @return 0 for success -1 for error
+ */
+static int walk_leave(const struct WalkFrame *frame, int parent_fd, const char *name, const char *path,
+                      const struct Options *opts, const struct WalkMove *move) {
+    if (!move)
+        return frame->ret != 0 ? -1 : frame->kept ? 0 : remove_emptied_dir_at(parent_fd, name, path, opts);
+
+    int ret = copy_dir_attrs(frame->fd, frame->dst_fd);
+    if (ret == 0 && frame->ret == 0) {
+        uint64_t start = stats_begin();
+        ret = unlinkat(parent_fd, name, AT_REMOVEDIR);
+        stats_end(STATS_RMDIR, start, ret != 0);
+    }
+    if (ret != 0)
+        fprintf(stderr, "better-rm: cannot move '%s': %s\n", path, strerror(errno));
+    return frame->ret != 0 ? -1 : ret;
+}
+
+/** Directory removal relative to a parent directory
+ *
+ * Every entry is stat'ed, unlinked or trashed through the directory fd of its parent, so the kernel never
+ * re-resolves the full path and the depth of the tree is not limited by `PATH_MAX`. A directory is scanned in full
+ * first, its non-directory entries removed in inode order and its subdirectories remembered, then the subdirectories
+ * are descended into one by one, so a single read buffer serves the whole walk. The walk keeps its directories on a
+ * heap allocated stack instead of recursing, and at most \ref WALK_MAX_OPEN_DIRS of them open: the shallowest open
+ * directory is closed when a deeper one is entered and reopened on the way back up, so neither the C stack nor the
+ * number of fds grows with the depth of the tree.
+ *
+ * Moving a tree to another filesystem takes the same walk. Every directory is created in the destination by the scan
+ * of its parent and its copy is closed and reopened along with it, half as many directories stay open. The other
+ * entries of a directory are copied by its scan and removed once one fsync of the copy of the directory made them
+ * durable.
+ *
+ * @param parent_fd file descriptor of the parent directory, or `AT_FDCWD`
+ * @param name directory name relative to \p parent_fd
+ * @param path full path of the directory, extended in place while descending
+ * @param opts provided options
+ * @param move destination the entries of the directory are moved into, NULL to remove them
+ * @param kept set when the directory is left in place because an entry below it is kept, may be NULL
+ * @param ring scan the directories through io_uring, see uring_scan_dir()
+ * @return 0 for success -1 for error
+ */
+static int remove_directory_at(int parent_fd, const char *name, struct PathBuf *path, const struct Options *opts,
+                               const struct WalkMove *move, bool *kept, bool ring) {
+    uint64_t start = stats_begin();
+    int fd = openat(parent_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    stats_end(STATS_OPENDIR, start, fd < 0);
+    if (fd < 0) {
+        report_remove_failure(path->buf, errno, opts);
+        return -1;
+    }
+
+    size_t cap = 16;
+    struct WalkFrame *frames = malloc(cap * sizeof(*frames));
+    if (!frames) {
+        close(fd);
+        return -1;
+    }
+    frames[0] = (struct WalkFrame) {.fd = fd, .dst_fd = move ? move->dst_fd : -1, .name_start = 0};
+    struct DirBatch batch = {.buf = NULL};
+
+    // Frames below first_open are closed, the ones from first_open to depth are open
+    size_t depth = 1, first_open = 0;
+    int ret = -1;
+
+    while (depth > 0) {
+        struct WalkFrame *frame = &frames[depth - 1];
+        if (!frame->scanned) {
+            walk_scan(frame, &batch, path, opts, move, ring);
             continue;
         }
 
-        snprintf(full_path, sizeof(full_path), "%s/%s", path, entry->d_name);
-
-        struct stat st;
-        if (lstat(full_path, &st) == 0) {
-            // Check filesystem boundary
-            if (opts->one_file_system && dir_dev != 0 && st.st_dev != dir_dev) {
-                if (opts->verbose) {
-                    printf("skipping '%s': different filesystem\n", full_path);
+        if (frame->next_subdir < frame->subdirs_len && (frame->ret == 0 || opts->force)) {
+            const char *subdir = frame->subdirs + frame->next_subdir;
+            frame->next_subdir += strlen(subdir) + 1;
+            size_t parent_len = path->len;
+            if (path_push(path, subdir) != 0) {
+                fprintf(stderr, "better-rm: cannot remove '%s/%s': %s\n", path->buf, subdir, strerror(ENOMEM));
+                frame->ret = -1;
+                continue;
+            }
+            if (depth == cap) {
+                struct WalkFrame *grown = realloc(frames, cap * 2 * sizeof(*frames));
+                if (!grown) {
+                    fprintf(stderr, "better-rm: cannot remove '%s': %s\n", path->buf, strerror(ENOMEM));
+                    frame->ret = -1;
+                    path_pop(path, parent_len);
+                    continue;
                 }
+                frames = grown;
+                frame = &frames[depth - 1];
+                cap *= 2;
+            }
+            start = stats_begin();
+            int child_fd = openat(frame->fd, subdir, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            stats_end(STATS_OPENDIR, start, child_fd < 0);
+            if (child_fd < 0)
+                report_remove_failure(path->buf, errno, opts);
+            int child_dst_fd = -1;
+            if (child_fd >= 0 && move) {
+                child_dst_fd = openat(frame->dst_fd, subdir, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+                if (child_dst_fd < 0) {
+                    fprintf(stderr, "better-rm: cannot move '%s': %s\n", path->buf, strerror(errno));
+                    close(child_fd);
+                    child_fd = -1;
+                }
+            }
+            if (child_fd < 0) {
+                frame->ret = -1;
+                path_pop(path, parent_len);
                 continue;
             }
 
-            if (S_ISDIR(st.st_mode)) {
-                ret = remove_directory(full_path, opts);
-            } else {
-                if (opts->verbose || opts->dry_run) {
-                    printf("%s%s '%s'\n", opts->dry_run ? "[DRY-RUN] would be " : "",
-                           opts->use_trash ? "trashing" : "removing", full_path);
-                }
-                if (!opts->dry_run) {
-                    if (opts->use_trash) {
-                        ret = move_to_trash(full_path, opts->trash_dir, false);
-                    } else {
-                        ret = unlink(full_path);
-                    }
-                    log_deletion(full_path, opts->use_trash ? "TRASH" : "DELETE", ret == 0);
+            // Make room by closing the shallowest open directory, the root's destination belongs to the caller
+            if (depth - first_open == (move ? WALK_MAX_OPEN_DIRS / 2 : WALK_MAX_OPEN_DIRS)) {
+                struct WalkFrame *oldest = &frames[first_open];
+                if (oldest->dev == 0 || opts->one_file_system || oldest->dst_fd >= 0)
+                    walk_identify(oldest);
+                close(oldest->fd);
+                oldest->fd = -1;
+                if (oldest->dst_fd >= 0 && first_open > 0) {
+                    close(oldest->dst_fd);
+                    oldest->dst_fd = -1;
                 }
+                first_open++;
             }
+            frames[depth++] =
+                    (struct WalkFrame) {.fd = child_fd, .dst_fd = child_dst_fd, .name_start = parent_len + 1};
+            continue;
+        }
 
-            if (ret != 0 && !opts->force) {
+        // The directory is exhausted, remove it through its parent and resume the parent
+        free(frame->subdirs);
+        if (depth == 1) {
+            if (frame->ret == 0 && frame->kept) {
+                keep_report(path->buf, opts);
+                if (kept)
+                    *kept = true;
+            }
+            ret = walk_leave(frame, parent_fd, name, path->buf, opts, move);
+            close(frame->fd);
+            break;
+        }
+
+        struct WalkFrame *parent = &frames[depth - 2];
+        if (parent->fd < 0) {
+            parent->fd = walk_reopen(frame->fd, parent->dev, parent->ino);
+            if (parent->fd >= 0 && move && depth > 2) {
+                parent->dst_fd = walk_reopen(frame->dst_fd, parent->dst_dev, parent->dst_ino);
+                if (parent->dst_fd < 0) {
+                    close(parent->fd);
+                    parent->fd = -1;
+                }
+            }
+            if (parent->fd < 0) {
+                fprintf(stderr, "better-rm: cannot remove '%.*s': %s\n", (int) (frame->name_start - 1), path->buf,
+                        strerror(errno));
+                for (size_t i = first_open; i < depth; i++) {
+                    close(frames[i].fd);
+                    if (move && i > 0)
+                        close(frames[i].dst_fd);
+                }
+                for (size_t i = 0; i + 1 < depth; i++)
+                    free(frames[i].subdirs);
                 break;
             }
+            first_open--;
+        }
+
+        // A directory holding a kept entry is not empty, nor are the ones above it
+        if (frame->ret == 0 && frame->kept) {
+            keep_report(path->buf, opts);
+            parent->kept = true;
+        } else if (walk_leave(frame, parent->fd, path->buf + frame->name_start, path->buf, opts, move) != 0) {
+            parent->ret = -1;
         }
+        close(frame->fd);
+        if (move)
+            close(frame->dst_fd);
+        path_pop(path, frame->name_start - 1);
+        depth--;
     }
 
-    closedir(dir);
+    dir_batch_free(&batch);
+    free(frames);
+    return ret;
+}
 
-    if (ret == 0) {
-        if (opts->verbose || opts->dry_run) {
-            printf("%s%s directory '%s'\n", opts->dry_run ? "[DRY-RUN] would be " : "",
-                   opts->use_trash ? "trashing" : "removing", path);
-        }
-        if (!opts->dry_run) {
-            if (opts->use_trash) {
-                ret = move_to_trash(path, opts->trash_dir, false);
-            } else {
-                ret = rmdir(path);
-            }
-            log_deletion(path, opts->use_trash ? "TRASH_DIR" : "DELETE_DIR", ret == 0);
+/** Move the entries of a directory into a directory on another filesystem and remove it
+ *
+ * The entries are moved one by one, directories are created in the destination and removed from the source once
+ * their entries were moved, so the walk has the bounded fds of remove_directory_at(). Protected directories and
+ * mounts found below the directory are left in place with their parents, and make the move fail.
+ *
+ * @param parent_fd file descriptor of the parent directory, or `AT_FDCWD`
+ * @param name directory name relative to \p parent_fd
+ * @param dst_fd empty directory to move the entries into, given the attributes of \p name at the end
+ * @param blobs_fd blob store regular files are deduplicated against, -1 for none
+ * @return 0 for success -1 for error
+ */
+int move_directory_at(int parent_fd, const char *name, int dst_fd, int blobs_fd) {
+    // Copies never cross into another filesystem and the patterns of the run do not apply to the trash
+    static const struct Options move_opts = {.one_file_system = true};
+    struct WalkMove move = {.dst_fd = dst_fd, .blobs_fd = blobs_fd};
+    struct PathBuf pb = {.buf = NULL, .len = 0, .cap = 0};
+    size_t len = strlen(name);
+    pb.cap = len + 256;
+    pb.buf = malloc(pb.cap);
+    if (!pb.buf)
+        return -1;
+    memcpy(pb.buf, name, len + 1);
+    pb.len = len;
+
+    int ret = remove_directory_at(parent_fd, name, &pb, &move_opts, &move, NULL, false);
+    int saved_errno = errno;
+    free(pb.buf);
+    errno = saved_errno;
+    return ret;
+}
+
+/** Recursive directory removal
+ *
+ * @param path directory
+ * @param opts provided options
+ * @return 0 for success -1 for error
+ */
+int remove_directory(const char *path, const struct Options *opts) {
+    return remove_directory_in(AT_FDCWD, path, path, opts);
+}
+
+/** Recursive removal of a directory relative to an open parent
+ *
+ * Hands the tree to the work-stealing engine when more than one job is requested, otherwise to the io_uring
+ * backend when requested and supported by the kernel, falling back to the fd-relative synchronous walk.
+ *
+ * @param parent_fd directory holding \p name, or AT_FDCWD
+ * @param name directory name relative to \p parent_fd
+ * @param path full path for messages and logging, ending with \p name
+ * @param opts provided options
+ * @return 0 for success -1 for error
+ */
+int remove_directory_in(int parent_fd, const char *name, const char *path, const struct Options *opts) {
+    if (opts->jobs > 1) {
+        return remove_directory_parallel(parent_fd, name, path, opts);
+    }
+
+    struct PathBuf pb = {.buf = NULL, .len = 0, .cap = 0};
+    size_t path_len = strlen(path);
+
+    pb.cap = path_len + 256;
+    pb.buf = malloc(pb.cap);
+    if (!pb.buf) {
+        return -1;
+    }
+    memcpy(pb.buf, path, path_len + 1);
+    pb.len = path_len;
+
+    int ret;
+    // A ring submits a whole batch at once, paced removals go entry by entry
+    if (opts->io_uring && uring_supported() && !throttle_enabled(opts)) {
+        ret = remove_directory_at(parent_fd, name, &pb, opts, NULL, NULL, true);
+    } else {
+        if (opts->io_uring && opts->verbose && opts->output == OUTPUT_TEXT) {
+            printf("%s, using synchronous removal\n",
+                   throttle_enabled(opts) ? "io_uring batches cannot be paced" : "io_uring is not available");
         }
+        ret = remove_directory_at(parent_fd, name, &pb, opts, NULL, NULL, false);
     }
 
+    free(pb.buf);
     return ret;
 }
 
-/** Safe Remove
+/** Recursive removal of a directory through the synchronous walk alone
  *
- * Moves a fs object to trash if the path is not protected while preserving root directory
+ * Lets the other engines hand over a subtree, the walk keeps its bounded number of fds.
+ *
+ * @param parent_fd directory holding \p name, or AT_FDCWD
+ * @param name directory name relative to \p parent_fd
+ * @param path full path for messages and logging
+ * @param opts provided options
+ * @param kept set when the directory is left in place because an entry below it is kept
+ * @return 0 for success -1 for error
+ */
+int remove_directory_walk(int parent_fd, const char *name, const char *path, const struct Options *opts, bool *kept) {
+    size_t len = strlen(path);
+    struct PathBuf pb = {.buf = malloc(len + 256), .len = len, .cap = len + 256};
+    if (!pb.buf) {
+        fprintf(stderr, "better-rm: cannot remove '%s': %s\n", path, strerror(ENOMEM));
+        return -1;
+    }
+    memcpy(pb.buf, path, len + 1);
+    int ret = remove_directory_at(parent_fd, name, &pb, opts, NULL, kept, false);
+    free(pb.buf);
+    return ret;
+}
+
+/** Move a whole directory tree to the trash at once
+ *
+ * On the same filesystem this is a single rename, which is O(1) regardless of the size of the tree, otherwise the
+ * tree is moved entry by entry by move_directory_at(). Either way its structure is kept in the trash. Callers make
+ * sure no protected directory lies below the tree, protected_set_below(), the per-entry walk leaves those and their
+ * parents in place.
+ *
+ * @param path directory
+ * @param opts provided options
+ * @return 0 for success -1 for error
+ */
+int trash_directory_tree(const char *path, const struct Options *opts) {
+    int ret = move_to_trash_at(AT_FDCWD, path, path, opts->trash_dir, opts->verbose && opts->output == OUTPUT_TEXT);
+    int err = ret == 0 ? 0 : errno;
+    log_deletion(path, "TRASH_DIR", ret == 0, -1);
+    output_record(opts, path, "TRASH_DIR", -1, err);
+    return ret;
+}
+
+/** Pick the options an operand is removed with
+ *
+ * Keeps trashing a same-device rename when the operand's filesystem has its own trash.
+ *
+ * @param path operand
+ * @param st lstat() of the operand
+ * @param opts provided options
+ * @param mount_opts storage for options using the trash of the operand's mount
+ * @return \p opts or \p mount_opts
+ */
+const struct Options *operand_options(const char *path, const struct stat *st, const struct Options *opts,
+                                      struct Options *mount_opts) {
+    if (opts->use_trash && opts->per_mount_trash && !opts->dry_run) {
+        struct stat trash_st;
+        if (stat(opts->trash_dir, &trash_st) == 0 && trash_st.st_dev != st->st_dev) {
+            const char *trash_dir = mount_trash_dir(path, st);
+            if (trash_dir) {
+                *mount_opts = *opts;
+                mount_opts->trash_dir = trash_dir;
+                return mount_opts;
+            }
+        }
+    }
+    return opts;
+}
+
+/** Remove one operand after the safety checks
  *
  * @param path path to be removed
  * @param opts provided options
- * @return
+ * @return 0 for success 1 for error
  */
-int safe_remove(const char *path, const struct Options *opts) {
+static int remove_operand(const char *path, const struct Options *opts) {
     // Check if path is protected
     if (is_protected(path)) {
         fprintf(stderr, "%sbetter-rm: cannot remove '%s': Protected system directory\n",
                 opts->dry_run ? "[DRY-RUN] " : "", path);
+        output_record(opts, path, "PROTECTED", -1, EPERM);
         return 1;
     }
 
@@ -408,19 +1270,33 @@ int safe_remove(const char *path, const struct Options *opts) {
     if (is_root_with_preserve(path, opts)) {
         fprintf(stderr, "%sbetter-rm: cannot remove '%s': --preserve-root is active\n",
                 opts->dry_run ? "[DRY-RUN] " : "", path);
+        output_record(opts, path, "PROTECTED", -1, EPERM);
         return 1;
     }
 
     // Get file information
     struct stat st;
-    if (lstat(path, &st) != 0) {
+    uint64_t start = stats_begin();
+    int stat_ret = lstat(path, &st);
+    stats_end(STATS_STAT, start, stat_ret != 0);
+    if (stat_ret != 0) {
         if (!opts->force) {
+            int err = errno;
+            stats_removal(false, -1, err);
             fprintf(stderr, "%sbetter-rm: cannot remove '%s': %s\n", opts->dry_run ? "[DRY-RUN] " : "", path,
-                    strerror(errno));
+                    strerror(err));
+            output_record(opts, path, opts->use_trash ? "TRASH" : "DELETE", -1, err);
             return 1;
         }
         return 0;
     }
+    if (keep_match_operand(opts->keep, path, S_ISDIR(st.st_mode))) {
+        keep_report(path, opts);
+        return 0;
+    }
+
+    struct Options mount_opts;
+    opts = operand_options(path, &st, opts, &mount_opts);
 
     // Interactive mode
     if (opts->interactive && !opts->dry_run) {
@@ -436,45 +1312,129 @@ int safe_remove(const char *path, const struct Options *opts) {
         if (!opts->recursive) {
             fprintf(stderr, "%sbetter-rm: cannot remove '%s': Is a directory\n", opts->dry_run ? "[DRY-RUN] " : "",
                     path);
+            output_record(opts, path, opts->use_trash ? "TRASH_DIR" : "DELETE_DIR", -1, EISDIR);
             return 1;
         }
 
-        if (opts->verbose || opts->dry_run) {
+        if (output_human(opts)) {
             printf("%s%s directory '%s' recursively\n", opts->dry_run ? "[DRY-RUN] would be " : "",
                    opts->use_trash ? "trashing" : "removing", path);
         }
 
+        // Only --one-file-system, --keep and a protected directory below the operand have to leave entries in place
+        bool whole_tree = !opts->dry_run && !opts->one_file_system && !opts->keep && !protected_set_below(path);
+        if (opts->use_trash && whole_tree) {
+            return trash_directory_tree(path, opts) == 0 ? 0 : 1;
+        }
+        if (opts->background && whole_tree && background_stage(path, &st, opts) == 0) {
+            return 0;
+        }
+
         return remove_directory(path, opts) == 0 ? 0 : 1;
     } else {
         // Remove regular file or symlink
-        if (opts->verbose || opts->dry_run) {
+        if (output_human(opts)) {
             printf("%s%s '%s'\n", opts->dry_run ? "[DRY-RUN] would be " : "", opts->use_trash ? "trashing" : "removing",
                    path);
         }
 
-        if (!opts->dry_run) {
+        if (opts->dry_run) {
+            output_record(opts, path, opts->use_trash ? "TRASH" : "DELETE", st.st_size, 0);
+        } else {
             int ret;
             if (opts->use_trash) {
+                throttle_wait(opts, 1, 0);
                 ret = move_to_trash(path, opts->trash_dir, false);
             } else {
-                ret = unlink(path);
+                ret = throttled_unlink_at(AT_FDCWD, path, &st, opts);
             }
+            int err = ret == 0 ? 0 : errno;
+            output_record(opts, path, opts->use_trash ? "TRASH" : "DELETE", st.st_size, err);
 
             if (ret != 0) {
                 if (!opts->force) {
                     fprintf(stderr, "better-rm: cannot %s '%s': %s\n", opts->use_trash ? "trash" : "remove", path,
-                            strerror(errno));
+                            strerror(err));
                     return 1;
                 }
             }
 
-            log_deletion(path, opts->use_trash ? "TRASH" : "DELETE", ret == 0);
+            log_deletion_stat(path, opts->use_trash ? "TRASH" : "DELETE", ret == 0, st.st_size, &st);
         }
     }
 
     return 0;
 }
 
+/** Safe Remove
+ *
+ * Moves a fs object to trash if the path is not protected while preserving root directory
+ *
+ * @param path path to be removed
+ * @param opts provided options
+ * @return 0 for success 1 for error
+ */
+int safe_remove(const char *path, const struct Options *opts) {
+    audit_begin(path, opts->use_trash ? "TRASH" : "DELETE");
+    int ret = remove_operand(path, opts);
+    audit_end();
+    return ret;
+}
+
+/** List the entries of a trash directory from its index
+ *
+ * @param trash_dir trash directory
+ * @return 0 for success 1 for error
+ */
+int list_trash(const char *trash_dir) {
+    struct TrashIndex index;
+    if (trash_index_open(trash_dir, &index) != 0) {
+        if (errno == ENOENT)
+            return 0;
+        fprintf(stderr, "better-rm: cannot read trash index in '%s': %s\n", trash_dir, strerror(errno));
+        return 1;
+    }
+
+    for (size_t i = 0; i < index.count; i++) {
+        const struct TrashRecord *record = &index.records[i];
+        const char *path = trash_index_string(&index, record->path_offset);
+        const char *name = trash_index_string(&index, record->name_offset);
+        if ((record->flags & TRASH_RECORD_REMOVED) || !path || !name || trash_index_find(&index, name) != record)
+            continue;
+
+        time_t deleted_at = (time_t) record->deleted_at;
+        struct tm tm_info;
+        char when[32] = "";
+        if (localtime_r(&deleted_at, &tm_info))
+            strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm_info);
+        printf("%s %12lld %s%s -> %s/%s\n", when, (long long) record->size, path, S_ISDIR(record->mode) ? "/" : "",
+               trash_dir, name);
+    }
+
+    trash_index_close(&index);
+    return 0;
+}
+
+/** Print the running totals of a trash directory
+ *
+ * @param trash_dir trash directory
+ * @return 0 for success 1 for error
+ */
+int print_trash_usage(const char *trash_dir) {
+    struct stat st;
+    if (stat(trash_dir, &st) != 0 && errno == ENOENT) {
+        printf("0\t0\t%s\n", trash_dir);
+        return 0;
+    }
+    struct TrashUsage usage;
+    if (trash_index_usage(trash_dir, &usage) != 0) {
+        fprintf(stderr, "better-rm: cannot read trash index in '%s': %s\n", trash_dir, strerror(errno));
+        return 1;
+    }
+    printf("%llu\t%llu\t%s\n", (unsigned long long) usage.bytes, (unsigned long long) usage.inodes, trash_dir);
+    return 0;
+}
+
 /** Print version information
  *
  */
@@ -506,9 +1466,36 @@ void print_usage(const char *program_name) {
     printf("      --preserve-root         do not remove '/' (default)\n");
     printf("      --no-preserve-root      allow removing '/'\n");
     printf("      --one-file-system       stay on the same filesystem\n");
+    printf("      --keep=PATTERN          leave entries named PATTERN, and the directories above them, in place\n");
+    printf("      --exclude=PATTERN       same as --keep\n");
+    printf("  -j, --jobs=N                remove directory trees with N worker threads\n");
+    printf("      --io-uring              batch metadata operations through io_uring when available\n");
+    printf("      --list-trash            list the trashed entries and where they came from\n");
+    printf("      --trash-usage           print the bytes and inodes in the trash, from its index\n");
+    printf("      --purge-trash [DIR...]  remove trash entries older than %s days (default: %d)\n",
+           TRASH_DAYS_ENV, DEFAULT_TRASH_DAYS);
+    printf("      --plan                  scan the operands once, print the plan and execute it\n");
+    printf("      --plan-file=FILE        save the plan of the operands to FILE, or apply FILE without operands\n");
+    printf("      --output=FORMAT         report every entry on stdout as text, ndjson or null (NUL separated)\n");
+    printf("      --stats[=FORMAT]        print syscall counts and latencies on stderr at exit, as text or json\n");
+    printf("      --files0-from=FILE      remove the NUL terminated operands listed in FILE, - for stdin\n");
+    printf("      --background            stage directory operands and return, a detached worker removes them\n");
+    printf("      --reclaim               remove the directories staged by --background runs\n");
+    printf("      --restore [PATH...]     restore trashed entries below PATH, or matching PATH as a pattern\n");
+    printf("      --audit-query [PATH...] print who removed PATH and when from the audit journal, or every record\n");
+    printf("      --newer-than=AGE        only entries removed less than AGE ago (s, m, h, d, w), with --restore or\n");
+    printf("                              --audit-query\n");
+    printf("      --older-than=AGE        only entries removed more than AGE ago, with --restore or --audit-query\n");
+    printf("      --rate=N                remove at most N entries per second\n");
+    printf("      --bw=SIZE               free at most SIZE bytes per second, K, M, G or T units, MiB without\n");
+    printf("      --shrink-above=SIZE     truncate regular files larger than SIZE step by step before unlinking\n");
     printf("  -h, --help                  display this help and exit\n\n");
     printf("Environment variables:\n");
-    printf("  BETTER_RM_TRASH             Override default trash directory\n\n");
+    printf("  BETTER_RM_TRASH             Override default trash directory\n");
+    printf("  BETTER_RM_TRASH_DAYS        Days to keep entries in the trash with --purge-trash\n");
+    printf("  BETTER_RM_JOURNAL           Directory of the audit journal (default: ~/.local/state/better-rm)\n");
+    printf("  %s            Socket of a %s daemon to run the removals, if it is running\n\n",
+           DAEMON_SOCKET_ENV, DAEMON_NAME);
     printf("Configuration files:\n");
     printf("  %s                    System-wide configuration\n", CONFIG_FILE);
     printf("  ~/%s                  User configuration\n\n", USER_CONFIG_FILE);
@@ -519,8 +1506,14 @@ void print_usage(const char *program_name) {
     printf("\n");
 }
 
-#ifndef UNIT_TESTING
-int main(int argc, char *argv[]) {
+/** Parse a command line and run it
+ *
+ * @param argc number of arguments
+ * @param argv arguments
+ * @param configured the protected set and the configuration are already loaded, by the daemon
+ * @return exit status
+ */
+int better_rm_main(int argc, char *argv[], bool configured) {
     struct Options opts = {.recursive = false,
                            .force = false,
                            .verbose = false,
@@ -530,24 +1523,61 @@ int main(int argc, char *argv[]) {
                            .one_file_system = false,
                            .use_trash = false,
                            .no_preserve_root = false,
-                           .trash_dir = NULL};
-
-    // Initialize protected directories
-    init_protected_dirs();
-    load_configs();
+                           .trash_dir = NULL,
+                           .jobs = 1,
+                           .io_uring = false,
+                           .per_mount_trash = false,
+                           .output = OUTPUT_TEXT,
+                           .background = false,
+                           .rate = 0,
+                           .bandwidth = 0,
+                           .shrink_above = 0,
+                           .keep = NULL};
+
+    // Initialize protected directories, from the snapshot of the previous run when the configuration is unchanged
+    bool from_snapshot = !configured && config_snapshot_load() == 0;
+    if (!configured && !from_snapshot) {
+        init_protected_dirs();
+        load_configs();
+        config_snapshot_save();
+    }
 
     // Parse command line options
     int opt;
+    bool list = false;
+    bool usage = false;
+    bool purge = false;
+    bool reclaim = false;
+    bool restore = false;
+    bool query = false;
+    int64_t deleted_after = INT64_MIN;
+    int64_t deleted_before = INT64_MAX;
+    bool plan = false;
+    const char *plan_file = NULL;
+    const char *files0_from = NULL;
+    char *keep_args[MAX_KEEP_PATTERNS];
+    int keep_argc = 0;
     static struct option long_options[] = {
             {"recursive", no_argument, 0, 'r'},     {"force", no_argument, 0, 'f'},
             {"verbose", no_argument, 0, 'v'},       {"dry-run", no_argument, 0, 'n'},
             {"trash", no_argument, 0, 't'},         {"trash-dir", required_argument, 0, 0},
             {"preserve-root", no_argument, 0, 0},   {"no-preserve-root", no_argument, 0, 0},
             {"one-file-system", no_argument, 0, 0}, {"help", no_argument, 0, 'h'},
-            {"version", no_argument, 0, 'V'},       {0, 0, 0, 0}};
+            {"version", no_argument, 0, 'V'},       {"jobs", required_argument, 0, 'j'},
+            {"io-uring", no_argument, 0, 0},        {"list-trash", no_argument, 0, 0},
+            {"purge-trash", no_argument, 0, 0},     {"output", required_argument, 0, 0},
+            {"plan", no_argument, 0, 0},            {"plan-file", required_argument, 0, 0},
+            {"stats", optional_argument, 0, 0},     {"files0-from", required_argument, 0, 0},
+            {"background", no_argument, 0, 0},      {"reclaim", no_argument, 0, 0},
+            {"trash-usage", no_argument, 0, 0},     {"rate", required_argument, 0, 0},
+            {"bw", required_argument, 0, 0},        {"shrink-above", required_argument, 0, 0},
+            {"restore", no_argument, 0, 0},         {"newer-than", required_argument, 0, 0},
+            {"older-than", required_argument, 0, 0}, {"audit-query", no_argument, 0, 0},
+            {"keep", required_argument, 0, 0},      {"exclude", required_argument, 0, 0},
+            {0, 0, 0, 0}};
 
     int option_index = 0;
-    while ((opt = getopt_long(argc, argv, "rRfivnthV", long_options, &option_index)) != -1) {
+    while ((opt = getopt_long(argc, argv, "rRfivnthVj:", long_options, &option_index)) != -1) {
         switch (opt) {
             case 0:
                 // Long options
@@ -562,6 +1592,76 @@ int main(int argc, char *argv[]) {
                     opts.preserve_root = false;
                 } else if (strcmp(long_options[option_index].name, "one-file-system") == 0) {
                     opts.one_file_system = true;
+                } else if (strcmp(long_options[option_index].name, "io-uring") == 0) {
+                    opts.io_uring = true;
+                } else if (strcmp(long_options[option_index].name, "list-trash") == 0) {
+                    list = true;
+                } else if (strcmp(long_options[option_index].name, "trash-usage") == 0) {
+                    usage = true;
+                } else if (strcmp(long_options[option_index].name, "purge-trash") == 0) {
+                    purge = true;
+                } else if (strcmp(long_options[option_index].name, "plan") == 0) {
+                    plan = true;
+                } else if (strcmp(long_options[option_index].name, "plan-file") == 0) {
+                    plan_file = optarg;
+                } else if (strcmp(long_options[option_index].name, "files0-from") == 0) {
+                    files0_from = optarg;
+                } else if (strcmp(long_options[option_index].name, "background") == 0) {
+                    opts.background = true;
+                } else if (strcmp(long_options[option_index].name, "reclaim") == 0) {
+                    reclaim = true;
+                } else if (strcmp(long_options[option_index].name, "output") == 0) {
+                    if (output_parse(optarg, &opts.output) != 0) {
+                        fprintf(stderr, "better-rm: invalid output format: '%s'\n", optarg);
+                        return 1;
+                    }
+                } else if (strcmp(long_options[option_index].name, "restore") == 0) {
+                    restore = true;
+                } else if (strcmp(long_options[option_index].name, "audit-query") == 0) {
+                    query = true;
+                } else if (strcmp(long_options[option_index].name, "newer-than") == 0 ||
+                           strcmp(long_options[option_index].name, "older-than") == 0) {
+                    time_t age;
+                    if (quota_parse_age(optarg, &age) != 0) {
+                        fprintf(stderr, "better-rm: invalid age: '%s'\n", optarg);
+                        return 1;
+                    }
+                    if (long_options[option_index].name[0] == 'n') {
+                        deleted_after = (int64_t) (time(NULL) - age);
+                    } else {
+                        deleted_before = (int64_t) (time(NULL) - age);
+                    }
+                } else if (strcmp(long_options[option_index].name, "rate") == 0) {
+                    if (throttle_parse_rate(optarg, &opts.rate) != 0) {
+                        fprintf(stderr, "better-rm: invalid rate: '%s'\n", optarg);
+                        return 1;
+                    }
+                } else if (strcmp(long_options[option_index].name, "bw") == 0) {
+                    if (throttle_parse_bandwidth(optarg, &opts.bandwidth) != 0) {
+                        fprintf(stderr, "better-rm: invalid bandwidth: '%s'\n", optarg);
+                        return 1;
+                    }
+                } else if (strcmp(long_options[option_index].name, "shrink-above") == 0) {
+                    if (quota_parse_bytes(optarg, &opts.shrink_above) != 0 || opts.shrink_above == 0) {
+                        fprintf(stderr, "better-rm: invalid size: '%s'\n", optarg);
+                        return 1;
+                    }
+                } else if (strcmp(long_options[option_index].name, "keep") == 0 ||
+                           strcmp(long_options[option_index].name, "exclude") == 0) {
+                    if (!keep_pattern_valid(optarg)) {
+                        fprintf(stderr, "better-rm: invalid keep pattern: '%s'\n", optarg);
+                        return 1;
+                    }
+                    if (keep_argc == MAX_KEEP_PATTERNS) {
+                        fprintf(stderr, "better-rm: too many keep patterns\n");
+                        return 1;
+                    }
+                    keep_args[keep_argc++] = optarg;
+                } else if (strcmp(long_options[option_index].name, "stats") == 0) {
+                    if (stats_enable(optarg) != 0) {
+                        fprintf(stderr, "better-rm: invalid stats format: '%s'\n", optarg);
+                        return 1;
+                    }
                 }
                 break;
             case 'r':
@@ -586,6 +1686,16 @@ int main(int argc, char *argv[]) {
             case 't':
                 opts.use_trash = true;
                 break;
+            case 'j': {
+                char *end;
+                long jobs = strtol(optarg, &end, 10);
+                if (*optarg == '\0' || *end != '\0' || jobs < 1 || jobs > MAX_JOBS) {
+                    fprintf(stderr, "better-rm: invalid number of jobs: '%s'\n", optarg);
+                    return 1;
+                }
+                opts.jobs = (int) jobs;
+                break;
+            }
             case 'h':
                 print_usage(argv[0]);
                 return 0;
@@ -598,15 +1708,99 @@ int main(int argc, char *argv[]) {
         }
     }
 
-    // Check if any files were specified
-    if (optind >= argc) {
+    if (list) {
+        return list_trash(opts.trash_dir ? opts.trash_dir : get_trash_dir());
+    }
+    if (usage) {
+        return print_trash_usage(opts.trash_dir ? opts.trash_dir : get_trash_dir());
+    }
+    if (query) {
+        return journal_query(argv + optind, (size_t) (argc - optind), deleted_after, deleted_before);
+    }
+
+    if (purge) {
+        long days = DEFAULT_TRASH_DAYS;
+        const char *days_env = getenv(TRASH_DAYS_ENV);
+        if (days_env) {
+            char *end;
+            days = strtol(days_env, &end, 10);
+            if (*days_env == '\0' || *end != '\0' || days < 0) {
+                fprintf(stderr, "better-rm: invalid %s: '%s'\n", TRASH_DAYS_ENV, days_env);
+                return 1;
+            }
+        }
+        time_t cutoff = time(NULL) - (time_t) days * 24 * 60 * 60;
+
+        // Trash directories given as operands, otherwise every trash directory of the caller
+        int ret;
+        if (optind < argc) {
+            ret = purge_trash(argv + optind, (size_t) (argc - optind), cutoff, &opts);
+        } else {
+            char **dirs;
+            size_t count = purge_default_dirs(&dirs);
+            ret = purge_trash(dirs, count, cutoff, &opts);
+            for (size_t i = 0; i < count; i++) {
+                free(dirs[i]);
+            }
+            free(dirs);
+        }
+        output_flush();
+        audit_close();
+        stats_report();
+        arena_destroy(&run_arena);
+        return ret;
+    }
+
+    if (restore) {
+        // Restoring the whole trash is never what an accidental removal calls for
+        if (optind >= argc && deleted_after == INT64_MIN && deleted_before == INT64_MAX) {
+            fprintf(stderr, "better-rm: --restore needs a path, a pattern, --newer-than or --older-than\n");
+            return 1;
+        }
+        int ret = restore_trash(opts.trash_dir, argv + optind, (size_t) (argc - optind), deleted_after, deleted_before,
+                                &opts);
+        output_flush();
+        audit_close();
+        stats_report();
+        arena_destroy(&run_arena);
+        return ret;
+    }
+
+    if (reclaim) {
+        int ret = background_reclaim(getuid() == 0, opts.jobs);
+        audit_close();
+        stats_report();
+        arena_destroy(&run_arena);
+        return ret;
+    }
+
+    // Trashing is already a rename, a plan executes what it scanned
+    if (opts.background && (opts.use_trash || plan || plan_file)) {
+        fprintf(stderr, "better-rm: --background cannot be combined with --trash or a plan\n");
+        return 1;
+    }
+
+    // Operands come either from the command line or from the list
+    if (files0_from && (optind < argc || plan || plan_file)) {
+        fprintf(stderr, "better-rm: --files0-from cannot be combined with operands or a plan\n");
+        return 1;
+    }
+    if (files0_from && opts.interactive && strcmp(files0_from, "-") == 0) {
+        fprintf(stderr, "better-rm: --interactive needs stdin, read the operands from a file\n");
+        return 1;
+    }
+
+    // Check if any files were specified, a saved plan or a list brings its own
+    if (optind >= argc && !plan_file && !files0_from) {
         fprintf(stderr, "better-rm: missing operand\n");
         fprintf(stderr, "Try '%s --help' for more information.\n", argv[0]);
         return 1;
     }
 
     // Setup trash directory if needed
+    // An explicitly chosen trash directory is used for every operand
     if (opts.use_trash && !opts.trash_dir) {
+        opts.per_mount_trash = getenv(TRASH_DIR_ENV) == NULL;
         opts.trash_dir = get_trash_dir();
     }
 
@@ -617,31 +1811,78 @@ int main(int argc, char *argv[]) {
     }
 
     // Show dry-run header if enabled
-    if (opts.dry_run) {
+    if (opts.dry_run && opts.output == OUTPUT_TEXT) {
         printf("=== DRY-RUN MODE: No files will be actually deleted ===\n");
         if (opts.use_trash) {
             printf("=== TRASH MODE: Files would be moved to %s ===\n", opts.trash_dir);
         }
     }
 
+    // The patterns of the configuration and of the command line are compiled once for every operand
+    struct KeepSet keep;
+    char *patterns[2 * MAX_KEEP_PATTERNS];
+    memcpy(patterns, keep_patterns, (size_t) keep_count * sizeof(*patterns));
+    memcpy(patterns + keep_count, keep_args, (size_t) keep_argc * sizeof(*patterns));
+    if (keep_count + keep_argc > 0) {
+        if (keep_compile(&keep, patterns, (size_t) (keep_count + keep_argc)) != 0) {
+            fprintf(stderr, "better-rm: cannot compile keep patterns: %s\n", strerror(ENOMEM));
+            return 1;
+        }
+        opts.keep = &keep;
+    }
+
     // Process each file
     int exit_status = 0;
-    for (int i = optind; i < argc; i++) {
-        if (safe_remove(argv[i], &opts) != 0) {
-            exit_status = 1;
-        }
+    if (files0_from) {
+        exit_status = files0_run(files0_from, &opts);
+    } else if (plan || plan_file) {
+        exit_status = plan_run(argv + optind, (size_t) (argc - optind), plan_file, &opts);
+    } else {
+        exit_status = operands_run(argv + optind, (size_t) (argc - optind), &opts);
     }
 
     // Show dry-run footer if enabled
-    if (opts.dry_run) {
+    if (opts.dry_run && opts.output == OUTPUT_TEXT) {
         printf("=== DRY-RUN COMPLETE: No files were actually deleted ===\n");
     }
+    output_flush();
 
-    // Cleanup
-    for (int i = 0; i < protected_count; i++) {
+    // Also resumes the trees left staged by interrupted workers, and removes the entries evicted from the trash
+    if ((opts.background && !opts.dry_run) || background_pending()) {
+        background_start(opts.jobs);
+    }
+
+    // Cleanup, snapshot entries point into its mapping
+    for (int i = 0; i < protected_count && !from_snapshot; i++) {
         free(protected_dirs[i]);
     }
+    for (int i = 0; i < keep_count && !from_snapshot; i++) {
+        free(keep_patterns[i]);
+    }
+    keep_count = 0;
+    if (opts.keep)
+        keep_free(&keep);
+    audit_close();
+    stats_report();
+    arena_destroy(&run_arena);
 
     return exit_status;
 }
+
+#ifndef UNIT_TESTING
+int main(int argc, char *argv[]) {
+    // Started through the better-rmd link, serve removals
+    const char *name = strrchr(argv[0], '/');
+    if (strcmp(name ? name + 1 : argv[0], DAEMON_NAME) == 0)
+        return daemon_main(argc, argv);
+
+    // Hand the command line to the daemon when there is one, run it here if it cannot be reached
+    const char *socket_path = getenv(DAEMON_SOCKET_ENV);
+    if (socket_path && *socket_path) {
+        int ret = daemon_client(socket_path, argc, argv);
+        if (ret >= 0)
+            return ret;
+    }
+    return better_rm_main(argc, argv, false);
+}
 #endif // UNIT_TESTING
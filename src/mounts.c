@@ -0,0 +1,509 @@
+/*! \file mounts.c
+ * Per-mount trash directories following the XDG Trash layout
+ *
+ * An operand that is not on the filesystem of the home trash is sent to `$topdir/.Trash-$uid`, where `$topdir` is the
+ * mount point of its filesystem, so that trashing it is a rename rather than a copy. The staging directories of
+ * `--background`, `$topdir/.better-rm-staging-$uid`, follow the same layout. `/proc/self/mountinfo` is parsed once per
+ * process and the directories resolved for each device are cached.
+ */
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+#include "../include/better_rm.h"
+
+#define MOUNTINFO_PATH "/proc/self/mountinfo"
+#define MOUNT_TRASH_PREFIX ".Trash-"
+#define LISTMOUNT_ROOT 0xffffffffffffffffull /*!< `LSMT_ROOT`, every mount of the namespace */
+#define LISTMOUNT_BATCH 256
+
+// listmount(2) is Linux 6.8, older headers lack its number, which the architectures below share
+#if !defined(SYS_listmount) && (defined(__x86_64__) || defined(__aarch64__) || defined(__riscv))
+#define SYS_listmount 458
+#endif
+
+/*! Request of listmount(2), the first version of `struct mnt_id_req` */
+struct ListmountRequest {
+    uint32_t size; /*!< size of the request */
+    uint32_t spare; /*!< 0 */
+    uint64_t mnt_id; /*!< mount whose mounts are listed, \ref LISTMOUNT_ROOT for all */
+    uint64_t param; /*!< last mount id of the previous batch, 0 for the first one */
+};
+
+/*! One line of mountinfo */
+struct MountEntry {
+    dev_t dev; /*!< device of the mounted filesystem */
+    bool whole; /*!< the root of the filesystem is mounted, not a bind mount of a subdirectory */
+    char *root; /*!< unescaped directory of the filesystem mounted at \ref mount_point */
+    char *mount_point; /*!< unescaped mount point */
+};
+
+/*! Per-mount directory resolved for a device */
+struct MountDir {
+    dev_t dev; /*!< device */
+    char *dir; /*!< `$topdir/$prefix$uid`, NULL when the device has no usable one */
+};
+
+static struct MountEntry *mounts;
+static size_t mount_count;
+static bool mounts_loaded;
+static struct MountDir *trash_cache;
+static size_t trash_cache_count;
+static struct MountDir *staging_cache;
+static size_t staging_cache_count;
+
+
+/** Decode the octal escapes mountinfo uses for spaces, tabs, newlines and backslashes in place
+ *
+ * @param s field to be decoded
+ */
+static void unescape_mount_field(char *s) {
+    char *out = s;
+    for (const char *in = s; *in; in++) {
+        if (in[0] == '\\' && in[1] >= '0' && in[1] <= '3' && in[2] >= '0' && in[2] <= '7' && in[3] >= '0' &&
+            in[3] <= '7') {
+            *out++ = (char) (((in[1] - '0') << 6) | ((in[2] - '0') << 3) | (in[3] - '0'));
+            in += 3;
+        } else {
+            *out++ = *in;
+        }
+    }
+    *out = '\0';
+}
+
+/** Parse mountinfo once
+ *
+ */
+static void load_mounts(void) {
+    mounts_loaded = true;
+
+    FILE *fp = fopen(MOUNTINFO_PATH, "re");
+    if (!fp)
+        return;
+
+    char *line = NULL;
+    size_t line_cap = 0;
+    size_t cap = 0;
+    while (getline(&line, &line_cap, fp) > 0) {
+        unsigned major, minor;
+        char root[PATH_MAX], mount_point[PATH_MAX];
+        // ID parentID major:minor root mount_point ...
+        if (sscanf(line, "%*d %*d %u:%u %4095s %4095s", &major, &minor, root, mount_point) != 4)
+            continue;
+
+        if (mount_count == cap) {
+            size_t new_cap = cap ? cap * 2 : 32;
+            struct MountEntry *grown = realloc(mounts, new_cap * sizeof(*grown));
+            if (!grown)
+                break;
+            mounts = grown;
+            cap = new_cap;
+        }
+
+        unescape_mount_field(root);
+        unescape_mount_field(mount_point);
+        char *copy = strdup(mount_point);
+        char *root_copy = strdup(root);
+        if (!copy || !root_copy) {
+            free(copy);
+            free(root_copy);
+            break;
+        }
+        mounts[mount_count].dev = makedev(major, minor);
+        mounts[mount_count].whole = strcmp(root, "/") == 0;
+        mounts[mount_count].root = root_copy;
+        mounts[mount_count].mount_point = copy;
+        mount_count++;
+    }
+
+    free(line);
+    fclose(fp);
+}
+
+/** Tell whether a mount point contains a path
+ *
+ * @param mount_point mount point
+ * @param path canonical absolute path
+ * @return length of the mount point if it is a prefix of \p path on a component boundary, otherwise 0
+ */
+static size_t mount_prefix_len(const char *mount_point, const char *path) {
+    size_t len = strlen(mount_point);
+    if (strcmp(mount_point, "/") == 0)
+        return 1;
+    if (strncmp(mount_point, path, len) != 0 || (path[len] != '/' && path[len] != '\0'))
+        return 0;
+    return len;
+}
+
+/** Find the mount point of the filesystem holding a path
+ *
+ * Bind mounts make several mount points share a device, the deepest one containing the path is the one renames
+ * within the path's mount work on.
+ *
+ * @param path canonical absolute path
+ * @param dev device of the path
+ * @return mount or NULL if unknown
+ */
+static const struct MountEntry *find_mount(const char *path, dev_t dev) {
+    if (!mounts_loaded)
+        load_mounts();
+
+    const struct MountEntry *best = NULL;
+    size_t best_len = 0;
+    const struct MountEntry *fallback = NULL;
+    for (size_t i = 0; i < mount_count; i++) {
+        if (mounts[i].dev != dev)
+            continue;
+        size_t len = mount_prefix_len(mounts[i].mount_point, path);
+        if (len > best_len) {
+            best = &mounts[i];
+            best_len = len;
+        }
+        if (!fallback && mounts[i].whole)
+            fallback = &mounts[i];
+    }
+    return best ? best : fallback;
+}
+
+/** Create or validate `$topdir/.Trash-$uid` or another private per-mount directory
+ *
+ * Like the XDG Trash specification requires, an existing directory is only used when it is a real directory owned
+ * by the user, so nobody else can redirect or read the user's trashed files.
+ *
+ * @param dir directory path
+ * @param dev device the directory has to be on
+ * @return true if the directory can be used
+ */
+bool prepare_mount_dir(const char *dir, dev_t dev) {
+    struct stat st;
+    if (lstat(dir, &st) != 0) {
+        if (errno != ENOENT || mkdir(dir, 0700) != 0 || lstat(dir, &st) != 0)
+            return false;
+    }
+    return S_ISDIR(st.st_mode) && st.st_uid == getuid() && (st.st_mode & 0077) == 0 && st.st_dev == dev;
+}
+
+/** Tell whether an open trash directory belongs to the user whose trash it is
+ *
+ * A `$topdir/.Trash-$uid` directory has to pass the checks of prepare_mount_dir() for that uid. Any other trash
+ * directory must not be writable by anybody but its owner, who has to be the caller, or for root the owner of the
+ * directory holding it, root itself, or anybody in a sticky directory like `/tmp`.
+ *
+ * @param fd trash directory opened without following symlinks
+ * @param path path of the trash directory
+ * @return true if the entries of the directory can be trusted
+ */
+bool trash_dir_trusted(int fd, const char *path) {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISDIR(st.st_mode) || (st.st_mode & 0022) != 0)
+        return false;
+
+    const char *slash = strrchr(path, '/');
+    const char *base = slash ? slash + 1 : path;
+    size_t prefix_len = strlen(MOUNT_TRASH_PREFIX);
+    if (strncmp(base, MOUNT_TRASH_PREFIX, prefix_len) == 0 && base[prefix_len] >= '0' && base[prefix_len] <= '9') {
+        char *end;
+        unsigned long uid = strtoul(base + prefix_len, &end, 10);
+        return *end == '\0' && st.st_uid == (uid_t) uid && (st.st_mode & 0077) == 0 &&
+               (getuid() == 0 || st.st_uid == getuid());
+    }
+    if (getuid() != 0 || st.st_uid == 0)
+        return st.st_uid == getuid();
+
+    char parent[PATH_MAX];
+    size_t len = slash ? (size_t) (slash == path ? 1 : slash - path) : 1;
+    struct stat parent_st;
+    if (len >= sizeof(parent))
+        return false;
+    memcpy(parent, slash ? path : ".", len);
+    parent[len] = '\0';
+    return stat(parent, &parent_st) == 0 && (parent_st.st_uid == st.st_uid || (parent_st.st_mode & S_ISVTX));
+}
+
+/** Resolve the private directory of the mount holding an operand
+ *
+ * @param path operand
+ * @param st lstat result of \p path
+ * @param prefix name of the directory without the uid
+ * @param cache directories already resolved
+ * @param cache_count entries in \p cache
+ * @return `$topdir/$prefix$uid` of the operand's mount, or NULL when it cannot be used
+ */
+static const char *mount_dir(const char *path, const struct stat *st, const char *prefix, struct MountDir **cache,
+                             size_t *cache_count) {
+    for (size_t i = 0; i < *cache_count; i++) {
+        if ((*cache)[i].dev == st->st_dev)
+            return (*cache)[i].dir;
+    }
+
+    // A symlink's own location is its parent directory, anything else can be canonicalized directly
+    char *resolved;
+    if (S_ISLNK(st->st_mode)) {
+        char *copy = strdup(path);
+        char *slash = copy ? strrchr(copy, '/') : NULL;
+        if (slash)
+            *slash = '\0';
+        resolved = copy ? realpath(slash ? (slash == copy ? "/" : copy) : ".", NULL) : NULL;
+        free(copy);
+    } else {
+        resolved = realpath(path, NULL);
+    }
+
+    char *dir = NULL;
+    const struct MountEntry *mount = resolved ? find_mount(resolved, st->st_dev) : NULL;
+    const char *mount_point = mount ? mount->mount_point : NULL;
+    if (mount_point) {
+        size_t len = strlen(mount_point) + strlen(prefix) + 22;
+        dir = malloc(len);
+        if (dir) {
+            snprintf(dir, len, "%s/%s%u", strcmp(mount_point, "/") == 0 ? "" : mount_point, prefix,
+                     (unsigned) getuid());
+            if (!prepare_mount_dir(dir, st->st_dev)) {
+                free(dir);
+                dir = NULL;
+            }
+        }
+    }
+    free(resolved);
+
+    struct MountDir *grown = realloc(*cache, (*cache_count + 1) * sizeof(*grown));
+    if (grown) {
+        *cache = grown;
+        grown[*cache_count].dev = st->st_dev;
+        grown[*cache_count].dir = dir;
+        (*cache_count)++;
+    }
+    return dir;
+}
+
+/** Resolve the trash directory of the mount holding an operand
+ *
+ * @param path operand
+ * @param st lstat result of \p path
+ * @return `$topdir/.Trash-$uid` of the operand's mount, or NULL when the operand has to use the default trash
+ */
+const char *mount_trash_dir(const char *path, const struct stat *st) {
+    return mount_dir(path, st, MOUNT_TRASH_PREFIX, &trash_cache, &trash_cache_count);
+}
+
+/** Resolve the `--background` staging directory of the mount holding an operand
+ *
+ * @param path operand
+ * @param st lstat result of \p path
+ * @return `$topdir/.better-rm-staging-$uid` of the operand's mount, or NULL when the mount has none usable
+ */
+const char *mount_staging_dir(const char *path, const struct stat *st) {
+    return mount_dir(path, st, STAGING_PREFIX, &staging_cache, &staging_cache_count);
+}
+
+/** Append a copy of a path to a growable list
+ *
+ * @param dirs list
+ * @param count entries in \p dirs
+ * @param path path to be added
+ * @return 0 for success -1 for error
+ */
+static int add_dir(char ***dirs, size_t *count, const char *path) {
+    char **grown = realloc(*dirs, (*count + 1) * sizeof(*grown));
+    if (!grown)
+        return -1;
+    *dirs = grown;
+    if (!(grown[*count] = strdup(path)))
+        return -1;
+    (*count)++;
+    return 0;
+}
+
+/** Tell whether a name is a per-mount directory name, a prefix followed by a uid
+ *
+ * @param name entry name
+ * @param prefix name of the directory without the uid
+ * @return true if \p name looks like `$prefix$uid`
+ */
+static bool is_mount_dir_name(const char *name, const char *prefix) {
+    size_t len = strlen(prefix);
+    if (strncmp(name, prefix, len) != 0 || name[len] == '\0')
+        return false;
+    for (const char *p = name + len; *p; p++) {
+        if (*p < '0' || *p > '9')
+            return false;
+    }
+    return true;
+}
+
+/** Tell whether an existing per-mount directory passes the checks of prepare_mount_dir() for the uid of its name
+ *
+ * @param path `$topdir/$name`
+ * @param name directory name accepted by is_mount_dir_name()
+ * @param prefix name of the directory without the uid
+ * @param dev device of the mount
+ * @return true if the directory can be used
+ */
+static bool mount_dir_valid(const char *path, const char *name, const char *prefix, dev_t dev) {
+    struct stat st;
+    unsigned long uid = strtoul(name + strlen(prefix), NULL, 10);
+    return lstat(path, &st) == 0 && S_ISDIR(st.st_mode) && st.st_dev == dev && st.st_uid == (uid_t) uid &&
+           (st.st_mode & 0077) == 0;
+}
+
+/** Collect the per-mount directories of a kind that exist
+ *
+ * @param prefix name of the directories without the uid
+ * @param all_users collect the directory of every user instead of only the calling user's
+ * @param dirs receives a malloc'ed list of malloc'ed paths
+ * @return number of directories found
+ */
+static size_t mount_dirs(const char *prefix, bool all_users, char ***dirs) {
+    if (!mounts_loaded)
+        load_mounts();
+
+    *dirs = NULL;
+    size_t count = 0;
+    for (size_t i = 0; i < mount_count; i++) {
+        // Bind mounts of a subdirectory share the filesystem root's trash
+        bool seen = !mounts[i].whole;
+        for (size_t j = 0; j < i && !seen; j++)
+            seen = mounts[j].whole && mounts[j].dev == mounts[i].dev;
+        if (seen)
+            continue;
+
+        const char *top = strcmp(mounts[i].mount_point, "/") == 0 ? "" : mounts[i].mount_point;
+        char path[PATH_MAX];
+        if (!all_users) {
+            snprintf(path, sizeof(path), "%s/%s%u", top, prefix, (unsigned) getuid());
+            if (mount_dir_valid(path, strrchr(path, '/') + 1, prefix, mounts[i].dev))
+                add_dir(dirs, &count, path);
+            continue;
+        }
+
+        DIR *dir = opendir(mounts[i].mount_point);
+        if (!dir)
+            continue;
+        const struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL) {
+            if (!is_mount_dir_name(entry->d_name, prefix))
+                continue;
+            snprintf(path, sizeof(path), "%s/%s", top, entry->d_name);
+            if (mount_dir_valid(path, entry->d_name, prefix, mounts[i].dev))
+                add_dir(dirs, &count, path);
+        }
+        closedir(dir);
+    }
+    return count;
+}
+
+/** Collect the per-mount trash directories that exist
+ *
+ * @param all_users collect the trash directory of every user instead of only the calling user's
+ * @param dirs receives a malloc'ed list of malloc'ed paths
+ * @return number of directories found
+ */
+size_t mount_trash_dirs(bool all_users, char ***dirs) {
+    return mount_dirs(MOUNT_TRASH_PREFIX, all_users, dirs);
+}
+
+/** Collect the per-mount `--background` staging directories that exist
+ *
+ * @param all_users collect the staging directory of every user instead of only the calling user's
+ * @param dirs receives a malloc'ed list of malloc'ed paths
+ * @return number of directories found
+ */
+size_t mount_staging_dirs(bool all_users, char ***dirs) {
+    return mount_dirs(STAGING_PREFIX, all_users, dirs);
+}
+
+/** Find the other places a directory is bind mounted at
+ *
+ * @param path canonical absolute path of the directory
+ * @param dev device of the directory
+ * @param mount_points receives a malloc'ed list of malloc'ed mount points
+ * @return number of mount points
+ */
+size_t mount_binds_of(const char *path, dev_t dev, char ***mount_points) {
+    *mount_points = NULL;
+    const struct MountEntry *mount = find_mount(path, dev);
+    if (!mount)
+        return 0;
+
+    // Path of the directory inside its filesystem, which is what mountinfo lists as the root of its bind mounts
+    const char *rest = path + mount_prefix_len(mount->mount_point, path);
+    if (strcmp(mount->mount_point, "/") == 0)
+        rest = path;
+    char inner[PATH_MAX];
+    if (snprintf(inner, sizeof(inner), "%s%s", strcmp(mount->root, "/") == 0 ? "" : mount->root, rest) >=
+        (int) sizeof(inner))
+        return 0;
+    if (inner[0] == '\0')
+        strcpy(inner, "/");
+
+    size_t count = 0;
+    for (size_t i = 0; i < mount_count; i++) {
+        if (mounts[i].dev == dev && strcmp(mounts[i].root, inner) == 0 && strcmp(mounts[i].mount_point, path) != 0)
+            add_dir(mount_points, &count, mounts[i].mount_point);
+    }
+    return count;
+}
+
+/** Hash the unique ids of the mounts of the process, which are never reused
+ *
+ * @param h FNV-1a hash to be extended
+ * @return 0 for success -1 if the kernel cannot list its mounts
+ */
+static int hash_mount_ids(uint64_t *h) {
+#ifdef SYS_listmount
+    struct ListmountRequest req = {.size = sizeof(req), .spare = 0, .mnt_id = LISTMOUNT_ROOT, .param = 0};
+    uint64_t ids[LISTMOUNT_BATCH];
+    for (;;) {
+        long n = syscall(SYS_listmount, &req, ids, (size_t) LISTMOUNT_BATCH, 0);
+        if (n < 0)
+            return -1;
+        for (long i = 0; i < n; i++) {
+            for (int byte = 0; byte < 8; byte++)
+                *h = (*h ^ ((ids[i] >> (8 * byte)) & 0xff)) * 1099511628211ull;
+        }
+        if (n < LISTMOUNT_BATCH)
+            return 0;
+        req.param = ids[n - 1];
+    }
+#else
+    (void) h;
+    return -1;
+#endif
+}
+
+/** Hash the mount table of the process
+ *
+ * Identifies the mount table cheaply, without parsing it, so cached state derived from it can be revalidated. Every
+ * mount and unmount changes the list of unique mount ids, which listmount() hands out without formatting the table:
+ * 1.4 us against 22 us for reading the 20 lines of mountinfo of a small system, and the gap grows with the mounts. A
+ * mount moved with `mount --move` keeps its id, the protected roots stat'ed on every load catch one moved over them.
+ * Kernels before Linux 6.8 hash the text of `/proc/self/mountinfo` instead.
+ *
+ * @return FNV-1a hash of the mount ids or of `/proc/self/mountinfo`, 0 if neither can be read
+ */
+uint64_t mounts_hash(void) {
+    uint64_t h = 14695981039346656037ull;
+    if (hash_mount_ids(&h) == 0)
+        return h;
+
+    int fd = open(MOUNTINFO_PATH, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return 0;
+    char buf[8192];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        for (ssize_t i = 0; i < n; i++)
+            h = (h ^ (unsigned char) buf[i]) * 1099511628211ull;
+    }
+    close(fd);
+    return n < 0 ? 0 : h;
+}
@@ -0,0 +1,144 @@
+/*! \file operands.c
+ * Coalescing of the command line operands
+ *
+ * Shell globs hand over overlapping operands, `rm -r a a/b a/b/c.txt`, or the thousands of siblings of a directory.
+ * Every operand is first made canonical from the real path of its parent, resolved once per run of operands sharing
+ * the same parent, and the name the operand was given, so a symlink operand stays the link itself. The operands are
+ * then sorted with `/` ordered before every other byte, which places the operands below a directory right after it.
+ * An operand equal to, or below, one that was removed successfully went with it and is dropped instead of being
+ * looked up again for an ENOENT. The others are removed in that order through operand_group_remove(), so
+ * consecutive siblings share one open fd of their parent.
+ *
+ * With `-i` the operands are removed in the order they were given, declining a directory must not drop what is below
+ * it. With `--one-file-system` or `--keep` a directory removed successfully may still hold mounts or kept entries that
+ * later operands name, so nothing is dropped.
+ */
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/better_rm.h"
+
+/*! Command line operand being coalesced */
+struct OperandEntry {
+    const char *path; /*!< operand as given */
+    const char *canonical; /*!< real path of the parent followed by the name, \ref path if it could not be resolved */
+    size_t index; /*!< position on the command line, orders duplicates */
+    bool resolved; /*!< \ref canonical was resolved, the operand can cover or be covered by others */
+};
+
+
+/** Order operands by canonical path, a `/` before any other byte
+ *
+ * @param a first \ref OperandEntry
+ * @param b second \ref OperandEntry
+ * @return negative, 0 or positive
+ */
+static int compare_canonical(const void *a, const void *b) {
+    const struct OperandEntry *x = a;
+    const struct OperandEntry *y = b;
+    const unsigned char *p = (const unsigned char *) x->canonical;
+    const unsigned char *q = (const unsigned char *) y->canonical;
+    while (*p && *p == *q) {
+        p++;
+        q++;
+    }
+    int cp = *p == '/' ? 1 : *p ? *p + 1 : 0;
+    int cq = *q == '/' ? 1 : *q ? *q + 1 : 0;
+    if (cp != cq)
+        return cp < cq ? -1 : 1;
+    return x->index < y->index ? -1 : x->index > y->index;
+}
+
+/** Tell whether an operand lies at or below another one
+ *
+ * @param entry operand
+ * @param covering canonical path of a removed operand, NULL if none
+ * @return true if \p entry went with \p covering
+ */
+static bool operand_covered(const struct OperandEntry *entry, const char *covering) {
+    if (!covering || !entry->resolved)
+        return false;
+    size_t len = strlen(covering);
+    return strncmp(entry->canonical, covering, len) == 0 &&
+           (entry->canonical[len] == '\0' || entry->canonical[len] == '/');
+}
+
+/** Remove the command line operands
+ *
+ * @param operands operands as given
+ * @param count number of \p operands
+ * @param opts provided options
+ * @return 0 for success 1 if an operand could not be removed
+ */
+int operands_run(char *const *operands, size_t count, const struct Options *opts) {
+    int exit_status = 0;
+    struct OperandEntry *entries = count > 1 && !opts->interactive ? malloc(count * sizeof(*entries)) : NULL;
+    if (!entries) {
+        for (size_t i = 0; i < count; i++) {
+            if (safe_remove(operands[i], opts) != 0)
+                exit_status = 1;
+        }
+        return exit_status;
+    }
+
+    // Canonical names live until every operand was removed
+    struct ArenaMark mark = arena_mark(&run_arena);
+    const char *parent = NULL;
+    size_t parent_len = 0;
+    char resolved[PATH_MAX];
+    bool parent_ok = false;
+    for (size_t i = 0; i < count; i++) {
+        const char *path = operands[i];
+        const char *slash = strrchr(path, '/');
+        const char *name = slash ? slash + 1 : path;
+        size_t len = slash ? (size_t) (slash == path ? 1 : slash - path) : 0;
+        entries[i] = (struct OperandEntry) {.path = path, .canonical = path, .index = i, .resolved = false};
+        if (name[0] == '\0' || strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+            continue;
+
+        // The siblings of a glob come one after the other, their parent is resolved once
+        if (!parent || parent_len != len || memcmp(parent, path, len) != 0) {
+            char dir[PATH_MAX];
+            parent = path;
+            parent_len = len;
+            parent_ok = len < sizeof(dir);
+            if (parent_ok) {
+                memcpy(dir, len == 0 ? "." : path, len == 0 ? 1 : len);
+                dir[len == 0 ? 1 : len] = '\0';
+                parent_ok = realpath(dir, resolved) != NULL;
+            }
+        }
+        if (!parent_ok)
+            continue;
+
+        size_t resolved_len = strcmp(resolved, "/") == 0 ? 0 : strlen(resolved);
+        char *canonical = arena_alloc(&run_arena, resolved_len + 1 + strlen(name) + 1);
+        if (!canonical)
+            continue;
+        memcpy(canonical, resolved, resolved_len);
+        canonical[resolved_len] = '/';
+        strcpy(canonical + resolved_len + 1, name);
+        entries[i].canonical = canonical;
+        entries[i].resolved = true;
+    }
+    qsort(entries, count, sizeof(*entries), compare_canonical);
+
+    struct OperandGroup group = {.parent = NULL, .parent_len = 0, .fd = -1};
+    const char *covering = NULL;
+    for (size_t i = 0; i < count; i++) {
+        if (!opts->one_file_system && !opts->keep && operand_covered(&entries[i], covering))
+            continue;
+        if (operand_group_remove(&group, entries[i].path, opts) != 0) {
+            exit_status = 1;
+        } else if (entries[i].resolved) {
+            covering = entries[i].canonical;
+        }
+    }
+    operand_group_close(&group);
+
+    arena_release(&run_arena, mark);
+    free(entries);
+    return exit_status;
+}
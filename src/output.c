@@ -0,0 +1,187 @@
+/*! \file output.c
+ * Machine-readable report of every entry, for `--output=ndjson` and `--output=null`
+ *
+ * Records are formatted into a large process wide buffer shared by the worker threads and written with one `writev()`
+ * of the buffer and the record that no longer fits, so a tree of millions of entries costs a few hundred syscalls and
+ * no stdio locking. In \ref OUTPUT_NDJSON mode one JSON object is written per line, in \ref OUTPUT_NULL mode the path,
+ * action, size, result and errno fields are each terminated by a NUL byte.
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "../include/better_rm.h"
+
+#define OUTPUT_BUFFER_SIZE (1 << 20)
+#define OUTPUT_RECORD_MAX 256 /*!< room for every field of a record but the path */
+
+static char output_buffer[OUTPUT_BUFFER_SIZE];
+static size_t output_len;
+static bool output_failed;
+static pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/** Parse the argument of `--output`
+ *
+ * @param name format name
+ * @param format receives the format
+ * @return 0 for success -1 for an unknown format
+ */
+int output_parse(const char *name, enum OutputFormat *format) {
+    if (strcmp(name, "text") == 0) {
+        *format = OUTPUT_TEXT;
+    } else if (strcmp(name, "ndjson") == 0) {
+        *format = OUTPUT_NDJSON;
+    } else if (strcmp(name, "null") == 0) {
+        *format = OUTPUT_NULL;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+/** Tell whether the human readable per-entry messages are printed
+ *
+ * @param opts provided options
+ * @return true with `--verbose` or `--dry-run` in \ref OUTPUT_TEXT mode
+ */
+bool output_human(const struct Options *opts) {
+    return opts->output == OUTPUT_TEXT && (opts->verbose || opts->dry_run);
+}
+
+/** Tell whether the size of the removed entries has to be known for the records
+ *
+ * @param opts provided options
+ * @return true when records are written
+ */
+bool output_wants_sizes(const struct Options *opts) {
+    return opts->output != OUTPUT_TEXT;
+}
+
+/** Write an iovec array to stdout completely
+ *
+ * @param iov buffers, modified
+ * @param count number of buffers
+ */
+static void output_writev(struct iovec *iov, int count) {
+    while (count > 0 && !output_failed) {
+        ssize_t n = writev(STDOUT_FILENO, iov, count);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            // A closed pipe or a full disk only ends the report, the removal goes on
+            fprintf(stderr, "better-rm: write error: %s\n", strerror(errno));
+            output_failed = true;
+            return;
+        }
+        while (count > 0 && (size_t) n >= iov->iov_len) {
+            n -= (ssize_t) iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *) iov->iov_base + n;
+            iov->iov_len -= (size_t) n;
+        }
+    }
+}
+
+/** Append a string as the body of a JSON string
+ *
+ * Bytes that are not ASCII are copied as they are, paths are not required to be valid UTF-8.
+ *
+ * @param out output, room for 6 bytes per input byte
+ * @param s string
+ * @return end of the output
+ */
+static char *json_escape(char *out, const char *s) {
+    static const char hex[] = "0123456789abcdef";
+    for (const unsigned char *p = (const unsigned char *) s; *p; p++) {
+        if (*p == '"' || *p == '\\') {
+            *out++ = '\\';
+            *out++ = (char) *p;
+        } else if (*p == '\n') {
+            *out++ = '\\';
+            *out++ = 'n';
+        } else if (*p == '\t') {
+            *out++ = '\\';
+            *out++ = 't';
+        } else if (*p < 0x20 || *p == 0x7f) {
+            memcpy(out, "\\u00", 4);
+            out[4] = hex[*p >> 4];
+            out[5] = hex[*p & 0xf];
+            out += 6;
+        } else {
+            *out++ = (char) *p;
+        }
+    }
+    return out;
+}
+
+/** Report what happened to one entry
+ *
+ * Does nothing in \ref OUTPUT_TEXT mode.
+ *
+ * @param opts provided options
+ * @param path path of the entry
+ * @param action action, named like in the syslog records
+ * @param size apparent size, -1 if unknown
+ * @param err 0 for success, errno of the failure otherwise
+ */
+void output_record(const struct Options *opts, const char *path, const char *action, off_t size, int err) {
+    if (opts->output == OUTPUT_TEXT)
+        return;
+
+    const char *result = err != 0 ? "error" : opts->dry_run ? "dry-run" : "ok";
+    size_t path_len = strlen(path);
+    size_t max = (opts->output == OUTPUT_NDJSON ? path_len * 6 : path_len) + strlen(action) + OUTPUT_RECORD_MAX;
+    char stack_record[1024];
+    char *record = max <= sizeof(stack_record) ? stack_record : malloc(max);
+    if (!record)
+        return;
+
+    char *end;
+    if (opts->output == OUTPUT_NDJSON) {
+        end = json_escape(stpcpy(record, "{\"path\":\""), path);
+        end += sprintf(end, "\",\"action\":\"%s\",\"size\":", action);
+        end += size >= 0 ? sprintf(end, "%lld", (long long) size) : sprintf(end, "null");
+        end += sprintf(end, ",\"result\":\"%s\",\"errno\":%d}\n", result, err);
+    } else {
+        memcpy(record, path, path_len + 1);
+        end = record + path_len + 1;
+        end += sprintf(end, "%s%c%lld%c%s%c%d", action, '\0', (long long) size, '\0', result, '\0', err) + 1;
+    }
+    size_t len = (size_t) (end - record);
+
+    pthread_mutex_lock(&output_lock);
+    if (output_len + len <= sizeof(output_buffer)) {
+        memcpy(output_buffer + output_len, record, len);
+        output_len += len;
+    } else {
+        struct iovec iov[2] = {{.iov_base = output_buffer, .iov_len = output_len},
+                               {.iov_base = record, .iov_len = len}};
+        output_writev(iov, 2);
+        output_len = 0;
+    }
+    pthread_mutex_unlock(&output_lock);
+
+    if (record != stack_record)
+        free(record);
+}
+
+/** Write the buffered records, called before exiting
+ *
+ */
+void output_flush(void) {
+    pthread_mutex_lock(&output_lock);
+    if (output_len > 0) {
+        struct iovec iov = {.iov_base = output_buffer, .iov_len = output_len};
+        output_writev(&iov, 1);
+        output_len = 0;
+    }
+    pthread_mutex_unlock(&output_lock);
+}
@@ -0,0 +1,529 @@
+/*! \file parallel.c
+ * Work-stealing parallel engine for recursive directory removal
+ *
+ * Every directory is a task. A worker scanning a directory removes the non-directory entries itself and pushes the
+ * subdirectories onto its own deque, where idle workers can steal them. A directory is removed by whichever worker
+ * drops its completion counter to zero, that is when its own scan and the tasks of all its children have finished.
+ * Every worker reads directories through a reader of its own, which hands out the entries in inode order.
+ *
+ * A scanned directory keeps its fd open until it is removed only when it has subdirectories, which open themselves
+ * and are removed through it. Subdirectories \ref PARALLEL_MAX_DEPTH levels below the operand are not queued, the
+ * worker finding one removes it with the synchronous walk, so a deep tree costs every worker at most that many fds
+ * plus the bounded ones of the walk.
+ */
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../include/better_rm.h"
+
+#define PARALLEL_MAX_DEPTH 16
+
+/*! A directory being removed */
+struct DirTask {
+    struct DirTask *parent; /*!< directory containing this one, NULL for the operand */
+    int fd; /*!< directory fd, open from the start of the scan until its subdirectories were removed */
+    unsigned depth; /*!< levels below the operand */
+    dev_t dev; /*!< device of the directory for `--one-file-system` */
+    unsigned pending; /*!< own scan plus unfinished child tasks, the directory is removed when it drops to zero */
+    bool failed; /*!< an entry below this directory could not be removed */
+    bool kept; /*!< an entry below this directory is kept, so the directory stays as well */
+    const char *name; /*!< name relative to the parent fd, points into \ref path */
+    char path[]; /*!< full path for messages and logging */
+};
+
+/*! Per-worker double-ended queue, the owner works on the bottom and thieves take from the top */
+struct Deque {
+    pthread_mutex_t lock; /*!< protects the ring buffer */
+    struct DirTask **items; /*!< ring buffer of tasks */
+    size_t head; /*!< index of the oldest task, stolen first */
+    size_t count; /*!< number of tasks in the ring */
+    size_t cap; /*!< size of \ref items */
+};
+
+/*! State shared by every worker of one removal */
+struct Engine {
+    const struct Options *opts; /*!< provided options */
+    int root_parent_fd; /*!< directory holding the operand, or AT_FDCWD */
+    struct Deque *deques; /*!< one deque per worker */
+    struct Slab *slabs; /*!< one task allocator per worker, tasks are recycled by whichever worker finishes them */
+    struct DirBatch *batches; /*!< one directory reader per worker */
+    int workers; /*!< number of workers */
+    size_t queued; /*!< tasks sitting in a deque */
+    size_t outstanding; /*!< tasks pushed but not yet finished */
+    int sleepers; /*!< workers waiting on \ref idle_cond */
+    bool stop; /*!< set on the first error unless `--force` is given */
+    bool failed; /*!< any task failed */
+    pthread_mutex_t idle_lock; /*!< protects waiting on \ref idle_cond */
+    pthread_cond_t idle_cond; /*!< signaled when work is queued or everything finished */
+};
+
+/*! Argument of a worker thread */
+struct Worker {
+    struct Engine *engine; /*!< shared state */
+    int id; /*!< index of the worker's own deque */
+};
+
+
+/** Allocate a task for a directory
+ *
+ * @param slab allocator of the calling worker
+ * @param parent containing directory task, NULL for the operand
+ * @param name directory name
+ * @return new task or NULL when out of memory
+ */
+static struct DirTask *task_create(struct Slab *slab, struct DirTask *parent, const char *name) {
+    size_t parent_len = parent ? strlen(parent->path) : 0;
+    size_t name_len = strlen(name);
+    struct DirTask *task = slab_alloc(slab, sizeof(*task) + parent_len + 1 + name_len + 1);
+    if (!task)
+        return NULL;
+
+    task->parent = parent;
+    task->fd = -1;
+    task->depth = parent ? parent->depth + 1 : 0;
+    task->dev = 0;
+    task->pending = 1;
+    task->failed = false;
+    task->kept = false;
+    if (parent) {
+        memcpy(task->path, parent->path, parent_len);
+        task->path[parent_len] = '/';
+        memcpy(task->path + parent_len + 1, name, name_len + 1);
+        task->name = task->path + parent_len + 1;
+    } else {
+        memcpy(task->path, name, name_len + 1);
+        task->name = task->path;
+    }
+    return task;
+}
+
+/** Push a task on the bottom of a deque
+ *
+ * @param dq deque
+ * @param task task to be pushed
+ * @return 0 for success -1 when out of memory
+ */
+static int deque_push(struct Deque *dq, struct DirTask *task) {
+    pthread_mutex_lock(&dq->lock);
+    if (dq->count == dq->cap) {
+        size_t cap = dq->cap ? dq->cap * 2 : 64;
+        struct DirTask **items = malloc(cap * sizeof(*items));
+        if (!items) {
+            pthread_mutex_unlock(&dq->lock);
+            return -1;
+        }
+        for (size_t i = 0; i < dq->count; i++)
+            items[i] = dq->items[(dq->head + i) % dq->cap];
+        free(dq->items);
+        dq->items = items;
+        dq->head = 0;
+        dq->cap = cap;
+    }
+    dq->items[(dq->head + dq->count) % dq->cap] = task;
+    dq->count++;
+    pthread_mutex_unlock(&dq->lock);
+    return 0;
+}
+
+/** Pop the most recently pushed task, used by the owner to keep its walk depth first
+ *
+ * @param dq deque
+ * @return task or NULL when empty
+ */
+static struct DirTask *deque_pop(struct Deque *dq) {
+    struct DirTask *task = NULL;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->count > 0) {
+        dq->count--;
+        task = dq->items[(dq->head + dq->count) % dq->cap];
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return task;
+}
+
+/** Steal the oldest task, which tends to be the root of the largest unexplored subtree
+ *
+ * @param dq victim deque
+ * @return task or NULL when empty
+ */
+static struct DirTask *deque_steal(struct Deque *dq) {
+    struct DirTask *task = NULL;
+    if (pthread_mutex_trylock(&dq->lock) != 0)
+        return NULL;
+    if (dq->count > 0) {
+        task = dq->items[dq->head];
+        dq->head = (dq->head + 1) % dq->cap;
+        dq->count--;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return task;
+}
+
+/** Record a failure and stop handing out work unless `--force` is given
+ *
+ * @param engine shared state
+ * @param task task whose subtree failed
+ */
+static void engine_fail(struct Engine *engine, struct DirTask *task) {
+    __atomic_store_n(&task->failed, true, __ATOMIC_RELAXED);
+    __atomic_store_n(&engine->failed, true, __ATOMIC_RELAXED);
+    if (!engine->opts->force)
+        __atomic_store_n(&engine->stop, true, __ATOMIC_RELAXED);
+}
+
+/** Wake sleeping workers
+ *
+ * @param engine shared state
+ * @param all wake every worker instead of one
+ */
+static void engine_wake(struct Engine *engine, bool all) {
+    if (__atomic_load_n(&engine->sleepers, __ATOMIC_SEQ_CST) == 0)
+        return;
+    pthread_mutex_lock(&engine->idle_lock);
+    if (all)
+        pthread_cond_broadcast(&engine->idle_cond);
+    else
+        pthread_cond_signal(&engine->idle_cond);
+    pthread_mutex_unlock(&engine->idle_lock);
+}
+
+/** Queue a subdirectory on the worker's own deque
+ *
+ * @param engine shared state
+ * @param id worker id
+ * @param task task to be queued
+ * @return 0 for success -1 when out of memory
+ */
+static int engine_push(struct Engine *engine, int id, struct DirTask *task) {
+    __atomic_add_fetch(&engine->outstanding, 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&engine->queued, 1, __ATOMIC_SEQ_CST);
+    if (deque_push(&engine->deques[id], task) != 0) {
+        __atomic_sub_fetch(&engine->queued, 1, __ATOMIC_SEQ_CST);
+        __atomic_sub_fetch(&engine->outstanding, 1, __ATOMIC_SEQ_CST);
+        return -1;
+    }
+    engine_wake(engine, false);
+    return 0;
+}
+
+/** Drop one reference of a directory and remove it once nothing below it is pending
+ *
+ * Removal walks up the tree, a parent whose last child just finished is removed by the same worker.
+ *
+ * @param engine shared state
+ * @param id worker id
+ * @param task finished task
+ */
+static void task_release(struct Engine *engine, int id, struct DirTask *task) {
+    const struct Options *opts = engine->opts;
+
+    while (task && __atomic_sub_fetch(&task->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+        struct DirTask *parent = task->parent;
+
+        if (task->fd >= 0)
+            close(task->fd);
+
+        bool kept = __atomic_load_n(&task->kept, __ATOMIC_ACQUIRE);
+        if (kept && !__atomic_load_n(&task->failed, __ATOMIC_ACQUIRE)) {
+            keep_report(task->path, opts);
+            if (parent)
+                __atomic_store_n(&parent->kept, true, __ATOMIC_RELEASE);
+        } else if (!__atomic_load_n(&task->failed, __ATOMIC_ACQUIRE) &&
+                   !__atomic_load_n(&engine->stop, __ATOMIC_RELAXED)) {
+            if (output_human(opts)) {
+                printf("%s%s directory '%s'\n", opts->dry_run ? "[DRY-RUN] would be " : "",
+                       opts->use_trash ? "trashing" : "removing", task->path);
+            }
+            int err = 0;
+            if (!opts->dry_run) {
+                int parent_fd = parent ? parent->fd : engine->root_parent_fd;
+                int ret;
+                throttle_wait(opts, 1, 0);
+                if (opts->use_trash) {
+                    ret = move_to_trash_at(parent_fd, task->name, task->path, opts->trash_dir, false);
+                } else {
+                    uint64_t start = stats_begin();
+                    ret = unlinkat(parent_fd, task->name, AT_REMOVEDIR);
+                    stats_end(STATS_RMDIR, start, ret != 0);
+                }
+                err = ret == 0 ? 0 : errno;
+                log_deletion(task->path, opts->use_trash ? "TRASH_DIR" : "DELETE_DIR", ret == 0, -1);
+                if (ret != 0) {
+                    // A failed move to the trash was reported by move_to_trash_at()
+                    if (!opts->use_trash)
+                        report_remove_failure(task->path, err, opts);
+                    engine_fail(engine, task);
+                }
+            }
+            output_record(opts, task->path, opts->use_trash ? "TRASH_DIR" : "DELETE_DIR", -1, err);
+        }
+
+        if (__atomic_load_n(&task->failed, __ATOMIC_ACQUIRE) && parent)
+            __atomic_store_n(&parent->failed, true, __ATOMIC_RELEASE);
+
+        slab_free(&engine->slabs[id], task);
+        task = parent;
+    }
+}
+
+/** Scan one directory, removing its files and queueing its subdirectories
+ *
+ * @param engine shared state
+ * @param id worker id
+ * @param task directory to be scanned
+ */
+static void task_run(struct Engine *engine, int id, struct DirTask *task) {
+    const struct Options *opts = engine->opts;
+
+    if (__atomic_load_n(&engine->stop, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&task->failed, true, __ATOMIC_RELEASE);
+        return;
+    }
+
+    int parent_fd = task->parent ? task->parent->fd : engine->root_parent_fd;
+    uint64_t start = stats_begin();
+    task->fd = openat(parent_fd, task->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    stats_end(STATS_OPENDIR, start, task->fd < 0);
+    if (task->fd < 0) {
+        report_remove_failure(task->path, errno, opts);
+        engine_fail(engine, task);
+        return;
+    }
+
+    if (opts->one_file_system) {
+        struct stat st;
+        if (fstat(task->fd, &st) == 0)
+            task->dev = st.st_dev;
+    }
+
+    // Entry paths share the directory prefix, only the name part is rewritten per entry
+    size_t path_len = strlen(task->path);
+    size_t path_cap = path_len + 256;
+    char *path = slab_alloc(&engine->slabs[id], path_cap);
+    if (!path) {
+        engine_fail(engine, task);
+        return;
+    }
+    memcpy(path, task->path, path_len);
+    path[path_len] = '/';
+
+    struct DirBatch *batch = &engine->batches[id];
+    dir_batch_reset(batch);
+    const struct dirent *entry;
+    bool pushed = false;
+    while ((entry = dir_batch_next(batch, task->fd)) != NULL) {
+        if (__atomic_load_n(&engine->stop, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&task->failed, true, __ATOMIC_RELEASE);
+            break;
+        }
+
+        enum EntryKind kind = classify_entry_at(task->fd, entry, task->dev, opts);
+        if (kind == ENTRY_GONE)
+            continue;
+
+        size_t name_len = strlen(entry->d_name);
+        if (path_len + 1 + name_len + 1 > path_cap) {
+            size_t cap = path_cap * 2;
+            while (cap < path_len + 1 + name_len + 1)
+                cap *= 2;
+            char *grown = slab_alloc(&engine->slabs[id], cap);
+            if (!grown) {
+                fprintf(stderr, "better-rm: cannot remove '%s/%s': %s\n", task->path, entry->d_name, strerror(ENOMEM));
+                engine_fail(engine, task);
+                continue;
+            }
+            memcpy(grown, path, path_len + 1);
+            slab_free(&engine->slabs[id], path);
+            path = grown;
+            path_cap = cap;
+        }
+        memcpy(path + path_len + 1, entry->d_name, name_len + 1);
+
+        if (kind == ENTRY_DIR && task->depth + 1 >= PARALLEL_MAX_DEPTH) {
+            bool kept = false;
+            if (remove_directory_walk(task->fd, entry->d_name, path, opts, &kept) != 0)
+                engine_fail(engine, task);
+            else if (kept)
+                __atomic_store_n(&task->kept, true, __ATOMIC_RELEASE);
+            continue;
+        }
+        if (kind == ENTRY_DIR) {
+            struct DirTask *child = task_create(&engine->slabs[id], task, entry->d_name);
+            if (!child) {
+                fprintf(stderr, "better-rm: cannot remove '%s': %s\n", path, strerror(ENOMEM));
+                engine_fail(engine, task);
+                continue;
+            }
+            __atomic_add_fetch(&task->pending, 1, __ATOMIC_RELAXED);
+            if (engine_push(engine, id, child) != 0) {
+                __atomic_sub_fetch(&task->pending, 1, __ATOMIC_RELAXED);
+                fprintf(stderr, "better-rm: cannot remove '%s': %s\n", child->path, strerror(ENOMEM));
+                slab_free(&engine->slabs[id], child);
+                engine_fail(engine, task);
+            } else {
+                pushed = true;
+            }
+            continue;
+        }
+
+        if (kind == ENTRY_OTHER_FS) {
+            if (opts->verbose && opts->output == OUTPUT_TEXT) {
+                printf("skipping '%s': different filesystem\n", path);
+            }
+            output_record(opts, path, "SKIP", -1, 0);
+        } else if (kind == ENTRY_PROTECTED) {
+            fprintf(stderr, "%sbetter-rm: cannot remove '%s': Protected system directory\n",
+                    opts->dry_run ? "[DRY-RUN] " : "", path);
+            output_record(opts, path, "PROTECTED", -1, EPERM);
+            engine_fail(engine, task);
+        } else if (kind == ENTRY_KEPT) {
+            keep_report(path, opts);
+            __atomic_store_n(&task->kept, true, __ATOMIC_RELEASE);
+        } else if (remove_file_at(task->fd, entry->d_name, path, opts) != 0) {
+            engine_fail(engine, task);
+        }
+    }
+
+    if (!entry && errno != 0) {
+        report_remove_failure(task->path, errno, opts);
+        engine_fail(engine, task);
+    }
+    slab_free(&engine->slabs[id], path);
+
+    // Nothing is opened or removed through the directory anymore
+    if (!pushed) {
+        close(task->fd);
+        task->fd = -1;
+    }
+}
+
+/** Find the next task, first on the worker's own deque and then by stealing
+ *
+ * @param engine shared state
+ * @param id worker id
+ * @return task or NULL when no work is queued anywhere
+ */
+static struct DirTask *engine_next(struct Engine *engine, int id) {
+    struct DirTask *task = deque_pop(&engine->deques[id]);
+    for (int i = 1; !task && i < engine->workers; i++) {
+        task = deque_steal(&engine->deques[(id + i) % engine->workers]);
+    }
+    if (task)
+        __atomic_sub_fetch(&engine->queued, 1, __ATOMIC_SEQ_CST);
+    return task;
+}
+
+/** Worker loop, runs until every pushed task has finished
+ *
+ * @param arg \ref Worker
+ * @return NULL
+ */
+static void *worker_main(void *arg) {
+    const struct Worker *worker = arg;
+    struct Engine *engine = worker->engine;
+
+    for (;;) {
+        struct DirTask *task = engine_next(engine, worker->id);
+        if (task) {
+            task_run(engine, worker->id, task);
+            task_release(engine, worker->id, task);
+            if (__atomic_sub_fetch(&engine->outstanding, 1, __ATOMIC_SEQ_CST) == 0)
+                engine_wake(engine, true);
+            continue;
+        }
+
+        if (__atomic_load_n(&engine->outstanding, __ATOMIC_SEQ_CST) == 0)
+            break;
+
+        // Tasks exist but are being scanned by other workers, or a steal lost a lock race
+        pthread_mutex_lock(&engine->idle_lock);
+        __atomic_add_fetch(&engine->sleepers, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&engine->queued, __ATOMIC_SEQ_CST) == 0 &&
+            __atomic_load_n(&engine->outstanding, __ATOMIC_SEQ_CST) != 0) {
+            pthread_cond_wait(&engine->idle_cond, &engine->idle_lock);
+        }
+        __atomic_sub_fetch(&engine->sleepers, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&engine->idle_lock);
+    }
+
+    return NULL;
+}
+
+/** Recursive directory removal with a pool of work-stealing threads
+ *
+ * The calling thread takes part as worker 0, `opts->jobs - 1` additional threads are started.
+ *
+ * @param parent_fd directory holding \p name, or AT_FDCWD
+ * @param name directory name relative to \p parent_fd
+ * @param path full path for messages and logging, ending with \p name
+ * @param opts provided options
+ * @return 0 for success -1 for error
+ */
+int remove_directory_parallel(int parent_fd, const char *name, const char *path, const struct Options *opts) {
+    struct Engine engine = {.opts = opts, .root_parent_fd = parent_fd, .workers = opts->jobs};
+    int ret = -1;
+
+    engine.deques = calloc((size_t) engine.workers, sizeof(*engine.deques));
+    pthread_t *threads = calloc((size_t) engine.workers, sizeof(*threads));
+    struct Worker *workers = calloc((size_t) engine.workers, sizeof(*workers));
+    engine.slabs = calloc((size_t) engine.workers, sizeof(*engine.slabs));
+    engine.batches = calloc((size_t) engine.workers, sizeof(*engine.batches));
+    struct DirTask *root = engine.slabs ? task_create(&engine.slabs[0], NULL, path) : NULL;
+    if (!engine.deques || !threads || !workers || !engine.batches || !root) {
+        fprintf(stderr, "better-rm: cannot remove '%s': %s\n", path, strerror(ENOMEM));
+        goto out;
+    }
+    root->name = root->path + strlen(path) - strlen(name);
+
+    pthread_mutex_init(&engine.idle_lock, NULL);
+    pthread_cond_init(&engine.idle_cond, NULL);
+    for (int i = 0; i < engine.workers; i++) {
+        pthread_mutex_init(&engine.deques[i].lock, NULL);
+        workers[i].engine = &engine;
+        workers[i].id = i;
+    }
+
+    if (engine_push(&engine, 0, root) != 0) {
+        fprintf(stderr, "better-rm: cannot remove '%s': %s\n", path, strerror(ENOMEM));
+    } else {
+        int started = 1;
+        for (; started < engine.workers; started++) {
+            if (pthread_create(&threads[started], NULL, worker_main, &workers[started]) != 0)
+                break;
+        }
+        // Fewer threads than requested is not an error, the ones that started share the work
+
+        worker_main(&workers[0]);
+        for (int i = 1; i < started; i++)
+            pthread_join(threads[i], NULL);
+
+        ret = engine.failed ? -1 : 0;
+    }
+
+    for (int i = 0; i < opts->jobs; i++) {
+        pthread_mutex_destroy(&engine.deques[i].lock);
+        free(engine.deques[i].items);
+    }
+    pthread_cond_destroy(&engine.idle_cond);
+    pthread_mutex_destroy(&engine.idle_lock);
+
+out:
+    // Every task has been recycled by now, the memory of all of them goes at once
+    for (int i = 0; engine.slabs && i < engine.workers; i++)
+        slab_destroy(&engine.slabs[i]);
+    for (int i = 0; engine.batches && i < engine.workers; i++)
+        dir_batch_free(&engine.batches[i]);
+    free(engine.batches);
+    free(engine.slabs);
+    free(workers);
+    free(threads);
+    free(engine.deques);
+    return ret;
+}
@@ -0,0 +1,917 @@
+/*! \file plan.c
+ * Two-phase removal, scanning the operands into a plan once and executing the plan
+ *
+ * A plan is a tree of \ref PlanNode kept in one growable array, addressed by index, with the entry names in a second
+ * array. Every node records the identity and mtime of the entry seen by the scan and the number of entries and bytes
+ * of its subtree, so the plan can be reviewed before anything is removed. The arrays are written to a plan file as
+ * they are laid out in memory and read back in one go.
+ *
+ * Executing a plan walks the tree instead of the directories. Each entry is revalidated with one `fstatat()` and left
+ * in place if its device, inode or type changed since the scan. A file whose mtime changed is left in place as well,
+ * a directory whose mtime changed still has its planned entries removed but is itself kept.
+ *
+ * The scan, the execution and the printing of a plan walk the tree with a heap allocated stack of \ref PlanFrame
+ * instead of recursing, and the walks that open the directories close and reopen them with walk_dir_enter() and
+ * walk_dir_leave(), so neither the C stack nor the number of fds grows with the depth of the tree.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../include/better_rm.h"
+
+#define PLAN_MAGIC "BRMPLAN"
+#define PLAN_VERSION 1
+#define PLAN_NONE UINT32_MAX
+#define PLAN_NODE_KEEP 0x1u /*!< something below the directory is not part of the plan, it cannot be removed */
+#define PLAN_NODE_KEPT 0x2u /*!< something below the directory matched `--keep`, it stays without an error */
+
+/*! One entry of a plan */
+struct PlanNode {
+    uint64_t dev; /*!< device seen by the scan */
+    uint64_t ino; /*!< inode seen by the scan */
+    int64_t mtime_sec; /*!< modification time seen by the scan, seconds */
+    int64_t mtime_nsec; /*!< modification time seen by the scan, nanoseconds */
+    int64_t size; /*!< apparent size of the entry */
+    uint64_t total_entries; /*!< entries of the subtree, the node included */
+    uint64_t total_bytes; /*!< apparent size of the non-directory entries of the subtree */
+    uint32_t mode; /*!< type and permissions */
+    uint32_t flags; /*!< \ref PLAN_NODE_KEEP and \ref PLAN_NODE_KEPT */
+    uint32_t name_offset; /*!< name in the string table, the absolute path for an operand */
+    uint32_t first_child; /*!< first entry of a directory, \ref PLAN_NONE if none */
+    uint32_t next_sibling; /*!< next entry of the same directory or next operand, \ref PLAN_NONE if none */
+    uint32_t reserved; /*!< padding, 0 */
+};
+
+/*! Header of a plan file, followed by the nodes and the string table */
+struct PlanHeader {
+    char magic[8]; /*!< \ref PLAN_MAGIC */
+    uint32_t version; /*!< \ref PLAN_VERSION */
+    uint32_t node_size; /*!< `sizeof(struct PlanNode)` */
+    uint64_t node_count; /*!< number of nodes */
+    uint64_t strings_len; /*!< size of the string table */
+    uint32_t first_root; /*!< first operand, \ref PLAN_NONE for an empty plan */
+    uint32_t reserved; /*!< padding, 0 */
+};
+
+/*! Plan being built or executed */
+struct Plan {
+    struct PlanNode *nodes; /*!< nodes, children always after their parent */
+    size_t count; /*!< used nodes */
+    size_t cap; /*!< allocated nodes */
+    char *strings; /*!< NUL terminated names */
+    size_t strings_len; /*!< used bytes of \ref strings */
+    size_t strings_cap; /*!< allocated bytes of \ref strings */
+    uint32_t first_root; /*!< first operand */
+    uint32_t last_root; /*!< last operand, where the next one is linked */
+};
+
+/*! Directory on the explicit stack of a walk over the plan */
+struct PlanFrame {
+    struct WalkDir dir; /*!< open directory, unused when printing */
+    uint32_t index; /*!< node of the directory */
+    uint32_t next_child; /*!< next entry of the directory to visit, \ref PLAN_NONE when done */
+    size_t name_start; /*!< offset of the directory name in the path buffer, 0 for an operand */
+    int ret; /*!< 0 while everything below the directory succeeded */
+    bool changed; /*!< the directory changed since the scan */
+};
+
+/*! Explicit stack of a walk over the plan */
+struct PlanStack {
+    struct PlanFrame *frames; /*!< directories from the operand down */
+    size_t depth; /*!< used frames */
+    size_t cap; /*!< allocated frames */
+    struct WalkDir top; /*!< directory the operands are relative to, never closed */
+};
+
+
+/** Append a node to the plan
+ *
+ * @param plan plan
+ * @param name entry name, or absolute path of an operand
+ * @param st lstat() of the entry
+ * @return index of the node, \ref PLAN_NONE if out of memory or past the 32 bit index space
+ */
+static uint32_t plan_add(struct Plan *plan, const char *name, const struct stat *st) {
+    size_t name_len = strlen(name) + 1;
+    if (plan->count >= PLAN_NONE || plan->strings_len + name_len >= UINT32_MAX)
+        return PLAN_NONE;
+
+    if (plan->count == plan->cap) {
+        size_t cap = plan->cap ? plan->cap * 2 : 1024;
+        struct PlanNode *nodes = realloc(plan->nodes, cap * sizeof(*nodes));
+        if (!nodes)
+            return PLAN_NONE;
+        plan->nodes = nodes;
+        plan->cap = cap;
+    }
+    if (plan->strings_len + name_len > plan->strings_cap) {
+        size_t cap = plan->strings_cap ? plan->strings_cap * 2 : 16384;
+        while (cap < plan->strings_len + name_len)
+            cap *= 2;
+        char *strings = realloc(plan->strings, cap);
+        if (!strings)
+            return PLAN_NONE;
+        plan->strings = strings;
+        plan->strings_cap = cap;
+    }
+
+    memcpy(plan->strings + plan->strings_len, name, name_len);
+    uint32_t index = (uint32_t) plan->count++;
+    plan->nodes[index] = (struct PlanNode) {
+        .dev = (uint64_t) st->st_dev,
+        .ino = (uint64_t) st->st_ino,
+        .mtime_sec = (int64_t) st->st_mtim.tv_sec,
+        .mtime_nsec = (int64_t) st->st_mtim.tv_nsec,
+        .size = (int64_t) st->st_size,
+        .total_entries = 1,
+        .total_bytes = S_ISDIR(st->st_mode) ? 0 : (uint64_t) st->st_size,
+        .mode = (uint32_t) st->st_mode,
+        .name_offset = (uint32_t) plan->strings_len,
+        .first_child = PLAN_NONE,
+        .next_sibling = PLAN_NONE,
+    };
+    plan->strings_len += name_len;
+    return index;
+}
+
+/** Name of a node
+ *
+ * @param plan plan
+ * @param index node
+ * @return name
+ */
+static const char *plan_name(const struct Plan *plan, uint32_t index) {
+    return plan->strings + plan->nodes[index].name_offset;
+}
+
+/** Push a directory onto the stack of a walk
+ *
+ * Growing the stack moves the frames, the levels are linked to their parents again.
+ *
+ * @param stack stack
+ * @param plan plan
+ * @param index node of the directory
+ * @param name_start offset of the directory name in the path buffer
+ * @return frame, its level linked to the one of its parent but not entered, NULL if out of memory
+ */
+static struct PlanFrame *plan_push(struct PlanStack *stack, const struct Plan *plan, uint32_t index,
+                                   size_t name_start) {
+    if (stack->depth == stack->cap) {
+        size_t cap = stack->cap ? stack->cap * 2 : 64;
+        struct PlanFrame *grown = realloc(stack->frames, cap * sizeof(*grown));
+        if (!grown)
+            return NULL;
+        for (size_t i = 0; i < stack->depth; i++)
+            grown[i].dir.parent = i > 0 ? &grown[i - 1].dir : &stack->top;
+        stack->frames = grown;
+        stack->cap = cap;
+    }
+    struct PlanFrame *frame = &stack->frames[stack->depth];
+    *frame = (struct PlanFrame) {
+        .dir = {.parent = stack->depth > 0 ? &frame[-1].dir : &stack->top, .fd = -1, .dev = 0, .ino = 0},
+        .index = index,
+        .next_child = plan->nodes[index].first_child,
+        .name_start = name_start,
+        .ret = 0,
+        .changed = false,
+    };
+    stack->depth++;
+    return frame;
+}
+
+/** Read the entries of a directory into the plan
+ *
+ * The entries are all read before any subdirectory is scanned, so no directory stream stays open while descending.
+ *
+ * @param plan plan
+ * @param index node of the directory
+ * @param fd directory
+ * @param path full path of the directory, extended in place for every entry
+ * @param opts provided options
+ * @return 0 for success -1 if part of the directory could not be planned
+ */
+static int plan_read_dir(struct Plan *plan, uint32_t index, int fd, struct PathBuf *path, const struct Options *opts) {
+    int stream_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    DIR *dir = stream_fd >= 0 ? fdopendir(stream_fd) : NULL;
+    if (!dir) {
+        fprintf(stderr, "better-rm: cannot scan '%s': %s\n", path->buf, strerror(errno));
+        if (stream_fd >= 0)
+            close(stream_fd);
+        return -1;
+    }
+
+    dev_t dir_dev = (dev_t) plan->nodes[index].dev;
+    uint32_t last_child = PLAN_NONE;
+    const struct dirent *entry;
+    int ret = 0;
+
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+
+        size_t parent_len = path->len;
+        if (path_push(path, entry->d_name) != 0) {
+            fprintf(stderr, "better-rm: cannot scan '%s/%s': %s\n", path->buf, entry->d_name, strerror(ENOMEM));
+            ret = -1;
+            break;
+        }
+
+        struct stat st;
+        uint32_t child = PLAN_NONE;
+        if (fstatat(fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+            if (errno != ENOENT) {
+                fprintf(stderr, "better-rm: cannot scan '%s': %s\n", path->buf, strerror(errno));
+                ret = -1;
+            }
+        } else if (S_ISDIR(st.st_mode) && protected_set_contains(st.st_dev, st.st_ino)) {
+            fprintf(stderr, "%sbetter-rm: cannot remove '%s': Protected system directory\n",
+                    opts->dry_run ? "[DRY-RUN] " : "", path->buf);
+            output_record(opts, path->buf, "PROTECTED", -1, EPERM);
+            plan->nodes[index].flags |= PLAN_NODE_KEEP;
+            ret = -1;
+        } else if (S_ISDIR(st.st_mode) && opts->one_file_system && st.st_dev != dir_dev) {
+            if (opts->verbose && opts->output == OUTPUT_TEXT) {
+                printf("skipping '%s': different filesystem\n", path->buf);
+            }
+            output_record(opts, path->buf, "SKIP", -1, 0);
+            plan->nodes[index].flags |= PLAN_NODE_KEEP;
+        } else if (opts->keep && keep_match(opts->keep, entry->d_name, S_ISDIR(st.st_mode))) {
+            keep_report(path->buf, opts);
+            plan->nodes[index].flags |= PLAN_NODE_KEPT;
+        } else if ((child = plan_add(plan, entry->d_name, &st)) == PLAN_NONE) {
+            fprintf(stderr, "better-rm: cannot scan '%s': %s\n", path->buf, strerror(ENOMEM));
+            ret = -1;
+        }
+
+        if (child != PLAN_NONE) {
+            if (last_child == PLAN_NONE)
+                plan->nodes[index].first_child = child;
+            else
+                plan->nodes[last_child].next_sibling = child;
+            last_child = child;
+        }
+
+        path_pop(path, parent_len);
+        if (ret != 0 && !opts->force)
+            break;
+    }
+    closedir(dir);
+    return ret;
+}
+
+/** Scan a directory tree into the plan
+ *
+ * Every directory is read completely when it is entered, then its subdirectories are scanned one by one, and its
+ * totals are summed up from its entries when it is left.
+ *
+ * @param plan plan
+ * @param index node of the operand
+ * @param fd operand directory, closed before returning
+ * @param path full path of the operand, extended in place while descending
+ * @param opts provided options
+ * @return 0 for success -1 if part of the tree could not be planned
+ */
+static int plan_scan_tree(struct Plan *plan, uint32_t index, int fd, struct PathBuf *path, const struct Options *opts) {
+    struct PlanStack stack = {.frames = NULL, .depth = 0, .cap = 0, .top = {.parent = NULL, .fd = AT_FDCWD}};
+    struct PlanFrame *frame = plan_push(&stack, plan, index, 0);
+    if (!frame) {
+        fprintf(stderr, "better-rm: cannot scan '%s': %s\n", path->buf, strerror(ENOMEM));
+        close(fd);
+        return -1;
+    }
+    walk_dir_enter(&frame->dir, frame->dir.parent, fd);
+    frame->ret = plan_read_dir(plan, index, fd, path, opts);
+    frame->next_child = plan->nodes[index].first_child;
+
+    int ret = 0;
+    while (stack.depth > 0) {
+        frame = &stack.frames[stack.depth - 1];
+        // A directory that could not be reopened fails everything above it as well
+        uint32_t child = frame->next_child;
+        while (child != PLAN_NONE && !S_ISDIR(plan->nodes[child].mode))
+            child = plan->nodes[child].next_sibling;
+        if (child != PLAN_NONE && (frame->ret == 0 || opts->force) && frame->dir.fd >= 0) {
+            frame->next_child = plan->nodes[child].next_sibling;
+            size_t parent_len = path->len;
+            if (path_push(path, plan_name(plan, child)) != 0) {
+                fprintf(stderr, "better-rm: cannot scan '%s/%s': %s\n", path->buf, plan_name(plan, child),
+                        strerror(ENOMEM));
+                frame->ret = -1;
+                frame->next_child = PLAN_NONE;
+                continue;
+            }
+            int child_fd = openat(frame->dir.fd, plan_name(plan, child), O_RDONLY | O_DIRECTORY | O_NOFOLLOW |
+                                                                                   O_CLOEXEC);
+            struct PlanFrame *child_frame = child_fd >= 0 ? plan_push(&stack, plan, child, parent_len + 1) : NULL;
+            if (!child_frame) {
+                fprintf(stderr, "better-rm: cannot scan '%s': %s\n", path->buf,
+                        strerror(child_fd < 0 ? errno : ENOMEM));
+                if (child_fd >= 0)
+                    close(child_fd);
+                plan->nodes[child].flags |= PLAN_NODE_KEEP;
+                stack.frames[stack.depth - 1].ret = -1;
+                path_pop(path, parent_len);
+                continue;
+            }
+            walk_dir_enter(&child_frame->dir, child_frame->dir.parent, child_fd);
+            child_frame->ret = plan_read_dir(plan, child, child_fd, path, opts);
+            child_frame->next_child = plan->nodes[child].first_child;
+            continue;
+        }
+
+        struct PlanNode *node = &plan->nodes[frame->index];
+        for (child = node->first_child; child != PLAN_NONE; child = plan->nodes[child].next_sibling) {
+            node->total_entries += plan->nodes[child].total_entries;
+            node->total_bytes += plan->nodes[child].total_bytes;
+            node->flags |= plan->nodes[child].flags & (PLAN_NODE_KEEP | PLAN_NODE_KEPT);
+        }
+
+        int frame_ret = frame->ret;
+        bool lost = frame->dir.fd < 0;
+        if (lost)
+            frame_ret = -1;
+        if (walk_dir_leave(&frame->dir) != 0) {
+            if (!lost)
+                fprintf(stderr, "better-rm: cannot scan '%.*s': %s\n", (int) (frame->name_start - 1), path->buf,
+                        strerror(errno));
+            frame_ret = -1;
+        }
+        stack.depth--;
+        if (stack.depth == 0) {
+            ret = frame_ret;
+            break;
+        }
+        path_pop(path, frame->name_start - 1);
+        if (frame_ret != 0)
+            stack.frames[stack.depth - 1].ret = -1;
+    }
+    free(stack.frames);
+    return ret;
+}
+
+/** Scan one operand into the plan, after the same safety checks as a direct removal
+ *
+ * Without `--force` an operand that cannot be planned completely is left out of the plan.
+ *
+ * @param plan plan
+ * @param operand operand as given on the command line
+ * @param opts provided options
+ * @return 0 for success 1 for error
+ */
+static int plan_scan_operand(struct Plan *plan, const char *operand, const struct Options *opts) {
+    if (is_protected(operand)) {
+        fprintf(stderr, "%sbetter-rm: cannot remove '%s': Protected system directory\n",
+                opts->dry_run ? "[DRY-RUN] " : "", operand);
+        output_record(opts, operand, "PROTECTED", -1, EPERM);
+        return 1;
+    }
+    if (is_root_with_preserve(operand, opts)) {
+        fprintf(stderr, "%sbetter-rm: cannot remove '%s': --preserve-root is active\n",
+                opts->dry_run ? "[DRY-RUN] " : "", operand);
+        output_record(opts, operand, "PROTECTED", -1, EPERM);
+        return 1;
+    }
+
+    struct stat st;
+    if (lstat(operand, &st) != 0) {
+        if (opts->force)
+            return 0;
+        int err = errno;
+        fprintf(stderr, "%sbetter-rm: cannot remove '%s': %s\n", opts->dry_run ? "[DRY-RUN] " : "", operand,
+                strerror(err));
+        output_record(opts, operand, opts->use_trash ? "TRASH" : "DELETE", -1, err);
+        return 1;
+    }
+    if (keep_match_operand(opts->keep, operand, S_ISDIR(st.st_mode))) {
+        keep_report(operand, opts);
+        return 0;
+    }
+    if (S_ISDIR(st.st_mode) && !opts->recursive) {
+        fprintf(stderr, "%sbetter-rm: cannot remove '%s': Is a directory\n", opts->dry_run ? "[DRY-RUN] " : "",
+                operand);
+        output_record(opts, operand, opts->use_trash ? "TRASH_DIR" : "DELETE_DIR", -1, EISDIR);
+        return 1;
+    }
+
+    // Operands are kept as absolute paths so a saved plan can be applied from any directory
+    struct PathBuf path = {.buf = NULL, .len = 0, .cap = 0};
+    if (operand[0] == '/') {
+        path.buf = strdup(operand);
+    } else {
+        char *cwd = getcwd(NULL, 0);
+        if (cwd && (path.buf = malloc(strlen(cwd) + 1 + strlen(operand) + 1)) != NULL)
+            sprintf(path.buf, "%s/%s", strcmp(cwd, "/") == 0 ? "" : cwd, operand);
+        free(cwd);
+    }
+    if (!path.buf) {
+        fprintf(stderr, "better-rm: cannot scan '%s': %s\n", operand, strerror(ENOMEM));
+        return 1;
+    }
+    path.len = strlen(path.buf);
+    path.cap = path.len + 1;
+
+    size_t saved_count = plan->count;
+    size_t saved_strings_len = plan->strings_len;
+    uint32_t index = plan_add(plan, path.buf, &st);
+    int ret = 0;
+    if (index == PLAN_NONE) {
+        fprintf(stderr, "better-rm: cannot scan '%s': %s\n", operand, strerror(ENOMEM));
+        ret = -1;
+    } else if (S_ISDIR(st.st_mode)) {
+        int fd = open(path.buf, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd < 0) {
+            fprintf(stderr, "better-rm: cannot scan '%s': %s\n", operand, strerror(errno));
+            ret = -1;
+        } else {
+            ret = plan_scan_tree(plan, index, fd, &path, opts);
+        }
+    }
+    free(path.buf);
+
+    if (ret != 0 && (!opts->force || index == PLAN_NONE)) {
+        plan->count = saved_count;
+        plan->strings_len = saved_strings_len;
+        return 1;
+    }
+    if (plan->first_root == PLAN_NONE)
+        plan->first_root = index;
+    else
+        plan->nodes[plan->last_root].next_sibling = index;
+    plan->last_root = index;
+    return ret == 0 ? 0 : 1;
+}
+
+/** Print the directories of a subtree with their totals
+ *
+ * @param plan plan
+ * @param index directory
+ * @param path full path of the directory, extended in place while descending
+ */
+static void plan_print_dir(const struct Plan *plan, uint32_t index, struct PathBuf *path) {
+    struct PlanStack stack = {.frames = NULL, .depth = 0, .cap = 0, .top = {.parent = NULL, .fd = AT_FDCWD}};
+    if (!plan_push(&stack, plan, index, 0))
+        return;
+    printf("  %12llu %14llu  %s/\n", (unsigned long long) plan->nodes[index].total_entries,
+           (unsigned long long) plan->nodes[index].total_bytes, path->buf);
+
+    while (stack.depth > 0) {
+        struct PlanFrame *frame = &stack.frames[stack.depth - 1];
+        uint32_t child = frame->next_child;
+        while (child != PLAN_NONE && !S_ISDIR(plan->nodes[child].mode))
+            child = plan->nodes[child].next_sibling;
+        if (child == PLAN_NONE) {
+            stack.depth--;
+            if (stack.depth > 0)
+                path_pop(path, frame->name_start - 1);
+            continue;
+        }
+
+        frame->next_child = plan->nodes[child].next_sibling;
+        size_t parent_len = path->len;
+        if (path_push(path, plan_name(plan, child)) != 0)
+            break;
+        if (!plan_push(&stack, plan, child, parent_len + 1))
+            break;
+        printf("  %12llu %14llu  %s/\n", (unsigned long long) plan->nodes[child].total_entries,
+               (unsigned long long) plan->nodes[child].total_bytes, path->buf);
+    }
+    free(stack.frames);
+}
+
+/** Print the plan, one line per operand and with `--verbose` one line per directory
+ *
+ * @param plan plan
+ * @param opts provided options
+ */
+static void plan_print(const struct Plan *plan, const struct Options *opts) {
+    if (opts->output != OUTPUT_TEXT)
+        return;
+
+    unsigned long long entries = 0, bytes = 0;
+    for (uint32_t root = plan->first_root; root != PLAN_NONE; root = plan->nodes[root].next_sibling) {
+        const struct PlanNode *node = &plan->nodes[root];
+        entries += node->total_entries;
+        bytes += node->total_bytes;
+        if (opts->verbose && S_ISDIR(node->mode)) {
+            struct PathBuf path = {.buf = strdup(plan_name(plan, root)), .len = 0, .cap = 0};
+            if (path.buf) {
+                path.len = strlen(path.buf);
+                path.cap = path.len + 1;
+                plan_print_dir(plan, root, &path);
+                free(path.buf);
+            }
+        } else {
+            printf("  %12llu %14llu  %s%s\n", (unsigned long long) node->total_entries,
+                   (unsigned long long) node->total_bytes, plan_name(plan, root), S_ISDIR(node->mode) ? "/" : "");
+        }
+    }
+    printf("plan: %s %llu entries, %llu bytes\n", opts->use_trash ? "trash" : "remove", entries, bytes);
+}
+
+/** Report an entry left in place because it changed since the scan
+ *
+ * @param path full path of the entry
+ * @param opts provided options
+ */
+static void plan_report_changed(const char *path, const struct Options *opts) {
+    fprintf(stderr, "better-rm: skipping '%s': changed since the plan was made\n", path);
+    output_record(opts, path, "SKIP", -1, ESTALE);
+}
+
+/** Execute the plan of one entry, up to opening it when it is a directory
+ *
+ * @param plan plan
+ * @param index node
+ * @param parent_fd directory containing the entry, or `AT_FDCWD` for an operand
+ * @param name entry name relative to \p parent_fd
+ * @param path full path of the entry
+ * @param root the entry is an operand
+ * @param opts provided options
+ * @param changed set when the directory changed since the scan
+ * @param fd receives the open directory when its entries are to be removed
+ * @return 0 for success -1 if the entry was not removed, 1 if the directory was opened into \p fd
+ */
+static int plan_enter_node(const struct Plan *plan, uint32_t index, int parent_fd, const char *name,
+                           const struct PathBuf *path, bool root, const struct Options *opts, bool *changed,
+                           int *fd) {
+    const struct PlanNode *node = &plan->nodes[index];
+    struct stat st;
+    uint64_t start = stats_begin();
+    int stat_ret = fstatat(parent_fd, name, &st, AT_SYMLINK_NOFOLLOW);
+    stats_end(STATS_STAT, start, stat_ret != 0);
+    if (stat_ret != 0) {
+        // Already gone is as good as removed
+        if (errno == ENOENT)
+            return 0;
+        report_remove_failure(path->buf, errno, opts);
+        return -1;
+    }
+    if ((uint64_t) st.st_dev != node->dev || (uint64_t) st.st_ino != node->ino ||
+        (st.st_mode & S_IFMT) != (node->mode & S_IFMT)) {
+        plan_report_changed(path->buf, opts);
+        return -1;
+    }
+    *changed = (int64_t) st.st_mtim.tv_sec != node->mtime_sec || (int64_t) st.st_mtim.tv_nsec != node->mtime_nsec;
+
+    if (!S_ISDIR(st.st_mode)) {
+        if (*changed) {
+            plan_report_changed(path->buf, opts);
+            return -1;
+        }
+        return remove_file_at(parent_fd, name, path->buf, opts);
+    }
+
+    if (protected_set_contains(st.st_dev, st.st_ino)) {
+        fprintf(stderr, "%sbetter-rm: cannot remove '%s': Protected system directory\n",
+                opts->dry_run ? "[DRY-RUN] " : "", path->buf);
+        output_record(opts, path->buf, "PROTECTED", -1, EPERM);
+        return -1;
+    }
+
+    // A whole unchanged tree is trashed with one rename, like a direct removal does
+    if (root && opts->use_trash && !opts->dry_run && !opts->one_file_system && !*changed &&
+        !(node->flags & (PLAN_NODE_KEEP | PLAN_NODE_KEPT)) && !protected_set_below(path->buf)) {
+        return trash_directory_tree(path->buf, opts);
+    }
+
+    start = stats_begin();
+    *fd = openat(parent_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    stats_end(STATS_OPENDIR, start, *fd < 0);
+    if (*fd < 0) {
+        fprintf(stderr, "better-rm: cannot remove '%s': %s\n", path->buf, strerror(errno));
+        return -1;
+    }
+    return 1;
+}
+
+/** Finish the plan of a directory whose planned entries were all handled
+ *
+ * @param plan plan
+ * @param frame directory, already left
+ * @param ret 0 if every entry below the directory was removed
+ * @param parent_fd directory containing the directory, or `AT_FDCWD` for an operand
+ * @param path full path of the directory
+ * @param opts provided options
+ * @return 0 for success -1 if the directory was not removed
+ */
+static int plan_leave_node(const struct Plan *plan, const struct PlanFrame *frame, int ret, int parent_fd,
+                           const struct PathBuf *path, const struct Options *opts) {
+    const struct PlanNode *node = &plan->nodes[frame->index];
+    if (ret != 0 || (node->flags & PLAN_NODE_KEEP))
+        return -1;
+    if (node->flags & PLAN_NODE_KEPT) {
+        keep_report(path->buf, opts);
+        return 0;
+    }
+    if (frame->changed) {
+        plan_report_changed(path->buf, opts);
+        return -1;
+    }
+    return remove_emptied_dir_at(parent_fd, path->buf + frame->name_start, path->buf, opts);
+}
+
+/** Execute the plan of one operand and everything below it
+ *
+ * @param plan plan
+ * @param root node of the operand
+ * @param path absolute path of the operand, extended in place while descending
+ * @param opts provided options
+ * @return 0 for success -1 if the operand was not removed
+ */
+static int plan_execute_tree(const struct Plan *plan, uint32_t root, struct PathBuf *path,
+                             const struct Options *opts) {
+    bool changed = false;
+    int fd = -1;
+    int ret = plan_enter_node(plan, root, AT_FDCWD, path->buf, path, true, opts, &changed, &fd);
+    if (ret != 1)
+        return ret;
+
+    struct PlanStack stack = {.frames = NULL, .depth = 0, .cap = 0, .top = {.parent = NULL, .fd = AT_FDCWD}};
+    struct PlanFrame *frame = plan_push(&stack, plan, root, 0);
+    if (!frame) {
+        fprintf(stderr, "better-rm: cannot remove '%s': %s\n", path->buf, strerror(ENOMEM));
+        close(fd);
+        return -1;
+    }
+    walk_dir_enter(&frame->dir, frame->dir.parent, fd);
+    frame->changed = changed;
+
+    while (stack.depth > 0) {
+        frame = &stack.frames[stack.depth - 1];
+        // A directory that could not be reopened fails everything above it as well
+        if (frame->next_child != PLAN_NONE && (frame->ret == 0 || opts->force) && frame->dir.fd >= 0) {
+            uint32_t child = frame->next_child;
+            frame->next_child = plan->nodes[child].next_sibling;
+            size_t parent_len = path->len;
+            if (path_push(path, plan_name(plan, child)) != 0) {
+                fprintf(stderr, "better-rm: cannot remove '%s/%s': %s\n", path->buf, plan_name(plan, child),
+                        strerror(ENOMEM));
+                frame->ret = -1;
+                frame->next_child = PLAN_NONE;
+                continue;
+            }
+            int child_ret = plan_enter_node(plan, child, frame->dir.fd, plan_name(plan, child), path, false, opts,
+                                            &changed, &fd);
+            if (child_ret == 1) {
+                struct PlanFrame *child_frame = plan_push(&stack, plan, child, parent_len + 1);
+                if (child_frame) {
+                    walk_dir_enter(&child_frame->dir, child_frame->dir.parent, fd);
+                    child_frame->changed = changed;
+                    continue;
+                }
+                fprintf(stderr, "better-rm: cannot remove '%s': %s\n", path->buf, strerror(ENOMEM));
+                close(fd);
+            }
+            if (child_ret != 0)
+                frame->ret = -1;
+            path_pop(path, parent_len);
+            continue;
+        }
+
+        int frame_ret = frame->ret;
+        bool lost = frame->dir.fd < 0;
+        if (lost)
+            frame_ret = -1;
+        if (walk_dir_leave(&frame->dir) != 0) {
+            if (!lost)
+                fprintf(stderr, "better-rm: cannot remove '%.*s': %s\n", (int) (frame->name_start - 1), path->buf,
+                        strerror(errno));
+            frame_ret = -1;
+        } else {
+            int parent_fd = stack.depth > 1 ? stack.frames[stack.depth - 2].dir.fd : AT_FDCWD;
+            frame_ret = plan_leave_node(plan, frame, frame_ret, parent_fd, path, opts);
+        }
+        stack.depth--;
+        if (stack.depth == 0) {
+            ret = frame_ret;
+            break;
+        }
+        path_pop(path, frame->name_start - 1);
+        if (frame_ret != 0)
+            stack.frames[stack.depth - 1].ret = -1;
+    }
+    free(stack.frames);
+    return ret;
+}
+
+/** Execute every operand of the plan
+ *
+ * The operands go through the protection checks again, the configuration may have changed since a plan file was
+ * written.
+ *
+ * @param plan plan
+ * @param opts provided options
+ * @return 0 for success 1 for error
+ */
+static int plan_execute(const struct Plan *plan, const struct Options *opts) {
+    int status = 0;
+    for (uint32_t root = plan->first_root; root != PLAN_NONE; root = plan->nodes[root].next_sibling) {
+        const char *operand = plan_name(plan, root);
+        bool protected_dir = is_protected(operand);
+        if (protected_dir || is_root_with_preserve(operand, opts)) {
+            fprintf(stderr, "%sbetter-rm: cannot remove '%s': %s\n", opts->dry_run ? "[DRY-RUN] " : "", operand,
+                    protected_dir ? "Protected system directory" : "--preserve-root is active");
+            output_record(opts, operand, "PROTECTED", -1, EPERM);
+            status = 1;
+            continue;
+        }
+
+        struct PathBuf path = {.buf = strdup(operand), .len = 0, .cap = 0};
+        if (!path.buf) {
+            status = 1;
+            continue;
+        }
+        path.len = strlen(path.buf);
+        path.cap = path.len + 1;
+
+        struct stat st;
+        struct Options mount_opts;
+        const struct Options *operand_opts = opts;
+        if (lstat(operand, &st) == 0)
+            operand_opts = operand_options(operand, &st, opts, &mount_opts);
+
+        audit_begin(operand, opts->use_trash ? "TRASH" : "DELETE");
+        if (plan_execute_tree(plan, root, &path, operand_opts) != 0)
+            status = 1;
+        audit_end();
+        free(path.buf);
+    }
+    return status;
+}
+
+/** Write the plan to a file, through a temporary file renamed over it
+ *
+ * @param plan plan
+ * @param plan_file destination
+ * @return 0 for success -1 for error
+ */
+static int plan_save(const struct Plan *plan, const char *plan_file) {
+    struct PlanHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, PLAN_MAGIC, sizeof(header.magic));
+    header.version = PLAN_VERSION;
+    header.node_size = sizeof(struct PlanNode);
+    header.node_count = plan->count;
+    header.strings_len = plan->strings_len;
+    header.first_root = plan->first_root;
+
+    size_t tmp_len = strlen(plan_file) + 32;
+    char *tmp_path = malloc(tmp_len);
+    if (!tmp_path)
+        return -1;
+    snprintf(tmp_path, tmp_len, "%s.%ld.tmp", plan_file, (long) getpid());
+
+    int ret = -1;
+    FILE *file = NULL;
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd >= 0 && (file = fdopen(fd, "w")) != NULL) {
+        if (fwrite(&header, sizeof(header), 1, file) == 1 &&
+            (plan->count == 0 || fwrite(plan->nodes, sizeof(*plan->nodes), plan->count, file) == plan->count) &&
+            (plan->strings_len == 0 || fwrite(plan->strings, 1, plan->strings_len, file) == plan->strings_len))
+            ret = 0;
+        if (fclose(file) != 0)
+            ret = -1;
+    } else if (fd >= 0) {
+        close(fd);
+    }
+
+    if (ret == 0 && rename(tmp_path, plan_file) != 0)
+        ret = -1;
+    if (ret != 0) {
+        fprintf(stderr, "better-rm: cannot write plan '%s': %s\n", plan_file, strerror(errno));
+        unlink(tmp_path);
+    }
+    free(tmp_path);
+    return ret;
+}
+
+/** Tell whether a name can be used below a directory
+ *
+ * @param name entry name
+ * @return false for empty names, `.`, `..` and names holding a `/`
+ */
+static bool plan_valid_name(const char *name) {
+    return name[0] != '\0' && strcmp(name, ".") != 0 && strcmp(name, "..") != 0 && strchr(name, '/') == NULL;
+}
+
+/** Read a plan file written by plan_save()
+ *
+ * Every index and offset is checked, children and siblings always come after their node so the tree cannot loop, and
+ * entry names cannot leave the directory of their parent.
+ *
+ * @param plan receives the plan
+ * @param plan_file plan file
+ * @return 0 for success -1 for error
+ */
+static int plan_load(struct Plan *plan, const char *plan_file) {
+    FILE *file = fopen(plan_file, "re");
+    if (!file) {
+        fprintf(stderr, "better-rm: cannot read plan '%s': %s\n", plan_file, strerror(errno));
+        return -1;
+    }
+
+    struct PlanHeader header;
+    struct stat st;
+    bool valid = fstat(fileno(file), &st) == 0 && fread(&header, sizeof(header), 1, file) == 1 &&
+                 memcmp(header.magic, PLAN_MAGIC, sizeof(header.magic)) == 0 && header.version == PLAN_VERSION &&
+                 header.node_size == sizeof(struct PlanNode) && header.node_count < PLAN_NONE &&
+                 header.strings_len < UINT32_MAX &&
+                 (uint64_t) st.st_size ==
+                         sizeof(header) + header.node_count * sizeof(struct PlanNode) + header.strings_len &&
+                 (header.node_count == 0 ? header.first_root == PLAN_NONE : header.first_root == 0);
+
+    if (valid) {
+        plan->count = plan->cap = (size_t) header.node_count;
+        plan->strings_len = plan->strings_cap = (size_t) header.strings_len;
+        plan->nodes = malloc(plan->count ? plan->count * sizeof(*plan->nodes) : 1);
+        plan->strings = malloc(plan->strings_len ? plan->strings_len : 1);
+        plan->first_root = header.first_root;
+        valid = plan->nodes && plan->strings &&
+                fread(plan->nodes, sizeof(*plan->nodes), plan->count, file) == plan->count &&
+                fread(plan->strings, 1, plan->strings_len, file) == plan->strings_len &&
+                (plan->strings_len == 0 || plan->strings[plan->strings_len - 1] == '\0');
+    }
+    fclose(file);
+
+    // Operands are the chain of siblings starting at the first node, every other node is an entry of a directory
+    bool *is_root = valid ? calloc(plan->count ? plan->count : 1, sizeof(*is_root)) : NULL;
+    valid = valid && is_root;
+    for (uint32_t root = plan->first_root; valid && root != PLAN_NONE; root = plan->nodes[root].next_sibling) {
+        is_root[root] = true;
+        if (plan->nodes[root].next_sibling != PLAN_NONE && plan->nodes[root].next_sibling <= root)
+            valid = false;
+    }
+    for (size_t i = 0; valid && i < plan->count; i++) {
+        const struct PlanNode *node = &plan->nodes[i];
+        valid = node->name_offset < plan->strings_len &&
+                (node->first_child == PLAN_NONE || (node->first_child > i && node->first_child < plan->count)) &&
+                (node->next_sibling == PLAN_NONE || (node->next_sibling > i && node->next_sibling < plan->count)) &&
+                (is_root[i] ? plan_name(plan, (uint32_t) i)[0] == '/' : plan_valid_name(plan_name(plan, (uint32_t) i)));
+    }
+    free(is_root);
+
+    if (!valid) {
+        fprintf(stderr, "better-rm: cannot read plan '%s': Invalid plan file\n", plan_file);
+        free(plan->nodes);
+        free(plan->strings);
+        memset(plan, 0, sizeof(*plan));
+        return -1;
+    }
+    return 0;
+}
+
+/** Remove the operands in two phases, or apply a saved plan
+ *
+ * With operands, they are scanned into a plan that is printed and then executed, unless `--dry-run` only asks to
+ * preview it or \p plan_file asks to save it for later. Without operands the plan saved in \p plan_file is executed.
+ *
+ * @param operands operands
+ * @param count number of operands
+ * @param plan_file plan file to write or to apply, NULL for none
+ * @param opts provided options
+ * @return 0 for success 1 for error
+ */
+int plan_run(char *const *operands, size_t count, const char *plan_file, const struct Options *opts) {
+    struct Plan plan = {.first_root = PLAN_NONE, .last_root = PLAN_NONE};
+    int status = 0;
+
+    if (count > 0) {
+        for (size_t i = 0; i < count; i++) {
+            if (plan_scan_operand(&plan, operands[i], opts) != 0)
+                status = 1;
+        }
+        plan_print(&plan, opts);
+        if (plan_file) {
+            if (plan_save(&plan, plan_file) != 0)
+                status = 1;
+            goto out;
+        }
+        if (opts->dry_run)
+            goto out;
+    } else if (plan_load(&plan, plan_file) != 0) {
+        return 1;
+    } else if (opts->verbose) {
+        plan_print(&plan, opts);
+    }
+
+    if (opts->interactive && !opts->dry_run && plan.first_root != PLAN_NONE) {
+        printf("execute plan? ");
+        char response;
+        if (scanf(" %c", &response) != 1 || (response != 'y' && response != 'Y'))
+            goto out;
+    }
+    if (plan_execute(&plan, opts) != 0)
+        status = 1;
+
+out:
+    free(plan.nodes);
+    free(plan.strings);
+    return status;
+}
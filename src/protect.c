@@ -0,0 +1,468 @@
+/*! \file protect.c
+ * Identity based protection of the protected directories
+ *
+ * Every protected directory is resolved once to its `(st_dev, st_ino)` pair and kept in an open addressing hash set,
+ * so the removal engines can refuse to enter a protected directory however it is reached, through a bind mount or a
+ * symlinked parent included. A second set holds the inode numbers readdir may report for them, their own and the ones
+ * of the directories they are mounted or bind mounted on, so the engines only stat a directory entry whose `d_ino` is
+ * a candidate and keep the common case free of extra syscalls. The real paths every protected directory is reached
+ * at, its bind mounts included, are kept too, so a whole tree is only ever moved at once when no protected directory
+ * lies below it. Every path the set was built from is kept with the identity it resolved to, or none when it did not
+ * exist, so a set loaded from a configuration snapshot can be checked against the filesystem as it is now.
+ */
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "../include/better_rm.h"
+
+#define PROTECTED_SET_MIN_SLOTS 64
+
+/*! Identity of a protected directory, a zero inode marks an empty slot */
+struct ProtectedId {
+    dev_t dev; /*!< device */
+    ino_t ino; /*!< inode */
+};
+
+/*! Open addressing hash set of protected directory identities */
+struct ProtectedSet {
+    struct ProtectedId *ids; /*!< slots */
+    size_t mask; /*!< slot count minus one */
+    size_t count; /*!< used slots */
+    ino_t *probe_inos; /*!< inode numbers readdir reports for protected directories, 0 for an empty slot */
+    size_t probe_mask; /*!< probe slot count minus one */
+    size_t probe_count; /*!< used probe slots */
+    char *places; /*!< NUL terminated real paths the protected directories are reached at */
+    size_t places_len; /*!< bytes used in \ref places */
+    size_t places_cap; /*!< allocated size of \ref places */
+    char *roots; /*!< NUL terminated paths the set was built from */
+    size_t roots_len; /*!< bytes used in \ref roots */
+    size_t roots_cap; /*!< allocated size of \ref roots */
+    struct ProtectedId *root_ids; /*!< identity each of \ref roots resolved to, a zero inode if it did not exist */
+    size_t root_count; /*!< number of \ref root_ids */
+    size_t root_cap; /*!< allocated size of \ref root_ids */
+    bool borrowed; /*!< the tables belong to a read-only configuration snapshot mapping */
+};
+
+static struct ProtectedSet set;
+
+
+/** Hash a device and inode pair
+ *
+ * @param dev device, 0 to hash the inode alone
+ * @param ino inode
+ * @return hash
+ */
+static size_t hash_id(dev_t dev, ino_t ino) {
+    uint64_t h = ((uint64_t) ino * 0x9E3779B97F4A7C15ull) ^ ((uint64_t) dev * 0xC2B2AE3D27D4EB4Full);
+    return (size_t) (h ^ (h >> 29));
+}
+
+/** Copy tables borrowed from a configuration snapshot so they can be modified
+ *
+ * @return 0 for success -1 for error
+ */
+static int set_own(void) {
+    if (!set.borrowed)
+        return 0;
+    struct ProtectedId *ids = set.ids ? malloc((set.mask + 1) * sizeof(*ids)) : NULL;
+    ino_t *inos = set.probe_inos ? malloc((set.probe_mask + 1) * sizeof(*inos)) : NULL;
+    char *places = set.places_len ? malloc(set.places_len) : NULL;
+    char *roots = set.roots_len ? malloc(set.roots_len) : NULL;
+    struct ProtectedId *root_ids = set.root_count ? malloc(set.root_count * sizeof(*root_ids)) : NULL;
+    if ((set.ids && !ids) || (set.probe_inos && !inos) || (set.places_len && !places) || (set.roots_len && !roots) ||
+        (set.root_count && !root_ids)) {
+        free(ids);
+        free(inos);
+        free(places);
+        free(roots);
+        free(root_ids);
+        return -1;
+    }
+    if (ids)
+        memcpy(ids, set.ids, (set.mask + 1) * sizeof(*ids));
+    if (inos)
+        memcpy(inos, set.probe_inos, (set.probe_mask + 1) * sizeof(*inos));
+    if (places)
+        memcpy(places, set.places, set.places_len);
+    if (roots)
+        memcpy(roots, set.roots, set.roots_len);
+    if (root_ids)
+        memcpy(root_ids, set.root_ids, set.root_count * sizeof(*root_ids));
+    set.ids = ids;
+    set.probe_inos = inos;
+    set.places = places;
+    set.places_cap = set.places_len;
+    set.roots = roots;
+    set.roots_cap = set.roots_len;
+    set.root_ids = root_ids;
+    set.root_cap = set.root_count;
+    set.borrowed = false;
+    return 0;
+}
+
+/** Insert an identity, growing the table at half load
+ *
+ * @param dev device
+ * @param ino inode
+ * @return 0 for success -1 for error
+ */
+static int set_insert(dev_t dev, ino_t ino) {
+    if (set_own() != 0)
+        return -1;
+    if ((set.count + 1) * 2 > set.mask + 1 || !set.ids) {
+        size_t slots = set.ids ? (set.mask + 1) * 2 : PROTECTED_SET_MIN_SLOTS;
+        struct ProtectedId *ids = calloc(slots, sizeof(*ids));
+        if (!ids)
+            return -1;
+        for (size_t i = 0; set.ids && i <= set.mask; i++) {
+            if (set.ids[i].ino == 0)
+                continue;
+            size_t slot = hash_id(set.ids[i].dev, set.ids[i].ino) & (slots - 1);
+            while (ids[slot].ino != 0)
+                slot = (slot + 1) & (slots - 1);
+            ids[slot] = set.ids[i];
+        }
+        free(set.ids);
+        set.ids = ids;
+        set.mask = slots - 1;
+    }
+
+    size_t slot = hash_id(dev, ino) & set.mask;
+    while (set.ids[slot].ino != 0) {
+        if (set.ids[slot].dev == dev && set.ids[slot].ino == ino)
+            return 0;
+        slot = (slot + 1) & set.mask;
+    }
+    set.ids[slot] = (struct ProtectedId) {.dev = dev, .ino = ino};
+    set.count++;
+    return 0;
+}
+
+/** Insert a probe inode, growing the table at half load
+ *
+ * @param ino inode number
+ * @return 0 for success -1 for error
+ */
+static int probe_insert(ino_t ino) {
+    if (set_own() != 0)
+        return -1;
+    if ((set.probe_count + 1) * 2 > set.probe_mask + 1 || !set.probe_inos) {
+        size_t slots = set.probe_inos ? (set.probe_mask + 1) * 2 : PROTECTED_SET_MIN_SLOTS;
+        ino_t *inos = calloc(slots, sizeof(*inos));
+        if (!inos)
+            return -1;
+        for (size_t i = 0; set.probe_inos && i <= set.probe_mask; i++) {
+            if (set.probe_inos[i] == 0)
+                continue;
+            size_t slot = hash_id(0, set.probe_inos[i]) & (slots - 1);
+            while (inos[slot] != 0)
+                slot = (slot + 1) & (slots - 1);
+            inos[slot] = set.probe_inos[i];
+        }
+        free(set.probe_inos);
+        set.probe_inos = inos;
+        set.probe_mask = slots - 1;
+    }
+
+    size_t slot = hash_id(0, ino) & set.probe_mask;
+    while (set.probe_inos[slot] != 0) {
+        if (set.probe_inos[slot] == ino)
+            return 0;
+        slot = (slot + 1) & set.probe_mask;
+    }
+    set.probe_inos[slot] = ino;
+    set.probe_count++;
+    return 0;
+}
+
+/** Append a path to a table of NUL terminated paths
+ *
+ * @param table table, grown as needed
+ * @param table_len bytes used in \p table
+ * @param table_cap allocated size of \p table
+ * @param path path to be appended
+ * @return 0 for success -1 for error
+ */
+static int paths_append(char **table, size_t *table_len, size_t *table_cap, const char *path) {
+    size_t len = strlen(path) + 1;
+    if (*table_len + len > *table_cap) {
+        size_t cap = *table_cap ? *table_cap * 2 : 256;
+        while (cap < *table_len + len)
+            cap *= 2;
+        char *grown = realloc(*table, cap);
+        if (!grown)
+            return -1;
+        *table = grown;
+        *table_cap = cap;
+    }
+    memcpy(*table + *table_len, path, len);
+    *table_len += len;
+    return 0;
+}
+
+/** Remember a real path a protected directory is reached at
+ *
+ * @param path canonical absolute path
+ * @return 0 for success -1 for error
+ */
+static int place_insert(const char *path) {
+    if (set_own() != 0)
+        return -1;
+    return paths_append(&set.places, &set.places_len, &set.places_cap, path);
+}
+
+/** Remember a path the set is built from and what it resolved to
+ *
+ * @param path protected path as configured
+ * @param id identity of \p path, a zero inode if it does not exist
+ * @return 0 for success -1 for error
+ */
+static int root_insert(const char *path, struct ProtectedId id) {
+    if (set_own() != 0)
+        return -1;
+    if (set.root_count == set.root_cap) {
+        size_t cap = set.root_cap ? set.root_cap * 2 : 32;
+        struct ProtectedId *grown = realloc(set.root_ids, cap * sizeof(*grown));
+        if (!grown)
+            return -1;
+        set.root_ids = grown;
+        set.root_cap = cap;
+    }
+    if (paths_append(&set.roots, &set.roots_len, &set.roots_cap, path) != 0)
+        return -1;
+    set.root_ids[set.root_count++] = id;
+    return 0;
+}
+
+/** Find the inode number a directory listing reports for a mount point
+ *
+ * readdir returns the inode of the directory the filesystem is mounted on, not the root of the mounted filesystem,
+ * and this is what the engines see when they reach the mount point through a recursive bind mount.
+ *
+ * @param path mount point
+ * @return covered inode number, 0 if unknown
+ */
+static ino_t covered_ino(const char *path) {
+    char parent[PATH_MAX];
+    const char *slash = strrchr(path, '/');
+    if (!slash || slash[1] == '\0' || (size_t) (slash - path) >= sizeof(parent))
+        return 0;
+    if (slash == path) {
+        strcpy(parent, "/");
+    } else {
+        memcpy(parent, path, (size_t) (slash - path));
+        parent[slash - path] = '\0';
+    }
+
+    DIR *dir = opendir(parent);
+    if (!dir)
+        return 0;
+    ino_t ino = 0;
+    const struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, slash + 1) == 0) {
+            ino = entry->d_ino;
+            break;
+        }
+    }
+    closedir(dir);
+    return ino;
+}
+
+/** Protect the directory a path resolves to
+ *
+ * Paths that do not exist are ignored, they are still protected by name.
+ *
+ * @param path protected path
+ * @return 0 for success -1 for error
+ */
+int protected_set_add(const char *path) {
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        int err = errno;
+        if (root_insert(path, (struct ProtectedId) {.dev = 0, .ino = 0}) != 0)
+            return -1;
+        return err == ENOENT || err == ENOTDIR || err == EACCES ? 0 : -1;
+    }
+    if (root_insert(path, (struct ProtectedId) {.dev = st.st_dev, .ino = st.st_ino}) != 0 ||
+        set_insert(st.st_dev, st.st_ino) != 0 || probe_insert(st.st_ino) != 0)
+        return -1;
+
+    char resolved[PATH_MAX];
+    if (!realpath(path, resolved))
+        return 0;
+    if (place_insert(resolved) != 0)
+        return -1;
+
+    // A mount point is listed in its parent under the inode it covers, this directory being mounted or bind mounted
+    char parent[PATH_MAX];
+    struct stat parent_st;
+    int ret = 0;
+    if (snprintf(parent, sizeof(parent), "%s/..", resolved) < (int) sizeof(parent) &&
+        stat(parent, &parent_st) == 0 && parent_st.st_dev != st.st_dev) {
+        ino_t ino = covered_ino(resolved);
+        if (ino != 0 && probe_insert(ino) != 0)
+            ret = -1;
+    }
+
+    char **binds;
+    size_t bind_count = mount_binds_of(resolved, st.st_dev, &binds);
+    for (size_t i = 0; i < bind_count; i++) {
+        ino_t ino = covered_ino(binds[i]);
+        if ((ino != 0 && probe_insert(ino) != 0) || place_insert(binds[i]) != 0)
+            ret = -1;
+        free(binds[i]);
+    }
+    free(binds);
+    return ret;
+}
+
+/** Forget every protected directory
+ *
+ */
+void protected_set_clear(void) {
+    if (!set.borrowed) {
+        free(set.ids);
+        free(set.probe_inos);
+        free(set.places);
+        free(set.roots);
+        free(set.root_ids);
+    }
+    memset(&set, 0, sizeof(set));
+}
+
+/** Describe the hash tables of the set so they can be stored in a configuration snapshot
+ *
+ * @param tables receives the tables, which stay owned by the set
+ */
+void protected_set_export(struct ProtectedTables *tables) {
+    tables->id_size = sizeof(struct ProtectedId);
+    tables->ids = set.ids;
+    tables->id_slots = set.ids ? set.mask + 1 : 0;
+    tables->id_count = set.count;
+    tables->probe_inos = set.probe_inos;
+    tables->probe_slots = set.probe_inos ? set.probe_mask + 1 : 0;
+    tables->probe_count = set.probe_count;
+    tables->places = set.places;
+    tables->places_len = set.places_len;
+    tables->roots = set.roots;
+    tables->roots_len = set.roots_len;
+    tables->root_ids = set.root_ids;
+    tables->root_count = set.root_count;
+}
+
+/** Use hash tables stored in a configuration snapshot as the set, without copying them
+ *
+ * The tables have to stay mapped for the lifetime of the process, inserting afterwards works on a copy.
+ *
+ * @param tables tables previously described by protected_set_export()
+ * @return 0 for success -1 if the tables do not have the layout of this build
+ */
+int protected_set_import(const struct ProtectedTables *tables) {
+    // Lookups rely on power of two tables that always have an empty slot
+    if (tables->id_size != sizeof(struct ProtectedId) || (tables->id_slots & (tables->id_slots - 1)) != 0 ||
+        (tables->probe_slots & (tables->probe_slots - 1)) != 0 || tables->id_count * 2 > tables->id_slots ||
+        tables->probe_count * 2 > tables->probe_slots ||
+        (tables->places_len > 0 && tables->places[tables->places_len - 1] != '\0') ||
+        (tables->roots_len > 0 && tables->roots[tables->roots_len - 1] != '\0'))
+        return -1;
+
+    protected_set_clear();
+    set.ids = (struct ProtectedId *) tables->ids;
+    set.mask = tables->id_slots ? tables->id_slots - 1 : 0;
+    set.count = tables->id_count;
+    set.probe_inos = (ino_t *) tables->probe_inos;
+    set.probe_mask = tables->probe_slots ? tables->probe_slots - 1 : 0;
+    set.probe_count = tables->probe_count;
+    set.places = (char *) tables->places;
+    set.places_len = tables->places_len;
+    set.roots = (char *) tables->roots;
+    set.roots_len = tables->roots_len;
+    set.root_ids = (struct ProtectedId *) tables->root_ids;
+    set.root_count = tables->root_count;
+    set.borrowed = true;
+    return 0;
+}
+
+/** Tell whether every path the set was built from still resolves to what it did then
+ *
+ * A protected directory replaced, created or removed since then makes the set stale, it has to be built again.
+ *
+ * @return true if the set matches the filesystem
+ */
+bool protected_set_current(void) {
+    const char *root = set.roots;
+    for (size_t i = 0; i < set.root_count; i++) {
+        if (root >= set.roots + set.roots_len)
+            return false;
+        struct stat st;
+        struct ProtectedId id = {.dev = 0, .ino = 0};
+        if (stat(root, &st) == 0)
+            id = (struct ProtectedId) {.dev = st.st_dev, .ino = st.st_ino};
+        if (id.dev != set.root_ids[i].dev || id.ino != set.root_ids[i].ino)
+            return false;
+        root += strlen(root) + 1;
+    }
+    return root == set.roots + set.roots_len;
+}
+
+/** Tell whether readdir reporting an inode number for a directory means it may be protected
+ *
+ * @param ino `d_ino` of the entry
+ * @return true if the entry has to be stat'ed and checked with protected_set_contains()
+ */
+bool protected_set_probe(ino_t ino) {
+    if (set.probe_count == 0)
+        return false;
+    size_t slot = hash_id(0, ino) & set.probe_mask;
+    while (set.probe_inos[slot] != 0) {
+        if (set.probe_inos[slot] == ino)
+            return true;
+        slot = (slot + 1) & set.probe_mask;
+    }
+    return false;
+}
+
+/** Tell whether a directory is protected
+ *
+ * @param dev device of the directory
+ * @param ino inode of the directory
+ * @return true if protected
+ */
+bool protected_set_contains(dev_t dev, ino_t ino) {
+    if (set.count == 0)
+        return false;
+    size_t slot = hash_id(dev, ino) & set.mask;
+    while (set.ids[slot].ino != 0) {
+        if (set.ids[slot].dev == dev && set.ids[slot].ino == ino)
+            return true;
+        slot = (slot + 1) & set.mask;
+    }
+    return false;
+}
+
+/** Tell whether a protected directory lies below a directory
+ *
+ * @param path directory
+ * @return true if a protected directory is reached below \p path, or if \p path cannot be resolved
+ */
+bool protected_set_below(const char *path) {
+    if (set.places_len == 0)
+        return false;
+    char resolved[PATH_MAX];
+    if (!realpath(path, resolved))
+        return true;
+
+    size_t len = strcmp(resolved, "/") == 0 ? 0 : strlen(resolved);
+    for (const char *place = set.places; place < set.places + set.places_len; place += strlen(place) + 1) {
+        if (strncmp(place, resolved, len) == 0 && place[len] == '/')
+            return true;
+    }
+    return false;
+}
@@ -0,0 +1,326 @@
+/*! \file purge.c
+ * Removal of expired trash entries, run by the systemd timer through `better-rm --purge-trash`
+ *
+ * Each trash directory is read with a single readdir pass. The age and owner of an entry come from its trash index
+ * record, and only entries the index does not know about are stat'ed, falling back to their change time, which the
+ * rename into the trash updated. A trash directory is only purged when it belongs to the user it holds the trash of,
+ * see trash_dir_trusted(). Expired trees are removed by the same engines as `better-rm -r`, relative to the open trash
+ * directory, so a trash directory swapped for a symlink meanwhile cannot redirect the removal. The entries and bytes
+ * freed are accounted per user and logged as one summary record.
+ */
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pwd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../include/better_rm.h"
+
+#define TRASH_INDEX_PREFIX ".better-rm-"
+#define PURGE_DETAIL_MAX 1024
+
+/*! Entries and bytes freed on behalf of one user */
+struct PurgeUser {
+    uid_t uid; /*!< user who trashed the entries */
+    unsigned long long entries; /*!< entries removed */
+    unsigned long long bytes; /*!< bytes freed */
+};
+
+/*! State of a purge run */
+struct Purge {
+    const struct Options *opts; /*!< removal options */
+    time_t cutoff; /*!< entries trashed before this time are removed */
+    struct PurgeUser *users; /*!< per-user accounting */
+    size_t user_count; /*!< entries in \ref users */
+};
+
+
+/** Account removed entries to a user
+ *
+ * @param purge purge state
+ * @param uid user
+ * @param entries entries removed
+ * @param bytes bytes freed
+ */
+static void account(struct Purge *purge, uid_t uid, unsigned long long entries, unsigned long long bytes) {
+    size_t i = 0;
+    while (i < purge->user_count && purge->users[i].uid != uid)
+        i++;
+    if (i == purge->user_count) {
+        struct PurgeUser *grown = realloc(purge->users, (purge->user_count + 1) * sizeof(*grown));
+        if (!grown)
+            return;
+        purge->users = grown;
+        purge->users[i] = (struct PurgeUser) {.uid = uid};
+        purge->user_count++;
+    }
+    purge->users[i].entries += entries;
+    purge->users[i].bytes += bytes;
+}
+
+/** Tell whether a directory may be purged
+ *
+ * Refuses anything that is not recognizably a trash directory, so a wrong operand cannot wipe out old files
+ * elsewhere.
+ *
+ * @param dirfd directory opened without following symlinks
+ * @param trash_dir directory path
+ * @return true if \p trash_dir is a trash directory
+ */
+static bool is_trash_dir(int dirfd, const char *trash_dir) {
+    if (is_protected(trash_dir))
+        return false;
+    const char *slash = strrchr(trash_dir, '/');
+    const char *base = slash ? slash + 1 : trash_dir;
+    struct stat st;
+    return strncmp(base, ".Trash", 6) == 0 || fstatat(dirfd, TRASH_INDEX_PREFIX "index", &st, 0) == 0;
+}
+
+/** Remove the expired entries of one trash directory
+ *
+ * @param purge purge state
+ * @param trash_dir trash directory
+ * @return 0 for success -1 for error
+ */
+static int purge_trash_dir(struct Purge *purge, const char *trash_dir) {
+    const struct Options *opts = purge->opts;
+    int fd = open(trash_dir, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno == ENOENT)
+            return 0;
+        fprintf(stderr, "better-rm: cannot purge '%s': %s\n", trash_dir, strerror(errno));
+        return -1;
+    }
+    if (!is_trash_dir(fd, trash_dir)) {
+        fprintf(stderr, "better-rm: cannot purge '%s': Not a trash directory\n", trash_dir);
+        close(fd);
+        return -1;
+    }
+    if (!trash_dir_trusted(fd, trash_dir)) {
+        fprintf(stderr, "better-rm: cannot purge '%s': Trash directory not owned by its user\n", trash_dir);
+        close(fd);
+        return -1;
+    }
+    DIR *dir = fdopendir(fd);
+    if (!dir) {
+        close(fd);
+        return -1;
+    }
+
+    struct TrashIndex index;
+    bool indexed = trash_index_open_at(fcntl(fd, F_DUPFD_CLOEXEC, 0), &index) == 0;
+    if (!indexed && errno == ENOMEM) {
+        fprintf(stderr, "better-rm: cannot purge '%s': %s\n", trash_dir, strerror(ENOMEM));
+        closedir(dir);
+        return -1;
+    }
+
+    struct PathBuf path = {.buf = strdup(trash_dir), .len = strlen(trash_dir), .cap = strlen(trash_dir) + 1};
+    int ret = path.buf ? 0 : -1;
+    bool failed = false;
+    bool unlisted = false;
+    const struct dirent *entry;
+    while (ret == 0 && (entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 ||
+            strncmp(entry->d_name, TRASH_INDEX_PREFIX, strlen(TRASH_INDEX_PREFIX)) == 0)
+            continue;
+
+        struct TrashRecord *record = trash_index_find(&index, entry->d_name);
+        unsigned char type = entry->d_type;
+        time_t trashed_at;
+        uid_t uid;
+        off_t size;
+        if (record) {
+            trashed_at = (time_t) record->deleted_at;
+            uid = (uid_t) record->uid;
+            size = (off_t) record->size;
+            if (type == DT_UNKNOWN)
+                type = S_ISDIR(record->mode) ? DT_DIR : DT_REG;
+        } else {
+            struct stat st;
+            if (fstatat(fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+                continue;
+            trashed_at = st.st_ctime;
+            uid = st.st_uid;
+            size = st.st_size;
+            type = S_ISDIR(st.st_mode) ? DT_DIR : DT_REG;
+        }
+        if (trashed_at >= purge->cutoff)
+            continue;
+
+        size_t parent_len = path.len;
+        if (path_push(&path, entry->d_name) != 0) {
+            ret = -1;
+            break;
+        }
+
+        unsigned long long entries_before, bytes_before, failures_before;
+        audit_counts(&entries_before, &bytes_before, &failures_before);
+        int removed;
+        if (type == DT_DIR) {
+            removed = remove_directory_in(fd, entry->d_name, path.buf, opts);
+        } else {
+            if (output_human(opts)) {
+                printf("%spurging '%s'\n", opts->dry_run ? "[DRY-RUN] would be " : "", path.buf);
+            }
+            removed = opts->dry_run ? 0 : unlinkat(fd, entry->d_name, 0);
+            int err = removed == 0 ? 0 : errno;
+            if (!opts->dry_run)
+                log_deletion(path.buf, "PURGE", removed == 0, size);
+            output_record(opts, path.buf, "PURGE", size, err);
+            if (removed != 0)
+                fprintf(stderr, "better-rm: cannot purge '%s': %s\n", path.buf, strerror(err));
+        }
+        path_pop(&path, parent_len);
+
+        unsigned long long entries, bytes, failures;
+        audit_counts(&entries, &bytes, &failures);
+        account(purge, uid, entries - entries_before, bytes - bytes_before);
+        if (removed == 0 && record && !opts->dry_run && trash_index_remove(&index, record))
+            dedup_release(&index, record);
+        // The blobs of an entry without a record are not known
+        if (removed == 0 && !record)
+            unlisted = true;
+        // One entry that cannot be removed does not keep the others in the trash
+        if (removed != 0)
+            failed = true;
+    }
+
+    free(path.buf);
+    if (indexed) {
+        trash_index_close(&index);
+        if (!opts->dry_run)
+            trash_index_compact(trash_dir);
+    }
+    if (!opts->dry_run && unlisted)
+        dedup_collect(fd);
+    closedir(dir);
+    return ret == 0 && !failed ? 0 : -1;
+}
+
+/** Add a trash directory to a list unless it is already in it
+ *
+ * @param dirs list
+ * @param count entries in \p dirs
+ * @param path trash directory
+ */
+static void add_purge_dir(char ***dirs, size_t *count, const char *path) {
+    for (size_t i = 0; i < *count; i++) {
+        if (strcmp((*dirs)[i], path) == 0)
+            return;
+    }
+    char *copy = strdup(path);
+    char **grown = copy ? realloc(*dirs, (*count + 1) * sizeof(*grown)) : NULL;
+    if (!grown) {
+        free(copy);
+        return;
+    }
+    *dirs = grown;
+    grown[(*count)++] = copy;
+}
+
+/** Collect the trash directories purged when none are given
+ *
+ * root purges the shared `/tmp/.Trash`, the trash of every user with a home directory and every per-mount trash,
+ * anybody else only their own trash directories.
+ *
+ * @param dirs receives a malloc'ed list of malloc'ed paths
+ * @return number of directories
+ */
+size_t purge_default_dirs(char ***dirs) {
+    char **mount_dirs;
+    size_t mount_count = mount_trash_dirs(getuid() == 0, &mount_dirs);
+    size_t count = 0;
+    *dirs = NULL;
+
+    if (getuid() == 0) {
+        add_purge_dir(dirs, &count, "/tmp/.Trash");
+        const struct passwd *pw;
+        setpwent();
+        while ((pw = getpwent()) != NULL) {
+            if (!pw->pw_dir || strcmp(pw->pw_dir, "/") == 0 || pw->pw_dir[0] != '/')
+                continue;
+            char path[PATH_MAX];
+            snprintf(path, sizeof(path), "%s/%s", pw->pw_dir, DEFAULT_TRASH_DIR);
+            add_purge_dir(dirs, &count, path);
+        }
+        endpwent();
+    } else {
+        add_purge_dir(dirs, &count, get_trash_dir());
+    }
+
+    for (size_t i = 0; i < mount_count; i++) {
+        add_purge_dir(dirs, &count, mount_dirs[i]);
+        free(mount_dirs[i]);
+    }
+    free(mount_dirs);
+    return count;
+}
+
+/** Format the per-user accounting of a purge for the summary record
+ *
+ * @param purge purge state
+ * @param buf output buffer
+ * @param size size of \p buf
+ */
+static void format_users(const struct Purge *purge, char *buf, size_t size) {
+    size_t len = (size_t) snprintf(buf, size, "per user:");
+    for (size_t i = 0; i < purge->user_count && len < size; i++) {
+        const struct passwd *pw = getpwuid(purge->users[i].uid);
+        if (pw)
+            len += (size_t) snprintf(buf + len, size - len, " %s=%llu/%lluB", pw->pw_name, purge->users[i].entries,
+                                     purge->users[i].bytes);
+        else
+            len += (size_t) snprintf(buf + len, size - len, " %u=%llu/%lluB", (unsigned) purge->users[i].uid,
+                                     purge->users[i].entries, purge->users[i].bytes);
+    }
+}
+
+/** Remove the trash entries older than a cutoff from trash directories
+ *
+ * Every removed entry is counted rather than logged, whatever `audit=` says, and the run is logged as one summary
+ * record with per-user entry and byte counts.
+ *
+ * @param dirs trash directories
+ * @param count number of directories
+ * @param cutoff entries trashed before this time are removed
+ * @param opts removal options, `recursive` and `use_trash` are ignored
+ * @return 0 for success 1 for error
+ */
+int purge_trash(char *const *dirs, size_t count, time_t cutoff, const struct Options *opts) {
+    struct Options purge_opts = *opts;
+    purge_opts.recursive = true;
+    purge_opts.use_trash = false;
+    purge_opts.one_file_system = false;
+    struct Purge purge = {.opts = &purge_opts, .cutoff = cutoff, .users = NULL, .user_count = 0};
+
+    enum AuditMode saved_mode = audit_mode;
+    audit_mode = AUDIT_SUMMARY;
+    audit_begin("trash", "PURGE");
+
+    int ret = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (purge_trash_dir(&purge, dirs[i]) != 0)
+            ret = 1;
+    }
+
+    unsigned long long entries, bytes, failures;
+    audit_counts(&entries, &bytes, &failures);
+    if (opts->verbose && opts->output == OUTPUT_TEXT) {
+        printf("purged %llu entries, %llu bytes from %zu trash directories\n", entries, bytes, count);
+    }
+
+    char detail[PURGE_DETAIL_MAX];
+    format_users(&purge, detail, sizeof(detail));
+    audit_end_detail(detail);
+    audit_mode = saved_mode;
+
+    free(purge.users);
+    return ret;
+}
@@ -0,0 +1,339 @@
+/*! \file quota.c
+ * Size and age limits of the trash, set with `trash_max_bytes=` and `trash_max_age=` in the configuration files
+ *
+ * The trash index keeps running byte and inode totals of every trash directory, so checking a limit before an entry
+ * is trashed costs one read of the index header. When the new entry would not fit, or the oldest entry is past the age
+ * limit, entries are evicted oldest first: the index lists them in the order they were trashed and remembers where the
+ * live ones start, so evicting k entries visits k records. Evicted entries are removed right away, or with
+ * `trash_evict=background` renamed into the staging directory of their filesystem and left to the background worker.
+ * Evictions are audited as EVICT records of the trash directory, not as removals of the operand being trashed.
+ *
+ * Directory trees are measured when they are trashed under a byte limit only, without it a tree counts as its
+ * directory, which keeps trashing a tree a single rename. A tree that cannot be measured whole is not trashed, rather
+ * than being admitted for less than it takes.
+ */
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../include/better_rm.h"
+
+uint64_t trash_max_bytes; /*!< selected with `trash_max_bytes=`, 0 for no limit */
+time_t trash_max_age; /*!< selected with `trash_max_age=`, in seconds, 0 for no limit */
+enum TrashEvict trash_evict = TRASH_EVICT_SYNC; /*!< selected with `trash_evict=` */
+
+
+/** Parse a byte count with an optional binary unit
+ *
+ * @param s count, optionally followed by `K`, `M`, `G` or `T`
+ * @param bytes receives the count
+ * @return 0 for success -1 for an invalid count
+ */
+int quota_parse_bytes(const char *s, uint64_t *bytes) {
+    char *end;
+    errno = 0;
+    unsigned long long value = strtoull(s, &end, 10);
+    if (end == s || errno != 0 || s[0] == '-')
+        return -1;
+
+    const char *units = "KMGT";
+    const char *unit = end[0] != '\0' ? strchr(units, end[0] & ~0x20) : NULL;
+    if (end[0] != '\0' && (!unit || end[1] != '\0'))
+        return -1;
+    unsigned shift = unit ? 10u * (unsigned) (unit - units + 1) : 0;
+    if (shift > 0 && value > (UINT64_MAX >> shift))
+        return -1;
+    *bytes = (uint64_t) value << shift;
+    return 0;
+}
+
+/** Parse an age with an optional unit
+ *
+ * @param s age, followed by `s`, `m`, `h`, `d` or `w`, days without a unit
+ * @param seconds receives the age
+ * @return 0 for success -1 for an invalid age
+ */
+int quota_parse_age(const char *s, time_t *seconds) {
+    char *end;
+    errno = 0;
+    long long value = strtoll(s, &end, 10);
+    if (end == s || errno != 0 || value < 0)
+        return -1;
+
+    long long unit;
+    switch (end[0]) {
+        case 's':
+            unit = 1;
+            break;
+        case 'm':
+            unit = 60;
+            break;
+        case 'h':
+            unit = 60 * 60;
+            break;
+        case '\0':
+        case 'd':
+            unit = 24 * 60 * 60;
+            break;
+        case 'w':
+            unit = 7 * 24 * 60 * 60;
+            break;
+        default:
+            return -1;
+    }
+    if ((end[0] != '\0' && end[1] != '\0') || value > LLONG_MAX / unit)
+        return -1;
+    *seconds = (time_t) (value * unit);
+    return 0;
+}
+
+/*! Directory on the explicit stack of a measured tree */
+struct MeasureFrame {
+    struct WalkDir dir; /*!< open directory */
+    char *subdirs; /*!< NUL separated names of the subdirectories left to measure */
+    size_t subdirs_len; /*!< used bytes of \ref subdirs */
+    size_t subdirs_cap; /*!< allocated bytes of \ref subdirs */
+    size_t next; /*!< offset of the next subdirectory in \ref subdirs */
+};
+
+/** Add up the entries of one directory, remembering its subdirectories
+ *
+ * @param frame directory
+ * @param batch reader shared by the whole measurement
+ * @param usage totals to be increased
+ * @return 0 for success -1 with errno set if an entry cannot be read or stat'ed
+ */
+static int measure_scan(struct MeasureFrame *frame, struct DirBatch *batch, struct TrashUsage *usage) {
+    dir_batch_reset(batch);
+    const struct dirent *entry;
+    while ((entry = dir_batch_next(batch, frame->dir.fd)) != NULL) {
+        struct stat st;
+        uint64_t start = stats_begin();
+        int ret = fstatat(frame->dir.fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW);
+        stats_end(STATS_STAT, start, ret != 0);
+        // An entry removed meanwhile takes no room in the trash
+        if (ret != 0 && errno == ENOENT)
+            continue;
+        if (ret != 0)
+            return -1;
+        usage->bytes += st.st_size > 0 ? (uint64_t) st.st_size : 0;
+        usage->inodes++;
+        if (!S_ISDIR(st.st_mode))
+            continue;
+
+        size_t len = strlen(entry->d_name) + 1;
+        if (frame->subdirs_len + len > frame->subdirs_cap) {
+            size_t cap = frame->subdirs_cap ? frame->subdirs_cap * 2 : 256;
+            while (cap < frame->subdirs_len + len)
+                cap *= 2;
+            char *grown = realloc(frame->subdirs, cap);
+            if (!grown)
+                return -1;
+            frame->subdirs = grown;
+            frame->subdirs_cap = cap;
+        }
+        memcpy(frame->subdirs + frame->subdirs_len, entry->d_name, len);
+        frame->subdirs_len += len;
+    }
+    return errno != 0 ? -1 : 0;
+}
+
+/** Add up the entries of a directory tree
+ *
+ * The walk keeps one frame per level on the heap and closes the ancestors with walk_dir_enter(), so neither the C
+ * stack nor the number of fds grows with the depth of the tree.
+ *
+ * @param fd directory, closed
+ * @param usage totals to be increased
+ * @return 0 for success -1 with errno set if part of the tree cannot be measured
+ */
+static int measure_dir(int fd, struct TrashUsage *usage) {
+    struct MeasureFrame *frames = malloc(64 * sizeof(*frames));
+    if (!frames) {
+        close(fd);
+        return -1;
+    }
+    size_t cap = 64;
+    size_t depth = 1;
+    frames[0] = (struct MeasureFrame) {.subdirs = NULL};
+    walk_dir_enter(&frames[0].dir, NULL, fd);
+    struct DirBatch batch = {.buf = NULL};
+    int ret = measure_scan(&frames[0], &batch, usage);
+
+    while (ret == 0 && depth > 0) {
+        struct MeasureFrame *frame = &frames[depth - 1];
+        if (frame->next == frame->subdirs_len) {
+            ret = walk_dir_leave(&frame->dir);
+            free(frame->subdirs);
+            depth--;
+            continue;
+        }
+
+        const char *name = frame->subdirs + frame->next;
+        frame->next += strlen(name) + 1;
+        int child = openat(frame->dir.fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (child < 0) {
+            if (errno != ENOENT)
+                ret = -1;
+            continue;
+        }
+        if (depth == cap) {
+            // Growing the stack moves the frames, the levels are linked to their parents again
+            struct MeasureFrame *grown = realloc(frames, cap * 2 * sizeof(*grown));
+            if (!grown) {
+                close(child);
+                ret = -1;
+                break;
+            }
+            for (size_t i = 1; i < depth; i++)
+                grown[i].dir.parent = &grown[i - 1].dir;
+            frames = grown;
+            cap *= 2;
+        }
+        frame = &frames[depth++];
+        *frame = (struct MeasureFrame) {.subdirs = NULL};
+        walk_dir_enter(&frame->dir, &frames[depth - 2].dir, child);
+        ret = measure_scan(frame, &batch, usage);
+    }
+
+    int saved_errno = errno;
+    for (size_t i = 0; i < depth; i++) {
+        if (frames[i].dir.fd >= 0)
+            close(frames[i].dir.fd);
+        free(frames[i].subdirs);
+    }
+    free(frames);
+    dir_batch_free(&batch);
+    errno = saved_errno;
+    return ret;
+}
+
+/** Measure an entry about to be trashed
+ *
+ * @param dirfd directory file descriptor \p name is relative to, or `AT_FDCWD`
+ * @param name entry name relative to \p dirfd
+ * @param st lstat() of the entry
+ * @param usage receives the size and inodes of the entry, of the whole tree for a directory under a byte limit
+ * @return 0 for success -1 with errno set if the tree cannot be measured, it must not be trashed then
+ */
+int trash_quota_measure(int dirfd, const char *name, const struct stat *st, struct TrashUsage *usage) {
+    usage->bytes = st->st_size > 0 ? (uint64_t) st->st_size : 0;
+    usage->inodes = 1;
+    usage->oldest_at = 0;
+    if (trash_max_bytes == 0 || !S_ISDIR(st->st_mode))
+        return 0;
+    int fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    return measure_dir(fd, usage);
+}
+
+/** Remove one evicted entry from a trash directory
+ *
+ * @param index open index of the trash directory
+ * @param record record of the entry, already removed from the index
+ * @param trash_dir trash directory
+ * @param name entry name inside the trash directory
+ * @param verbose verbose output
+ */
+static void evict_entry(const struct TrashIndex *index, const struct TrashRecord *record, const char *trash_dir,
+                        const char *name, bool verbose) {
+    char path[PATH_MAX];
+    off_t size = (off_t) record->size;
+    int len = snprintf(path, sizeof(path), "%s/%s", trash_dir, name);
+    struct stat st;
+    if (len < 0 || (size_t) len >= sizeof(path) || fstatat(index->dirfd, name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+        return;
+    if (verbose)
+        printf("evicting '%s' from the trash\n", path);
+
+    // The staging directory is on the filesystem of the trash, so staging is a rename whatever the entry is. An entry
+    // linking to blobs is removed right away, its blobs can only be freed once it is gone
+    if (trash_evict == TRASH_EVICT_BACKGROUND && !(record->flags & TRASH_RECORD_BLOBS) &&
+        background_move(path, &st, NULL, 0) == 0) {
+        log_deletion(path, "EVICT", true, size);
+        return;
+    }
+    if (S_ISDIR(st.st_mode)) {
+        struct Options opts = {.recursive = true, .force = true, .preserve_root = true, .output = OUTPUT_TEXT};
+        remove_directory(path, &opts);
+    } else {
+        uint64_t start = stats_begin();
+        int ret = unlinkat(index->dirfd, name, 0);
+        stats_end(STATS_UNLINK, start, ret != 0);
+        log_deletion(path, "EVICT", ret == 0, size);
+    }
+    dedup_release(index, record);
+}
+
+/** Evict the oldest entries of a trash directory until the limits are met
+ *
+ * @param trash_dir trash directory
+ * @param used bytes used by the trash directory
+ * @param incoming bytes of the entry about to be trashed
+ * @param cutoff entries trashed before this time are evicted
+ * @param verbose verbose output
+ */
+static void trash_quota_evict(const char *trash_dir, uint64_t used, uint64_t incoming, int64_t cutoff, bool verbose) {
+    // Only the records from the oldest live one on are visited, no name is looked up
+    struct TrashIndex index;
+    if (trash_index_open_records(trash_dir, &index) != 0)
+        return;
+
+    audit_nested_begin(trash_dir, "EVICT");
+    size_t i = (size_t) __atomic_load_n(&index.header->oldest, __ATOMIC_RELAXED);
+    for (; i < index.count; i++) {
+        struct TrashRecord *record = &index.records[i];
+        if (record->flags & TRASH_RECORD_REMOVED)
+            continue;
+        if ((trash_max_bytes == 0 || used + incoming <= trash_max_bytes) && record->deleted_at >= cutoff)
+            break;
+
+        // Names come from a file of the user, never leave the trash directory
+        const char *name = trash_index_string(&index, record->name_offset);
+        if (!name || name[0] == '\0' || strchr(name, '/') || strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+            continue;
+        // A concurrent eviction took the record
+        if (!trash_index_remove(&index, record))
+            continue;
+        used -= (uint64_t) record->size < used ? (uint64_t) record->size : used;
+        evict_entry(&index, record, trash_dir, name, verbose);
+    }
+    audit_nested_end();
+    trash_index_skip(&index, i);
+    trash_index_close(&index);
+}
+
+/** Make room in a trash directory for a new entry
+ *
+ * Nothing is evicted when the usage of the trash directory cannot be read, a broken index never blocks trashing.
+ *
+ * @param trash_dir trash directory
+ * @param usage measure of the entry, see trash_quota_measure()
+ * @param verbose verbose output
+ * @return 0 if the entry may be trashed, -1 with `errno` set to `EFBIG` if it is larger than the byte limit
+ */
+int trash_quota_admit(const char *trash_dir, const struct TrashUsage *usage, bool verbose) {
+    if (trash_max_bytes == 0 && trash_max_age == 0)
+        return 0;
+    if (trash_max_bytes != 0 && usage->bytes > trash_max_bytes) {
+        errno = EFBIG;
+        return -1;
+    }
+
+    struct TrashUsage used;
+    if (trash_index_usage(trash_dir, &used) != 0)
+        return 0;
+    int64_t cutoff = trash_max_age != 0 ? (int64_t) (time(NULL) - trash_max_age) : INT64_MIN;
+    if ((trash_max_bytes == 0 || used.bytes + usage->bytes <= trash_max_bytes) && used.oldest_at >= cutoff)
+        return 0;
+    trash_quota_evict(trash_dir, used.bytes, usage->bytes, cutoff, verbose);
+    return 0;
+}
@@ -0,0 +1,432 @@
+/*! \file restore.c
+ * Restoring trashed entries to where they came from with `--restore`
+ *
+ * The entries to be restored are picked from the trash indexes alone: by original path, which matches the entry and
+ * everything that was below it, by a `fnmatch()` pattern on the original path, where `*` also matches `/` as in
+ * `find -path`, and by the time they were trashed. Nothing in the trash directories is read or stat'ed to find them.
+ *
+ * A trashed tree is put back with a single rename whatever its size, an entry on another filesystem than its original
+ * location, or linking to blobs of the deduplicated store, goes through the copy engine of the trash. Renames never
+ * replace an existing entry. Matches are sorted by path, so a directory comes right before what was trashed below it:
+ * directories other matches live in are restored first and in order, everything else is then spread over `-j` workers.
+ * Missing parent directories are created, and an empty trashed directory whose original path exists again as a
+ * directory is merged into it. Only trash directories trash_dir_trusted() accepts are read, and only the entries the
+ * caller trashed are restored.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../include/better_rm.h"
+
+/*! One trashed entry picked for restoring */
+struct RestoreEntry {
+    struct TrashIndex *index; /*!< index of the trash directory holding the entry */
+    struct TrashRecord *record; /*!< record of the entry */
+    const char *trash_dir; /*!< trash directory holding the entry */
+    const char *name; /*!< entry name inside the trash directory */
+    char *path; /*!< original path, normalized */
+    bool ancestor; /*!< other matches were trashed below this entry, it is restored before them */
+};
+
+/*! State of a restore run */
+struct Restore {
+    const struct Options *opts; /*!< provided options */
+    struct TrashIndex *indexes; /*!< open indexes of the trash directories */
+    struct RestoreEntry *entries; /*!< matched entries, sorted by path */
+    size_t count; /*!< number of \ref entries */
+    size_t next; /*!< next entry taken by a worker */
+    bool failed; /*!< an entry could not be restored */
+};
+
+
+/** Normalize an absolute path in place
+ *
+ * Repeated slashes, `.` components and trailing slashes are dropped. `..` is kept, the path may not exist.
+ *
+ * @param path absolute path
+ */
+void normalize_path(char *path) {
+    char *out = path;
+    const char *in = path;
+    while (*in) {
+        if (in[0] == '/' && (in[1] == '/' || in[1] == '\0' || (in[1] == '.' && (in[2] == '/' || in[2] == '\0')))) {
+            in += in[1] == '.' ? 2 : 1;
+            continue;
+        }
+        *out++ = *in++;
+    }
+    if (out == path)
+        *out++ = '/';
+    *out = '\0';
+}
+
+/** Make an operand absolute against the working directory and normalize it
+ *
+ * @param operand path or pattern given on the command line
+ * @return malloc'ed absolute path, NULL if out of memory or the working directory is unknown
+ */
+char *absolute_operand(const char *operand) {
+    char *absolute;
+    if (operand[0] == '/') {
+        absolute = strdup(operand);
+    } else {
+        char cwd[PATH_MAX];
+        if (!getcwd(cwd, sizeof(cwd)))
+            return NULL;
+        size_t len = strlen(cwd) + 1 + strlen(operand) + 1;
+        absolute = malloc(len);
+        if (absolute)
+            snprintf(absolute, len, "%s/%s", cwd, operand);
+    }
+    if (absolute)
+        normalize_path(absolute);
+    return absolute;
+}
+
+/** Tell whether an original path is selected by one of the operands
+ *
+ * @param path normalized original path
+ * @param patterns normalized absolute operands
+ * @param count number of \p patterns, 0 selects every path
+ * @return true if the entry is to be restored
+ */
+static bool path_selected(const char *path, char *const *patterns, size_t count) {
+    if (count == 0)
+        return true;
+    for (size_t i = 0; i < count; i++) {
+        const char *pattern = patterns[i];
+        if (strpbrk(pattern, "*?[")) {
+            if (fnmatch(pattern, path, 0) == 0)
+                return true;
+            continue;
+        }
+        size_t len = strlen(pattern);
+        if (strncmp(path, pattern, len) == 0 && (path[len] == '\0' || path[len] == '/' || len == 1))
+            return true;
+    }
+    return false;
+}
+
+/** Order two matches by path, with `/` before every other byte so descendants follow their directory
+ *
+ * Entries trashed under the same path come newest first.
+ *
+ * @param a pointer to the first entry
+ * @param b pointer to the second entry
+ * @return negative, zero or positive like strcmp()
+ */
+static int compare_entries(const void *a, const void *b) {
+    const struct RestoreEntry *entry_a = a, *entry_b = b;
+    const unsigned char *pa = (const unsigned char *) entry_a->path, *pb = (const unsigned char *) entry_b->path;
+    while (*pa && *pa == *pb) {
+        pa++;
+        pb++;
+    }
+    if (*pa != *pb) {
+        int ca = *pa == '/' ? 1 : *pa == '\0' ? 0 : *pa + 1;
+        int cb = *pb == '/' ? 1 : *pb == '\0' ? 0 : *pb + 1;
+        return ca - cb;
+    }
+    int64_t at_a = entry_a->record->deleted_at, at_b = entry_b->record->deleted_at;
+    return (at_a < at_b) - (at_a > at_b);
+}
+
+/** Collect the matching entries of one trash directory
+ *
+ * @param restore restore state
+ * @param index open index of the trash directory
+ * @param trash_dir trash directory
+ * @param patterns normalized absolute operands
+ * @param count number of \p patterns
+ * @param deleted_after entries trashed before this time are skipped
+ * @param deleted_before entries trashed after this time are skipped
+ * @param cap allocated size of the entries
+ * @return 0 for success -1 if out of memory
+ */
+static int collect_entries(struct Restore *restore, struct TrashIndex *index, const char *trash_dir,
+                           char *const *patterns, size_t count, int64_t deleted_after, int64_t deleted_before,
+                           size_t *cap) {
+    for (size_t i = 0; i < index->count; i++) {
+        struct TrashRecord *record = &index->records[i];
+        // Only what the caller trashed goes back, with the caller's permissions
+        if ((record->flags & TRASH_RECORD_REMOVED) || record->uid != (uint32_t) getuid() ||
+            record->deleted_at < deleted_after || record->deleted_at > deleted_before)
+            continue;
+        const char *path = trash_index_string(index, record->path_offset);
+        const char *name = trash_index_string(index, record->name_offset);
+        // Names come from a file of the user, never leave the trash directory
+        if (!path || path[0] != '/' || !name || name[0] == '\0' || strchr(name, '/') || strcmp(name, ".") == 0 ||
+            strcmp(name, "..") == 0)
+            continue;
+        // An older record of a reused name describes an entry that is gone
+        if (trash_index_find(index, name) != record)
+            continue;
+
+        char *normalized = strdup(path);
+        if (!normalized)
+            return -1;
+        normalize_path(normalized);
+        if (strcmp(normalized, "/") == 0 || !path_selected(normalized, patterns, count)) {
+            free(normalized);
+            continue;
+        }
+
+        if (restore->count == *cap) {
+            size_t grown_cap = *cap ? *cap * 2 : 256;
+            struct RestoreEntry *grown = realloc(restore->entries, grown_cap * sizeof(*grown));
+            if (!grown) {
+                free(normalized);
+                return -1;
+            }
+            restore->entries = grown;
+            *cap = grown_cap;
+        }
+        restore->entries[restore->count++] = (struct RestoreEntry){
+                .index = index, .record = record, .trash_dir = trash_dir, .name = name, .path = normalized};
+    }
+    return 0;
+}
+
+/** Create the missing parent directories of a path, like `mkdir -p`
+ *
+ * The modes of the original parents are unknown, the ones created are private to the user.
+ *
+ * @param path absolute path whose parents are created
+ */
+static void make_parents(const char *path) {
+    char *parent = strdup(path);
+    if (!parent)
+        return;
+    for (char *slash = strchr(parent + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        // Concurrent workers create the same parents
+        mkdir(parent, 0700);
+        *slash = '/';
+    }
+    free(parent);
+}
+
+/** Move a trashed entry to its original path, never replacing what is there
+ *
+ * @param entry entry to be restored
+ * @return 0 for success -1 for error
+ */
+static int restore_move(const struct RestoreEntry *entry) {
+    int dirfd = entry->index->dirfd;
+    int ret = -1;
+    // A rename would hand the inodes of blobs out of the trash, an entry linking to any is copied on any filesystem
+    bool copy = entry->record->flags & TRASH_RECORD_BLOBS;
+    for (int attempt = 0; attempt < 2; attempt++) {
+        uint64_t start;
+        if (!copy) {
+            start = stats_begin();
+            ret = renameat2(dirfd, entry->name, AT_FDCWD, entry->path, RENAME_NOREPLACE);
+            // Filesystems without RENAME_NOREPLACE, the check races with other writers of the original location only
+            if (ret != 0 && errno == EINVAL) {
+                struct stat st;
+                if (lstat(entry->path, &st) == 0) {
+                    errno = EEXIST;
+                } else {
+                    ret = renameat(dirfd, entry->name, AT_FDCWD, entry->path);
+                }
+            }
+            stats_end(STATS_RENAME, start, ret != 0);
+        }
+
+        if (copy || (ret != 0 && errno == EXDEV)) {
+            start = stats_begin();
+            // Part of a directory moved out of the trash stays restored, the rest stays in the trash entry
+            ret = copy_to_trash_at(dirfd, entry->name, entry->path, false) == 0 ? 0 : -1;
+            stats_end(STATS_COPY, start, ret != 0);
+        }
+        if (ret == 0 || errno != ENOENT || attempt > 0)
+            break;
+        // The trashed entry itself vanishing looks the same, creating the parents then does no harm
+        make_parents(entry->path);
+    }
+
+    if (ret != 0 && errno == EEXIST && S_ISDIR(entry->record->mode)) {
+        struct stat st;
+        int saved_errno = errno;
+        // An emptied directory trashed after its entries, the original location was created again
+        if (lstat(entry->path, &st) == 0 && S_ISDIR(st.st_mode) && unlinkat(dirfd, entry->name, AT_REMOVEDIR) == 0)
+            return 0;
+        errno = saved_errno;
+    }
+    return ret;
+}
+
+/** Restore one matched entry and report it
+ *
+ * @param restore restore state
+ * @param entry entry to be restored
+ */
+static void restore_entry(struct Restore *restore, const struct RestoreEntry *entry) {
+    const struct Options *opts = restore->opts;
+    off_t size = S_ISDIR(entry->record->mode) ? -1 : (off_t) entry->record->size;
+    if (opts->dry_run) {
+        if (output_human(opts))
+            printf("[DRY-RUN] would restore '%s' from '%s/%s'\n", entry->path, entry->trash_dir, entry->name);
+        output_record(opts, entry->path, "RESTORE", size, 0);
+        return;
+    }
+
+    int ret = restore_move(entry);
+    int err = ret == 0 ? 0 : errno;
+    if (ret == 0) {
+        if (trash_index_remove(entry->index, entry->record))
+            dedup_release(entry->index, entry->record);
+        if (output_human(opts))
+            printf("restored '%s' from '%s/%s'\n", entry->path, entry->trash_dir, entry->name);
+    } else {
+        __atomic_store_n(&restore->failed, true, __ATOMIC_RELAXED);
+        fprintf(stderr, "better-rm: cannot restore '%s' from '%s/%s': %s\n", entry->path, entry->trash_dir,
+                entry->name, strerror(err));
+    }
+    errno = err;
+    log_deletion(entry->path, "RESTORE", ret == 0, size);
+    output_record(opts, entry->path, "RESTORE", size, err);
+}
+
+/** Restore the matches no other match depends on, shared by every worker
+ *
+ * @param arg restore state
+ * @return NULL
+ */
+static void *restore_worker(void *arg) {
+    struct Restore *restore = arg;
+    for (;;) {
+        size_t i = __atomic_fetch_add(&restore->next, 1, __ATOMIC_RELAXED);
+        if (i >= restore->count)
+            break;
+        if (!restore->entries[i].ancestor)
+            restore_entry(restore, &restore->entries[i]);
+    }
+    return NULL;
+}
+
+/** Restore trashed entries to their original paths
+ *
+ * @param trash_dir trash directory to restore from, NULL for the trash of the user and its per-mount trashes
+ * @param operands original paths, restored with everything that was below them, or patterns, none to select everything
+ * @param count number of \p operands
+ * @param deleted_after entries trashed before this time are left in the trash
+ * @param deleted_before entries trashed after this time are left in the trash
+ * @param opts provided options, `-j` restores that many entries at once
+ * @return 0 for success 1 for error
+ */
+int restore_trash(const char *trash_dir, char *const *operands, size_t count, int64_t deleted_after,
+                  int64_t deleted_before, const struct Options *opts) {
+    char **mount_dirs = NULL;
+    size_t mount_count = trash_dir ? 0 : mount_trash_dirs(false, &mount_dirs);
+    const char **dirs = malloc((mount_count + 1) * sizeof(*dirs));
+    size_t dir_count = 0;
+    if (dirs) {
+        dirs[dir_count++] = trash_dir ? trash_dir : get_trash_dir();
+        for (size_t i = 0; i < mount_count; i++) {
+            if (strcmp(mount_dirs[i], dirs[0]) != 0)
+                dirs[dir_count++] = mount_dirs[i];
+        }
+    }
+
+    struct Restore restore = {.opts = opts, .indexes = NULL, .entries = NULL, .count = 0, .next = 0, .failed = false};
+    char **patterns = calloc(count ? count : 1, sizeof(*patterns));
+    restore.indexes = calloc(dir_count ? dir_count : 1, sizeof(*restore.indexes));
+    int ret = dirs && patterns && restore.indexes ? 0 : 1;
+    for (size_t i = 0; ret == 0 && i < count; i++) {
+        patterns[i] = absolute_operand(operands[i]);
+        if (!patterns[i]) {
+            fprintf(stderr, "better-rm: cannot restore '%s': %s\n", operands[i], strerror(errno));
+            ret = 1;
+        }
+    }
+
+    size_t cap = 0;
+    size_t opened = 0;
+    for (size_t i = 0; ret == 0 && i < dir_count; i++) {
+        int dirfd = open(dirs[i], O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (dirfd >= 0 && !trash_dir_trusted(dirfd, dirs[i])) {
+            fprintf(stderr, "better-rm: cannot restore from '%s': Trash directory not owned by its user\n", dirs[i]);
+            close(dirfd);
+            ret = 1;
+            continue;
+        }
+        if (trash_index_open_at(dirfd, &restore.indexes[opened]) != 0) {
+            if (errno != ENOENT) {
+                fprintf(stderr, "better-rm: cannot read trash index in '%s': %s\n", dirs[i], strerror(errno));
+                ret = 1;
+            }
+            continue;
+        }
+        opened++;
+        if (collect_entries(&restore, &restore.indexes[opened - 1], dirs[i], patterns, count, deleted_after,
+                            deleted_before, &cap) != 0) {
+            fprintf(stderr, "better-rm: cannot restore from '%s': %s\n", dirs[i], strerror(ENOMEM));
+            ret = 1;
+        }
+    }
+
+    if (ret == 0 && restore.count > 0) {
+        qsort(restore.entries, restore.count, sizeof(*restore.entries), compare_entries);
+        // Only the newest entry trashed under a path goes back, it is first of its run
+        size_t kept = 0;
+        for (size_t i = 0; i < restore.count; i++) {
+            if (kept > 0 && strcmp(restore.entries[kept - 1].path, restore.entries[i].path) == 0) {
+                free(restore.entries[i].path);
+                continue;
+            }
+            restore.entries[kept++] = restore.entries[i];
+        }
+        restore.count = kept;
+
+        audit_begin("trash", "RESTORE");
+        for (size_t i = 0; i + 1 < restore.count; i++) {
+            const char *path = restore.entries[i].path;
+            size_t len = strlen(path);
+            if (strncmp(restore.entries[i + 1].path, path, len) == 0 && restore.entries[i + 1].path[len] == '/') {
+                restore.entries[i].ancestor = true;
+                restore_entry(&restore, &restore.entries[i]);
+            }
+        }
+
+        int workers = opts->jobs > 1 ? opts->jobs : 1;
+        pthread_t *threads = workers > 1 ? calloc((size_t) workers, sizeof(*threads)) : NULL;
+        int started = 0;
+        for (; threads && started < workers - 1; started++) {
+            if (pthread_create(&threads[started], NULL, restore_worker, &restore) != 0)
+                break;
+        }
+        // Fewer threads than requested is not an error, the ones that started share the work
+        restore_worker(&restore);
+        for (int i = 0; i < started; i++)
+            pthread_join(threads[i], NULL);
+        free(threads);
+        audit_end();
+
+        if (restore.failed)
+            ret = 1;
+    }
+
+    for (size_t i = 0; i < restore.count; i++)
+        free(restore.entries[i].path);
+    free(restore.entries);
+    for (size_t i = 0; i < opened; i++)
+        trash_index_close(&restore.indexes[i]);
+    free(restore.indexes);
+    for (size_t i = 0; patterns && i < count; i++)
+        free(patterns[i]);
+    free(patterns);
+    for (size_t i = 0; i < mount_count; i++)
+        free(mount_dirs[i]);
+    free(mount_dirs);
+    free(dirs);
+    return ret;
+}
@@ -0,0 +1,464 @@
+/*! \file snapshot.c
+ * Binary snapshot of the parsed configuration
+ *
+ * Parsing the configuration files and resolving every protected directory to its identity costs more than most
+ * removals, so the result is kept in `$XDG_CACHE_HOME/better-rm/config.snapshot` and mapped by the next invocations.
+ * The snapshot holds the protected directory names, the keep patterns, the audit mode, the trash limits and the hash
+ * tables and the real paths of the protected set as they are laid out in memory. It is keyed on the device, inode,
+ * size, mtime and ctime of \ref CONFIG_FILE, of the user configuration file and of the executable, whose defaults it
+ * holds, on the user and on the mount table, and is rebuilt from the text files whenever one of them changes. A
+ * protected directory replaced, created or removed since the snapshot was built rebuilds it as well: each of those
+ * changes the mtime of the directory holding it, so every load stats the distinct parents of the protected paths, a
+ * single `/` for the default set, instead of every protected path. Parents modified within \ref SNAPSHOT_SETTLE_SECONDS
+ * of the build could change again within the same timestamp, the protected paths themselves are stat'ed then.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../include/better_rm.h"
+
+#define SNAPSHOT_NAME "config.snapshot"
+#define SNAPSHOT_MAGIC "BRMCFG1"
+#define SNAPSHOT_VERSION 8
+#define SNAPSHOT_ALIGN 8
+#define SNAPSHOT_SOURCES 3
+#define SNAPSHOT_SETTLE_SECONDS 2 /*!< mtime age past any filesystem timestamp granularity, FAT has 2 seconds */
+
+/*! Identity of a configuration file the snapshot was built from */
+struct SnapshotSource {
+    uint64_t dev; /*!< device */
+    uint64_t ino; /*!< inode */
+    uint64_t size; /*!< size in bytes */
+    int64_t mtime_sec; /*!< modification time, seconds */
+    int64_t mtime_nsec; /*!< modification time, nanoseconds */
+    int64_t ctime_sec; /*!< status change time, seconds */
+    int64_t ctime_nsec; /*!< status change time, nanoseconds */
+    uint32_t exists; /*!< 0 if the file did not exist */
+    uint32_t reserved; /*!< padding, 0 */
+};
+
+/*! Identity and modification time of a directory holding protected paths */
+struct SnapshotParent {
+    uint64_t dev; /*!< device, 0 if the directory did not exist */
+    uint64_t ino; /*!< inode */
+    int64_t mtime_sec; /*!< modification time, seconds */
+    int64_t mtime_nsec; /*!< modification time, nanoseconds */
+};
+
+/*! Header of a snapshot file, followed by the string table and the hash tables at the given offsets */
+struct SnapshotHeader {
+    char magic[8]; /*!< \ref SNAPSHOT_MAGIC */
+    uint32_t version; /*!< \ref SNAPSHOT_VERSION */
+    uint32_t id_size; /*!< size of one protected identity, checks the layout of this build */
+    uint32_t ino_size; /*!< `sizeof(ino_t)` */
+    uint32_t uid; /*!< user the snapshot was built for */
+    struct SnapshotSource sources[SNAPSHOT_SOURCES]; /*!< system and user configuration file, executable */
+    uint64_t mounts_hash; /*!< mounts_hash() when the snapshot was built */
+    uint32_t audit_mode; /*!< parsed `audit=` setting */
+    uint32_t protected_count; /*!< number of protected directory names */
+    uint32_t audit_journal; /*!< parsed `audit_journal=` setting */
+    uint32_t keep_count; /*!< number of `keep=` patterns, stored after the protected directory names */
+    uint64_t trash_max_bytes; /*!< parsed `trash_max_bytes=` setting */
+    int64_t trash_max_age; /*!< parsed `trash_max_age=` setting */
+    uint32_t trash_evict; /*!< parsed `trash_evict=` setting */
+    uint32_t trash_dedup; /*!< parsed `trash_dedup=` setting */
+    uint64_t strings_offset; /*!< NUL terminated protected directory names, then keep patterns */
+    uint64_t strings_len; /*!< length of the string table */
+    uint64_t ids_offset; /*!< identity slots */
+    uint64_t id_slots; /*!< number of identity slots */
+    uint64_t id_count; /*!< used identity slots */
+    uint64_t probes_offset; /*!< probe inode slots */
+    uint64_t probe_slots; /*!< number of probe slots */
+    uint64_t probe_count; /*!< used probe slots */
+    uint64_t places_offset; /*!< NUL terminated real paths the protected directories are reached at */
+    uint64_t places_len; /*!< length of the real paths */
+    uint64_t roots_offset; /*!< NUL terminated paths the protected set was built from */
+    uint64_t roots_len; /*!< length of the paths the protected set was built from */
+    uint64_t root_ids_offset; /*!< identity of every path the protected set was built from */
+    uint64_t root_count; /*!< number of paths the protected set was built from */
+    uint64_t parents_offset; /*!< state of the distinct parents of the paths the protected set was built from */
+    uint64_t parent_count; /*!< number of parents, 0 when the paths themselves are checked on load */
+};
+
+
+/** Resolve the snapshot directory
+ *
+ * @param buf output buffer
+ * @param size size of \p buf
+ * @return 0 for success -1 if neither `XDG_CACHE_HOME` nor `HOME` is set
+ */
+static int snapshot_dir(char *buf, size_t size) {
+    const char *cache_home = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    int len;
+
+    if (cache_home && cache_home[0] == '/') {
+        len = snprintf(buf, size, "%s/better-rm", cache_home);
+    } else if (home) {
+        len = snprintf(buf, size, "%s/.cache/better-rm", home);
+    } else {
+        return -1;
+    }
+    return len > 0 && (size_t) len < size - sizeof(SNAPSHOT_NAME) - 16 ? 0 : -1;
+}
+
+/** Describe the current state of the files the configuration comes from
+ *
+ * @param sources receives the system and user configuration file and executable identities
+ */
+static void snapshot_sources(struct SnapshotSource sources[SNAPSHOT_SOURCES]) {
+    char user_config[PATH_MAX];
+    const char *paths[SNAPSHOT_SOURCES] = {
+        CONFIG_FILE,
+        user_config_path(user_config, sizeof(user_config)) == 0 ? user_config : NULL,
+        "/proc/self/exe",
+    };
+
+    memset(sources, 0, SNAPSHOT_SOURCES * sizeof(*sources));
+    for (int i = 0; i < SNAPSHOT_SOURCES; i++) {
+        struct stat st;
+        if (!paths[i] || stat(paths[i], &st) != 0)
+            continue;
+        sources[i] = (struct SnapshotSource) {
+            .dev = (uint64_t) st.st_dev,
+            .ino = (uint64_t) st.st_ino,
+            .size = (uint64_t) st.st_size,
+            .mtime_sec = (int64_t) st.st_mtim.tv_sec,
+            .mtime_nsec = (int64_t) st.st_mtim.tv_nsec,
+            .ctime_sec = (int64_t) st.st_ctim.tv_sec,
+            .ctime_nsec = (int64_t) st.st_ctim.tv_nsec,
+            .exists = 1,
+        };
+    }
+}
+
+/** Tell whether a table lies within the snapshot
+ *
+ * @param offset offset of the table
+ * @param count number of elements
+ * @param elem_size size of one element
+ * @param len size of the snapshot
+ * @return true if the table is aligned and in bounds
+ */
+static bool table_fits(uint64_t offset, uint64_t count, uint64_t elem_size, uint64_t len) {
+    return offset % SNAPSHOT_ALIGN == 0 && offset >= sizeof(struct SnapshotHeader) && offset <= len &&
+           count <= (len - offset) / elem_size;
+}
+
+/** Length of the parent directory part of a path
+ *
+ * @param path path
+ * @return length of the parent, 1 for `/` and its direct entries, 0 for a name without a directory
+ */
+static size_t parent_len(const char *path) {
+    const char *slash = strrchr(path, '/');
+    return !slash ? 0 : slash == path ? 1 : (size_t) (slash - path);
+}
+
+/** Stat the distinct parent directories of the paths the protected set was built from
+ *
+ * @param roots NUL terminated paths
+ * @param roots_len length of \p roots
+ * @param parents receives the state of every distinct parent in the order the paths first name it, room for one per
+ *        path
+ * @return number of parents
+ */
+static size_t stat_parents(const char *roots, size_t roots_len, struct SnapshotParent *parents) {
+    size_t count = 0;
+    for (const char *root = roots; root < roots + roots_len; root += strlen(root) + 1) {
+        size_t len = parent_len(root);
+        bool seen = false;
+        for (const char *prev = roots; prev < root && !seen; prev += strlen(prev) + 1)
+            seen = parent_len(prev) == len && memcmp(prev, root, len) == 0;
+        if (seen)
+            continue;
+
+        char parent[PATH_MAX];
+        struct stat st;
+        parents[count] = (struct SnapshotParent) {.dev = 0};
+        if (len < sizeof(parent)) {
+            memcpy(parent, len > 0 ? root : ".", len > 0 ? len : 1);
+            parent[len > 0 ? len : 1] = '\0';
+            if (stat(parent, &st) == 0)
+                parents[count] = (struct SnapshotParent) {
+                    .dev = (uint64_t) st.st_dev,
+                    .ino = (uint64_t) st.st_ino,
+                    .mtime_sec = (int64_t) st.st_mtim.tv_sec,
+                    .mtime_nsec = (int64_t) st.st_mtim.tv_nsec,
+                };
+        }
+        count++;
+    }
+    return count;
+}
+
+/** Tell whether the parents of the protected paths are as they were when the snapshot was built
+ *
+ * @param tables protected set of the snapshot
+ * @param parents parents recorded by the snapshot
+ * @param count number of \p parents
+ * @return true if none of them changed
+ */
+static bool parents_current(const struct ProtectedTables *tables, const struct SnapshotParent *parents, size_t count) {
+    struct SnapshotParent *now = malloc(tables->root_count * sizeof(*now));
+    if (!now)
+        return false;
+    bool current = stat_parents(tables->roots, tables->roots_len, now) == count &&
+                   memcmp(now, parents, count * sizeof(*now)) == 0;
+    free(now);
+    return current;
+}
+
+/** Load the configuration from the snapshot left by a previous invocation
+ *
+ * On success \ref protected_dirs points into the mapping, which is kept for the lifetime of the process, and the
+ * protected set uses the mapped hash tables without copying them.
+ *
+ * @return 0 if the configuration was loaded, -1 if the snapshot is missing, stale or invalid
+ */
+int config_snapshot_load(void) {
+    char path[PATH_MAX];
+    if (snapshot_dir(path, sizeof(path)) != 0)
+        return -1;
+    strcat(path, "/" SNAPSHOT_NAME);
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    if (fd < 0)
+        return -1;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 022) != 0 ||
+        (uint64_t) st.st_size < sizeof(struct SnapshotHeader)) {
+        close(fd);
+        return -1;
+    }
+    size_t len = (size_t) st.st_size;
+    void *map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -1;
+
+    const struct SnapshotHeader *header = map;
+    const char *base = map;
+    struct SnapshotSource sources[SNAPSHOT_SOURCES];
+    snapshot_sources(sources);
+    bool valid = memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) == 0 &&
+                 header->version == SNAPSHOT_VERSION && header->ino_size == sizeof(ino_t) &&
+                 header->uid == (uint32_t) getuid() && memcmp(header->sources, sources, sizeof(sources)) == 0 &&
+                 header->mounts_hash == mounts_hash() && header->audit_mode <= AUDIT_SUMMARY &&
+                 header->audit_journal <= 1 && header->trash_evict <= TRASH_EVICT_BACKGROUND &&
+                 header->trash_dedup <= 1 && header->trash_max_age >= 0 &&
+                 header->protected_count <= MAX_PROTECTED_DIRS && header->keep_count <= MAX_KEEP_PATTERNS &&
+                 table_fits(header->strings_offset, header->strings_len, 1, len) &&
+                 table_fits(header->ids_offset, header->id_slots, header->id_size ? header->id_size : 1, len) &&
+                 table_fits(header->probes_offset, header->probe_slots, sizeof(ino_t), len) &&
+                 table_fits(header->places_offset, header->places_len, 1, len) &&
+                 table_fits(header->roots_offset, header->roots_len, 1, len) &&
+                 table_fits(header->root_ids_offset, header->root_count, header->id_size ? header->id_size : 1, len) &&
+                 table_fits(header->parents_offset, header->parent_count, sizeof(struct SnapshotParent), len) &&
+                 header->parent_count <= header->root_count &&
+                 (header->strings_len == 0 || base[header->strings_offset + header->strings_len - 1] == '\0');
+
+    // Every name and pattern has to be terminated inside the string table
+    char *names[MAX_PROTECTED_DIRS + MAX_KEEP_PATTERNS];
+    uint64_t offset = header->strings_offset;
+    for (uint32_t i = 0; valid && i < header->protected_count + header->keep_count; i++) {
+        if (offset >= header->strings_offset + header->strings_len) {
+            valid = false;
+            break;
+        }
+        names[i] = (char *) base + offset;
+        offset += strlen(names[i]) + 1;
+    }
+
+    struct ProtectedTables tables = {
+        .id_size = header->id_size,
+        .ids = base + header->ids_offset,
+        .id_slots = (size_t) header->id_slots,
+        .id_count = (size_t) header->id_count,
+        .probe_inos = (const ino_t *) (base + header->probes_offset),
+        .probe_slots = (size_t) header->probe_slots,
+        .probe_count = (size_t) header->probe_count,
+        .places = base + header->places_offset,
+        .places_len = (size_t) header->places_len,
+        .roots = base + header->roots_offset,
+        .roots_len = (size_t) header->roots_len,
+        .root_ids = base + header->root_ids_offset,
+        .root_count = (size_t) header->root_count,
+    };
+    const struct SnapshotParent *parents = (const struct SnapshotParent *) (base + header->parents_offset);
+    if (!valid || protected_set_import(&tables) != 0 ||
+        !(header->parent_count > 0 ? parents_current(&tables, parents, (size_t) header->parent_count)
+                                   : protected_set_current())) {
+        protected_set_clear();
+        munmap(map, len);
+        return -1;
+    }
+
+    memcpy(protected_dirs, names, header->protected_count * sizeof(*names));
+    protected_count = (int) header->protected_count;
+    memcpy(keep_patterns, names + header->protected_count, header->keep_count * sizeof(*names));
+    keep_count = (int) header->keep_count;
+    audit_mode = (enum AuditMode) header->audit_mode;
+    trash_max_bytes = header->trash_max_bytes;
+    trash_max_age = (time_t) header->trash_max_age;
+    trash_evict = (enum TrashEvict) header->trash_evict;
+    trash_dedup = header->trash_dedup != 0;
+    audit_journal = header->audit_journal != 0;
+    return 0;
+}
+
+/** Write a table to the snapshot, padded to \ref SNAPSHOT_ALIGN
+ *
+ * @param fd snapshot file
+ * @param data table
+ * @param len size of the table
+ * @param offset offset of the table, advanced past it and its padding
+ * @return 0 for success -1 for error
+ */
+static int write_table(int fd, const void *data, size_t len, uint64_t *offset) {
+    static const char padding[SNAPSHOT_ALIGN];
+    size_t pad = (SNAPSHOT_ALIGN - len % SNAPSHOT_ALIGN) % SNAPSHOT_ALIGN;
+    if ((len > 0 && pwrite(fd, data, len, (off_t) *offset) != (ssize_t) len) ||
+        (pad > 0 && pwrite(fd, padding, pad, (off_t) (*offset + len)) != (ssize_t) pad))
+        return -1;
+    *offset += len + pad;
+    return 0;
+}
+
+/** Save the configuration that was just parsed for the next invocations
+ *
+ * The snapshot is written to a temporary file renamed over the previous one, so concurrent invocations only ever map
+ * a complete snapshot. Failing to save is silent, the configuration files are simply parsed again next time.
+ *
+ * @return 0 for success -1 for error
+ */
+int config_snapshot_save(void) {
+    char dir[PATH_MAX];
+    if (snapshot_dir(dir, sizeof(dir)) != 0)
+        return -1;
+
+    // Create ~/.cache when it does not exist yet, ignoring failures the open below reports anyway
+    char *slash = strrchr(dir, '/');
+    *slash = '\0';
+    mkdir(dir, 0700);
+    *slash = '/';
+    if (mkdir(dir, 0700) != 0 && errno != EEXIST)
+        return -1;
+
+    char path[PATH_MAX];
+    char tmp_path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s/" SNAPSHOT_NAME, dir) >= (int) sizeof(path) ||
+        snprintf(tmp_path, sizeof(tmp_path), "%s/" SNAPSHOT_NAME ".%ld", dir, (long) getpid()) >=
+                (int) sizeof(tmp_path))
+        return -1;
+
+    struct SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.ino_size = sizeof(ino_t);
+    header.uid = (uint32_t) getuid();
+    snapshot_sources(header.sources);
+    header.mounts_hash = mounts_hash();
+    header.audit_mode = (uint32_t) audit_mode;
+    header.trash_max_bytes = trash_max_bytes;
+    header.trash_max_age = (int64_t) trash_max_age;
+    header.trash_evict = (uint32_t) trash_evict;
+    header.trash_dedup = trash_dedup ? 1 : 0;
+    header.audit_journal = audit_journal ? 1 : 0;
+    header.protected_count = (uint32_t) protected_count;
+    header.keep_count = (uint32_t) keep_count;
+
+    struct ProtectedTables tables;
+    protected_set_export(&tables);
+    header.id_size = (uint32_t) tables.id_size;
+    header.id_slots = tables.id_slots;
+    header.id_count = tables.id_count;
+    header.probe_slots = tables.probe_slots;
+    header.probe_count = tables.probe_count;
+    header.places_len = tables.places_len;
+    header.roots_len = tables.roots_len;
+    header.root_count = tables.root_count;
+
+    // Parents are stat'ed before the paths are checked again, a change in between shows in their mtime
+    struct SnapshotParent *parents = malloc((tables.root_count ? tables.root_count : 1) * sizeof(*parents));
+    if (!parents)
+        return -1;
+    header.parent_count = stat_parents(tables.roots, tables.roots_len, parents);
+    time_t now = time(NULL);
+    for (size_t i = 0; i < header.parent_count; i++) {
+        if (parents[i].dev != 0 && parents[i].mtime_sec > (int64_t) now - SNAPSHOT_SETTLE_SECONDS)
+            header.parent_count = 0;
+    }
+    if (!protected_set_current())
+        header.parent_count = 0;
+
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC | O_NOFOLLOW, 0600);
+    if (fd < 0) {
+        free(parents);
+        return -1;
+    }
+
+    // The names and patterns are written as one NUL separated table
+    size_t strings_len = 0;
+    for (int i = 0; i < protected_count; i++)
+        strings_len += strlen(protected_dirs[i]) + 1;
+    for (int i = 0; i < keep_count; i++)
+        strings_len += strlen(keep_patterns[i]) + 1;
+    char *strings = malloc(strings_len ? strings_len : 1);
+    if (!strings) {
+        free(parents);
+        close(fd);
+        unlink(tmp_path);
+        return -1;
+    }
+    char *cursor = strings;
+    for (int i = 0; i < protected_count; i++)
+        cursor = stpcpy(cursor, protected_dirs[i]) + 1;
+    for (int i = 0; i < keep_count; i++)
+        cursor = stpcpy(cursor, keep_patterns[i]) + 1;
+
+    uint64_t offset = sizeof(header) + (SNAPSHOT_ALIGN - sizeof(header) % SNAPSHOT_ALIGN) % SNAPSHOT_ALIGN;
+    header.strings_offset = offset;
+    header.strings_len = strings_len;
+    int ret = write_table(fd, strings, strings_len, &offset);
+    free(strings);
+    header.ids_offset = offset;
+    if (ret == 0)
+        ret = write_table(fd, tables.ids, tables.id_slots * tables.id_size, &offset);
+    header.probes_offset = offset;
+    if (ret == 0)
+        ret = write_table(fd, tables.probe_inos, tables.probe_slots * sizeof(ino_t), &offset);
+    header.places_offset = offset;
+    if (ret == 0)
+        ret = write_table(fd, tables.places, tables.places_len, &offset);
+    header.roots_offset = offset;
+    if (ret == 0)
+        ret = write_table(fd, tables.roots, tables.roots_len, &offset);
+    header.root_ids_offset = offset;
+    if (ret == 0)
+        ret = write_table(fd, tables.root_ids, tables.root_count * tables.id_size, &offset);
+    header.parents_offset = offset;
+    if (ret == 0)
+        ret = write_table(fd, parents, header.parent_count * sizeof(*parents), &offset);
+    free(parents);
+    if (ret == 0 && pwrite(fd, &header, sizeof(header), 0) != (ssize_t) sizeof(header))
+        ret = -1;
+
+    if (close(fd) != 0)
+        ret = -1;
+    if (ret == 0 && rename(tmp_path, path) != 0)
+        ret = -1;
+    if (ret != 0)
+        unlink(tmp_path);
+    return ret;
+}
@@ -0,0 +1,301 @@
+/*! \file stats.c
+ * `--stats` instrumentation of the hot syscalls
+ *
+ * Every thread counts its own calls, failures and latencies in a block of its own, so the workers of the parallel
+ * engine never share a cache line. Latencies go to log-bucketed histograms, four buckets per power of two of
+ * nanoseconds, which bounds the error of a percentile to 25%. The blocks of all threads are merged when the report is
+ * printed at exit. Nothing is measured, and no clock is read, unless `--stats` is given.
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../include/better_rm.h"
+
+#define STATS_SUB_BITS 2 /*!< log2 of the buckets per power of two */
+#define STATS_BUCKETS ((64 - STATS_SUB_BITS + 1) << STATS_SUB_BITS)
+#define STATS_ERRNO_MAX 256
+
+static const char *const stats_op_names[STATS_OP_COUNT] = {"stat",   "opendir", "unlink",   "rmdir",    "rename",
+                                                           "copy",   "syslog",  "io_uring", "truncate", "journal"};
+
+/*! Counters of one thread */
+struct StatsThread {
+    struct StatsThread *next; /*!< next registered thread */
+    uint64_t calls[STATS_OP_COUNT]; /*!< calls per operation */
+    uint64_t errors[STATS_OP_COUNT]; /*!< failed calls per operation */
+    uint64_t max_ns[STATS_OP_COUNT]; /*!< slowest call per operation */
+    uint64_t buckets[STATS_OP_COUNT][STATS_BUCKETS]; /*!< latency histogram per operation */
+    uint64_t entries; /*!< entries removed */
+    uint64_t bytes; /*!< apparent size of the removed entries whose size is known */
+    uint64_t failures[STATS_ERRNO_MAX]; /*!< entries that could not be removed, by errno */
+};
+
+static bool stats_on;
+static bool stats_json;
+static uint64_t stats_start_ns;
+static struct StatsThread *stats_threads;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct StatsThread *stats_local;
+
+
+/** Read the monotonic clock
+ *
+ * @return nanoseconds
+ */
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+/** Get the counters of the calling thread, registering them on first use
+ *
+ * @return counters, NULL if out of memory
+ */
+static struct StatsThread *stats_thread(void) {
+    if (stats_local)
+        return stats_local;
+    struct StatsThread *local = calloc(1, sizeof(*local));
+    if (!local)
+        return NULL;
+    pthread_mutex_lock(&stats_lock);
+    local->next = stats_threads;
+    stats_threads = local;
+    pthread_mutex_unlock(&stats_lock);
+    stats_local = local;
+    return local;
+}
+
+/** Map a latency to its histogram bucket
+ *
+ * @param ns latency
+ * @return bucket index
+ */
+static unsigned bucket_of(uint64_t ns) {
+    if (ns < (1u << STATS_SUB_BITS))
+        return (unsigned) ns;
+    unsigned msb = 63u - (unsigned) __builtin_clzll(ns);
+    unsigned sub = (unsigned) (ns >> (msb - STATS_SUB_BITS)) & ((1u << STATS_SUB_BITS) - 1);
+    return ((msb - STATS_SUB_BITS + 1) << STATS_SUB_BITS) + sub;
+}
+
+/** Largest latency falling in a histogram bucket
+ *
+ * @param bucket bucket index
+ * @return nanoseconds
+ */
+static uint64_t bucket_limit(unsigned bucket) {
+    if (bucket < (1u << STATS_SUB_BITS))
+        return bucket;
+    unsigned shift = (bucket >> STATS_SUB_BITS) - 1;
+    uint64_t sub = bucket & ((1u << STATS_SUB_BITS) - 1);
+    return (((1ull << STATS_SUB_BITS) + sub + 1) << shift) - 1;
+}
+
+/** Enable the instrumentation
+ *
+ * @param format `text`, `json`, or NULL for text
+ * @return 0 for success -1 for an unknown format
+ */
+int stats_enable(const char *format) {
+    if (format && strcmp(format, "json") == 0) {
+        stats_json = true;
+    } else if (format && strcmp(format, "text") != 0) {
+        return -1;
+    }
+    stats_on = true;
+    stats_start_ns = now_ns();
+    return 0;
+}
+
+/** Tell whether `--stats` was given
+ *
+ * @return true if the instrumentation is enabled, removals then look up the size of the entries
+ */
+bool stats_enabled(void) {
+    return stats_on;
+}
+
+/** Start timing an operation
+ *
+ * @return start time to be given to stats_end(), 0 when disabled
+ */
+uint64_t stats_begin(void) {
+    return stats_on ? now_ns() : 0;
+}
+
+/** Account a timed operation
+ *
+ * `errno` is preserved, so the call can sit between a syscall and the code checking its error.
+ *
+ * @param op operation
+ * @param start value returned by stats_begin()
+ * @param failed the operation failed
+ */
+void stats_end(enum StatsOp op, uint64_t start, bool failed) {
+    if (!stats_on)
+        return;
+    int saved_errno = errno;
+    uint64_t ns = now_ns() - start;
+    struct StatsThread *local = stats_thread();
+    if (local) {
+        local->calls[op]++;
+        local->errors[op] += failed;
+        if (ns > local->max_ns[op])
+            local->max_ns[op] = ns;
+        local->buckets[op][bucket_of(ns)]++;
+    }
+    errno = saved_errno;
+}
+
+/** Account the outcome of the removal of one entry
+ *
+ * @param success the entry was removed
+ * @param size apparent size of the entry, -1 if unknown
+ * @param err errno of the failure
+ */
+void stats_removal(bool success, off_t size, int err) {
+    if (!stats_on)
+        return;
+    struct StatsThread *local = stats_thread();
+    if (!local)
+        return;
+    if (success) {
+        local->entries++;
+        if (size > 0)
+            local->bytes += (uint64_t) size;
+    } else {
+        local->failures[err > 0 && err < STATS_ERRNO_MAX ? err : 0]++;
+    }
+}
+
+/** Find a percentile in a merged histogram
+ *
+ * @param buckets histogram
+ * @param calls number of samples
+ * @param max slowest sample, the result is capped to it
+ * @param permille percentile in thousandths
+ * @return latency in nanoseconds
+ */
+static uint64_t percentile(const uint64_t *buckets, uint64_t calls, uint64_t max, unsigned permille) {
+    uint64_t rank = (calls * permille + 999) / 1000;
+    uint64_t seen = 0;
+    for (unsigned b = 0; b < STATS_BUCKETS; b++) {
+        seen += buckets[b];
+        if (seen >= rank && seen > 0) {
+            uint64_t limit = bucket_limit(b);
+            return limit < max ? limit : max;
+        }
+    }
+    return max;
+}
+
+/** Format a latency for humans
+ *
+ * @param buf output
+ * @param size size of \p buf
+ * @param ns latency
+ * @return \p buf
+ */
+static const char *format_ns(char *buf, size_t size, uint64_t ns) {
+    if (ns < 1000) {
+        snprintf(buf, size, "%lluns", (unsigned long long) ns);
+    } else if (ns < 1000000) {
+        snprintf(buf, size, "%.1fus", (double) ns / 1e3);
+    } else if (ns < 1000000000) {
+        snprintf(buf, size, "%.1fms", (double) ns / 1e6);
+    } else {
+        snprintf(buf, size, "%.2fs", (double) ns / 1e9);
+    }
+    return buf;
+}
+
+/** Print the merged counters of every thread to stderr, called once at exit
+ *
+ * The workers have to be finished.
+ */
+void stats_report(void) {
+    if (!stats_on)
+        return;
+
+    struct StatsThread total;
+    memset(&total, 0, sizeof(total));
+    pthread_mutex_lock(&stats_lock);
+    for (const struct StatsThread *t = stats_threads; t; t = t->next) {
+        for (int op = 0; op < STATS_OP_COUNT; op++) {
+            total.calls[op] += t->calls[op];
+            total.errors[op] += t->errors[op];
+            if (t->max_ns[op] > total.max_ns[op])
+                total.max_ns[op] = t->max_ns[op];
+            for (unsigned b = 0; b < STATS_BUCKETS; b++)
+                total.buckets[op][b] += t->buckets[op][b];
+        }
+        total.entries += t->entries;
+        total.bytes += t->bytes;
+        for (int e = 0; e < STATS_ERRNO_MAX; e++)
+            total.failures[e] += t->failures[e];
+    }
+    pthread_mutex_unlock(&stats_lock);
+
+    uint64_t failures = 0;
+    for (int e = 0; e < STATS_ERRNO_MAX; e++)
+        failures += total.failures[e];
+    double seconds = (double) (now_ns() - stats_start_ns) / 1e9;
+    double rate = seconds > 0 ? (double) total.entries / seconds : 0.0;
+
+    if (stats_json) {
+        fprintf(stderr,
+                "{\"entries\":%llu,\"bytes\":%llu,\"failures\":%llu,\"seconds\":%.6f,\"entries_per_second\":%.1f,"
+                "\"operations\":{",
+                (unsigned long long) total.entries, (unsigned long long) total.bytes, (unsigned long long) failures,
+                seconds, rate);
+        bool first = true;
+        for (int op = 0; op < STATS_OP_COUNT; op++) {
+            if (total.calls[op] == 0)
+                continue;
+            fprintf(stderr, "%s\"%s\":{\"calls\":%llu,\"errors\":%llu,\"p50_ns\":%llu,\"p99_ns\":%llu,\"max_ns\":%llu}",
+                    first ? "" : ",", stats_op_names[op], (unsigned long long) total.calls[op],
+                    (unsigned long long) total.errors[op],
+                    (unsigned long long) percentile(total.buckets[op], total.calls[op], total.max_ns[op], 500),
+                    (unsigned long long) percentile(total.buckets[op], total.calls[op], total.max_ns[op], 990),
+                    (unsigned long long) total.max_ns[op]);
+            first = false;
+        }
+        fprintf(stderr, "},\"failures_by_errno\":{");
+        first = true;
+        for (int e = 0; e < STATS_ERRNO_MAX; e++) {
+            if (total.failures[e] == 0)
+                continue;
+            fprintf(stderr, "%s\"%d\":%llu", first ? "" : ",", e, (unsigned long long) total.failures[e]);
+            first = false;
+        }
+        fprintf(stderr, "}}\n");
+        return;
+    }
+
+    fprintf(stderr, "better-rm: %llu entries in %.3f s (%.0f entries/s), %llu bytes, %llu failures\n",
+            (unsigned long long) total.entries, seconds, rate, (unsigned long long) total.bytes,
+            (unsigned long long) failures);
+    fprintf(stderr, "%-10s %12s %10s %10s %10s %10s\n", "operation", "calls", "errors", "p50", "p99", "max");
+    for (int op = 0; op < STATS_OP_COUNT; op++) {
+        if (total.calls[op] == 0)
+            continue;
+        char p50[32], p99[32], max[32];
+        fprintf(stderr, "%-10s %12llu %10llu %10s %10s %10s\n", stats_op_names[op],
+                (unsigned long long) total.calls[op], (unsigned long long) total.errors[op],
+                format_ns(p50, sizeof(p50), percentile(total.buckets[op], total.calls[op], total.max_ns[op], 500)),
+                format_ns(p99, sizeof(p99), percentile(total.buckets[op], total.calls[op], total.max_ns[op], 990)),
+                format_ns(max, sizeof(max), total.max_ns[op]));
+    }
+    for (int e = 0; e < STATS_ERRNO_MAX; e++) {
+        if (total.failures[e] > 0) {
+            fprintf(stderr, "failures: %s: %llu\n", e ? strerror(e) : "unknown error",
+                    (unsigned long long) total.failures[e]);
+        }
+    }
+}
@@ -0,0 +1,212 @@
+/*! \file throttle.c
+ * Paced removal with `--rate`, `--bw` and `--shrink-above`
+ *
+ * Removing millions of entries, or a file of hundreds of gigabytes, in one burst fills the journal of ext4 and xfs and
+ * stalls every other writer of the volume until the commits catch up. `--rate` caps the removals per second and `--bw`
+ * the bytes freed per second, both with a token bucket shared by every thread of the process: each removal books its
+ * cost on a virtual clock and sleeps while the clock runs ahead of real time by more than the allowed burst. Booking is
+ * a compare-and-swap, so the workers of the parallel engine never take a lock.
+ *
+ * With `--shrink-above` a regular file larger than the threshold is truncated from its end step by step before its
+ * name is unlinked, so the extents are freed over many small transactions instead of one huge one. With `--bw` every
+ * step is paced, a step then frees at most a second worth of the bandwidth. Only files whose last link is being
+ * removed are shrunk, their data is lost for the processes still holding them open.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../include/better_rm.h"
+
+#define THROTTLE_BURST_NS 100000000ull /*!< time worth of removals that may go through at once */
+#define SHRINK_STEP (256ull << 20) /*!< bytes freed by one truncation step */
+#define SHRINK_STEP_MIN (1ull << 20) /*!< smallest truncation step under a low `--bw` */
+
+static uint64_t ops_clock; /*!< virtual time, in nanoseconds, the booked removals are paid up to */
+static uint64_t bytes_clock; /*!< virtual time, in nanoseconds, the booked bytes are paid up to */
+
+
+/** Read the monotonic clock
+ *
+ * @return nanoseconds
+ */
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+/** Book a cost on a virtual clock
+ *
+ * @param clock virtual clock of the bucket
+ * @param amount units to be booked
+ * @param per_second units allowed per second
+ * @param now current time
+ * @return nanoseconds to sleep before the units may be used
+ */
+static uint64_t throttle_book(uint64_t *clock, uint64_t amount, uint64_t per_second, uint64_t now) {
+    // Doubles keep the cost of a huge file from overflowing, the precision lost is far below a nanosecond per second
+    uint64_t cost = (uint64_t) ((double) amount * 1e9 / (double) per_second);
+    uint64_t booked = __atomic_load_n(clock, __ATOMIC_RELAXED);
+    uint64_t paid;
+    do {
+        // Idle time does not pile up as credit beyond the burst
+        paid = (booked > now ? booked : now) + cost;
+    } while (!__atomic_compare_exchange_n(clock, &booked, paid, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return paid > now + THROTTLE_BURST_NS ? paid - now - THROTTLE_BURST_NS : 0;
+}
+
+/** Parse a bandwidth given to `--bw`
+ *
+ * @param s bytes per second, followed by `K`, `M`, `G` or `T`, MiB without a unit
+ * @param bandwidth receives the bytes per second
+ * @return 0 for success -1 for an invalid or zero bandwidth
+ */
+int throttle_parse_bandwidth(const char *s, uint64_t *bandwidth) {
+    size_t len = strlen(s);
+    uint64_t value;
+    if (quota_parse_bytes(s, &value) != 0)
+        return -1;
+    if (len > 0 && s[len - 1] >= '0' && s[len - 1] <= '9') {
+        if (value > (UINT64_MAX >> 20))
+            return -1;
+        value <<= 20;
+    }
+    if (value == 0)
+        return -1;
+    *bandwidth = value;
+    return 0;
+}
+
+/** Parse a rate given to `--rate`
+ *
+ * @param s removals per second
+ * @param rate receives the removals per second
+ * @return 0 for success -1 for an invalid or zero rate
+ */
+int throttle_parse_rate(const char *s, uint64_t *rate) {
+    char *end;
+    errno = 0;
+    unsigned long long value = strtoull(s, &end, 10);
+    if (end == s || *end != '\0' || errno != 0 || s[0] == '-' || value == 0)
+        return -1;
+    *rate = value;
+    return 0;
+}
+
+/** Tell whether removals are paced
+ *
+ * @param opts provided options
+ * @return true if `--rate`, `--bw` or `--shrink-above` was given
+ */
+bool throttle_enabled(const struct Options *opts) {
+    return opts->rate != 0 || opts->bandwidth != 0 || opts->shrink_above != 0;
+}
+
+/** Tell whether unlinking needs the lstat() of the entries
+ *
+ * @param opts provided options
+ * @return true if the bytes freed are paced or large files are shrunk
+ */
+bool throttle_wants_sizes(const struct Options *opts) {
+    return !opts->dry_run && !opts->use_trash && (opts->bandwidth != 0 || opts->shrink_above != 0);
+}
+
+/** Wait until a removal fits in the limits
+ *
+ * @param opts provided options
+ * @param ops removals about to be made
+ * @param bytes bytes about to be freed
+ */
+void throttle_wait(const struct Options *opts, unsigned ops, uint64_t bytes) {
+    if (opts->rate == 0 && opts->bandwidth == 0)
+        return;
+    uint64_t now = now_ns();
+    uint64_t delay = 0;
+    if (opts->rate != 0 && ops > 0)
+        delay = throttle_book(&ops_clock, ops, opts->rate, now);
+    if (opts->bandwidth != 0 && bytes > 0) {
+        uint64_t bytes_delay = throttle_book(&bytes_clock, bytes, opts->bandwidth, now);
+        delay = bytes_delay > delay ? bytes_delay : delay;
+    }
+    if (delay == 0)
+        return;
+
+    struct timespec ts = {.tv_sec = (time_t) (delay / 1000000000ull), .tv_nsec = (long) (delay % 1000000000ull)};
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {
+    }
+}
+
+/** Truncate a large file from its end step by step
+ *
+ * Best effort: a file that cannot be opened for writing, or that another link still keeps alive, is left to the
+ * unlink.
+ *
+ * @param dirfd directory file descriptor \p name is relative to, or `AT_FDCWD`
+ * @param name file name relative to \p dirfd
+ * @param st lstat() of the file
+ * @param opts provided options
+ * @return bytes the steps freed
+ */
+static uint64_t shrink_file_at(int dirfd, const char *name, const struct stat *st, const struct Options *opts) {
+    int fd = openat(dirfd, name, O_WRONLY | O_NOFOLLOW | O_NONBLOCK | O_NOCTTY | O_CLOEXEC);
+    if (fd < 0)
+        return 0;
+    // The name may have been replaced since it was stat'ed, never truncate anything but the file being removed
+    struct stat cur;
+    if (fstat(fd, &cur) != 0 || !S_ISREG(cur.st_mode) || cur.st_nlink != 1 || cur.st_dev != st->st_dev ||
+        cur.st_ino != st->st_ino) {
+        close(fd);
+        return 0;
+    }
+
+    uint64_t step = SHRINK_STEP;
+    if (opts->bandwidth != 0 && opts->bandwidth < step)
+        step = opts->bandwidth > SHRINK_STEP_MIN ? opts->bandwidth : SHRINK_STEP_MIN;
+    uint64_t allocated = (uint64_t) cur.st_blocks * 512;
+    uint64_t freed = 0;
+    off_t size = cur.st_size;
+    while ((uint64_t) size > step && freed < allocated) {
+        uint64_t chunk = allocated - freed < step ? allocated - freed : step;
+        throttle_wait(opts, 0, chunk);
+        uint64_t start = stats_begin();
+        int ret = ftruncate(fd, size - (off_t) step);
+        stats_end(STATS_TRUNCATE, start, ret != 0);
+        if (ret != 0)
+            break;
+        size -= (off_t) step;
+        freed += chunk;
+    }
+    close(fd);
+    return freed;
+}
+
+/** Unlink a non-directory entry within the limits of `--rate`, `--bw` and `--shrink-above`
+ *
+ * @param dirfd directory file descriptor \p name is relative to, or `AT_FDCWD`
+ * @param name entry name relative to \p dirfd
+ * @param st lstat() of the entry, NULL if it was not stat'ed
+ * @param opts provided options
+ * @return 0 for success -1 for error
+ */
+int throttled_unlink_at(int dirfd, const char *name, const struct stat *st, const struct Options *opts) {
+    uint64_t bytes = 0;
+    if (st && S_ISREG(st->st_mode)) {
+        bytes = (uint64_t) st->st_blocks * 512;
+        if (opts->shrink_above != 0 && st->st_nlink == 1 && (uint64_t) st->st_size > opts->shrink_above) {
+            uint64_t freed = shrink_file_at(dirfd, name, st, opts);
+            bytes -= freed < bytes ? freed : bytes;
+        }
+    }
+    throttle_wait(opts, 1, bytes);
+
+    uint64_t start = stats_begin();
+    int ret = unlinkat(dirfd, name, 0);
+    stats_end(STATS_UNLINK, start, ret != 0);
+    return ret;
+}
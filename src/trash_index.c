@@ -0,0 +1,676 @@
+/*! \file trash_index.c
+ * Append-only index of the entries of a trash directory
+ *
+ * Every trash directory holds `.better-rm-index`, a header followed by fixed-size \ref TrashRecord entries, and
+ * `.better-rm-strings.<generation>`, the NUL terminated original paths and trash names the records point into. Trashing
+ * an entry appends one record, removing it from the trash only flips a flag in its record, and readers map both files
+ * so listing, restoring and purging never scan or stat the trash directory.
+ *
+ * Appending and reading share a `flock()` on the index file, compaction takes it exclusively. Compaction writes the
+ * surviving records to a new strings generation and a new index that is renamed over the old one, then marks the old
+ * index stale so processes holding it open switch to the new one. Appenders serialize among themselves with an
+ * exclusive lock on the strings file.
+ *
+ * The header keeps the running byte and inode totals of the live entries, added to by every append and taken from by
+ * every removal, and recomputed from scratch by compaction, so the usage of a trash directory is known without walking
+ * it.
+ *
+ * Opening an index hashes the trash names of its live records once, so trash_index_find() costs one probe whatever
+ * the number of records. Eviction only walks the records from the oldest live one and opens the index with
+ * trash_index_open_records(), which skips the hashing.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../include/better_rm.h"
+
+#define TRASH_INDEX_NAME ".better-rm-index"
+#define TRASH_INDEX_TMP_NAME ".better-rm-index.tmp"
+#define TRASH_STRINGS_PREFIX ".better-rm-strings."
+#define TRASH_INDEX_MAGIC "BRMTIDX"
+#define TRASH_INDEX_VERSION 1
+#define TRASH_INDEX_STALE 0x1u
+#define TRASH_INDEX_COMPACT_MIN 64
+
+/*! Process wide appender, kept open between appends to the same trash directory */
+struct IndexWriter {
+    char *trash_dir; /*!< trash directory the fds belong to, NULL when closed */
+    int dirfd; /*!< trash directory */
+    int index_fd; /*!< index file */
+    int strings_fd; /*!< strings file of the index's generation */
+    struct TrashIndexHeader *header; /*!< mapping of the index header, holding the running totals */
+};
+
+static struct IndexWriter writer = {.dirfd = -1, .index_fd = -1, .strings_fd = -1, .header = NULL};
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool writer_warned;
+
+
+/** Build the name of the strings file of a generation
+ *
+ * @param buf output buffer
+ * @param size size of \p buf
+ * @param generation index generation
+ */
+static void strings_name(char *buf, size_t size, uint64_t generation) {
+    snprintf(buf, size, "%s%llu", TRASH_STRINGS_PREFIX, (unsigned long long) generation);
+}
+
+/** Tell whether a header read from an index is complete
+ *
+ * @param header header read from the start of the index
+ * @param n bytes read
+ * @return true for a complete header
+ */
+static bool header_complete(const struct TrashIndexHeader *header, ssize_t n) {
+    return n >= (ssize_t) sizeof(*header);
+}
+
+/** Open the index of a trash directory, creating it with an empty header if needed, and take the shared lock
+ *
+ * Loops until the opened index is not one a concurrent compaction replaced.
+ *
+ * @param dirfd trash directory
+ * @param header receives the index header
+ * @return index fd or -1 for error
+ */
+static int index_open_shared(int dirfd, struct TrashIndexHeader *header) {
+    for (;;) {
+        int fd = openat(dirfd, TRASH_INDEX_NAME, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        if (fd < 0)
+            return -1;
+
+        if (flock(fd, LOCK_SH) != 0) {
+            close(fd);
+            return -1;
+        }
+
+        ssize_t n = pread(fd, header, sizeof(*header), 0);
+        if (!header_complete(header, n)) {
+            // Fresh index, write the header under the exclusive lock unless another process beat us to it
+            if (flock(fd, LOCK_EX) != 0) {
+                close(fd);
+                return -1;
+            }
+            n = pread(fd, header, sizeof(*header), 0);
+            if (!header_complete(header, n)) {
+                memset(header, 0, sizeof(*header));
+                memcpy(header->magic, TRASH_INDEX_MAGIC, sizeof(header->magic));
+                header->version = TRASH_INDEX_VERSION;
+                header->record_size = sizeof(struct TrashRecord);
+                if (ftruncate(fd, 0) != 0 || pwrite(fd, header, sizeof(*header), 0) != (ssize_t) sizeof(*header)) {
+                    close(fd);
+                    return -1;
+                }
+            }
+            if (flock(fd, LOCK_SH) != 0) {
+                close(fd);
+                return -1;
+            }
+        }
+
+        if (memcmp(header->magic, TRASH_INDEX_MAGIC, sizeof(header->magic)) != 0 ||
+            header->version != TRASH_INDEX_VERSION || header->record_size != sizeof(struct TrashRecord)) {
+            close(fd);
+            errno = EINVAL;
+            return -1;
+        }
+
+        if (!(header->flags & TRASH_INDEX_STALE))
+            return fd;
+        close(fd);
+    }
+}
+
+/** Close the cached appender
+ *
+ */
+static void writer_close(void) {
+    if (writer.header)
+        munmap(writer.header, sizeof(*writer.header));
+    if (writer.strings_fd >= 0)
+        close(writer.strings_fd);
+    if (writer.index_fd >= 0)
+        close(writer.index_fd);
+    if (writer.dirfd >= 0)
+        close(writer.dirfd);
+    free(writer.trash_dir);
+    writer.trash_dir = NULL;
+    writer.header = NULL;
+    writer.dirfd = writer.index_fd = writer.strings_fd = -1;
+}
+
+/** Make the cached appender point at a trash directory and hold the shared index lock
+ *
+ * @param trash_dir trash directory
+ * @return 0 for success -1 for error
+ */
+static int writer_lock_index(const char *trash_dir) {
+    struct TrashIndexHeader header;
+
+    if (writer.trash_dir && strcmp(writer.trash_dir, trash_dir) == 0) {
+        if (flock(writer.index_fd, LOCK_SH) == 0 &&
+            !(__atomic_load_n(&writer.header->flags, __ATOMIC_RELAXED) & TRASH_INDEX_STALE))
+            return 0;
+    }
+
+    // Different trash directory, or the index was compacted since it was opened
+    writer_close();
+    writer.dirfd = open(trash_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (writer.dirfd < 0)
+        return -1;
+    writer.index_fd = index_open_shared(writer.dirfd, &header);
+    if (writer.index_fd < 0) {
+        writer_close();
+        return -1;
+    }
+
+    char name[64];
+    strings_name(name, sizeof(name), header.generation);
+    writer.strings_fd = openat(writer.dirfd, name, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    writer.trash_dir = strdup(trash_dir);
+    void *map = mmap(NULL, sizeof(*writer.header), PROT_READ | PROT_WRITE, MAP_SHARED, writer.index_fd, 0);
+    writer.header = map == MAP_FAILED ? NULL : map;
+    if (writer.strings_fd < 0 || !writer.trash_dir || !writer.header) {
+        writer_close();
+        return -1;
+    }
+    return 0;
+}
+
+/** Append a string to the strings file
+ *
+ * @param fd strings file
+ * @param offset offset to write at, advanced past the string
+ * @param s string
+ * @return 0 for success -1 for error
+ */
+static int append_string(int fd, off_t *offset, const char *s) {
+    size_t len = strlen(s) + 1;
+    if (pwrite(fd, s, len, *offset) != (ssize_t) len)
+        return -1;
+    *offset += (off_t) len;
+    return 0;
+}
+
+/** Record an entry that was just moved to the trash
+ *
+ * Failing to record an entry never fails the removal, the entry is still in the trash and only missing from
+ * listings.
+ *
+ * @param trash_dir trash directory
+ * @param original_path path the entry was removed from, made absolute against the working directory
+ * @param trash_path full path of the entry in the trash
+ * @param st lstat result of the entry before it was moved
+ * @param usage apparent size and inodes of the entry, of the whole tree for a measured directory
+ * @param blobs blobs of the store the entry links to, see dedup_refs_end(), NULL for none
+ * @return 0 for success -1 for error
+ */
+int trash_index_append(const char *trash_dir, const char *original_path, const char *trash_path,
+                       const struct stat *st, const struct TrashUsage *usage, const char *blobs) {
+    char *absolute = NULL;
+    if (original_path[0] != '/') {
+        char cwd[PATH_MAX];
+        if (!getcwd(cwd, sizeof(cwd)))
+            return -1;
+        size_t len = strlen(cwd) + strlen(original_path) + 2;
+        absolute = malloc(len);
+        if (!absolute)
+            return -1;
+        snprintf(absolute, len, "%s/%s", cwd, original_path);
+        original_path = absolute;
+    }
+    const char *slash = strrchr(trash_path, '/');
+    const char *trash_name = slash ? slash + 1 : trash_path;
+
+    pthread_mutex_lock(&writer_lock);
+    int ret = -1;
+    if (writer_lock_index(trash_dir) == 0) {
+        if (flock(writer.strings_fd, LOCK_EX) == 0) {
+            struct stat index_st, strings_st;
+            if (fstat(writer.index_fd, &index_st) == 0 && fstat(writer.strings_fd, &strings_st) == 0) {
+                struct TrashRecord record = {.dev = (uint64_t) st->st_dev,
+                                             .ino = (uint64_t) st->st_ino,
+                                             .size = (int64_t) usage->bytes,
+                                             .deleted_at = (int64_t) time(NULL),
+                                             .uid = (uint32_t) getuid(),
+                                             .mode = (uint32_t) st->st_mode,
+                                             .flags = blobs ? TRASH_RECORD_BLOBS : 0,
+                                             .inodes = usage->inodes < UINT32_MAX ? (uint32_t) usage->inodes
+                                                                                  : UINT32_MAX};
+                // A torn record left by a crashed appender is overwritten
+                size_t count = ((size_t) index_st.st_size - sizeof(struct TrashIndexHeader)) / sizeof(record);
+                off_t offset = strings_st.st_size;
+                record.path_offset = (uint64_t) offset;
+                if (append_string(writer.strings_fd, &offset, original_path) == 0) {
+                    record.name_offset = (uint64_t) offset;
+                    // The blob list follows the trash name
+                    record.blobs_offset = blobs ? record.name_offset + strlen(trash_name) + 1 : 0;
+                    if (append_string(writer.strings_fd, &offset, trash_name) == 0 &&
+                        (!blobs || append_string(writer.strings_fd, &offset, blobs) == 0) &&
+                        pwrite(writer.index_fd, &record, sizeof(record),
+                               (off_t) (sizeof(struct TrashIndexHeader) + count * sizeof(record))) ==
+                                (ssize_t) sizeof(record)) {
+                        __atomic_add_fetch(&writer.header->bytes, (uint64_t) record.size, __ATOMIC_RELAXED);
+                        __atomic_add_fetch(&writer.header->inodes, (uint64_t) record.inodes, __ATOMIC_RELAXED);
+                        ret = 0;
+                    }
+                }
+            }
+            flock(writer.strings_fd, LOCK_UN);
+        }
+        flock(writer.index_fd, LOCK_UN);
+    }
+
+    if (ret != 0 && !writer_warned) {
+        writer_warned = true;
+        fprintf(stderr, "better-rm: cannot update trash index in '%s': %s\n", trash_dir, strerror(errno));
+    }
+    pthread_mutex_unlock(&writer_lock);
+    free(absolute);
+    return ret;
+}
+
+/** Read the running totals of a trash directory
+ *
+ * @param trash_dir trash directory
+ * @param usage receives the bytes and inodes of the live entries, and in \ref TrashUsage.oldest_at the time the entry
+ *        eviction would start from was trashed, `INT64_MAX` if there is none
+ * @return 0 for success -1 for error
+ */
+int trash_index_usage(const char *trash_dir, struct TrashUsage *usage) {
+    pthread_mutex_lock(&writer_lock);
+    int ret = -1;
+    if (writer_lock_index(trash_dir) == 0) {
+        usage->bytes = __atomic_load_n(&writer.header->bytes, __ATOMIC_RELAXED);
+        usage->inodes = __atomic_load_n(&writer.header->inodes, __ATOMIC_RELAXED);
+        usage->oldest_at = INT64_MAX;
+        uint64_t oldest = __atomic_load_n(&writer.header->oldest, __ATOMIC_RELAXED);
+        struct TrashRecord record;
+        // A record restored meanwhile only makes eviction start early, it skips removed records
+        if (pread(writer.index_fd, &record, sizeof(record),
+                  (off_t) (sizeof(struct TrashIndexHeader) + oldest * sizeof(record))) == (ssize_t) sizeof(record))
+            usage->oldest_at = record.deleted_at;
+        flock(writer.index_fd, LOCK_UN);
+        ret = 0;
+    }
+    pthread_mutex_unlock(&writer_lock);
+    return ret;
+}
+
+/** Map a file read-write
+ *
+ * @param fd file
+ * @param len receives the mapped length
+ * @return mapping, NULL for an empty file, MAP_FAILED for error
+ */
+static void *map_file(int fd, size_t *len) {
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+        return MAP_FAILED;
+    *len = (size_t) st.st_size;
+    if (*len == 0)
+        return NULL;
+    return mmap(NULL, *len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+}
+
+/** Hash a trash name
+ *
+ * @param s name
+ * @return FNV-1a hash
+ */
+static size_t hash_name(const char *s) {
+    uint64_t h = 14695981039346656037ull;
+    for (; *s; s++)
+        h = (h ^ (unsigned char) *s) * 1099511628211ull;
+    return (size_t) h;
+}
+
+/** Insert the live records of an index into its name table
+ *
+ * @param index index mapped by trash_index_open_at()
+ * @return 0 for success -1 if out of memory
+ */
+static int index_hash_names(struct TrashIndex *index) {
+    size_t slots = 16;
+    while (slots < index->count * 2)
+        slots *= 2;
+    index->slots = calloc(slots, sizeof(*index->slots));
+    if (!index->slots)
+        return -1;
+    index->mask = slots - 1;
+
+    for (size_t i = 0; i < index->count; i++) {
+        struct TrashRecord *record = &index->records[i];
+        const char *name = trash_index_string(index, record->name_offset);
+        if ((record->flags & TRASH_RECORD_REMOVED) || !name)
+            continue;
+        size_t slot = hash_name(name) & index->mask;
+        while (index->slots[slot] && strcmp(trash_index_string(index, index->slots[slot]->name_offset), name) != 0)
+            slot = (slot + 1) & index->mask;
+        // Later records of a reused name win
+        index->slots[slot] = record;
+    }
+    return 0;
+}
+
+/** Map the index of an open trash directory
+ *
+ * @param dirfd trash directory, taken over by the index and closed even on failure, -1 fails
+ * @param index index to be filled
+ * @param names hash the names of the live records for trash_index_find()
+ * @return 0 for success -1 for error
+ */
+static int index_map(int dirfd, struct TrashIndex *index, bool names) {
+    memset(index, 0, sizeof(*index));
+    index->fd = -1;
+    index->dirfd = dirfd;
+    if (index->dirfd < 0)
+        return -1;
+
+    struct TrashIndexHeader header;
+    char name[64];
+    int strings_fd;
+    index->fd = index_open_shared(index->dirfd, &header);
+    if (index->fd < 0)
+        goto fail;
+
+    index->map = map_file(index->fd, &index->map_len);
+    if (index->map == MAP_FAILED || !index->map)
+        goto fail;
+    index->header = index->map;
+    index->records = (struct TrashRecord *) (index->header + 1);
+    index->count = (index->map_len - sizeof(header)) / sizeof(struct TrashRecord);
+
+    strings_name(name, sizeof(name), header.generation);
+    strings_fd = openat(index->dirfd, name, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (strings_fd < 0)
+        goto fail;
+    index->strings = map_file(strings_fd, &index->strings_len);
+    close(strings_fd);
+    if (index->strings == MAP_FAILED) {
+        index->strings = NULL;
+        goto fail;
+    }
+    if (names && index_hash_names(index) != 0) {
+        errno = ENOMEM;
+        goto fail;
+    }
+    return 0;
+
+fail:
+    if (index->map == MAP_FAILED)
+        index->map = NULL;
+    int saved_errno = errno;
+    trash_index_close(index);
+    errno = saved_errno;
+    return -1;
+}
+
+/** Map the index of a trash directory
+ *
+ * The records appended after the index was opened are not visible through it. The index must be released
+ * with trash_index_close().
+ *
+ * @param trash_dir trash directory
+ * @param index index to be filled
+ * @return 0 for success -1 for error
+ */
+int trash_index_open(const char *trash_dir, struct TrashIndex *index) {
+    return trash_index_open_at(open(trash_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC), index);
+}
+
+/** Map the index of a trash directory for walking its records only
+ *
+ * Like trash_index_open() without hashing the names, so opening costs the same however many records the index holds.
+ * trash_index_find() finds nothing through such an index.
+ *
+ * @param trash_dir trash directory
+ * @param index index to be filled
+ * @return 0 for success -1 for error
+ */
+int trash_index_open_records(const char *trash_dir, struct TrashIndex *index) {
+    return index_map(open(trash_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC), index, false);
+}
+
+/** Map the index of a trash directory already open
+ *
+ * Like trash_index_open(), for a directory whose owner was checked through its fd.
+ *
+ * @param dirfd trash directory, taken over by the index and closed even on failure, -1 fails
+ * @param index index to be filled
+ * @return 0 for success -1 for error
+ */
+int trash_index_open_at(int dirfd, struct TrashIndex *index) {
+    return index_map(dirfd, index, true);
+}
+
+/** Look up a string of the index
+ *
+ * @param index open index
+ * @param offset string offset from a record
+ * @return string, or NULL if the offset is out of range
+ */
+const char *trash_index_string(const struct TrashIndex *index, uint64_t offset) {
+    if (!index->strings || offset >= index->strings_len)
+        return NULL;
+    const char *s = index->strings + offset;
+    return memchr(s, '\0', index->strings_len - offset) ? s : NULL;
+}
+
+/** Find the live record of a trash entry
+ *
+ * Only the latest record of a name is found, the earlier ones describe entries that are no longer in the trash.
+ *
+ * @param index open index
+ * @param trash_name entry name inside the trash directory
+ * @return record, or NULL if not indexed or removed since the index was opened
+ */
+struct TrashRecord *trash_index_find(const struct TrashIndex *index, const char *trash_name) {
+    if (!index->slots)
+        return NULL;
+    size_t slot = hash_name(trash_name) & index->mask;
+    while (index->slots[slot]) {
+        struct TrashRecord *record = index->slots[slot];
+        if (strcmp(trash_index_string(index, record->name_offset), trash_name) == 0)
+            return (__atomic_load_n(&record->flags, __ATOMIC_RELAXED) & TRASH_RECORD_REMOVED) ? NULL : record;
+        slot = (slot + 1) & index->mask;
+    }
+    return NULL;
+}
+
+/** Mark a record as no longer in the trash
+ *
+ * @param index open index
+ * @param record record of \p index
+ * @return true if this call removed the record, false if it already was
+ */
+bool trash_index_remove(struct TrashIndex *index, struct TrashRecord *record) {
+    if (__atomic_fetch_or(&record->flags, TRASH_RECORD_REMOVED, __ATOMIC_RELAXED) & TRASH_RECORD_REMOVED)
+        return false;
+    __atomic_add_fetch(&index->header->removed, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&index->header->bytes, (uint64_t) record->size, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&index->header->inodes, (uint64_t) record->inodes, __ATOMIC_RELAXED);
+    return true;
+}
+
+/** Move the start of eviction past records known to be removed
+ *
+ * @param index open index
+ * @param oldest index of the first record that may still be live
+ */
+void trash_index_skip(struct TrashIndex *index, size_t oldest) {
+    uint64_t current = __atomic_load_n(&index->header->oldest, __ATOMIC_RELAXED);
+    while (current < oldest && !__atomic_compare_exchange_n(&index->header->oldest, &current, (uint64_t) oldest, false,
+                                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+/** Rewrite the index of a trash directory without its removed records
+ *
+ * Records whose entry is no longer in the trash directory are dropped as well, and the totals are recomputed from
+ * the surviving records. Nothing is done while another process uses the index.
+ *
+ * @param dirfd trash directory
+ * @return 0 for success or when skipped, -1 for error
+ */
+static int index_compact_at(int dirfd) {
+    int fd = openat(dirfd, TRASH_INDEX_NAME, O_RDWR | O_CLOEXEC);
+    if (fd < 0)
+        return errno == ENOENT ? 0 : -1;
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+        close(fd);
+        return 0;
+    }
+
+    struct TrashIndex index = {.dirfd = dirfd, .fd = fd};
+    int ret = -1;
+    int new_fd = -1, new_strings_fd = -1;
+    char old_strings[64], new_strings[64];
+    int strings_fd;
+    struct TrashIndexHeader header;
+    off_t record_offset = sizeof(header), strings_offset = 0;
+
+    index.map = map_file(fd, &index.map_len);
+    if (index.map == MAP_FAILED || !index.map || index.map_len < sizeof(header)) {
+        if (index.map == MAP_FAILED)
+            index.map = NULL;
+        goto out;
+    }
+    index.header = index.map;
+    if (index.header->flags & TRASH_INDEX_STALE) {
+        ret = 0;
+        goto out;
+    }
+    index.records = (struct TrashRecord *) (index.header + 1);
+    index.count = (index.map_len - sizeof(header)) / sizeof(struct TrashRecord);
+
+    strings_name(old_strings, sizeof(old_strings), index.header->generation);
+    strings_name(new_strings, sizeof(new_strings), index.header->generation + 1);
+    strings_fd = openat(dirfd, old_strings, O_RDONLY | O_CLOEXEC);
+    if (strings_fd >= 0) {
+        struct stat st;
+        if (fstat(strings_fd, &st) == 0 && st.st_size > 0) {
+            index.strings_len = (size_t) st.st_size;
+            index.strings = mmap(NULL, index.strings_len, PROT_READ, MAP_SHARED, strings_fd, 0);
+            if (index.strings == MAP_FAILED)
+                index.strings = NULL;
+        }
+        close(strings_fd);
+    }
+
+    new_fd = openat(dirfd, TRASH_INDEX_TMP_NAME, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    new_strings_fd = openat(dirfd, new_strings, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (new_fd < 0 || new_strings_fd < 0)
+        goto out;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRASH_INDEX_MAGIC, sizeof(header.magic));
+    header.version = TRASH_INDEX_VERSION;
+    header.record_size = sizeof(struct TrashRecord);
+    header.generation = index.header->generation + 1;
+
+    for (size_t i = 0; i < index.count; i++) {
+        struct TrashRecord record = index.records[i];
+        const char *path = trash_index_string(&index, record.path_offset);
+        const char *name = trash_index_string(&index, record.name_offset);
+        struct stat st;
+        if ((record.flags & TRASH_RECORD_REMOVED) || !path || !name ||
+            (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) != 0 && errno == ENOENT))
+            continue;
+
+        header.bytes += (uint64_t) record.size;
+        header.inodes += record.inodes;
+        record.path_offset = (uint64_t) strings_offset;
+        if (append_string(new_strings_fd, &strings_offset, path) != 0)
+            goto out;
+        record.name_offset = (uint64_t) strings_offset;
+        if (append_string(new_strings_fd, &strings_offset, name) != 0)
+            goto out;
+        // Blobs that cannot be read back are released by the sweep of an unlisted entry
+        if (record.flags & TRASH_RECORD_BLOBS) {
+            const char *blobs = trash_index_string(&index, record.blobs_offset);
+            record.blobs_offset = (uint64_t) strings_offset;
+            if (append_string(new_strings_fd, &strings_offset, blobs ? blobs : DEDUP_UNLISTED) != 0)
+                goto out;
+        }
+        if (pwrite(new_fd, &record, sizeof(record), record_offset) != (ssize_t) sizeof(record))
+            goto out;
+        record_offset += (off_t) sizeof(record);
+    }
+
+    if (pwrite(new_fd, &header, sizeof(header), 0) != (ssize_t) sizeof(header) || fsync(new_strings_fd) != 0 ||
+        fsync(new_fd) != 0 ||
+        renameat(dirfd, TRASH_INDEX_TMP_NAME, dirfd, TRASH_INDEX_NAME) != 0)
+        goto out;
+
+    // Processes still holding the old index reopen the new one
+    index.header->flags |= TRASH_INDEX_STALE;
+    unlinkat(dirfd, old_strings, 0);
+    ret = 0;
+
+out:
+    if (ret != 0) {
+        unlinkat(dirfd, TRASH_INDEX_TMP_NAME, 0);
+        if (new_strings_fd >= 0)
+            unlinkat(dirfd, new_strings, 0);
+    }
+    if (new_fd >= 0)
+        close(new_fd);
+    if (new_strings_fd >= 0)
+        close(new_strings_fd);
+    if (index.strings)
+        munmap((void *) index.strings, index.strings_len);
+    if (index.map)
+        munmap(index.map, index.map_len);
+    close(fd);
+    return ret;
+}
+
+/** Compact the index of a trash directory
+ *
+ * @param trash_dir trash directory
+ * @return 0 for success or when skipped, -1 for error
+ */
+int trash_index_compact(const char *trash_dir) {
+    int dirfd = open(trash_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirfd < 0)
+        return -1;
+    int ret = index_compact_at(dirfd);
+    close(dirfd);
+    return ret;
+}
+
+/** Release an index, compacting it when most of its records were removed
+ *
+ * @param index index opened with trash_index_open()
+ */
+void trash_index_close(struct TrashIndex *index) {
+    bool compact = index->header && index->count >= TRASH_INDEX_COMPACT_MIN &&
+                   __atomic_load_n(&index->header->removed, __ATOMIC_RELAXED) * 2 > index->count;
+
+    if (index->strings)
+        munmap((void *) index->strings, index->strings_len);
+    if (index->map)
+        munmap(index->map, index->map_len);
+    if (index->fd >= 0)
+        close(index->fd);
+    free(index->slots);
+
+    if (compact)
+        index_compact_at(index->dirfd);
+    if (index->dirfd >= 0)
+        close(index->dirfd);
+    memset(index, 0, sizeof(*index));
+    index->dirfd = index->fd = -1;
+}
@@ -0,0 +1,502 @@
+/*! \file uring.c
+ * io_uring backend batching the metadata operations of recursive directory removal
+ *
+ * Entries of a directory are read in batches. The entries of a batch whose `d_type` is not enough are stat'ed with
+ * `IORING_OP_STATX` in one submission, then its non-directory entries are unlinked, or renamed into the trash, with
+ * `IORING_OP_UNLINKAT`/`IORING_OP_RENAMEAT` in a second one, so every batch costs at most two `io_uring_enter()`
+ * calls instead of two syscalls per entry. The ring only scans one directory at a time, uring_scan_dir() is called by
+ * the walk of remove_directory_at() for every directory, so the heap allocated stack and the bounded fds of that walk
+ * apply here as well.
+ *
+ * Built only when configured with `-DBUILD_WITH_IO_URING=ON`, otherwise \ref uring_supported always reports false
+ * and callers use the synchronous engine.
+ */
+#include <errno.h>
+#include <stdbool.h>
+
+#include "../include/better_rm.h"
+
+#ifdef BETTER_RM_IO_URING
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+#define URING_BATCH 256
+
+/*! Ring mappings shared with the kernel */
+struct Uring {
+    int fd; /*!< ring fd */
+    unsigned *sq_tail; /*!< submission queue tail, advanced by us */
+    unsigned sq_mask; /*!< submission ring index mask */
+    unsigned *sq_array; /*!< submission ring of sqe indexes */
+    unsigned *cq_head; /*!< completion queue head, advanced by us */
+    unsigned *cq_tail; /*!< completion queue tail, advanced by the kernel */
+    unsigned cq_mask; /*!< completion ring index mask */
+    struct io_uring_sqe *sqes; /*!< submission queue entries */
+    struct io_uring_cqe *cqes; /*!< completion queue entries */
+    void *sq_ptr; /*!< mapping of the submission ring */
+    size_t sq_len; /*!< size of \ref sq_ptr */
+    void *cq_ptr; /*!< mapping of the completion ring, may alias \ref sq_ptr */
+    size_t cq_len; /*!< size of \ref cq_ptr */
+    size_t sqes_len; /*!< size of \ref sqes */
+};
+
+/*! One batch of directory entries, reused for every directory since it is drained before descending */
+struct Batch {
+    char names[URING_BATCH][256]; /*!< entry names, `d_name` is at most 255 bytes */
+    unsigned char types[URING_BATCH]; /*!< `d_type` reported by readdir */
+    ino_t inos[URING_BATCH]; /*!< `d_ino` reported by readdir */
+    enum EntryKind kinds[URING_BATCH]; /*!< classification of each entry */
+    struct statx stx[URING_BATCH]; /*!< statx results */
+    char *trash_paths[URING_BATCH]; /*!< rename targets in trash mode */
+    char trash_path[PATH_MAX]; /*!< rename target being generated */
+    int res[URING_BATCH]; /*!< completion results */
+    bool submitted[URING_BATCH]; /*!< an unlink or rename was queued for the entry */
+    int count; /*!< entries in the batch */
+};
+
+static struct Uring ring = {.fd = -1};
+static struct Batch *batch;
+static int ring_state; /* 0 not probed, 1 usable, -1 unavailable */
+
+
+/** Map the rings of a freshly created io_uring instance
+ *
+ * @param p parameters filled by `io_uring_setup()`
+ * @return 0 for success -1 for error
+ */
+static int uring_map(const struct io_uring_params *p) {
+    ring.sq_len = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+    ring.cq_len = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring.cq_len > ring.sq_len)
+            ring.sq_len = ring.cq_len;
+        ring.cq_len = ring.sq_len;
+    }
+
+    ring.sq_ptr = mmap(NULL, ring.sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd,
+                       IORING_OFF_SQ_RING);
+    if (ring.sq_ptr == MAP_FAILED)
+        return -1;
+
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        ring.cq_ptr = ring.sq_ptr;
+    } else {
+        ring.cq_ptr = mmap(NULL, ring.cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd,
+                           IORING_OFF_CQ_RING);
+        if (ring.cq_ptr == MAP_FAILED) {
+            munmap(ring.sq_ptr, ring.sq_len);
+            return -1;
+        }
+    }
+
+    ring.sqes_len = p->sq_entries * sizeof(struct io_uring_sqe);
+    ring.sqes = mmap(NULL, ring.sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd,
+                     IORING_OFF_SQES);
+    if (ring.sqes == MAP_FAILED) {
+        if (ring.cq_ptr != ring.sq_ptr)
+            munmap(ring.cq_ptr, ring.cq_len);
+        munmap(ring.sq_ptr, ring.sq_len);
+        return -1;
+    }
+
+    char *sq = ring.sq_ptr;
+    char *cq = ring.cq_ptr;
+    ring.sq_tail = (unsigned *) (sq + p->sq_off.tail);
+    ring.sq_mask = *(unsigned *) (sq + p->sq_off.ring_mask);
+    ring.sq_array = (unsigned *) (sq + p->sq_off.array);
+    ring.cq_head = (unsigned *) (cq + p->cq_off.head);
+    ring.cq_tail = (unsigned *) (cq + p->cq_off.tail);
+    ring.cq_mask = *(unsigned *) (cq + p->cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *) (cq + p->cq_off.cqes);
+    return 0;
+}
+
+/** Check that the kernel implements every opcode the backend submits
+ *
+ * @return true when STATX, UNLINKAT and RENAMEAT are supported
+ */
+static bool uring_probe_ops(void) {
+    size_t len = sizeof(struct io_uring_probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, len);
+    if (!probe)
+        return false;
+
+    bool ok = syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) == 0;
+    const int ops[] = {IORING_OP_STATX, IORING_OP_UNLINKAT, IORING_OP_RENAMEAT};
+    for (size_t i = 0; ok && i < sizeof(ops) / sizeof(ops[0]); i++) {
+        ok = ops[i] <= probe->last_op && (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+
+    free(probe);
+    return ok;
+}
+
+/** Report whether the io_uring backend can be used, setting up the ring on first use
+ *
+ * @return true when the ring is ready, false when the caller must fall back to the synchronous engine
+ */
+bool uring_supported(void) {
+    if (ring_state != 0)
+        return ring_state > 0;
+    ring_state = -1;
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring.fd = (int) syscall(__NR_io_uring_setup, URING_BATCH, &params);
+    if (ring.fd < 0)
+        return false;
+
+    batch = malloc(sizeof(*batch));
+    if (!batch || uring_map(&params) != 0 || !uring_probe_ops()) {
+        free(batch);
+        batch = NULL;
+        close(ring.fd);
+        ring.fd = -1;
+        return false;
+    }
+
+    ring_state = 1;
+    return true;
+}
+
+/** Get the next free submission queue entry
+ *
+ * Batches never exceed the ring size and are reaped before the next one, so a slot is always available.
+ *
+ * @param queued number of entries prepared since the last submission, incremented
+ * @return zeroed sqe
+ */
+static struct io_uring_sqe *uring_get_sqe(unsigned *queued) {
+    unsigned tail = *ring.sq_tail + *queued;
+    unsigned index = tail & ring.sq_mask;
+    struct io_uring_sqe *sqe = &ring.sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring.sq_array[index] = index;
+    (*queued)++;
+    return sqe;
+}
+
+/** Submit the queued entries and wait for all of them to complete
+ *
+ * @param queued number of sqes prepared with uring_get_sqe()
+ * @return 0 for success -1 for error
+ */
+static int uring_submit_and_wait(unsigned queued) {
+    if (queued == 0)
+        return 0;
+
+    __atomic_store_n(ring.sq_tail, *ring.sq_tail + queued, __ATOMIC_RELEASE);
+
+    uint64_t start = stats_begin();
+    unsigned submitted = 0, done = 0;
+    while (done < queued) {
+        int ret = (int) syscall(__NR_io_uring_enter, ring.fd, queued - submitted, queued - done,
+                                IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            stats_end(STATS_URING, start, true);
+            return -1;
+        }
+        submitted += (unsigned) ret;
+
+        unsigned head = *ring.cq_head;
+        unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            const struct io_uring_cqe *cqe = &ring.cqes[head & ring.cq_mask];
+            batch->res[cqe->user_data] = cqe->res;
+            head++;
+            done++;
+        }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    }
+    stats_end(STATS_URING, start, false);
+    return 0;
+}
+
+/** Tell whether an entry of the batch has to be stat'ed
+ *
+ * Besides the entries readdir could not type, summary auditing and the `--output` records need the size of the
+ * non-directory entries, the trash index needs their identity, and directories that may be protected have to be
+ * identified.
+ *
+ * @param d_type type reported by readdir
+ * @param ino inode number reported by readdir
+ * @param opts provided options
+ * @return true if a STATX has to be submitted for the entry
+ */
+static bool uring_needs_stat(unsigned char d_type, ino_t ino, const struct Options *opts) {
+    return entry_needs_stat(d_type, opts) ||
+           ((audit_wants_sizes() || stats_enabled() || output_wants_sizes(opts) || opts->use_trash) &&
+            d_type != DT_DIR) ||
+           (d_type == DT_DIR && protected_set_probe(ino));
+}
+
+/** Size of a non-directory entry of the batch, as far as it was stat'ed
+ *
+ * @param i index in the batch
+ * @param opts provided options
+ * @return apparent size, -1 if the entry was not stat'ed
+ */
+static off_t uring_entry_size(int i, const struct Options *opts) {
+    return uring_needs_stat(batch->types[i], batch->inos[i], opts) ? (off_t) batch->stx[i].stx_size : -1;
+}
+
+/** Classify every entry of the current batch, stat'ing through the ring only those readdir could not type
+ *
+ * @param dirfd directory fd
+ * @param dir_dev device of the directory, 0 if unknown
+ * @param opts provided options
+ * @return 0 for success -1 for error
+ */
+static int uring_classify_batch(int dirfd, dev_t dir_dev, const struct Options *opts) {
+    unsigned queued = 0;
+    for (int i = 0; i < batch->count; i++) {
+        if (!uring_needs_stat(batch->types[i], batch->inos[i], opts)) {
+            batch->kinds[i] = batch->types[i] == DT_DIR ? ENTRY_DIR : ENTRY_FILE;
+            continue;
+        }
+        struct io_uring_sqe *sqe = uring_get_sqe(&queued);
+        sqe->opcode = IORING_OP_STATX;
+        sqe->fd = dirfd;
+        sqe->addr = (uintptr_t) batch->names[i];
+        sqe->len = STATX_TYPE | STATX_MODE | STATX_INO | STATX_SIZE;
+        sqe->addr2 = (uintptr_t) &batch->stx[i];
+        sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+        sqe->user_data = (unsigned) i;
+    }
+    if (uring_submit_and_wait(queued) != 0)
+        return -1;
+
+    for (int i = 0; i < batch->count; i++) {
+        if (!uring_needs_stat(batch->types[i], batch->inos[i], opts))
+            continue;
+        const struct statx *stx = &batch->stx[i];
+        if (batch->res[i] < 0)
+            batch->kinds[i] = ENTRY_GONE;
+        else if (!S_ISDIR(stx->stx_mode))
+            batch->kinds[i] = ENTRY_FILE;
+        else if (protected_set_contains(makedev(stx->stx_dev_major, stx->stx_dev_minor), (ino_t) stx->stx_ino))
+            batch->kinds[i] = ENTRY_PROTECTED;
+        else if (opts->one_file_system && dir_dev != 0 && makedev(stx->stx_dev_major, stx->stx_dev_minor) != dir_dev)
+            batch->kinds[i] = ENTRY_OTHER_FS;
+        else
+            batch->kinds[i] = ENTRY_DIR;
+    }
+    for (int i = 0; opts->keep && i < batch->count; i++)
+        batch->kinds[i] = keep_classify(opts, batch->names[i], batch->kinds[i]);
+    return 0;
+}
+
+/** Scan one directory through the ring, removing its non-directory entries and collecting its subdirectories
+ *
+ * @param fd directory
+ * @param dir_dev device of the directory for `--one-file-system`, 0 if unknown
+ * @param reader reads the entries in inode order
+ * @param path full path of the directory, extended in place for every entry
+ * @param opts provided options
+ * @param kept set when an entry of the directory is kept
+ * @param add_subdir called with \p ctx for every subdirectory, returns -1 when out of memory
+ * @param ctx argument of \p add_subdir
+ * @return 0 for success -1 for error
+ */
+int uring_scan_dir(int fd, dev_t dir_dev, struct DirBatch *reader, struct PathBuf *path, const struct Options *opts,
+                   bool *kept, int (*add_subdir)(void *ctx, const char *name), void *ctx) {
+    int ret = 0;
+    bool eof = false;
+
+    dir_batch_reset(reader);
+    while (!eof && (ret == 0 || opts->force)) {
+        const struct dirent *entry;
+        batch->count = 0;
+        while (batch->count < URING_BATCH && (entry = dir_batch_next(reader, fd)) != NULL) {
+            batch->types[batch->count] = entry->d_type;
+            batch->inos[batch->count] = entry->d_ino;
+            strcpy(batch->names[batch->count++], entry->d_name);
+        }
+        if (batch->count < URING_BATCH) {
+            eof = true;
+            if (errno != 0) {
+                report_remove_failure(path->buf, errno, opts);
+                ret = -1;
+            }
+        }
+        if (batch->count == 0)
+            break;
+
+        if (uring_classify_batch(fd, dir_dev, opts) != 0) {
+            report_remove_failure(path->buf, errno, opts);
+            ret = -1;
+            break;
+        }
+
+        // Rename targets only live until the batch completes
+        struct ArenaMark mark = arena_mark(&run_arena);
+        unsigned queued = 0;
+        for (int i = 0; i < batch->count; i++) {
+            batch->trash_paths[i] = NULL;
+            batch->submitted[i] = false;
+        }
+
+        for (int i = 0; i < batch->count; i++) {
+            if (batch->kinds[i] == ENTRY_GONE)
+                continue;
+
+            size_t parent_len = path->len;
+            if (path_push(path, batch->names[i]) != 0) {
+                ret = -1;
+                break;
+            }
+
+            if (batch->kinds[i] == ENTRY_OTHER_FS) {
+                if (opts->verbose && opts->output == OUTPUT_TEXT) {
+                    printf("skipping '%s': different filesystem\n", path->buf);
+                }
+                output_record(opts, path->buf, "SKIP", -1, 0);
+            } else if (batch->kinds[i] == ENTRY_PROTECTED) {
+                fprintf(stderr, "%sbetter-rm: cannot remove '%s': Protected system directory\n",
+                        opts->dry_run ? "[DRY-RUN] " : "", path->buf);
+                output_record(opts, path->buf, "PROTECTED", -1, EPERM);
+                ret = -1;
+            } else if (batch->kinds[i] == ENTRY_KEPT) {
+                keep_report(path->buf, opts);
+                *kept = true;
+            } else if (batch->kinds[i] == ENTRY_DIR) {
+                if (add_subdir(ctx, batch->names[i]) != 0) {
+                    fprintf(stderr, "better-rm: cannot remove '%s': %s\n", path->buf, strerror(ENOMEM));
+                    path_pop(path, parent_len);
+                    ret = -1;
+                    break;
+                }
+            } else {
+                if (output_human(opts)) {
+                    printf("%s%s '%s'\n", opts->dry_run ? "[DRY-RUN] would be " : "",
+                           opts->use_trash ? "trashing" : "removing", path->buf);
+                }
+                if (opts->dry_run) {
+                    output_record(opts, path->buf, opts->use_trash ? "TRASH" : "DELETE", uring_entry_size(i, opts), 0);
+                } else {
+                    int name_err = 0;
+                    struct TrashUsage usage = {.bytes = batch->stx[i].stx_size, .inodes = 1};
+                    if (opts->use_trash) {
+                        if (trash_quota_admit(opts->trash_dir, &usage, false) != 0 ||
+                            generate_trash_name(batch->trash_path, sizeof(batch->trash_path), path->buf,
+                                                opts->trash_dir) != 0) {
+                            name_err = errno;
+                        } else if (!(batch->trash_paths[i] = arena_strdup(&run_arena, batch->trash_path))) {
+                            name_err = ENOMEM;
+                        }
+                    }
+                    if (name_err) {
+                        errno = name_err;
+                        log_deletion(path->buf, "TRASH", false, -1);
+                        output_record(opts, path->buf, "TRASH", -1, name_err);
+                        ret = -1;
+                    } else {
+                        struct io_uring_sqe *sqe = uring_get_sqe(&queued);
+                        sqe->fd = fd;
+                        sqe->addr = (uintptr_t) batch->names[i];
+                        sqe->user_data = (unsigned) i;
+                        if (opts->use_trash) {
+                            sqe->opcode = IORING_OP_RENAMEAT;
+                            sqe->len = (unsigned) AT_FDCWD;
+                            sqe->addr2 = (uintptr_t) batch->trash_paths[i];
+                            sqe->rename_flags = RENAME_NOREPLACE;
+                        } else {
+                            sqe->opcode = IORING_OP_UNLINKAT;
+                        }
+                        batch->submitted[i] = true;
+                    }
+                }
+            }
+            path_pop(path, parent_len);
+        }
+
+        if (uring_submit_and_wait(queued) != 0) {
+            report_remove_failure(path->buf, errno, opts);
+            ret = -1;
+        }
+
+        for (int i = 0; i < batch->count; i++) {
+            if (!batch->submitted[i])
+                continue;
+
+            size_t parent_len = path->len;
+            if (path_push(path, batch->names[i]) != 0) {
+                ret = -1;
+                continue;
+            }
+            // A name taken meanwhile, or a filesystem without RENAME_NOREPLACE, is retried synchronously
+            bool indexed = false;
+            if (opts->use_trash && (batch->res[i] == -EEXIST || batch->res[i] == -EINVAL)) {
+                int moved = move_to_trash_at(fd, batch->names[i], path->buf, opts->trash_dir, false);
+                batch->res[i] = moved == 0 ? 0 : -errno;
+                indexed = true;
+            }
+            const struct statx *stx = &batch->stx[i];
+            struct stat st = {.st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor),
+                              .st_ino = (ino_t) stx->stx_ino,
+                              .st_mode = stx->stx_mode,
+                              .st_size = (off_t) stx->stx_size};
+            if (batch->res[i] < 0) {
+                errno = -batch->res[i];
+                if (opts->use_trash && !indexed)
+                    fprintf(stderr, "better-rm: cannot move to trash: %s\n", strerror(errno));
+                else if (!opts->use_trash)
+                    report_remove_failure(path->buf, errno, opts);
+                ret = -1;
+            } else if (opts->use_trash && !indexed) {
+                struct TrashUsage usage = {.bytes = stx->stx_size, .inodes = 1};
+                trash_index_append(opts->trash_dir, path->buf, batch->trash_paths[i], &st, &usage, NULL);
+            }
+            bool stated = uring_needs_stat(batch->types[i], batch->inos[i], opts);
+            log_deletion_stat(path->buf, opts->use_trash ? "TRASH" : "DELETE", batch->res[i] >= 0,
+                              uring_entry_size(i, opts), stated ? &st : NULL);
+            output_record(opts, path->buf, opts->use_trash ? "TRASH" : "DELETE", uring_entry_size(i, opts),
+                          batch->res[i] < 0 ? -batch->res[i] : 0);
+            path_pop(path, parent_len);
+        }
+        arena_release(&run_arena, mark);
+    }
+    return ret;
+}
+
+#else
+
+/** Report whether the io_uring backend can be used
+ *
+ * @return always false, the backend was not compiled in
+ */
+bool uring_supported(void) { return false; }
+
+/** Scan one directory through the ring
+ *
+ * @param fd directory
+ * @param dir_dev device of the directory
+ * @param reader reads the entries
+ * @param path full path of the directory
+ * @param opts provided options
+ * @param kept set when an entry of the directory is kept
+ * @param add_subdir called for every subdirectory
+ * @param ctx argument of \p add_subdir
+ * @return always -1, the backend was not compiled in
+ */
+int uring_scan_dir(int fd, dev_t dir_dev, struct DirBatch *reader, struct PathBuf *path, const struct Options *opts,
+                   bool *kept, int (*add_subdir)(void *ctx, const char *name), void *ctx) {
+    errno = ENOSYS;
+    return -1;
+}
+
+#endif // BETTER_RM_IO_URING
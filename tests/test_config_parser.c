@@ -7,6 +7,8 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include "../include/better_rm.h"
+
 // Function declarations from main.c
 void load_config_file(const char *filename);
 void load_configs(void);
@@ -189,6 +191,144 @@ START_TEST(test_long_lines) {
 }
 END_TEST
 
+// Test audit mode directive
+START_TEST(test_audit_mode_directive) {
+    char config_path[256];
+    snprintf(config_path, sizeof(config_path), "%s/audit.conf", test_dir);
+
+    write_config(config_path, "audit=summary\n");
+    load_config_file(config_path);
+    ck_assert_int_eq(audit_mode, AUDIT_SUMMARY);
+
+    // Unknown modes are ignored
+    write_config(config_path, "audit=verbose\n");
+    load_config_file(config_path);
+    ck_assert_int_eq(audit_mode, AUDIT_SUMMARY);
+
+    write_config(config_path, "audit=file\n");
+    load_config_file(config_path);
+    ck_assert_int_eq(audit_mode, AUDIT_FILE);
+}
+END_TEST
+
+// Test trash limit directives
+START_TEST(test_trash_quota_directives) {
+    char config_path[256];
+    snprintf(config_path, sizeof(config_path), "%s/quota.conf", test_dir);
+
+    write_config(config_path, "trash_max_bytes=10K\ntrash_max_age=2w\ntrash_evict=background\ntrash_dedup=yes\n");
+    load_config_file(config_path);
+    ck_assert_uint_eq(trash_max_bytes, 10240);
+    ck_assert_int_eq(trash_max_age, 14 * 24 * 60 * 60);
+    ck_assert_int_eq(trash_evict, TRASH_EVICT_BACKGROUND);
+    ck_assert(trash_dedup);
+
+    // Invalid values are ignored, an age without a unit is in days
+    write_config(config_path, "trash_max_bytes=lots\ntrash_max_age=3\ntrash_evict=never\ntrash_dedup=maybe\n");
+    load_config_file(config_path);
+    ck_assert_uint_eq(trash_max_bytes, 10240);
+    ck_assert_int_eq(trash_max_age, 3 * 24 * 60 * 60);
+    ck_assert_int_eq(trash_evict, TRASH_EVICT_BACKGROUND);
+    ck_assert(trash_dedup);
+
+    trash_max_bytes = 0;
+    trash_max_age = 0;
+    trash_evict = TRASH_EVICT_SYNC;
+    trash_dedup = false;
+}
+END_TEST
+
+// Test the configuration snapshot round trip and its invalidation
+START_TEST(test_config_snapshot) {
+    char path[512], keep[512], missing[512], moved[512];
+    snprintf(path, sizeof(path), "%s/cache", test_dir);
+    setenv("XDG_CACHE_HOME", path, 1);
+    snprintf(path, sizeof(path), "%s/xdg", test_dir);
+    setenv("XDG_CONFIG_HOME", path, 1);
+    mkdir(path, 0755);
+    snprintf(path, sizeof(path), "%s/xdg/better-rm", test_dir);
+    mkdir(path, 0755);
+    snprintf(keep, sizeof(keep), "%s/keep", test_dir);
+    mkdir(keep, 0755);
+
+    char config[1024];
+    snprintf(path, sizeof(path), "%s/xdg/better-rm/config", test_dir);
+    snprintf(missing, sizeof(missing), "%s/missing", test_dir);
+    snprintf(config, sizeof(config), "protect=%s\nprotect=%s\naudit=summary\nkeep=*.log\nkeep=sub/dir\n", keep,
+             missing);
+    write_config(path, config);
+
+    // Patterns with a slash inside are refused
+    load_configs();
+    ck_assert_int_eq(keep_count, 1);
+    ck_assert_int_eq(config_snapshot_save(), 0);
+
+    // Forget the parsed configuration, the snapshot has to bring it back
+    int parsed_count = protected_count;
+    char *parsed[MAX_PROTECTED_DIRS];
+    memcpy(parsed, protected_dirs, sizeof(parsed));
+    protected_set_clear();
+    audit_mode = AUDIT_FILE;
+    protected_count = 0;
+    char *parsed_keep = keep_patterns[0];
+    keep_count = 0;
+
+    ck_assert_int_eq(config_snapshot_load(), 0);
+    ck_assert_int_eq(keep_count, 1);
+    ck_assert_str_eq(keep_patterns[0], "*.log");
+    ck_assert_int_eq(protected_count, parsed_count);
+    for (int i = 0; i < parsed_count; i++) {
+        ck_assert_str_eq(protected_dirs[i], parsed[i]);
+    }
+    ck_assert_int_eq(audit_mode, AUDIT_SUMMARY);
+    struct stat st;
+    ck_assert_int_eq(stat(keep, &st), 0);
+    ck_assert(protected_set_contains(st.st_dev, st.st_ino));
+    ck_assert(is_protected(keep));
+
+    // So does a protected directory created or replaced since the snapshot was built
+    ck_assert_int_eq(mkdir(missing, 0755), 0);
+    ck_assert_int_eq(config_snapshot_load(), -1);
+    ck_assert_int_eq(rmdir(missing), 0);
+    ck_assert_int_eq(config_snapshot_load(), 0);
+    snprintf(moved, sizeof(moved), "%s/keep.old", test_dir);
+    ck_assert_int_eq(rename(keep, moved), 0);
+    ck_assert_int_eq(mkdir(keep, 0755), 0);
+    ck_assert_int_eq(config_snapshot_load(), -1);
+    ck_assert_int_eq(rmdir(keep), 0);
+    ck_assert_int_eq(rename(moved, keep), 0);
+    ck_assert_int_eq(config_snapshot_load(), 0);
+
+    // Once the directory holding them settled, its mtime alone tells a protected directory came and went
+    const struct timespec past[2] = {{.tv_sec = 1000000000, .tv_nsec = 0}, {.tv_sec = 1000000000, .tv_nsec = 0}};
+    ck_assert_int_eq(utimensat(AT_FDCWD, test_dir, past, 0), 0);
+    ck_assert_int_eq(config_snapshot_save(), 0);
+    ck_assert_int_eq(config_snapshot_load(), 0);
+    ck_assert_int_eq(mkdir(missing, 0755), 0);
+    ck_assert_int_eq(rmdir(missing), 0);
+    ck_assert_int_eq(config_snapshot_load(), -1);
+
+    // Changing a configuration file invalidates the snapshot
+    snprintf(config, sizeof(config), "protect=%s\naudit=file\n", keep);
+    write_config(path, config);
+    ck_assert_int_eq(config_snapshot_load(), -1);
+
+    // Restore the parsed entries for the teardown, without the identity of the test directory
+    memcpy(protected_dirs, parsed, sizeof(parsed));
+    protected_count = parsed_count;
+    protected_set_clear();
+    for (int i = 0; i < protected_count; i++) {
+        if (strcmp(protected_dirs[i], keep) != 0)
+            protected_set_add(protected_dirs[i]);
+    }
+    audit_mode = AUDIT_FILE;
+    free(parsed_keep);
+    keep_count = 0;
+    unsetenv("XDG_CACHE_HOME");
+    unsetenv("XDG_CONFIG_HOME");
+}
+END_TEST
+
 
 // Create test suite
 Suite *test_config_parser_suite(void) {
@@ -206,6 +346,9 @@ Suite *test_config_parser_suite(void) {
     tcase_add_test(tc_core, test_protect_with_spaces);
     tcase_add_test(tc_core, test_xdg_config_home_env);
     tcase_add_test(tc_core, test_long_lines);
+    tcase_add_test(tc_core, test_audit_mode_directive);
+    tcase_add_test(tc_core, test_trash_quota_directives);
+    tcase_add_test(tc_core, test_config_snapshot);
 
     suite_add_tcase(s, tc_core);
 
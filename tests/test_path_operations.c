@@ -1,13 +1,16 @@
 #include <check.h>
+#include <limits.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include "../include/better_rm.h"
+
 // Function declarations from main.c
 char *resolve_path(const char *path);
-char *generate_trash_name(const char *original_path, const char *trash_dir);
 
 // Test fixture data
 static char *test_dir = NULL;
@@ -38,7 +41,6 @@ START_TEST(test_resolve_absolute_path) {
     char *resolved = resolve_path("/usr/bin");
     ck_assert_ptr_nonnull(resolved);
     ck_assert_str_eq(resolved, "/usr/bin");
-    free(resolved);
 }
 END_TEST
 
@@ -54,7 +56,6 @@ START_TEST(test_resolve_relative_path) {
     char expected[256];
     snprintf(expected, sizeof(expected), "%s/%s", test_dir, subdir);
     ck_assert_str_eq(resolved, expected);
-    free(resolved);
 }
 END_TEST
 
@@ -79,7 +80,6 @@ START_TEST(test_resolve_symlink) {
     char expected[256];
     snprintf(expected, sizeof(expected), "%s/%s", test_dir, target);
     ck_assert_str_eq(resolved, expected);
-    free(resolved);
 }
 END_TEST
 
@@ -92,7 +92,6 @@ START_TEST(test_resolve_nonexistent_path) {
     char expected[256];
     snprintf(expected, sizeof(expected), "%s/does_not_exist", test_dir);
     ck_assert_str_eq(resolved, expected);
-    free(resolved);
 }
 END_TEST
 
@@ -101,8 +100,8 @@ START_TEST(test_generate_trash_name) {
     const char *original = "/home/user/document.txt";
     const char *trash_dir_path = "/home/user/.Trash";
 
-    char *trash_name = generate_trash_name(original, trash_dir_path);
-    ck_assert_ptr_nonnull(trash_name);
+    char trash_name[PATH_MAX];
+    ck_assert_int_eq(generate_trash_name(trash_name, sizeof(trash_name), original, trash_dir_path), 0);
 
     // Should start with trash directory
     ck_assert(strstr(trash_name, trash_dir_path) == trash_name);
@@ -117,6 +116,15 @@ START_TEST(test_generate_trash_name) {
     char pid_str[32];
     snprintf(pid_str, sizeof(pid_str), ".%d", getpid());
     ck_assert_ptr_nonnull(strstr(trash_name, pid_str));
+
+    // Same-named entries trashed in the same second get different names
+    char next_name[PATH_MAX];
+    ck_assert_int_eq(generate_trash_name(next_name, sizeof(next_name), original, trash_dir_path), 0);
+    ck_assert_str_ne(trash_name, next_name);
+
+    // Names that do not fit are refused
+    char short_name[16];
+    ck_assert_int_eq(generate_trash_name(short_name, sizeof(short_name), original, trash_dir_path), -1);
 }
 END_TEST
 
@@ -128,7 +136,6 @@ START_TEST(test_resolve_path_trailing_slash) {
 
     // realpath typically removes trailing slashes
     ck_assert_str_eq(resolved, "/usr/bin");
-    free(resolved);
 }
 END_TEST
 
@@ -137,7 +144,6 @@ START_TEST(test_resolve_current_dir) {
     char *resolved = resolve_path(".");
     ck_assert_ptr_nonnull(resolved);
     ck_assert_str_eq(resolved, test_dir);
-    free(resolved);
 }
 END_TEST
 
@@ -146,7 +152,38 @@ START_TEST(test_resolve_parent_dir) {
     char *resolved = resolve_path("..");
     ck_assert_ptr_nonnull(resolved);
     ck_assert_str_eq(resolved, "/tmp");
-    free(resolved);
+}
+END_TEST
+
+// Test arena rewinding and slab recycling
+START_TEST(test_arena_and_slab_reuse) {
+    struct Arena arena = {0};
+    char *kept = arena_strdup(&arena, "kept");
+    ck_assert_ptr_nonnull(kept);
+
+    struct ArenaMark mark = arena_mark(&arena);
+    char *scratch = arena_alloc(&arena, 100);
+    ck_assert_ptr_nonnull(scratch);
+    ck_assert_int_eq((int) ((uintptr_t) scratch % 16), 0);
+    // Larger than a block, gets one of its own
+    ck_assert_ptr_nonnull(arena_alloc(&arena, 1 << 20));
+    arena_release(&arena, mark);
+
+    // Rewound memory is handed out again and older allocations survive
+    ck_assert_ptr_eq(arena_alloc(&arena, 100), scratch);
+    ck_assert_str_eq(kept, "kept");
+    arena_destroy(&arena);
+
+    struct Slab slab = {0};
+    void *node = slab_alloc(&slab, 200);
+    ck_assert_ptr_nonnull(node);
+    slab_free(&slab, node);
+    ck_assert_ptr_eq(slab_alloc(&slab, 150), node);
+    void *big = slab_alloc(&slab, 64 * 1024);
+    ck_assert_ptr_nonnull(big);
+    slab_free(&slab, big);
+    slab_free(&slab, node);
+    slab_destroy(&slab);
 }
 END_TEST
 
@@ -166,6 +203,7 @@ Suite *test_path_operations_suite(void) {
     tcase_add_test(tc_core, test_resolve_nonexistent_path);
     tcase_add_test(tc_core, test_generate_trash_name);
     tcase_add_test(tc_core, test_resolve_path_trailing_slash);
+    tcase_add_test(tc_core, test_arena_and_slab_reuse);
     tcase_add_test(tc_core, test_resolve_current_dir);
     tcase_add_test(tc_core, test_resolve_parent_dir);
 
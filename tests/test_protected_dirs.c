@@ -6,26 +6,14 @@
 #include <string.h>
 #include <unistd.h>
 
+#include "../include/better_rm.h"
+
 // Function declarations from main.c
 void init_protected_dirs(void);
 void load_config_file(const char *filename);
 bool is_protected(const char *path);
 bool is_root_with_preserve(const char *path, const struct Options *opts);
 
-// Options struct from main.c
-struct Options {
-    bool recursive;
-    bool force;
-    bool verbose;
-    bool interactive;
-    bool dry_run;
-    bool preserve_root;
-    bool one_file_system;
-    bool use_trash;
-    bool no_preserve_root;
-    char *trash_dir;
-};
-
 // Access to protected dirs for testing
 extern char *protected_dirs[];
 extern int protected_count;
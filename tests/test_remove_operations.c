@@ -1,31 +1,25 @@
 #include <check.h>
+#include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
+#include "../include/better_rm.h"
+
 // Function declarations from main.c
-int safe_remove(const char *path, const struct Options *opts);
 int remove_directory(const char *path, const struct Options *opts);
 void init_protected_dirs(void);
 int ensure_trash_dir(const char *trash_dir);
 
-struct Options {
-    bool recursive;
-    bool force;
-    bool verbose;
-    bool interactive;
-    bool dry_run;
-    bool preserve_root;
-    bool one_file_system;
-    bool use_trash;
-    bool no_preserve_root;
-    const char *trash_dir;
-};
-
 // Test fixture data
 static char *test_dir = NULL;
 static char *trash_dir = NULL;
@@ -232,6 +226,781 @@ START_TEST(test_remove_nested_directories) {
 }
 END_TEST
 
+// Test removing a tree whose paths are longer than PATH_MAX
+START_TEST(test_remove_directory_deeper_than_path_max) {
+    char component[201];
+    memset(component, 'd', sizeof(component) - 1);
+    component[sizeof(component) - 1] = '\0';
+
+    ck_assert_int_eq(mkdir("deep", 0755), 0);
+    int fd = open("deep", O_RDONLY | O_DIRECTORY);
+    ck_assert_int_ne(fd, -1);
+
+    // 30 levels of 200 character names exceed PATH_MAX (4096)
+    for (int i = 0; i < 30; i++) {
+        ck_assert_int_eq(mkdirat(fd, component, 0755), 0);
+        int child = openat(fd, component, O_RDONLY | O_DIRECTORY);
+        ck_assert_int_ne(child, -1);
+        close(fd);
+        fd = child;
+    }
+    int file_fd = openat(fd, "leaf.txt", O_WRONLY | O_CREAT, 0644);
+    ck_assert_int_ne(file_fd, -1);
+    close(file_fd);
+    close(fd);
+
+    struct Options opts = default_opts;
+    opts.recursive = true;
+
+    ck_assert_int_eq(safe_remove("deep", &opts), 0);
+    ck_assert(!file_exists("deep"));
+}
+END_TEST
+
+// Test a tree deeper than the walker keeps directories open is removed without more fds and without repeats
+START_TEST(test_remove_directory_deeper_than_open_dirs) {
+    ck_assert_int_eq(mkdir("tall", 0755), 0);
+    int fd = open("tall", O_RDONLY | O_DIRECTORY);
+    ck_assert_int_ne(fd, -1);
+
+    // Every level holds two files besides the next level, so reopened directories have entries left to resume at
+    for (int i = 0; i < 1000; i++) {
+        ck_assert_int_eq(mkdirat(fd, "d", 0755), 0);
+        close(openat(fd, "a", O_WRONLY | O_CREAT, 0644));
+        close(openat(fd, "z", O_WRONLY | O_CREAT, 0644));
+        int child = openat(fd, "d", O_RDONLY | O_DIRECTORY);
+        ck_assert_int_ne(child, -1);
+        close(fd);
+        fd = child;
+    }
+    close(fd);
+
+    struct rlimit saved_limit, limit;
+    ck_assert_int_eq(getrlimit(RLIMIT_NOFILE, &saved_limit), 0);
+    limit = saved_limit;
+    limit.rlim_cur = 256;
+    ck_assert_int_eq(setrlimit(RLIMIT_NOFILE, &limit), 0);
+
+    struct Options opts = default_opts;
+    opts.recursive = true;
+    opts.dry_run = true;
+    opts.output = OUTPUT_NDJSON;
+
+    char report[512];
+    snprintf(report, sizeof(report), "%s/tall.out", test_dir);
+    int saved_stdout = dup(STDOUT_FILENO);
+    int out = open(report, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    dup2(out, STDOUT_FILENO);
+    close(out);
+
+    int dry_ret = safe_remove("tall", &opts);
+    output_flush();
+
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+
+    opts.dry_run = false;
+    opts.output = OUTPUT_TEXT;
+    int ret = safe_remove("tall", &opts);
+    setrlimit(RLIMIT_NOFILE, &saved_limit);
+
+    ck_assert_int_eq(dry_ret, 0);
+    FILE *file = fopen(report, "r");
+    ck_assert_ptr_nonnull(file);
+    int records = 0, c;
+    while ((c = fgetc(file)) != EOF) {
+        if (c == '\n')
+            records++;
+    }
+    fclose(file);
+    ck_assert_int_eq(records, 3 * 1000 + 1);
+
+    ck_assert_int_eq(ret, 0);
+    ck_assert(!file_exists("tall"));
+}
+END_TEST
+
+// Creates dir/sub0..subN each holding files and a nested directory
+static void create_wide_tree(const char *root, int dirs, int files) {
+    char path[512];
+    ck_assert_int_eq(mkdir(root, 0755), 0);
+    for (int d = 0; d < dirs; d++) {
+        snprintf(path, sizeof(path), "%s/sub%d", root, d);
+        ck_assert_int_eq(mkdir(path, 0755), 0);
+        snprintf(path, sizeof(path), "%s/sub%d/nested", root, d);
+        ck_assert_int_eq(mkdir(path, 0755), 0);
+        for (int f = 0; f < files; f++) {
+            snprintf(path, sizeof(path), "%s/sub%d/file%d.txt", root, d, f);
+            create_test_file(path, "content");
+            snprintf(path, sizeof(path), "%s/sub%d/nested/file%d.txt", root, d, f);
+            create_test_file(path, "content");
+        }
+    }
+}
+
+// Test removing a tree with several worker threads
+START_TEST(test_remove_directory_parallel) {
+    create_wide_tree("parallel", 32, 16);
+
+    struct Options opts = default_opts;
+    opts.recursive = true;
+    opts.jobs = 4;
+
+    ck_assert_int_eq(safe_remove("parallel", &opts), 0);
+    ck_assert(!file_exists("parallel"));
+}
+END_TEST
+
+// Test parallel dry-run leaves the tree untouched
+START_TEST(test_remove_directory_parallel_dry_run) {
+    create_wide_tree("parallel", 8, 4);
+
+    struct Options opts = default_opts;
+    opts.recursive = true;
+    opts.dry_run = true;
+    opts.jobs = 4;
+
+    int saved_stdout = dup(STDOUT_FILENO);
+    int devnull = open("/dev/null", O_WRONLY);
+    dup2(devnull, STDOUT_FILENO);
+    close(devnull);
+
+    int ret = safe_remove("parallel", &opts);
+
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+
+    ck_assert_int_eq(ret, 0);
+    ck_assert(file_exists("parallel/sub7/nested/file3.txt"));
+}
+END_TEST
+
+// Test the batch reader hands out every entry in inode order, without . and ..
+START_TEST(test_dir_batch_inode_order) {
+    create_wide_tree("batch", 1, 500);
+
+    int fd = open("batch/sub0", O_RDONLY | O_DIRECTORY);
+    ck_assert_int_ge(fd, 0);
+    struct DirBatch batch = {0};
+    const struct dirent *entry;
+    size_t count = 0;
+    ino_t last = 0;
+    while ((entry = dir_batch_next(&batch, fd)) != NULL) {
+        ck_assert_str_ne(entry->d_name, ".");
+        ck_assert_str_ne(entry->d_name, "..");
+        // 500 entries fit in the first batch, so the whole directory is sorted
+        ck_assert(entry->d_ino >= last);
+        last = entry->d_ino;
+        count++;
+    }
+    ck_assert_int_eq(errno, 0);
+    dir_batch_free(&batch);
+    close(fd);
+
+    // The files and the nested directory
+    ck_assert_uint_eq(count, 501);
+}
+END_TEST
+
+// Test shrinking large files before the unlink never truncates a file another link keeps alive
+START_TEST(test_shrink_large_files) {
+    int fd = open("big", O_WRONLY | O_CREAT, 0644);
+    ck_assert_int_ge(fd, 0);
+    ck_assert_int_eq(ftruncate(fd, 4 << 20), 0);
+    ck_assert_int_eq(pwrite(fd, "x", 1, (4 << 20) - 1), 1);
+    close(fd);
+    ck_assert_int_eq(link("big", "big.link"), 0);
+    ck_assert_int_eq(mkdir("tree", 0755), 0);
+    ck_assert_int_eq(link("big", "tree/big"), 0);
+    create_test_file("tree/small", "content");
+
+    struct Options opts = default_opts;
+    opts.recursive = true;
+    opts.shrink_above = 1 << 20;
+    opts.rate = 1000;
+    opts.bandwidth = 64 << 20;
+
+    ck_assert_int_eq(safe_remove("big", &opts), 0);
+    ck_assert_int_eq(safe_remove("tree", &opts), 0);
+    ck_assert(!file_exists("big"));
+    ck_assert(!file_exists("tree"));
+
+    struct stat st;
+    ck_assert_int_eq(stat("big.link", &st), 0);
+    ck_assert_int_eq(st.st_size, 4 << 20);
+
+    // The last link is shrunk, then unlinked
+    ck_assert_int_eq(safe_remove("big.link", &opts), 0);
+    ck_assert(!file_exists("big.link"));
+}
+END_TEST
+
+// Test removing a tree through the io_uring backend, or its synchronous fallback
+START_TEST(test_remove_directory_io_uring) {
+    create_wide_tree("uring", 4, 300);
+    symlink("/etc/passwd", "uring/sub0/link");
+
+    struct Options opts = default_opts;
+    opts.recursive = true;
+    opts.io_uring = true;
+
+    ck_assert_int_eq(safe_remove("uring", &opts), 0);
+    ck_assert(!file_exists("uring"));
+    ck_assert(file_exists("/etc/passwd"));
+}
+END_TEST
+
+// Test recursive walks refuse to enter protected directories in every engine
+START_TEST(test_remove_directory_skips_protected_subdir) {
+    const int jobs[] = {1, 4, 1};
+    const bool io_uring[] = {false, false, true};
+    for (int i = 0; i < 3; i++) {
+        create_wide_tree("walk", 3, 3);
+        mkdir("walk/sub1/keep", 0755);
+        create_test_file("walk/sub1/keep/precious.txt", "precious");
+        ck_assert_int_eq(protected_set_add("walk/sub1/keep"), 0);
+
+        struct Options opts = default_opts;
+        opts.recursive = true;
+        opts.force = true;
+        opts.jobs = jobs[i];
+        opts.io_uring = io_uring[i];
+
+        ck_assert_int_ne(safe_remove("walk", &opts), 0);
+        ck_assert(file_exists("walk/sub1/keep/precious.txt"));
+        ck_assert(!file_exists("walk/sub0"));
+        ck_assert(!file_exists("walk/sub1/file0.txt"));
+
+        // The protected directory is also refused by identity under another name
+        symlink("walk/sub1/keep", "alias");
+        ck_assert(is_protected("alias"));
+        unlink("alias");
+
+        protected_set_clear();
+        ck_assert_int_eq(system("rm -rf walk"), 0);
+    }
+}
+END_TEST
+
+// Test --keep leaves matching entries and their parent directories in place in every engine
+START_TEST(test_remove_directory_keeps_matching_entries) {
+    char *patterns[] = {"*.log", "cache/", "keep-*.d", "NOTES"};
+    struct KeepSet keep;
+    ck_assert_int_eq(keep_compile(&keep, patterns, 4), 0);
+    ck_assert(keep_match(&keep, "build.log", false));
+    ck_assert(keep_match(&keep, ".log", false));
+    ck_assert(!keep_match(&keep, "build.log.gz", false));
+    ck_assert(keep_match(&keep, "cache", true));
+    ck_assert(!keep_match(&keep, "cache", false));
+    ck_assert(keep_match(&keep, "keep-me.d", true));
+    ck_assert(keep_match(&keep, "NOTES", false));
+    ck_assert(!keep_match(&keep, "notes", false));
+    ck_assert(!keep_pattern_valid("sub/cache"));
+    ck_assert(!keep_pattern_valid(""));
+
+    const int jobs[] = {1, 4, 1};
+    const bool io_uring[] = {false, false, true};
+    for (int i = 0; i < 3; i++) {
+        create_wide_tree("build", 3, 3);
+        create_test_file("build/out.log", "log");
+        create_test_file("build/sub1/deep.log", "log");
+        mkdir("build/sub2/cache", 0755);
+        create_test_file("build/sub2/cache/blob", "blob");
+        create_test_file("build/sub0/cache", "not a directory");
+
+        struct Options opts = default_opts;
+        opts.recursive = true;
+        opts.jobs = jobs[i];
+        opts.io_uring = io_uring[i];
+        opts.keep = &keep;
+
+        ck_assert_int_eq(safe_remove("build", &opts), 0);
+        ck_assert(file_exists("build/out.log"));
+        ck_assert(file_exists("build/sub1/deep.log"));
+        ck_assert(file_exists("build/sub2/cache/blob"));
+        ck_assert(!file_exists("build/sub0"));
+        ck_assert(!file_exists("build/sub1/file0.txt"));
+        ck_assert(!file_exists("build/sub2/file0.txt"));
+
+        // A kept operand is not removed either
+        ck_assert_int_eq(safe_remove("build/out.log", &opts), 0);
+        ck_assert(file_exists("build/out.log"));
+        ck_assert_int_eq(system("rm -rf build"), 0);
+    }
+    keep_free(&keep);
+}
+END_TEST
+
+// Test --one-file-system still removes directories on the same filesystem
+START_TEST(test_remove_directory_one_file_system) {
+    create_wide_tree("onefs", 4, 4);
+
+    struct Options opts = default_opts;
+    opts.recursive = true;
+    opts.one_file_system = true;
+
+    ck_assert_int_eq(safe_remove("onefs", &opts), 0);
+    ck_assert(!file_exists("onefs"));
+}
+END_TEST
+
+// Test recursive trash moves the whole tree with its structure intact
+START_TEST(test_trash_directory_tree_single_rename) {
+    create_wide_tree("tree", 3, 2);
+
+    struct Options opts = default_opts;
+    opts.recursive = true;
+    opts.use_trash = true;
+    opts.trash_dir = trash_dir;
+
+    ck_assert_int_eq(safe_remove("tree", &opts), 0);
+    ck_assert(!file_exists("tree"));
+
+    // Exactly one trash entry, holding the original layout
+    DIR *dir = opendir(trash_dir);
+    ck_assert_ptr_nonnull(dir);
+    int count = 0;
+    char trashed[512] = "";
+    const struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        // The trash index lives next to the trashed entries
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 ||
+            strncmp(entry->d_name, ".better-rm-", 11) == 0)
+            continue;
+        snprintf(trashed, sizeof(trashed), "%s/%s/sub2/nested/file1.txt", trash_dir, entry->d_name);
+        count++;
+    }
+    closedir(dir);
+
+    ck_assert_int_eq(count, 1);
+    ck_assert(file_exists(trashed));
+}
+END_TEST
+
+// Test recursive trash leaves a protected subdirectory and its parents in place instead of moving the whole tree
+START_TEST(test_trash_directory_tree_skips_protected_subdir) {
+    create_wide_tree("tree", 3, 2);
+    mkdir("tree/sub1/keep", 0755);
+    create_test_file("tree/sub1/keep/precious.txt", "precious");
+    ck_assert_int_eq(protected_set_add("tree/sub1/keep"), 0);
+    ck_assert(protected_set_below("tree"));
+    ck_assert(!protected_set_below("tree/sub0"));
+
+    struct Options opts = default_opts;
+    opts.recursive = true;
+    opts.force = true;
+    opts.use_trash = true;
+    opts.trash_dir = trash_dir;
+
+    ck_assert_int_ne(safe_remove("tree", &opts), 0);
+    ck_assert(file_exists("tree/sub1/keep/precious.txt"));
+    ck_assert(!file_exists("tree/sub0"));
+    ck_assert(!file_exists("tree/sub1/file0.txt"));
+    protected_set_clear();
+}
+END_TEST
+
+// Test summary auditing removes trees like per-file auditing
+START_TEST(test_remove_directory_audit_summary) {
+    create_wide_tree("summary", 4, 4);
+
+    struct Options opts = default_opts;
+    opts.recursive = true;
+
+    audit_mode = AUDIT_SUMMARY;
+    int ret = safe_remove("summary", &opts);
+    audit_mode = AUDIT_FILE;
+
+    ck_assert_int_eq(ret, 0);
+    ck_assert(!file_exists("summary"));
+}
+END_TEST
+
+/** Print the `--stats` report with stderr in a file
+ *
+ * @param out receives the report
+ * @param size size of \p out
+ */
+static void report_stats(char *out, size_t size) {
+    char report[512];
+    snprintf(report, sizeof(report), "%s/stats.out", test_dir);
+    int saved_stderr = dup(STDERR_FILENO);
+    int fd = open(report, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    dup2(fd, STDERR_FILENO);
+    close(fd);
+    stats_report();
+    dup2(saved_stderr, STDERR_FILENO);
+    close(saved_stderr);
+
+    FILE *file = fopen(report, "r");
+    ck_assert_ptr_nonnull(file);
+    size_t len = fread(out, 1, size - 1, file);
+    fclose(file);
+    out[len] = '\0';
+}
+
+// Test the counters of the worker threads add up to the removed tree in both report formats
+START_TEST(test_stats_report_counts_removal) {
+    create_wide_tree("stats", 4, 4);
+
+    struct Options opts = default_opts;
+    opts.recursive = true;
+    opts.jobs = 4;
+
+    ck_assert_int_eq(stats_enable("text"), 0);
+    ck_assert_int_eq(safe_remove("stats", &opts), 0);
+    ck_assert(!file_exists("stats"));
+
+    // 9 directories and 32 files of 7 bytes
+    char out[8192];
+    report_stats(out, sizeof(out));
+    unsigned long long entries, bytes, failures;
+    ck_assert_int_eq(sscanf(out, "better-rm: %llu entries in %*f s (%*f entries/s), %llu bytes, %llu failures",
+                            &entries, &bytes, &failures),
+                     3);
+    ck_assert_uint_eq(entries, 41);
+    ck_assert_uint_eq(bytes, 224);
+    ck_assert_uint_eq(failures, 0);
+    ck_assert_ptr_nonnull(strstr(out, "\nunlink "));
+
+    ck_assert_int_eq(stats_enable("json"), 0);
+    report_stats(out, sizeof(out));
+    ck_assert_ptr_nonnull(strstr(out, "{\"entries\":41,\"bytes\":224,\"failures\":0,"));
+    const char *unlink_stats = strstr(out, "\"unlink\":");
+    ck_assert_ptr_nonnull(unlink_stats);
+    unsigned long long calls, errors, p50, p99, max;
+    ck_assert_int_eq(sscanf(unlink_stats, "\"unlink\":{\"calls\":%llu,\"errors\":%llu,\"p50_ns\":%llu,\"p99_ns\":%llu,"
+                                          "\"max_ns\":%llu}",
+                            &calls, &errors, &p50, &p99, &max),
+                     5);
+    ck_assert_uint_eq(calls, 32);
+    ck_assert_uint_eq(errors, 0);
+    // Percentiles of the merged histogram stay ordered and within the slowest call
+    ck_assert(p50 <= p99);
+    ck_assert(p99 <= max);
+    ck_assert_ptr_nonnull(strstr(out, "\"rmdir\":{\"calls\":9,"));
+    ck_assert_ptr_nonnull(strstr(out, "\"failures_by_errno\":{}}"));
+}
+END_TEST
+
+/** Run an audit journal query with stdout in a file
+ *
+ * @param operand path or pattern
+ * @param out receives the output
+ * @param size size of \p out
+ * @return number of lines printed
+ */
+static int query_journal(const char *operand, char *out, size_t size) {
+    char report[512];
+    snprintf(report, sizeof(report), "%s/query.out", test_dir);
+    int saved_stdout = dup(STDOUT_FILENO);
+    int fd = open(report, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    dup2(fd, STDOUT_FILENO);
+    close(fd);
+    char *operands[] = {(char *) operand};
+    ck_assert_int_eq(journal_query(operands, 1, INT64_MIN, INT64_MAX), 0);
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+
+    FILE *file = fopen(report, "r");
+    ck_assert_ptr_nonnull(file);
+    size_t len = fread(out, 1, size - 1, file);
+    fclose(file);
+    out[len] = '\0';
+    int lines = 0;
+    for (size_t i = 0; i < len; i++)
+        lines += out[i] == '\n';
+    return lines;
+}
+
+// Test the audit journal answers who removed a path, through its parent directories too
+START_TEST(test_audit_journal_query) {
+    char journal[512], path[600], out[4096];
+    snprintf(journal, sizeof(journal), "%s/journal", test_dir);
+    setenv("BETTER_RM_JOURNAL", journal, 1);
+    audit_journal = true;
+
+    // 12 files and 5 directories written as one group at exit
+    create_wide_tree("journaled", 2, 3);
+    struct Options opts = default_opts;
+    opts.recursive = true;
+    opts.jobs = 4;
+    ck_assert_int_eq(safe_remove("journaled", &opts), 0);
+    journal_flush();
+
+    // The file, the two directories below the operand and the operand
+    ck_assert_int_eq(query_journal("journaled/sub1/nested/file2.txt", out, sizeof(out)), 4);
+    snprintf(path, sizeof(path), "DELETE: %s/journaled/sub1/nested/file2.txt (user: ", test_dir);
+    ck_assert_ptr_nonnull(strstr(out, path));
+    ck_assert_ptr_nonnull(strstr(out, ", size: 7, inode: "));
+    snprintf(path, sizeof(path), "DELETE_DIR: %s/journaled (user: ", test_dir);
+    ck_assert_ptr_nonnull(strstr(out, path));
+
+    // The first query saved the index, records journaled after it are indexed by the next one
+    snprintf(path, sizeof(path), "%s/audit.index", journal);
+    ck_assert(file_exists(path));
+    create_test_file("late.txt", "content");
+    ck_assert_int_eq(safe_remove("late.txt", &opts), 0);
+    journal_flush();
+    ck_assert_int_eq(query_journal("late.txt", out, sizeof(out)), 1);
+    ck_assert_int_eq(query_journal("*/file0.txt", out, sizeof(out)), 4);
+    ck_assert_int_eq(query_journal("never-removed", out, sizeof(out)), 0);
+
+    audit_journal = false;
+    unsetenv("BETTER_RM_JOURNAL");
+}
+END_TEST
+
+// Test every engine reports each entry once with --output=ndjson and --output=null
+START_TEST(test_remove_directory_output_records) {
+    const int jobs[] = {1, 4, 1};
+    const bool io_uring[] = {false, false, true};
+    const enum OutputFormat formats[] = {OUTPUT_NDJSON, OUTPUT_NULL, OUTPUT_NDJSON};
+    char report[512];
+    snprintf(report, sizeof(report), "%s/report.out", test_dir);
+
+    for (int i = 0; i < 3; i++) {
+        // 12 files and 5 directories
+        create_wide_tree("records", 2, 3);
+
+        struct Options opts = default_opts;
+        opts.recursive = true;
+        opts.jobs = jobs[i];
+        opts.io_uring = io_uring[i];
+        opts.output = formats[i];
+
+        int saved_stdout = dup(STDOUT_FILENO);
+        int out = open(report, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        dup2(out, STDOUT_FILENO);
+        close(out);
+
+        int ret = safe_remove("records", &opts);
+        output_flush();
+
+        dup2(saved_stdout, STDOUT_FILENO);
+        close(saved_stdout);
+        ck_assert_int_eq(ret, 0);
+        ck_assert(!file_exists("records"));
+
+        FILE *file = fopen(report, "r");
+        ck_assert_ptr_nonnull(file);
+        char buf[8192];
+        size_t len = fread(buf, 1, sizeof(buf) - 1, file);
+        fclose(file);
+        buf[len] = '\0';
+
+        size_t separators = 0;
+        for (size_t j = 0; j < len; j++) {
+            if (buf[j] == (formats[i] == OUTPUT_NDJSON ? '\n' : '\0'))
+                separators++;
+        }
+        if (formats[i] == OUTPUT_NDJSON) {
+            ck_assert_uint_eq(separators, 17);
+            ck_assert_ptr_nonnull(strstr(buf, "\"action\":\"DELETE\",\"size\":7,\"result\":\"ok\",\"errno\":0}"));
+            ck_assert_ptr_nonnull(strstr(buf, "{\"path\":\"records\",\"action\":\"DELETE_DIR\""));
+        } else {
+            // Path, action, size, result and errno per entry
+            ck_assert_uint_eq(separators, 17 * 5);
+            const char tail[] = "records\0DELETE_DIR\0-1\0ok\0"
+                                "0";
+            ck_assert(len >= sizeof(tail));
+            ck_assert(memcmp(buf + len - sizeof(tail), tail, sizeof(tail)) == 0);
+        }
+    }
+}
+END_TEST
+
+// Test a plan is executed from the scan without walking the tree again
+START_TEST(test_plan_executes_scan) {
+    create_wide_tree("planned", 4, 4);
+    create_test_file("planned.txt", "content");
+
+    struct Options opts = default_opts;
+    opts.recursive = true;
+    char *operands[] = {"planned", "planned.txt"};
+
+    ck_assert_int_eq(plan_run(operands, 2, NULL, &opts), 0);
+    ck_assert(!file_exists("planned"));
+    ck_assert(!file_exists("planned.txt"));
+}
+END_TEST
+
+// Test nested and repeated operands are dropped, but not the ones reached through a symlink
+START_TEST(test_operands_coalesce_nested) {
+    create_wide_tree("tree", 2, 2);
+    mkdir("outside", 0755);
+    create_test_file("outside/target.txt", "target");
+    symlink("../outside", "tree/link");
+
+    struct Options opts = default_opts;
+    opts.recursive = true;
+    char *operands[] = {"tree/sub1/file0.txt", "tree", "./tree/sub0", "tree", "tree/link/target.txt", "tree/gone"};
+
+    // Without coalescing the operands below tree would fail with ENOENT
+    ck_assert_int_eq(operands_run(operands, 6, &opts), 0);
+    ck_assert(!file_exists("tree"));
+    ck_assert(file_exists("outside"));
+    ck_assert(!file_exists("outside/target.txt"));
+
+    // A directory that is not removed keeps the operands below it
+    create_wide_tree("tree", 1, 1);
+    opts.recursive = false;
+    char *flat[] = {"tree", "tree/sub0/file0.txt"};
+    ck_assert_int_ne(operands_run(flat, 2, &opts), 0);
+    ck_assert(!file_exists("tree/sub0/file0.txt"));
+    ck_assert(file_exists("tree"));
+}
+END_TEST
+
+// Test applying a saved plan leaves the entries that changed since the scan
+START_TEST(test_plan_file_skips_changed_entries) {
+    create_wide_tree("planned", 2, 2);
+    char plan_file[512];
+    snprintf(plan_file, sizeof(plan_file), "%s/plan.bin", test_dir);
+
+    struct Options opts = default_opts;
+    opts.recursive = true;
+    opts.force = true;
+    char *operands[] = {"planned"};
+
+    ck_assert_int_eq(plan_run(operands, 1, plan_file, &opts), 0);
+    ck_assert(file_exists(plan_file));
+    ck_assert(file_exists("planned/sub1/nested/file1.txt"));
+
+    // A replaced file and a file added after the scan
+    unlink("planned/sub0/file0.txt");
+    create_test_file("planned/sub0/file0.txt", "replaced");
+    create_test_file("planned/sub1/new.txt", "new");
+
+    ck_assert_int_ne(plan_run(NULL, 0, plan_file, &opts), 0);
+    ck_assert(file_exists("planned/sub0/file0.txt"));
+    ck_assert(file_exists("planned/sub1/new.txt"));
+    ck_assert(!file_exists("planned/sub0/file1.txt"));
+    ck_assert(!file_exists("planned/sub0/nested"));
+    ck_assert(!file_exists("planned/sub1/nested"));
+
+    // A corrupted plan is refused
+    int fd = open(plan_file, O_WRONLY);
+    ck_assert_int_ge(fd, 0);
+    ck_assert_int_eq(pwrite(fd, "X", 1, 0), 1);
+    close(fd);
+    ck_assert_int_ne(plan_run(NULL, 0, plan_file, &opts), 0);
+    ck_assert(file_exists("planned/sub1/new.txt"));
+}
+END_TEST
+
+// Test removing the NUL terminated operands of a list, grouped or not by parent directory
+START_TEST(test_files0_from_removes_listed_operands) {
+    create_wide_tree("listed", 2, 3);
+    create_test_file("top.txt", "content");
+    create_test_file("kept.txt", "content");
+
+    // The last operand has no terminator, the empty one is refused
+    static const char list[] = "listed/sub0/file0.txt\0listed/sub0/file1.txt\0top.txt\0missing.txt\0\0"
+                               "listed/sub0/file2.txt\0listed/sub1";
+    char list_file[512];
+    snprintf(list_file, sizeof(list_file), "%s/list", test_dir);
+    FILE *f = fopen(list_file, "w");
+    ck_assert_ptr_nonnull(f);
+    ck_assert_int_eq(fwrite(list, 1, sizeof(list) - 1, f), sizeof(list) - 1);
+    fclose(f);
+
+    struct Options opts = default_opts;
+    opts.recursive = true;
+    ck_assert_int_ne(files0_run(list_file, &opts), 0);
+    ck_assert(!file_exists("listed/sub0/file0.txt"));
+    ck_assert(!file_exists("listed/sub0/file1.txt"));
+    ck_assert(!file_exists("listed/sub0/file2.txt"));
+    ck_assert(!file_exists("top.txt"));
+    ck_assert(!file_exists("listed/sub1"));
+    ck_assert(file_exists("listed/sub0"));
+    ck_assert(file_exists("kept.txt"));
+
+    // Missing operands are ignored with --force
+    static const char forced[] = "missing.txt\0kept.txt\0";
+    f = fopen(list_file, "w");
+    ck_assert_ptr_nonnull(f);
+    ck_assert_int_eq(fwrite(forced, 1, sizeof(forced) - 1, f), sizeof(forced) - 1);
+    fclose(f);
+    opts.force = true;
+    ck_assert_int_eq(files0_run(list_file, &opts), 0);
+    ck_assert(!file_exists("kept.txt"));
+}
+END_TEST
+
+START_TEST(test_background_reclaim_resumes_staged_trees) {
+    // Trees left in the home staging directory by an interrupted worker
+    char *home = getenv("HOME") ? strdup(getenv("HOME")) : NULL;
+    setenv("HOME", test_dir, 1);
+    ck_assert_int_eq(mkdir(".better-rm-staging", 0700), 0);
+    create_wide_tree(".better-rm-staging/1.1.0", 3, 4);
+    create_test_file(".better-rm-staging/1.1.1", "content");
+
+    ck_assert_int_eq(background_reclaim(false, 1), 0);
+    ck_assert(!file_exists(".better-rm-staging/1.1.0"));
+    ck_assert(!file_exists(".better-rm-staging/1.1.1"));
+    ck_assert(file_exists(".better-rm-staging"));
+
+    // A staging directory others can read is not trusted
+    create_wide_tree(".better-rm-staging/1.1.2", 1, 1);
+    chmod(".better-rm-staging", 0755);
+    ck_assert_int_ne(background_reclaim(false, 1), 0);
+    ck_assert(file_exists(".better-rm-staging/1.1.2"));
+
+    if (home) {
+        setenv("HOME", home, 1);
+        free(home);
+    }
+}
+END_TEST
+
+// Accept one connection on a listening socket and serve it in a child process
+static pid_t serve_once(int listen_fd) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        int conn = accept(listen_fd, NULL, NULL);
+        if (conn < 0)
+            _exit(2);
+        daemon_serve(conn);
+    }
+    return pid;
+}
+
+START_TEST(test_daemon_runs_client_command_line) {
+    create_test_file("served.txt", "content");
+    mkdir("served_dir", 0755);
+    create_test_file("served_dir/file.txt", "content");
+
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/d.sock", test_dir);
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    ck_assert_int_ge(listen_fd, 0);
+    ck_assert_int_eq(bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)), 0);
+    ck_assert_int_eq(listen(listen_fd, 1), 0);
+
+    // Options are parsed by the daemon, in the working directory of the client
+    char *args[] = {"better-rm", "-rf", "served.txt", "served_dir", "missing.txt", NULL};
+    pid_t pid = serve_once(listen_fd);
+    ck_assert_int_eq(daemon_client(addr.sun_path, 5, args), 0);
+    ck_assert_int_eq(waitpid(pid, NULL, 0), pid);
+    ck_assert(!file_exists("served.txt"));
+    ck_assert(!file_exists("served_dir"));
+
+    // The exit status of the command comes back
+    char *failing[] = {"better-rm", "missing.txt", NULL};
+    pid = serve_once(listen_fd);
+    ck_assert_int_eq(daemon_client(addr.sun_path, 2, failing), 1);
+    ck_assert_int_eq(waitpid(pid, NULL, 0), pid);
+
+    // Without a daemon the command runs locally
+    close(listen_fd);
+    unlink(addr.sun_path);
+    ck_assert_int_eq(daemon_client(addr.sun_path, 2, failing), -1);
+}
+END_TEST
+
 // Create test suite
 Suite *test_remove_operations_suite(void) {
     Suite *s;
@@ -252,6 +1021,28 @@ Suite *test_remove_operations_suite(void) {
     tcase_add_test(tc_core, test_remove_with_trash);
     tcase_add_test(tc_core, test_remove_symlink);
     tcase_add_test(tc_core, test_remove_nested_directories);
+    tcase_add_test(tc_core, test_remove_directory_deeper_than_path_max);
+    tcase_add_test(tc_core, test_remove_directory_deeper_than_open_dirs);
+    tcase_add_test(tc_core, test_remove_directory_parallel);
+    tcase_add_test(tc_core, test_remove_directory_parallel_dry_run);
+    tcase_add_test(tc_core, test_remove_directory_io_uring);
+    tcase_add_test(tc_core, test_dir_batch_inode_order);
+    tcase_add_test(tc_core, test_shrink_large_files);
+    tcase_add_test(tc_core, test_remove_directory_skips_protected_subdir);
+    tcase_add_test(tc_core, test_remove_directory_keeps_matching_entries);
+    tcase_add_test(tc_core, test_remove_directory_one_file_system);
+    tcase_add_test(tc_core, test_trash_directory_tree_single_rename);
+    tcase_add_test(tc_core, test_trash_directory_tree_skips_protected_subdir);
+    tcase_add_test(tc_core, test_remove_directory_audit_summary);
+    tcase_add_test(tc_core, test_stats_report_counts_removal);
+    tcase_add_test(tc_core, test_audit_journal_query);
+    tcase_add_test(tc_core, test_remove_directory_output_records);
+    tcase_add_test(tc_core, test_plan_executes_scan);
+    tcase_add_test(tc_core, test_plan_file_skips_changed_entries);
+    tcase_add_test(tc_core, test_operands_coalesce_nested);
+    tcase_add_test(tc_core, test_files0_from_removes_listed_operands);
+    tcase_add_test(tc_core, test_daemon_runs_client_command_line);
+    tcase_add_test(tc_core, test_background_reclaim_resumes_staged_trees);
 
     suite_add_tcase(s, tc_core);
 
@@ -1,16 +1,21 @@
 #include <check.h>
 #include <dirent.h>
+#include <fcntl.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "../include/better_rm.h"
+
 // Function declarations from main.c
 int move_to_trash(const char *path, const char *trash_dir, bool verbose);
 int ensure_trash_dir(const char *trash_dir);
-char *generate_trash_name(const char *original_path, const char *trash_dir);
+int copy_to_trash_at(int dirfd, const char *name, const char *trash_path, bool dedup);
+const char *mount_trash_dir(const char *path, const struct stat *st);
 
 // Test fixture data
 static char *test_dir = NULL;
@@ -175,13 +180,18 @@ END_TEST
 START_TEST(test_trash_name_uniqueness) {
     const char *test_file = "duplicate.txt";
 
-    // Move same filename multiple times
+    // Move same filename multiple times within the same second
     for (int i = 0; i < 3; i++) {
         char content[32];
         snprintf(content, sizeof(content), "content %d", i);
         create_test_file(test_file, content);
         ck_assert_int_eq(move_to_trash(test_file, trash_dir, false), 0);
-        sleep(1); // Ensure different timestamps
+    }
+
+    // An empty directory would silently replace one trashed under the same name
+    for (int i = 0; i < 2; i++) {
+        ck_assert_int_eq(mkdir("duplicate.txt.d", 0755), 0);
+        ck_assert_int_eq(move_to_trash("duplicate.txt.d", trash_dir, false), 0);
     }
 
     // Count files in trash with this name
@@ -197,7 +207,7 @@ START_TEST(test_trash_name_uniqueness) {
     }
     closedir(dir);
 
-    ck_assert_int_eq(count, 3);
+    ck_assert_int_eq(count, 5);
 }
 END_TEST
 
@@ -235,6 +245,429 @@ START_TEST(test_move_readonly_file) {
 }
 END_TEST
 
+// Test identical copies share one blob that is freed with the last of them
+START_TEST(test_copy_to_trash_dedups_identical_files) {
+    mkdir("first", 0755);
+    create_test_file("first/data.txt", "shared content");
+    create_test_file("second.txt", "shared content");
+    create_test_file("other.txt", "other content");
+
+    char first[512], second[512], other[512], path[600];
+    snprintf(first, sizeof(first), "%s/first.test", trash_dir);
+    snprintf(second, sizeof(second), "%s/second.test", trash_dir);
+    snprintf(other, sizeof(other), "%s/other.test", trash_dir);
+    ck_assert_int_eq(copy_to_trash_at(AT_FDCWD, "first", first, true), 0);
+    ck_assert_int_eq(copy_to_trash_at(AT_FDCWD, "second.txt", second, true), 0);
+    ck_assert_int_eq(copy_to_trash_at(AT_FDCWD, "other.txt", other, true), 0);
+
+    // The store and both copies link to one inode
+    struct stat first_st, second_st, other_st;
+    snprintf(path, sizeof(path), "%s/data.txt", first);
+    ck_assert_int_eq(lstat(path, &first_st), 0);
+    ck_assert_int_eq(lstat(second, &second_st), 0);
+    ck_assert_int_eq(lstat(other, &other_st), 0);
+    ck_assert(first_st.st_ino == second_st.st_ino);
+    ck_assert_int_eq(second_st.st_nlink, 3);
+    ck_assert(other_st.st_ino != second_st.st_ino);
+    ck_assert_int_eq(other_st.st_nlink, 2);
+
+    // Blobs still linked from the trash survive the sweep, the others are freed
+    int fd = open(trash_dir, O_RDONLY | O_DIRECTORY);
+    ck_assert_int_ge(fd, 0);
+    ck_assert_int_eq(unlink(second), 0);
+    ck_assert_int_eq(unlink(other), 0);
+    dedup_collect(fd);
+    ck_assert_int_eq(lstat(path, &first_st), 0);
+    ck_assert_int_eq(first_st.st_nlink, 2);
+
+    ck_assert_int_eq(unlink(path), 0);
+    dedup_collect(fd);
+    close(fd);
+    snprintf(path, sizeof(path), "%s/.better-rm-blobs", trash_dir);
+    DIR *blobs = opendir(path);
+    ck_assert_ptr_nonnull(blobs);
+    struct dirent *entry;
+    int left = 0;
+    while ((entry = readdir(blobs)) != NULL) {
+        if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0)
+            left++;
+    }
+    closedir(blobs);
+    ck_assert_int_eq(left, 0);
+}
+END_TEST
+
+// Count the blobs left in the store of the test trash
+static int count_blobs(void) {
+    char path[600];
+    snprintf(path, sizeof(path), "%s/.better-rm-blobs", trash_dir);
+    DIR *blobs = opendir(path);
+    ck_assert_ptr_nonnull(blobs);
+    struct dirent *entry;
+    int left = 0;
+    while ((entry = readdir(blobs)) != NULL) {
+        if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0)
+            left++;
+    }
+    closedir(blobs);
+    return left;
+}
+
+// Copy a file into the test trash the way move_to_trash_at() does across filesystems, indexing its blobs
+static void trash_deduped(const char *name, const char *trash_name) {
+    char trash_path[512];
+    snprintf(trash_path, sizeof(trash_path), "%s/%s", trash_dir, trash_name);
+    struct stat st;
+    ck_assert_int_eq(lstat(name, &st), 0);
+    struct TrashUsage usage = {.bytes = (uint64_t) st.st_size, .inodes = 1};
+    dedup_refs_begin();
+    ck_assert_int_eq(copy_to_trash_at(AT_FDCWD, name, trash_path, true), 0);
+    const char *blobs = dedup_refs_end();
+    ck_assert_ptr_nonnull(blobs);
+    ck_assert_int_eq(trash_index_append(trash_dir, name, trash_path, &st, &usage, blobs), 0);
+}
+
+START_TEST(test_trash_record_releases_its_blobs) {
+    create_test_file("shared.txt", "shared content");
+    create_test_file("kept.txt", "shared content");
+    create_test_file("own.txt", "own content");
+    trash_deduped("shared.txt", "shared.test");
+    trash_deduped("kept.txt", "kept.test");
+    trash_deduped("own.txt", "own.test");
+    ck_assert_int_eq(count_blobs(), 2);
+
+    // Restoring copies the entry out, the restored file shares no inode with the store
+    struct Options opts = {.preserve_root = true, .jobs = 1};
+    char *operands[] = {"shared.txt"};
+    ck_assert_int_eq(restore_trash(trash_dir, operands, 1, INT64_MIN, INT64_MAX, &opts), 0);
+    struct stat st;
+    ck_assert_int_eq(lstat("shared.txt", &st), 0);
+    ck_assert_int_eq(st.st_nlink, 1);
+    ck_assert_int_eq(count_blobs(), 2);
+
+    // Removing the last entry linking to a blob frees that blob alone
+    struct TrashIndex index;
+    ck_assert_int_eq(trash_index_open(trash_dir, &index), 0);
+    struct TrashRecord *record = trash_index_find(&index, "kept.test");
+    ck_assert_ptr_nonnull(record);
+    ck_assert(record->flags & TRASH_RECORD_BLOBS);
+    ck_assert_int_eq(unlinkat(index.dirfd, "kept.test", 0), 0);
+    ck_assert(trash_index_remove(&index, record));
+    dedup_release(&index, record);
+    trash_index_close(&index);
+    ck_assert_int_eq(count_blobs(), 1);
+}
+END_TEST
+
+// Test the cross-filesystem copy fallback preserves data and metadata
+START_TEST(test_copy_to_trash_preserves_tree) {
+    mkdir("copied", 0750);
+    mkdir("copied/sub", 0755);
+    create_test_file("copied/sub/data.txt", "copied content");
+    chmod("copied/sub/data.txt", 0640);
+    symlink("sub/data.txt", "copied/link");
+
+    const struct timespec times[2] = {{.tv_sec = 1000000000, .tv_nsec = 0}, {.tv_sec = 1000000000, .tv_nsec = 0}};
+    ck_assert_int_eq(utimensat(AT_FDCWD, "copied/sub/data.txt", times, 0), 0);
+
+    char target[512];
+    snprintf(target, sizeof(target), "%s/copied.test", trash_dir);
+    ck_assert_int_eq(copy_to_trash_at(AT_FDCWD, "copied", target, false), 0);
+
+    // The source is gone once every entry was moved
+    ck_assert(!file_exists("copied"));
+
+    char path[600];
+    struct stat st;
+    snprintf(path, sizeof(path), "%s/sub/data.txt", target);
+    ck_assert_int_eq(lstat(path, &st), 0);
+    ck_assert_int_eq(st.st_mode & 0777, 0640);
+    ck_assert_int_eq(st.st_mtim.tv_sec, 1000000000);
+
+    FILE *file = fopen(path, "r");
+    ck_assert_ptr_nonnull(file);
+    char content[64] = "";
+    ck_assert_ptr_nonnull(fgets(content, sizeof(content), file));
+    fclose(file);
+    ck_assert_str_eq(content, "copied content");
+
+    ck_assert_int_eq(lstat(target, &st), 0);
+    ck_assert_int_eq(st.st_mode & 0777, 0750);
+
+    snprintf(path, sizeof(path), "%s/link", target);
+    ck_assert_int_eq(lstat(path, &st), 0);
+    ck_assert(S_ISLNK(st.st_mode));
+
+    // No partial copy is left behind
+    snprintf(path, sizeof(path), "%s.partial", target);
+    ck_assert(!file_exists(path));
+}
+END_TEST
+
+START_TEST(test_mount_trash_dir_same_device) {
+    // Needs a writable mount that is not the one holding the test directory
+    char mount_dir[] = "/dev/shm/better_rm_mount_test_XXXXXX";
+    struct stat test_st, st;
+    if (!mkdtemp(mount_dir))
+        return;
+    ck_assert_int_eq(stat(test_dir, &test_st), 0);
+    ck_assert_int_eq(lstat(mount_dir, &st), 0);
+    if (st.st_dev == test_st.st_dev) {
+        rmdir(mount_dir);
+        return;
+    }
+
+    char expected[64], shm_trash[80];
+    snprintf(expected, sizeof(expected), "/.Trash-%u", (unsigned) getuid());
+    snprintf(shm_trash, sizeof(shm_trash), "/dev/shm%s", expected);
+    bool existed = file_exists(shm_trash);
+
+    const char *mount_trash = mount_trash_dir(mount_dir, &st);
+    rmdir(mount_dir);
+    if (!mount_trash)
+        return;
+
+    // The trash sits at the top of the operand's own filesystem and is private to the user
+    struct stat trash_st;
+    ck_assert_int_eq(lstat(mount_trash, &trash_st), 0);
+    ck_assert(S_ISDIR(trash_st.st_mode));
+    ck_assert_int_eq(trash_st.st_dev, st.st_dev);
+    ck_assert_int_eq(trash_st.st_mode & 0777, 0700);
+    ck_assert_int_eq(trash_st.st_uid, getuid());
+    ck_assert_str_eq(strrchr(mount_trash, '/'), expected);
+
+    // Resolved once per device
+    ck_assert_ptr_eq(mount_trash_dir(mount_dir, &st), mount_trash);
+
+    if (!existed)
+        rmdir(mount_trash);
+}
+END_TEST
+
+START_TEST(test_trash_index_records_entries) {
+    create_test_file("indexed.txt", "12345");
+    mkdir("indexed_dir", 0755);
+    ck_assert_int_eq(move_to_trash("indexed.txt", trash_dir, false), 0);
+    ck_assert_int_eq(move_to_trash("indexed_dir", trash_dir, false), 0);
+
+    struct TrashIndex index;
+    ck_assert_int_eq(trash_index_open(trash_dir, &index), 0);
+    ck_assert_uint_eq(index.count, 2);
+
+    char expected[512];
+    snprintf(expected, sizeof(expected), "%s/indexed.txt", test_dir);
+    const struct TrashRecord *record = &index.records[0];
+    ck_assert_str_eq(trash_index_string(&index, record->path_offset), expected);
+    ck_assert_int_eq(record->size, 5);
+    ck_assert_uint_eq(record->uid, getuid());
+    ck_assert(S_ISREG(record->mode));
+    ck_assert(S_ISDIR(index.records[1].mode));
+
+    // Records name the entry inside the trash
+    const char *name = trash_index_string(&index, record->name_offset);
+    ck_assert_ptr_nonnull(name);
+    char trashed[512];
+    snprintf(trashed, sizeof(trashed), "%s/%s", trash_dir, name);
+    ck_assert(file_exists(trashed));
+
+    struct TrashRecord *found = trash_index_find(&index, name);
+    ck_assert_ptr_eq(found, record);
+    trash_index_remove(&index, found);
+    ck_assert_ptr_null(trash_index_find(&index, name));
+    trash_index_close(&index);
+
+    // Compaction drops removed records and keeps the others readable
+    ck_assert_int_eq(trash_index_compact(trash_dir), 0);
+    ck_assert_int_eq(trash_index_open(trash_dir, &index), 0);
+    ck_assert_uint_eq(index.count, 1);
+    snprintf(expected, sizeof(expected), "%s/indexed_dir", test_dir);
+    ck_assert_str_eq(trash_index_string(&index, index.records[0].path_offset), expected);
+    trash_index_close(&index);
+
+    // Appends after a compaction go to the new index
+    create_test_file("after.txt", NULL);
+    ck_assert_int_eq(move_to_trash("after.txt", trash_dir, false), 0);
+    ck_assert_int_eq(trash_index_open(trash_dir, &index), 0);
+    ck_assert_uint_eq(index.count, 2);
+    trash_index_close(&index);
+
+    // An index opened for its records alone has no name table
+    ck_assert_int_eq(trash_index_open_records(trash_dir, &index), 0);
+    ck_assert_uint_eq(index.count, 2);
+    ck_assert_ptr_null(index.slots);
+    ck_assert_ptr_nonnull(trash_index_string(&index, index.records[1].name_offset));
+    ck_assert_ptr_null(trash_index_find(&index, trash_index_string(&index, index.records[1].name_offset)));
+    trash_index_close(&index);
+}
+END_TEST
+
+START_TEST(test_purge_trash_removes_expired_entries) {
+    create_test_file("expired.txt", "1234");
+    mkdir("expired_dir", 0755);
+    mkdir("expired_dir/sub", 0755);
+    create_test_file("expired_dir/sub/data.txt", "123456");
+    ck_assert_int_eq(move_to_trash("expired.txt", trash_dir, false), 0);
+    ck_assert_int_eq(move_to_trash("expired_dir", trash_dir, false), 0);
+
+    // Nothing is old enough yet
+    struct Options opts = {.preserve_root = true, .jobs = 1};
+    char *dirs[] = {trash_dir};
+    ck_assert_int_eq(purge_trash(dirs, 1, time(NULL) - 60, &opts), 0);
+    ck_assert_ptr_nonnull(find_in_trash("expired.txt"));
+
+    ck_assert_int_eq(purge_trash(dirs, 1, time(NULL) + 60, &opts), 0);
+    ck_assert_ptr_null(find_in_trash("expired.txt"));
+    ck_assert_ptr_null(find_in_trash("expired_dir"));
+
+    // The index forgets the purged entries
+    struct TrashIndex index;
+    ck_assert_int_eq(trash_index_open(trash_dir, &index), 0);
+    ck_assert_uint_eq(index.count, 0);
+    trash_index_close(&index);
+
+    // Only trash directories are purged
+    mkdir("not_trash", 0755);
+    create_test_file("not_trash/keep.txt", NULL);
+    char *others[] = {"not_trash"};
+    ck_assert_int_ne(purge_trash(others, 1, time(NULL) + 60, &opts), 0);
+    ck_assert(file_exists("not_trash/keep.txt"));
+
+    // Nor a trash directory anybody could have put entries in
+    create_test_file("shared.txt", "12");
+    ck_assert_int_eq(move_to_trash("shared.txt", trash_dir, false), 0);
+    ck_assert_int_eq(chmod(trash_dir, 0777), 0);
+    ck_assert_int_ne(purge_trash(dirs, 1, time(NULL) + 60, &opts), 0);
+    ck_assert_ptr_nonnull(find_in_trash("shared.txt"));
+    ck_assert_int_eq(chmod(trash_dir, 0700), 0);
+}
+END_TEST
+
+START_TEST(test_trash_quota_evicts_oldest_entries) {
+    trash_max_bytes = 10;
+    create_test_file("first.txt", "1234");
+    create_test_file("second.txt", "1234");
+    ck_assert_int_eq(move_to_trash("first.txt", trash_dir, false), 0);
+    ck_assert_int_eq(move_to_trash("second.txt", trash_dir, false), 0);
+
+    struct TrashUsage usage;
+    ck_assert_int_eq(trash_index_usage(trash_dir, &usage), 0);
+    ck_assert_uint_eq(usage.bytes, 8);
+    ck_assert_uint_eq(usage.inodes, 2);
+
+    // The oldest entry makes room for the new one, an eviction is not a removal of the operand
+    create_test_file("third.txt", "12345");
+    audit_mode = AUDIT_SUMMARY;
+    audit_begin("third.txt", "TRASH");
+    ck_assert_int_eq(move_to_trash("third.txt", trash_dir, false), 0);
+    unsigned long long entries, bytes, failures;
+    audit_counts(&entries, &bytes, &failures);
+    ck_assert_uint_eq(entries, 0);
+    ck_assert_uint_eq(failures, 0);
+    audit_end();
+    audit_mode = AUDIT_FILE;
+    ck_assert_ptr_null(find_in_trash("first.txt"));
+    ck_assert_ptr_nonnull(find_in_trash("second.txt"));
+    ck_assert_ptr_nonnull(find_in_trash("third.txt"));
+    ck_assert_int_eq(trash_index_usage(trash_dir, &usage), 0);
+    ck_assert_uint_eq(usage.bytes, 9);
+    ck_assert_uint_eq(usage.inodes, 2);
+
+    // An entry larger than the whole quota stays where it is
+    create_test_file("huge.txt", "12345678901");
+    ck_assert_int_ne(move_to_trash("huge.txt", trash_dir, false), 0);
+    ck_assert(file_exists("huge.txt"));
+    ck_assert_ptr_nonnull(find_in_trash("second.txt"));
+
+    // Compaction recomputes the same totals
+    ck_assert_int_eq(trash_index_compact(trash_dir), 0);
+    ck_assert_int_eq(trash_index_usage(trash_dir, &usage), 0);
+    ck_assert_uint_eq(usage.bytes, 9);
+    trash_max_bytes = 0;
+}
+END_TEST
+
+START_TEST(test_trash_quota_measures_deep_tree) {
+    // 100 levels, deeper than the measurement keeps directories open, each with a two byte file
+    ck_assert_int_eq(mkdir("tree", 0755), 0);
+    int fd = open("tree", O_RDONLY | O_DIRECTORY);
+    ck_assert_int_ne(fd, -1);
+    for (int i = 0; i < 100; i++) {
+        int file_fd = openat(fd, "f", O_WRONLY | O_CREAT, 0644);
+        ck_assert_int_ne(file_fd, -1);
+        ck_assert_int_eq(write(file_fd, "12", 2), 2);
+        close(file_fd);
+        ck_assert_int_eq(mkdirat(fd, "d", 0755), 0);
+        int child = openat(fd, "d", O_RDONLY | O_DIRECTORY);
+        ck_assert_int_ne(child, -1);
+        close(fd);
+        fd = child;
+    }
+    close(fd);
+
+    trash_max_bytes = 1 << 20;
+    struct stat st;
+    ck_assert_int_eq(lstat("tree", &st), 0);
+    struct TrashUsage usage;
+    ck_assert_int_eq(trash_quota_measure(AT_FDCWD, "tree", &st, &usage), 0);
+    ck_assert_uint_eq(usage.inodes, 201);
+    ck_assert(usage.bytes >= 200);
+
+    // A tree that cannot be opened is not measured at all, the whole tree is admitted once measured
+    ck_assert_int_ne(trash_quota_measure(AT_FDCWD, "missing", &st, &usage), 0);
+    ck_assert_int_eq(move_to_trash("tree", trash_dir, false), 0);
+    ck_assert_ptr_nonnull(find_in_trash("tree"));
+    trash_max_bytes = 0;
+}
+END_TEST
+
+START_TEST(test_restore_trash_by_path_and_pattern) {
+    mkdir("project", 0755);
+    mkdir("project/src", 0755);
+    create_test_file("project/src/main.c", "int main;");
+    create_test_file("project/notes.txt", "notes");
+    create_test_file("project.log", "log");
+    ck_assert_int_eq(move_to_trash("project/notes.txt", trash_dir, false), 0);
+    ck_assert_int_eq(move_to_trash("project", trash_dir, false), 0);
+    ck_assert_int_eq(move_to_trash("project.log", trash_dir, false), 0);
+
+    // The tree comes back with a single rename, then the file trashed from inside it
+    struct Options opts = {.preserve_root = true, .jobs = 4};
+    char *operands[] = {"project/"};
+    ck_assert_int_eq(restore_trash(trash_dir, operands, 1, INT64_MIN, INT64_MAX, &opts), 0);
+    ck_assert(file_exists("project/src/main.c"));
+    ck_assert(file_exists("project/notes.txt"));
+    ck_assert(!file_exists("project.log"));
+    ck_assert_ptr_nonnull(find_in_trash("project.log"));
+
+    // Patterns match the original path, and an existing entry is never replaced
+    create_test_file("project.log", "new");
+    char *patterns[] = {"*.log"};
+    ck_assert_int_ne(restore_trash(trash_dir, patterns, 1, INT64_MIN, INT64_MAX, &opts), 0);
+    ck_assert_ptr_nonnull(find_in_trash("project.log"));
+
+    // Entries trashed outside the time window stay in the trash
+    ck_assert_int_eq(unlink("project.log"), 0);
+    ck_assert_int_eq(restore_trash(trash_dir, patterns, 1, INT64_MIN, time(NULL) - 60, &opts), 0);
+    ck_assert(!file_exists("project.log"));
+    ck_assert_int_eq(restore_trash(trash_dir, patterns, 1, time(NULL) - 60, INT64_MAX, &opts), 0);
+    ck_assert(file_exists("project.log"));
+
+    struct TrashIndex index;
+    ck_assert_int_eq(trash_index_open(trash_dir, &index), 0);
+    ck_assert_uint_eq(index.header->bytes, 0);
+    trash_index_close(&index);
+
+    // Entries another user trashed stay where they are
+    ck_assert_int_eq(move_to_trash("project.log", trash_dir, false), 0);
+    ck_assert_int_eq(trash_index_open(trash_dir, &index), 0);
+    index.records[index.count - 1].uid = (uint32_t) getuid() + 1;
+    trash_index_close(&index);
+    ck_assert_int_eq(restore_trash(trash_dir, patterns, 1, INT64_MIN, INT64_MAX, &opts), 0);
+    ck_assert(!file_exists("project.log"));
+    ck_assert_ptr_nonnull(find_in_trash("project.log"));
+}
+END_TEST
+
 // Create test suite
 Suite *test_trash_operations_suite(void) {
     Suite *s;
@@ -254,6 +687,15 @@ Suite *test_trash_operations_suite(void) {
     tcase_add_test(tc_core, test_move_file_special_chars);
     tcase_add_test(tc_core, test_trash_dir_permissions);
     tcase_add_test(tc_core, test_move_readonly_file);
+    tcase_add_test(tc_core, test_copy_to_trash_preserves_tree);
+    tcase_add_test(tc_core, test_copy_to_trash_dedups_identical_files);
+    tcase_add_test(tc_core, test_trash_record_releases_its_blobs);
+    tcase_add_test(tc_core, test_mount_trash_dir_same_device);
+    tcase_add_test(tc_core, test_trash_index_records_entries);
+    tcase_add_test(tc_core, test_purge_trash_removes_expired_entries);
+    tcase_add_test(tc_core, test_trash_quota_evicts_oldest_entries);
+    tcase_add_test(tc_core, test_trash_quota_measures_deep_tree);
+    tcase_add_test(tc_core, test_restore_trash_by_path_and_pattern);
 
     suite_add_tcase(s, tc_core);
 